@@ -16,7 +16,9 @@ class AD7298Device
 {
 public:
     /// Constructor.
-    AD7298Device()
+    AD7298Device() :
+        m_awake(FALSE),
+        m_selectedChannel(NO_CHANNEL)
     {
     }
 
@@ -33,6 +35,9 @@ public:
     {
         HRESULT hr = S_OK;
         
+        // We don't know what state a previous program left the ADC in.
+        _resetSession();
+
         // Prepare to use the controller for the ADC's SPI controller.
         hr = m_spi.begin(ADC_SPI_BUS, 2, 20000, 16);
 
@@ -48,12 +53,29 @@ public:
     /// Release the ADC.
     inline void end()
     {
+        ULONG dataIn;
+        CMD_REG cmdReg;
+
+        // If the ADC is powered up, put it back in Partial Power-Down.
+        if (m_awake)
+        {
+            cmdReg.ALL_BITS = 0;
+            cmdReg.WRITE = 1;
+            cmdReg.PPD = 1;
+            _transferFrame(cmdReg.ALL_BITS, dataIn);
+        }
+        _resetSession();
+
         // Release the ADC SPI bus.
         m_spi.end();
     }
 
     /// Take a reading with the ADC used on the Gen1 board.
     /**
+    The ADC is left powered up with the channel selected after a reading, so the
+    wake-up "jog" is only sent after begin() or an error, and the channel select write
+    is only sent when a different channel is read.  A repeated read of one channel
+    then takes two frames instead of five.
     \param[in] channel Number of channel on ADC to read.
     \param[out] value The value read from the ADC.
     \param[out] bits The size of the reading in "value" in bits.
@@ -63,10 +85,8 @@ public:
     {
         HRESULT hr = S_OK;
         
-        ULONG dataOut;
         ULONG dataIn;
         ULONG chanIn;
-        USHORT chanMask;
         CMD_REG cmdReg;
 
 
@@ -76,67 +96,28 @@ public:
             hr = DMAP_E_ADC_DOES_NOT_HAVE_REQUESTED_CHANNEL;
         }
 
-        //
-        // Jog the ADC twice to bring it out of any unresponsive state (such as Partial
-        // Power-Down) that the shutdown of a previous program may have left it in.
-        //
-        if (SUCCEEDED(hr))
-        {
-            // Build ADC command register contents with Partial Power-Down bit clear.
-            cmdReg.ALL_BITS = 0;
-            cmdReg.WRITE = 1;
-            dataOut = (ULONG)cmdReg.ALL_BITS;
-
-            hr = g_quarkFabricGpio.setPinState(m_csFabricBit, LOW);  // Make ADC chip select active
-            
-            if (SUCCEEDED(hr))
-            {
-                // Write the ADC command register.
-                hr = m_spi.transfer16(dataOut, dataIn);
-                
-                g_quarkFabricGpio.setPinState(m_csFabricBit, HIGH);      // Make ADC chip select inactive
-            }
-        }
-
-        if (SUCCEEDED(hr))
+        if (SUCCEEDED(hr) && !m_awake)
         {
-            // Build ADC command register contents with Partial Power-Down bit clear.
-            cmdReg.ALL_BITS = 0;
-            cmdReg.WRITE = 1;
-            dataOut = (ULONG)cmdReg.ALL_BITS;
-
-            hr = g_quarkFabricGpio.setPinState(m_csFabricBit, LOW);  // Make ADC chip select active
-            
-            if (SUCCEEDED(hr))
-            {
-                // Write the ADC command register.
-                hr = m_spi.transfer16(dataOut, dataIn);
-                
-                g_quarkFabricGpio.setPinState(m_csFabricBit, HIGH);      // Make ADC chip select inactive
-            }
+            hr = _wake();
         }
 
         //
-        // Tell the ADC which channel we want to read.
+        // If needed, tell the ADC which channel we want to read.  The REPEAT bit makes
+        // the ADC keep converting that channel, so it stays selected for later reads.
         //
 
-        if (SUCCEEDED(hr))
+        if (SUCCEEDED(hr) && (channel != m_selectedChannel))
         {
-            // Build ADC command register contents with bit set for the channel we want to read.
-            chanMask = 0x0080 >> channel;
             cmdReg.ALL_BITS = 0;
-            cmdReg.CHAN = chanMask;
+            cmdReg.CHAN = 0x0080 >> channel;
+            cmdReg.REPEAT = 1;
             cmdReg.WRITE = 1;
-            dataOut = (ULONG)cmdReg.ALL_BITS;
 
-            hr = g_quarkFabricGpio.setPinState(m_csFabricBit, LOW);  // Make ADC chip select active
-            
+            hr = _transferFrame(cmdReg.ALL_BITS, dataIn);
+
             if (SUCCEEDED(hr))
             {
-                // Send the channel information to the ADC.
-                hr = m_spi.transfer16(dataOut, dataIn);
-                
-                g_quarkFabricGpio.setPinState(m_csFabricBit, HIGH);      // Make ADC chip select inactive
+                m_selectedChannel = channel;
             }
         }
 
@@ -147,15 +128,7 @@ public:
         if (SUCCEEDED(hr))
         {
             // Shift out 16 bits to perform the conversion.
-            dataOut = 0;
-            hr = g_quarkFabricGpio.setPinState(m_csFabricBit, LOW);  // Make ADC chip select active
-            
-            if (SUCCEEDED(hr))
-            {
-                hr = m_spi.transfer16(dataOut, dataIn);
-                
-                g_quarkFabricGpio.setPinState(m_csFabricBit, HIGH);      // Make ADC chip select inactive
-            }
+            hr = _transferFrame(0, dataIn);
         }
 
         //
@@ -164,21 +137,8 @@ public:
 
         if (SUCCEEDED(hr))
         {
-            // Build ADC command register contents with Partial Power-Down bit set.
-            cmdReg.ALL_BITS = 0;
-            cmdReg.WRITE = 1;
-            cmdReg.PPD = 1;
-            dataOut = (ULONG)cmdReg.ALL_BITS;
-
-            hr = g_quarkFabricGpio.setPinState(m_csFabricBit, LOW);  // Make ADC chip select active
-            
-            if (SUCCEEDED(hr))
-            {
-                // Write the ADC command register and shift out the conversion result.
-                hr = m_spi.transfer16(dataOut, dataIn);
-                
-                g_quarkFabricGpio.setPinState(m_csFabricBit, HIGH);      // Make ADC chip select inactive
-            }
+            // Shift out the conversion result, leaving the command register unchanged.
+            hr = _transferFrame(0, dataIn);
         }
 
         //
@@ -200,12 +160,184 @@ public:
             value = dataIn & ((1 << ADC_BITS) - 1);
             bits = ADC_BITS;
         }
+        else
+        {
+            // Start over with a jog on the next reading.
+            _resetSession();
+        }
+        
+        return hr;
+    }
+
+    /// Take readings from several channels of the ADC in one scan.
+    /**
+    All the requested channels are selected in the CHAN field of a single command register
+    write, and the ADC then converts them in sequence, one per frame.  Each result carries
+    its channel number, which is used to return it in the caller's order.
+    \param[in] channels Array of channel numbers to read.  A channel may appear more than once.
+    \param[out] values Array that receives the value read from each channel.
+    \param[in] count The number of channels to read.
+    \param[out] bits The size of each reading in "values" in bits.
+    \return HRESULT success or error code.
+    */
+    inline HRESULT readValues(const ULONG* channels, PULONG values, ULONG count, ULONG & bits)
+    {
+        HRESULT hr = S_OK;
+        
+        ULONG dataIn;
+        ULONG chanIn;
+        ULONG conversions = 0;
+        ULONG results[8] = { 0 };
+        USHORT chanMask = 0;
+        USHORT chanSeen = 0;
+        CMD_REG cmdReg;
+        ULONG i;
+
+
+        // Make sure the channel numbers are in range, and build the set of channels to convert.
+        for (i = 0; SUCCEEDED(hr) && (i < count); i++)
+        {
+            if (channels[i] >= ADC_CHANNELS)
+            {
+                hr = DMAP_E_ADC_DOES_NOT_HAVE_REQUESTED_CHANNEL;
+            }
+            else if ((chanMask & (0x0080 >> channels[i])) == 0)
+            {
+                chanMask |= 0x0080 >> channels[i];
+                conversions++;
+            }
+        }
+
+        if (SUCCEEDED(hr) && (count > 0))
+        {
+            if (!m_awake)
+            {
+                hr = _wake();
+            }
+
+            // Select all the channels to be converted.
+            if (SUCCEEDED(hr))
+            {
+                cmdReg.ALL_BITS = 0;
+                cmdReg.CHAN = chanMask;
+                cmdReg.WRITE = 1;
+                hr = _transferFrame(cmdReg.ALL_BITS, dataIn);
+
+                // The single channel selection used by readValue() has been replaced.
+                m_selectedChannel = NO_CHANNEL;
+            }
+
+            // Perform the first conversion.
+            if (SUCCEEDED(hr))
+            {
+                hr = _transferFrame(0, dataIn);
+            }
+
+            // Each following frame returns one result while the next conversion runs.
+            for (i = 0; SUCCEEDED(hr) && (i < conversions); i++)
+            {
+                hr = _transferFrame(0, dataIn);
+
+                if (SUCCEEDED(hr))
+                {
+                    chanIn = (dataIn >> ADC_BITS) & ((1 << ADC_CHAN_BITS) - 1);
+                    if (chanIn < ADC_CHANNELS)
+                    {
+                        results[chanIn] = dataIn & ((1 << ADC_BITS) - 1);
+                        chanSeen |= 0x0080 >> chanIn;
+                    }
+                }
+            }
+        }
+
+        // Verify we got data for every channel requested and pass it back to the caller.
+        if (SUCCEEDED(hr) && ((chanSeen & chanMask) != chanMask))
+        {
+            hr = DMAP_E_ADC_DATA_FROM_WRONG_CHANNEL;
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            for (i = 0; i < count; i++)
+            {
+                values[i] = results[channels[i]];
+            }
+            bits = ADC_BITS;
+        }
+        else
+        {
+            // Start over with a jog on the next reading.
+            _resetSession();
+        }
         
         return hr;
     }
 
 private:
 
+    /// Method to send one 16-bit frame to the ADC with chip select active.
+    /**
+    \param[in] dataOut The data to send to the ADC.
+    \param[out] dataIn The data received from the ADC.
+    \return HRESULT success or error code.
+    */
+    inline HRESULT _transferFrame(ULONG dataOut, ULONG & dataIn)
+    {
+        HRESULT hr = S_OK;
+
+        hr = g_quarkFabricGpio.setPinState(m_csFabricBit, LOW);  // Make ADC chip select active
+
+        if (SUCCEEDED(hr))
+        {
+            hr = m_spi.transfer16(dataOut, dataIn);
+
+            g_quarkFabricGpio.setPinState(m_csFabricBit, HIGH);      // Make ADC chip select inactive
+        }
+
+        return hr;
+    }
+
+    /// Method to bring the ADC out of any unresponsive state.
+    /**
+    The ADC is jogged twice to bring it out of any unresponsive state (such as Partial
+    Power-Down) that the shutdown of a previous program, or an error, may have left it in.
+    \return HRESULT success or error code.
+    */
+    inline HRESULT _wake()
+    {
+        HRESULT hr = S_OK;
+
+        ULONG dataIn;
+        CMD_REG cmdReg;
+
+        // Build ADC command register contents with Partial Power-Down bit clear.
+        cmdReg.ALL_BITS = 0;
+        cmdReg.WRITE = 1;
+
+        hr = _transferFrame(cmdReg.ALL_BITS, dataIn);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = _transferFrame(cmdReg.ALL_BITS, dataIn);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            // The jog also cleared the channel selection.
+            m_awake = TRUE;
+            m_selectedChannel = NO_CHANNEL;
+        }
+
+        return hr;
+    }
+
+    /// Method to forget what is known about the ADC state.
+    inline void _resetSession()
+    {
+        m_awake = FALSE;
+        m_selectedChannel = NO_CHANNEL;
+    }
+
     /// Struct for ADC Control Register contents.
     typedef union {
         struct {
@@ -242,6 +374,15 @@ private:
     /// The number of channel number bits returned with an ADC conversion.
     const ULONG ADC_CHAN_BITS = 4;
 
+    /// Value of m_selectedChannel when no single channel is selected.
+    const ULONG NO_CHANNEL = 0xFFFFFFFF;
+
+    /// TRUE if the ADC has been jogged out of Partial Power-Down.
+    BOOL m_awake;
+
+    /// The channel selected for conversion by the last readValue() call.
+    ULONG m_selectedChannel;
+
     /// The SPI Controller object used to talk to the ADC.
     SpiControllerClass m_spi;
 
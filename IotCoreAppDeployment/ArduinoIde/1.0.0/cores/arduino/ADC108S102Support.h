@@ -9,6 +9,8 @@
 
 #if WINAPI_FAMILY_PARTITION(WINAPI_PARTITION_DESKTOP)   // If building a Win32 app:
 
+#include <vector>
+
 #include "SpiController.h"
 #include "GpioController.h"
 
@@ -100,6 +102,63 @@ public:
         return hr;
     }
 
+    /// Take readings from several channels of the ADC in one scan.
+    /**
+    The ADC converts the channel addressed in one 16-bit frame during the next frame, so
+    a scan of N channels is sent as N+1 frames with chip select held active, instead of
+    two frames per channel.
+    \param[in] channels Array of channel numbers to read.
+    \param[out] values Array that receives the value read from each channel.
+    \param[in] count The number of channels to read.
+    \param[out] bits The size of each reading in "values" in bits.
+    \return HRESULT success or error code.
+    */
+    inline HRESULT readValues(const ULONG* channels, PULONG values, ULONG count, ULONG & bits)
+    {
+        HRESULT hr = S_OK;
+        
+        std::vector<USHORT> frames(count + 1, 0);
+        ULONG i;
+
+        // Make sure the channel numbers are in range, and build the frames that select them.
+        for (i = 0; SUCCEEDED(hr) && (i < count); i++)
+        {
+            if (channels[i] >= ADC_CHANNELS)
+            {
+                hr = DMAP_E_ADC_DOES_NOT_HAVE_REQUESTED_CHANNEL;
+            }
+            else
+            {
+                frames[i] = (USHORT)(channels[i] << (CHAN_SHIFT - 16));
+            }
+        }
+
+        if (SUCCEEDED(hr) && (count > 0))
+        {
+            // Perform the conversions and get the results.
+            hr = g_quarkFabricGpio.setPinState(m_csFabricBit, LOW);       // Make ADC chip select active
+            
+            if (SUCCEEDED(hr))
+            {
+                hr = m_spi.transferBuffer16(frames.data(), frames.data(), count + 1);
+                
+                g_quarkFabricGpio.setPinState(m_csFabricBit, HIGH);  // Make ADC chip select inactive
+            }
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            // The result for each channel arrives in the frame after the one that selected it.
+            for (i = 0; i < count; i++)
+            {
+                values[i] = (frames[i + 1] >> DATA_SHIFT) & ((1 << ADC_BITS) - 1);
+            }
+            bits = ADC_BITS;
+        }
+        
+        return hr;
+    }
+
 private:
     /// The number of channels on the ADC.
     const ULONG ADC_CHANNELS = 8;
@@ -10,13 +10,30 @@
 #include "I2c.h"
 #include "I2cTransaction.h"
 #include "I2cController.h"
+#include "ConversionWait.h"
 
 class ADS1015Device
 {
 public:
+    /// Struct used to return the cost of the readings taken.
+    typedef struct {
+        ULONGLONG samples;          ///< Number of readings taken
+        ULONGLONG transactions;     ///< Number of I2C transactions used to take them
+        ULONGLONG cpuCycles;        ///< CPU cycles used by the calling thread to take them
+        ULONGLONG polls;            ///< Number of status polls made while waiting for conversions
+        ULONGLONG maxPolls;         ///< Most status polls made for one conversion
+    } ADC_STATS, *PADC_STATS;
+
     /// Constructor.
-    ADS1015Device()
+    ADS1015Device() :
+        m_dataRateCode(DR_3300_SPS),
+        m_continuous(FALSE),
+        m_continuousChannel(NO_CHANNEL),
+        m_rateChanged(FALSE),
+        m_lastReadTicks(0)
     {
+        m_wait.setConversionTime(_conversionMicroseconds());
+        resetStats();
     }
 
     /// Destructor.
@@ -46,6 +63,80 @@ public:
         g_i2c.end();
     }
 
+    /// Set the conversion rate of the ADC.
+    /**
+    \param[in] samplesPerSecond The desired rate.  The fastest supported rate that does not
+    exceed this is used (128, 250, 490, 920, 1600, 2400 or 3300 samples per second).
+    \return HRESULT success or error code.
+    */
+    inline HRESULT setDataRate(ULONG samplesPerSecond)
+    {
+        HRESULT hr = S_OK;
+        BYTE code;
+
+        if (samplesPerSecond < m_dataRates[0])
+        {
+            hr = E_INVALIDARG;
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            code = DR_3300_SPS;
+            while (m_dataRates[code] > samplesPerSecond)
+            {
+                code--;
+            }
+
+            if (code != m_dataRateCode)
+            {
+                m_dataRateCode = code;
+                m_wait.setConversionTime(_conversionMicroseconds());
+
+                // Make a running continuous conversion pick up the new rate.  The channel
+                // is kept, so setContinuousMode(FALSE) can still stop the conversion.
+                m_rateChanged = TRUE;
+            }
+        }
+
+        return hr;
+    }
+
+    /// Get the conversion rate of the ADC in samples per second.
+    inline ULONG getDataRate()
+    {
+        return m_dataRates[m_dataRateCode];
+    }
+
+    /// Select continuous or single-shot conversion mode.
+    /**
+    In continuous mode the ADC converts the selected channel over and over at the data rate.
+    The configuration is only written when the channel changes, and each reading is a single
+    read of the conversion register, paced so that a new conversion is returned each time.
+    In single-shot mode each reading writes the configuration to start a conversion, polls
+    for it to finish, then reads the result, and the ADC powers down between readings.
+    \param[in] enable TRUE for continuous mode, FALSE for single-shot mode.
+    \return HRESULT success or error code.
+    */
+    inline HRESULT setContinuousMode(BOOL enable)
+    {
+        HRESULT hr = S_OK;
+
+        if (!enable && m_continuous && (m_continuousChannel != NO_CHANNEL))
+        {
+            // Put the ADC back in single-shot mode so it powers down.
+            hr = _writeConfig(m_continuousChannel, FALSE);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            m_continuous = enable;
+            m_continuousChannel = NO_CHANNEL;
+            m_rateChanged = FALSE;
+        }
+
+        return hr;
+    }
+
     /// Take a reading with the ADC used on the Ika Lure board.
     /**
     \param[in] channel Number of channel on ADC to read.
@@ -54,9 +145,209 @@ public:
     \return HRESULT success or error code.
     \note This routine is not multi-thread safe.  If two or more threads access the 
     ADC at the same time, each thread could be changing the other thread's configuration 
-    (such as channel number).  A global mutex could be added to fix this.
+    (such as channel number).  AdcClass serializes its use of the ADC, so this is only a
+    concern when this object is used directly.
     */
     inline HRESULT readValue(ULONG channel, ULONG & value, ULONG & bits)
+    {
+        HRESULT hr = S_OK;
+        ULONG64 startCycles;
+        ULONG64 endCycles;
+
+        QueryThreadCycleTime(GetCurrentThread(), &startCycles);
+
+        if (m_continuous)
+        {
+            hr = _readContinuous(channel, value, bits);
+        }
+        else
+        {
+            hr = _readSingleShot(channel, value, bits);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            QueryThreadCycleTime(GetCurrentThread(), &endCycles);
+            m_stats.samples++;
+            m_stats.cpuCycles += endCycles - startCycles;
+        }
+
+        return hr;
+    }
+
+    /// Take readings from several channels of the ADC in one scan.
+    /**
+    The ADS1015 converts one channel at a time, so the scan saves bus traffic instead: the
+    result of each conversion is read in the same I2C transaction that starts the next one.
+    \param[in] channels Array of channel numbers to read.
+    \param[out] values Array that receives the value read from each channel.
+    \param[in] count The number of channels to read.
+    \param[out] bits The size of each reading in "values" in bits.
+    \return HRESULT success or error code.
+    \note Like readValue(), this routine is not multi-thread safe.  In continuous mode the
+    channels are read one after another with readValue().
+    */
+    inline HRESULT readValues(const ULONG* channels, PULONG values, ULONG count, ULONG & bits)
+    {
+        HRESULT hr = S_OK;
+        
+        CONFIG_REG_H configH;
+        CONFIG_REG_L configL;
+        I2cTransactionClass transaction;
+        BYTE configRegAdr[1] = { 1 };
+        BYTE configData[3] = { 1, 0, 0 };
+        BYTE statusData[2] = { 0 };
+        BYTE conversionRegAdr[1] = { 0 };
+        BYTE conversionData[2] = { 0 };
+        ULONG64 startCycles;
+        ULONG64 endCycles;
+        ULONG i;
+
+        if (m_continuous)
+        {
+            for (i = 0; SUCCEEDED(hr) && (i < count); i++)
+            {
+                hr = readValue(channels[i], values[i], bits);
+            }
+            return hr;
+        }
+
+        QueryThreadCycleTime(GetCurrentThread(), &startCycles);
+
+        configL.ALL_BITS = CONFIG_REG_INIT_L;
+        configL.DR = m_dataRateCode;
+        configData[2] = configL.ALL_BITS;
+
+        // Make sure the channel numbers are in range.
+        for (i = 0; SUCCEEDED(hr) && (i < count); i++)
+        {
+            if (channels[i] >= ADC_CHANNELS)
+            {
+                hr = DMAP_E_ADC_DOES_NOT_HAVE_REQUESTED_CHANNEL;
+            }
+        }
+
+        for (i = 0; SUCCEEDED(hr) && (i <= count); i++)
+        {
+            transaction.reset();
+            hr = transaction.setAddress(ADC_I2C_ADR);
+
+            // Read the result of the previous conversion.
+            if (SUCCEEDED(hr) && (i > 0))
+            {
+                hr = transaction.queueWrite(conversionRegAdr, 1);
+
+                if (SUCCEEDED(hr))
+                {
+                    hr = transaction.queueRead(conversionData, 2);
+                }
+            }
+
+            // Start the conversion for this channel.
+            if (SUCCEEDED(hr) && (i < count))
+            {
+                configH.ALL_BITS = CONFIG_REG_INIT_H;
+                configH.MUX = ANI0 + (BYTE)channels[i];
+                configH.OS = 1;     // Signal to start a conversion
+                configData[1] = configH.ALL_BITS;
+
+                // Register address and both configuration bytes in one write.
+                hr = transaction.queueWrite(configData, 3, (i > 0));
+            }
+
+            if (SUCCEEDED(hr))
+            {
+                hr = _execute(transaction);
+            }
+
+            if (SUCCEEDED(hr) && (i > 0))
+            {
+                values[i - 1] = _scaleReading(conversionData);
+            }
+
+            if (SUCCEEDED(hr) && (i < count))
+            {
+                m_wait.startConversion();
+            }
+
+            // Wait for the conversion to complete.
+            if (SUCCEEDED(hr) && (i < count))
+            {
+                transaction.reset();
+                hr = transaction.setAddress(ADC_I2C_ADR);
+
+                if (SUCCEEDED(hr))
+                {
+                    hr = transaction.queueWrite(configRegAdr, 1);
+                }
+
+                if (SUCCEEDED(hr))
+                {
+                    hr = transaction.queueRead(statusData, 2);
+                }
+
+                configH.OS = 0;
+                while (SUCCEEDED(hr) && (configH.OS == 0))
+                {
+                    hr = m_wait.waitForPoll();
+
+                    if (SUCCEEDED(hr))
+                    {
+                        hr = _execute(transaction);
+                    }
+
+                    if (SUCCEEDED(hr))
+                    {
+                        configH.ALL_BITS = statusData[0];
+                        if (configH.OS == 1)
+                        {
+                            m_wait.conversionDone();
+                        }
+                    }
+                }
+            }
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            bits = ADC_BITS;
+
+            QueryThreadCycleTime(GetCurrentThread(), &endCycles);
+            m_stats.samples += count;
+            m_stats.cpuCycles += endCycles - startCycles;
+        }
+        
+        return hr;
+    }
+
+    /// Get the bus and CPU cost of the readings taken so far.
+    inline void getStats(ADC_STATS & stats)
+    {
+        ConversionWaitClass::WAIT_STATS waitStats;
+
+        m_wait.getStats(waitStats);
+        stats = m_stats;
+        stats.polls = waitStats.polls;
+        stats.maxPolls = waitStats.maxPolls;
+    }
+
+    /// Reset the reading statistics.
+    inline void resetStats()
+    {
+        ZeroMemory(&m_stats, sizeof(m_stats));
+        m_wait.resetStats();
+    }
+
+private:
+
+    /// Method to take a single-shot reading.
+    /**
+    \param[in] channel Number of channel on ADC to read.
+    \param[out] value The value read from the ADC.
+    \param[out] bits The size of the reading in "value" in bits.
+    \return HRESULT success or error code.
+    */
+    inline HRESULT _readSingleShot(ULONG channel, ULONG & value, ULONG & bits)
     {
         HRESULT hr = S_OK;
         
@@ -75,6 +366,7 @@ public:
 
         configH.ALL_BITS = CONFIG_REG_INIT_H;
         configL.ALL_BITS = CONFIG_REG_INIT_L;
+        configL.DR = m_dataRateCode;
         switch (channel)
         {
         case 0:
@@ -123,11 +415,18 @@ public:
         
         if (SUCCEEDED(hr))
         {
-            hr = transaction.execute(g_i2c.getController());
+            hr = _execute(transaction);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            m_wait.startConversion();
         }
 
         //
-        // Wait for the conversion to complete.
+        // Wait for the conversion to complete.  Rather than polling the bus as fast as
+        // possible, wait until the conversion should be nearly done then poll at a
+        // bounded rate.
         //
 
         if (SUCCEEDED(hr))
@@ -146,8 +445,12 @@ public:
 
         while (SUCCEEDED(hr) && !conversionDone)
         {
-            hr = transaction.execute(g_i2c.getController());
-            
+            hr = m_wait.waitForPoll();
+
+            if (SUCCEEDED(hr))
+            {
+                hr = _execute(transaction);
+            }
 
             if (SUCCEEDED(hr))
             {
@@ -155,6 +458,7 @@ public:
                 if (configH.OS == 1)
                 {
                     conversionDone = TRUE;
+                    m_wait.conversionDone();
                 }
             }
         }
@@ -179,7 +483,7 @@ public:
 
         if (SUCCEEDED(hr))
         {
-            hr = transaction.execute(g_i2c.getController());
+            hr = _execute(transaction);
             
         }
         
@@ -204,7 +508,158 @@ public:
         return hr;
     }
 
-private:
+    /// Method to take a reading in continuous conversion mode.
+    /**
+    \param[in] channel Number of channel on ADC to read.
+    \param[out] value The value read from the ADC.
+    \param[out] bits The size of the reading in "value" in bits.
+    \return HRESULT success or error code.
+    */
+    inline HRESULT _readContinuous(ULONG channel, ULONG & value, ULONG & bits)
+    {
+        HRESULT hr = S_OK;
+        
+        I2cTransactionClass transaction;
+        BYTE conversionRegAdr[1] = { 0 };
+        BYTE conversionData[2] = { 0 };
+        ULONGLONG now;
+        ULONGLONG periodTicks = m_wait.getConversionTicks();
+        ULONGLONG readyTicks;
+
+        if (channel >= ADC_CHANNELS)
+        {
+            hr = DMAP_E_ADC_DOES_NOT_HAVE_REQUESTED_CHANNEL;
+        }
+
+        // Switch the ADC to the channel if it is not already converting it at the current
+        // rate.  The first conversion on the new channel takes a full period, plus a margin
+        // for the tolerance of the ADC's internal oscillator.
+        if (SUCCEEDED(hr) && ((channel != m_continuousChannel) || m_rateChanged))
+        {
+            hr = _writeConfig(channel, TRUE);
+
+            if (SUCCEEDED(hr))
+            {
+                m_continuousChannel = channel;
+                m_rateChanged = FALSE;
+                m_lastReadTicks = g_hiResClock.now() + ((periodTicks * RATE_MARGIN_PERCENT) / 100);
+            }
+        }
+
+        // Wait for the next conversion to be ready, so each reading is a new sample.
+        if (SUCCEEDED(hr))
+        {
+            readyTicks = m_lastReadTicks + periodTicks;
+            m_wait.waitUntil(readyTicks);
+            now = g_hiResClock.now();
+
+            // If we were slow to ask, the latest conversion was ready a while ago;
+            // pace the next reading from now rather than trying to catch up.
+            if ((now - readyTicks) > periodTicks)
+            {
+                readyTicks = now;
+            }
+            m_lastReadTicks = readyTicks;
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = transaction.setAddress(ADC_I2C_ADR);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = transaction.queueWrite(conversionRegAdr, 1);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = transaction.queueRead(conversionData, 2);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = _execute(transaction);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            value = _scaleReading(conversionData);
+            bits = ADC_BITS;
+        }
+
+        return hr;
+    }
+
+    /// Method to write the configuration register for a channel.
+    /**
+    \param[in] channel Number of channel on ADC to convert.
+    \param[in] continuous TRUE to start continuous conversions, FALSE to select single-shot
+    mode (which powers down the ADC).
+    \return HRESULT success or error code.
+    */
+    inline HRESULT _writeConfig(ULONG channel, BOOL continuous)
+    {
+        HRESULT hr = S_OK;
+        
+        CONFIG_REG_H configH;
+        CONFIG_REG_L configL;
+        I2cTransactionClass transaction;
+        BYTE configData[3] = { 1, 0, 0 };
+
+        configH.ALL_BITS = CONFIG_REG_INIT_H;
+        configH.MUX = ANI0 + (BYTE)channel;
+        configH.MODE = continuous ? 0 : 1;
+        configL.ALL_BITS = CONFIG_REG_INIT_L;
+        configL.DR = m_dataRateCode;
+
+        configData[1] = configH.ALL_BITS;
+        configData[2] = configL.ALL_BITS;
+
+        hr = transaction.setAddress(ADC_I2C_ADR);
+
+        if (SUCCEEDED(hr))
+        {
+            // Register address and both configuration bytes in one write.
+            hr = transaction.queueWrite(configData, 3);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = _execute(transaction);
+        }
+
+        return hr;
+    }
+
+    /// Method to run an I2C transaction with the ADC and count it.
+    inline HRESULT _execute(I2cTransactionClass & transaction)
+    {
+        m_stats.transactions++;
+        return transaction.execute(g_i2c.getController());
+    }
+
+    /// Method to convert the contents of the conversion register to a reading.
+    /**
+    \param[in] conversionData The two bytes read from the conversion register.
+    \return The reading, scaled for a 5 volt full-scale value.
+    */
+    inline ULONG _scaleReading(BYTE conversionData[2])
+    {
+        ULONG value;
+
+        value = conversionData[0] << 8;
+        value = value | conversionData[1];
+        // Extract the reading from the data sent back from the ADC.
+        value = value >> DATA_SHIFT;
+        // This is a signed ADC, so make sure the result is not negative.
+        if ((value & (1 << ADC_BITS)) != 0)
+        {
+            value = 0;
+        }
+        // Scale the ADC for its full-scale value not being 5.000 volts.
+        return ((value * FULL_SCALE) + 2500) / 5000;
+    }
 
     /// Struct for ADC Config Register (MSByte) contents.
     typedef union {
@@ -250,6 +705,45 @@ private:
     /// The Configuration Register LSByte initialization values.
     const BYTE CONFIG_REG_INIT_L = 0xE3;    // 3.3k Samples/sec, Disable comparator
 
+    /// Data rate code for 3300 samples per second, the fastest rate.
+    static const BYTE DR_3300_SPS = 7;
+
+    /// Samples per second for each data rate code.
+    const ULONG m_dataRates[8] = { 128, 250, 490, 920, 1600, 2400, 3300, 3300 };
+
+    /// Extra wait after a channel change, allowing for the ADC oscillator tolerance.
+    const ULONG RATE_MARGIN_PERCENT = 10;
+
+    /// Value of m_continuousChannel when no continuous conversion is running.
+    static const ULONG NO_CHANNEL = 0xFFFFFFFF;
+
+    /// The data rate code programmed into the Configuration Register.
+    BYTE m_dataRateCode;
+
+    /// TRUE to use continuous conversion mode.
+    BOOL m_continuous;
+
+    /// The channel the ADC is converting in continuous mode.
+    ULONG m_continuousChannel;
+
+    /// TRUE if the data rate has changed since the continuous conversion was started.
+    BOOL m_rateChanged;
+
+    /// QPC time of the conversion returned by the last continuous mode reading.
+    ULONGLONG m_lastReadTicks;
+
+    /// Reading statistics.
+    ADC_STATS m_stats;
+
+    /// Used to wait for conversions to finish.
+    ConversionWaitClass m_wait;
+
+    /// Method to get the conversion time at the current data rate.
+    inline ULONG _conversionMicroseconds()
+    {
+        return (1000000 + m_dataRates[m_dataRateCode] - 1) / m_dataRates[m_dataRateCode];
+    }
+
     /// The mux value for single-ended input on AIN0.
     const BYTE ANI0 = 4;
 
@@ -10,14 +10,47 @@
 #include "AD7298Support.h"
 #include "ADS1015Support.h"
 #include "MCP3008support.h"
+#include "HiResTimer.h"
 
+/// The largest number of channels on any of the supported ADCs.
+#define ADC_MAX_CHANNELS 8
+
+/// Class used to take readings with the ADC on the board.
+/**
+This class can be used by several threads at once.  Requests are gathered into scans of
+the ADC: while one thread is reading the ADC, the channels other threads ask for are
+collected, and the next scan reads all of them at once.  Threads asking for the same
+channel while a scan is pending share that scan's reading of the channel.  A thread that
+finds the ADC idle starts a scan immediately, so a single reader sees no added latency.
+*/
 class AdcClass
 {
 public:
+    /// Struct used to return ADC scan performance information.
+    typedef struct {
+        ULONGLONG scans;                ///< Number of scans of the ADC performed
+        ULONGLONG samples;              ///< Number of channels read by those scans
+        ULONGLONG samplesPerSecond;     ///< Rate at which channels are read during a scan
+        ULONGLONG requests;             ///< Number of channel readings asked for by callers
+    } SCAN_STATS, *PSCAN_STATS;
+
     /// Constructor.
     AdcClass()
     {
         m_boardType = BoardPinsClass::BOARD_TYPE::NOT_SET;
+        m_scans = 0;
+        m_scanSamples = 0;
+        m_scanTicks = 0;
+        m_requests = 0;
+        m_pendingMask = 0;
+        m_scanInProgress = FALSE;
+        m_scansStarted = 0;
+        m_scansCompleted = 0;
+        m_resultBits = 0;
+        ZeroMemory(m_results, sizeof(m_results));
+        ZeroMemory(m_resultHr, sizeof(m_resultHr));
+        InitializeCriticalSection(&m_lock);
+        InitializeConditionVariable(&m_scanDone);
     }
 
     /// Destructor.
@@ -45,6 +78,8 @@ public:
             m_gen1Adc.end();
         }
 #endif // WINAPI_FAMILY_PARTITION(WINAPI_PARTITION_DESKTOP)
+
+        DeleteCriticalSection(&m_lock);
     }
 
     /// Take a reading with the ADC on the board.
@@ -57,51 +92,224 @@ public:
     \return HRESULT success or error code.
     */
     inline HRESULT readValue(ULONG pin, ULONG & value, ULONG & bits)
+    {
+        return readValues(&pin, &value, 1, bits);
+    }
+
+    /// Take readings from several analog inputs with the ADC on the board.
+    /**
+    The channels are read with a single scan by the ADC driver, which is faster than
+    reading them one at a time.  The scan may also include channels requested by other
+    threads.  This method assumes the pin numbers passed in have been verified to be
+    within the range of analog inputs.
+    \param[in] pins Array of the GPIO pin numbers to read with the ADC.
+    \param[out] values Array that receives the value read from each pin.
+    \param[in] count The number of pins to read.
+    \param[out] bits The size of each reading in "values" in bits.
+    \return HRESULT success or error code.
+    */
+    inline HRESULT readValues(const ULONG* pins, PULONG values, ULONG count, ULONG & bits)
     {
         HRESULT hr = S_OK;
         
         ULONG channel;
+        ULONG requestMask = 0;
+        ULONGLONG scan;
+        ULONG i;
 
 
-        // Translate the pin number passed in to analog channel 0-5.
+        // Translate the pin numbers passed in to analog channel numbers.
         // This calculation is based on the fact that all the ADCs we work with
         // have A0-An mapped to channels 0-n on the ADC.
-        channel = pin - A0;
-
-        // Verify we have initialized the correct ADC.
-        hr = _verifyAdcInitialized();
- 
-        if (SUCCEEDED(hr))
+        for (i = 0; SUCCEEDED(hr) && (i < count); i++)
         {
-            if (m_boardType == BoardPinsClass::BOARD_TYPE::MBM_IKA_LURE)
-            {
-                hr = m_ikaLureAdc.readValue(channel, value, bits);
-            }
-            else if (m_boardType == BoardPinsClass::BOARD_TYPE::MBM_BARE)
+            channel = pins[i] - A0;
+            if (channel >= ADC_MAX_CHANNELS)
             {
-                hr = m_addOnAdc.readValue(channel, value, bits);
+                hr = DMAP_E_ADC_DOES_NOT_HAVE_REQUESTED_CHANNEL;
             }
-            else if (m_boardType == BoardPinsClass::BOARD_TYPE::PI2_BARE)
+            else
             {
-                hr = m_addOnAdc.readValue(channel, value, bits);
+                requestMask |= 1 << channel;
             }
-#if WINAPI_FAMILY_PARTITION(WINAPI_PARTITION_DESKTOP)   // If building a Win32 app:
-            else if (m_boardType == BoardPinsClass::BOARD_TYPE::GALILEO_GEN2)
+        }
+
+        if (SUCCEEDED(hr) && (requestMask != 0))
+        {
+            EnterCriticalSection(&m_lock);
+
+            // Verify we have initialized the correct ADC.
+            hr = _verifyAdcInitialized();
+
+            if (SUCCEEDED(hr))
             {
-                hr = m_gen2Adc.readValue(channel, value, bits);
+                // Add our channels to the next scan, sharing any already requested.
+                m_pendingMask |= requestMask;
+                m_requests += count;
+                scan = m_scansStarted + 1;
+
+                while (m_scansCompleted < scan)
+                {
+                    if (m_scanInProgress)
+                    {
+                        // Wait for the scan on the ADC to finish.
+                        SleepConditionVariableCS(&m_scanDone, &m_lock, INFINITE);
+                    }
+                    else
+                    {
+                        // The ADC is idle, so perform the next scan on this thread.
+                        _performScan();
+                    }
+                }
             }
-            else if (m_boardType == BoardPinsClass::BOARD_TYPE::GALILEO_GEN1)
+
+            if (SUCCEEDED(hr))
             {
-                hr = m_gen1Adc.readValue(channel, value, bits);
+                // Pass back the readings from the scan that included our channels.
+                for (i = 0; SUCCEEDED(hr) && (i < count); i++)
+                {
+                    channel = pins[i] - A0;
+                    hr = m_resultHr[channel];
+                    values[i] = m_results[channel];
+                }
+                bits = m_resultBits;
             }
-#endif // WINAPI_FAMILY_PARTITION(WINAPI_PARTITION_DESKTOP)
+
+            LeaveCriticalSection(&m_lock);
         }
         
         return hr;
     }
 
+    /// Select the conversion mode and rate of the board's ADC.
+    /**
+    Only the ADS1015 used on the Ika Lure has a continuous conversion mode.
+    \param[in] continuous TRUE for continuous conversions, FALSE for single-shot conversions.
+    \param[in] samplesPerSecond The desired conversion rate.
+    \return HRESULT success or error code.
+    */
+    inline HRESULT setConversionMode(BOOL continuous, ULONG samplesPerSecond)
+    {
+        HRESULT hr = S_OK;
+
+        EnterCriticalSection(&m_lock);
+        _waitForIdle();
+
+        hr = _verifyAdcInitialized();
+
+        if (SUCCEEDED(hr) && (m_boardType != BoardPinsClass::BOARD_TYPE::MBM_IKA_LURE))
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = m_ikaLureAdc.setDataRate(samplesPerSecond);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = m_ikaLureAdc.setContinuousMode(continuous);
+        }
+
+        LeaveCriticalSection(&m_lock);
+
+        return hr;
+    }
+
+    /// Get the bus transactions and CPU cycles used by readings of the board's I2C ADC.
+    /**
+    \param[out] stats The reading statistics.
+    \return HRESULT success or error code.
+    */
+    inline HRESULT getConversionStats(ADS1015Device::ADC_STATS & stats)
+    {
+        HRESULT hr = S_OK;
+
+        EnterCriticalSection(&m_lock);
+        _waitForIdle();
+
+        hr = _verifyAdcInitialized();
+
+        if (SUCCEEDED(hr) && (m_boardType != BoardPinsClass::BOARD_TYPE::MBM_IKA_LURE))
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            m_ikaLureAdc.getStats(stats);
+        }
+
+        LeaveCriticalSection(&m_lock);
+
+        return hr;
+    }
+
+    /// Get performance information for the scans done by the board's ADC.
+    /**
+    When several threads read the ADC at once, "requests" exceeds "samples" by the number
+    of readings that were shared between threads.
+    */
+    inline void getScanStats(SCAN_STATS & stats)
+    {
+        ULONGLONG scanMicroseconds;
+
+        EnterCriticalSection(&m_lock);
+        stats.scans = m_scans;
+        stats.samples = m_scanSamples;
+        stats.requests = m_requests;
+        stats.samplesPerSecond = 0;
+        scanMicroseconds = g_hiResClock.ticksToMicroseconds(m_scanTicks);
+        if (scanMicroseconds > 0)
+        {
+            stats.samplesPerSecond = (m_scanSamples * 1000000ULL) / scanMicroseconds;
+        }
+        LeaveCriticalSection(&m_lock);
+    }
+
+    /// Reset the scan performance information.
+    inline void resetScanStats()
+    {
+        EnterCriticalSection(&m_lock);
+        m_scans = 0;
+        m_scanSamples = 0;
+        m_scanTicks = 0;
+        m_requests = 0;
+        LeaveCriticalSection(&m_lock);
+    }
+
 private:
 
+    /// Scan counters.
+    ULONGLONG m_scans;
+    ULONGLONG m_scanSamples;
+    ULONGLONG m_scanTicks;
+    ULONGLONG m_requests;
+
+    /// Lock protecting the ADC devices and the scan state.
+    RTL_CRITICAL_SECTION m_lock;
+
+    /// Signalled whenever a scan finishes.
+    CONDITION_VARIABLE m_scanDone;
+
+    /// Bit mask of the channels requested for the next scan.
+    ULONG m_pendingMask;
+
+    /// TRUE while a thread is performing a scan with the lock released.
+    BOOL m_scanInProgress;
+
+    /// Number of scans started and completed.
+    ULONGLONG m_scansStarted;
+    ULONGLONG m_scansCompleted;
+
+    /// The latest reading of each channel, and the result of taking it.
+    ULONG m_results[ADC_MAX_CHANNELS];
+    HRESULT m_resultHr[ADC_MAX_CHANNELS];
+
+    /// The size of the readings in m_results in bits.
+    ULONG m_resultBits;
+
     /// The board type for which this object has been initialized.
     BoardPinsClass::BOARD_TYPE m_boardType;
 
@@ -117,6 +325,107 @@ private:
 
     MCP3008Device m_addOnAdc;
 
+    /// Method to wait, with the lock held, until no scan is in progress.
+    inline void _waitForIdle()
+    {
+        while (m_scanInProgress)
+        {
+            SleepConditionVariableCS(&m_scanDone, &m_lock, INFINITE);
+        }
+    }
+
+    /// Method to scan the channels requested so far.
+    /**
+    Called with the lock held.  The lock is released while the ADC is being read, so other
+    threads can add channels to the following scan.
+    */
+    inline void _performScan()
+    {
+        HRESULT hr = S_OK;
+        ULONG channels[ADC_MAX_CHANNELS];
+        ULONG values[ADC_MAX_CHANNELS] = { 0 };
+        ULONG count = 0;
+        ULONG bits = 0;
+        ULONGLONG start;
+        ULONGLONG end;
+        ULONG i;
+
+        for (i = 0; i < ADC_MAX_CHANNELS; i++)
+        {
+            if ((m_pendingMask & (1 << i)) != 0)
+            {
+                channels[count] = i;
+                count++;
+            }
+        }
+        m_pendingMask = 0;
+        m_scansStarted++;
+        m_scanInProgress = TRUE;
+        LeaveCriticalSection(&m_lock);
+
+        start = g_hiResClock.now();
+        hr = _readChannels(channels, values, count, bits);
+        end = g_hiResClock.now();
+
+        EnterCriticalSection(&m_lock);
+        for (i = 0; i < count; i++)
+        {
+            m_results[channels[i]] = values[i];
+            m_resultHr[channels[i]] = hr;
+        }
+        if (SUCCEEDED(hr))
+        {
+            m_resultBits = bits;
+            m_scans++;
+            m_scanSamples += count;
+            m_scanTicks += end - start;
+        }
+        m_scansCompleted++;
+        m_scanInProgress = FALSE;
+        WakeAllConditionVariable(&m_scanDone);
+    }
+
+    /// Method to read channels with the ADC driver for the board.
+    /**
+    A single channel is read with the driver's readValue() method, and several channels
+    with its multi-channel scan.
+    \param[in] channels Array of channel numbers to read.
+    \param[out] values Array that receives the value read from each channel.
+    \param[in] count The number of channels to read.
+    \param[out] bits The size of each reading in "values" in bits.
+    \return HRESULT success or error code.
+    */
+    inline HRESULT _readChannels(const ULONG* channels, PULONG values, ULONG count, ULONG & bits)
+    {
+        HRESULT hr = S_OK;
+
+        if (m_boardType == BoardPinsClass::BOARD_TYPE::MBM_IKA_LURE)
+        {
+            hr = (count == 1) ? m_ikaLureAdc.readValue(channels[0], values[0], bits) :
+                m_ikaLureAdc.readValues(channels, values, count, bits);
+        }
+        else if ((m_boardType == BoardPinsClass::BOARD_TYPE::MBM_BARE) ||
+                 (m_boardType == BoardPinsClass::BOARD_TYPE::PI2_BARE))
+        {
+            hr = (count == 1) ? m_addOnAdc.readValue(channels[0], values[0], bits) :
+                m_addOnAdc.readValues(channels, values, count, bits);
+        }
+#if WINAPI_FAMILY_PARTITION(WINAPI_PARTITION_DESKTOP)   // If building a Win32 app:
+        else if (m_boardType == BoardPinsClass::BOARD_TYPE::GALILEO_GEN2)
+        {
+            hr = (count == 1) ? m_gen2Adc.readValue(channels[0], values[0], bits) :
+                m_gen2Adc.readValues(channels, values, count, bits);
+        }
+        else if (m_boardType == BoardPinsClass::BOARD_TYPE::GALILEO_GEN1)
+        {
+            hr = (count == 1) ? m_gen1Adc.readValue(channels[0], values[0], bits) :
+                m_gen1Adc.readValues(channels, values, count, bits);
+        }
+#endif // WINAPI_FAMILY_PARTITION(WINAPI_PARTITION_DESKTOP)
+
+        return hr;
+    }
+
     /// Initialize this object if it has not already been done.
     inline HRESULT _verifyAdcInitialized()
     {
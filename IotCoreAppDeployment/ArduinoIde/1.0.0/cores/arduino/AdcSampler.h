@@ -0,0 +1,459 @@
+// Copyright (c) Microsoft Open Technologies, Inc.  All rights reserved.  
+// Licensed under the BSD 2-Clause License.  
+// See License.txt in the project root for license information.
+
+#ifndef _ADC_SAMPLER_H_
+#define _ADC_SAMPLER_H_
+
+#include <Windows.h>
+#include <vector>
+
+#include "Adc.h"
+#include "HiResTimer.h"
+
+/// The maximum number of analog pins a sampler can scan.
+#define ADC_SAMPLER_MAX_PINS 8
+
+/// The maximum number of samples the sampler ring buffer can hold.
+#define ADC_SAMPLER_MAX_RING_SAMPLES 0x100000
+
+/// Time before a deadline at which the sampler thread stops sleeping and starts spinning.
+#define ADC_SAMPLER_SPIN_MICROSECONDS 2000
+
+/// Class used to sample analog inputs at a fixed rate on a background thread.
+/**
+The sampler thread scans the requested pins once per sample period, using the multi-channel
+scan of the board's ADC.  Each period has a deadline computed from the high resolution timer,
+so timing errors do not accumulate.  The thread sleeps until shortly before each deadline,
+then spins until the deadline arrives.
+
+Each reading is stored in a ring buffer with its timestamp and pin.  The ring has a single
+writer (the sampler thread) and a single reader (the consumer calling read()), so no lock is
+needed.  If the ring does not have room for a whole scan, the scan is dropped and counted as
+an overrun.
+
+\note Other code should not use the ADC while the sampler is running.
+*/
+class AdcSamplerClass
+{
+public:
+    /// Struct used to return one reading.
+    typedef struct {
+        ULONGLONG timestampMicroseconds;    ///< Time of the scan, relative to the call to start()
+        ULONG pin;                          ///< The analog pin read
+        ULONG value;                        ///< The value read, in the native ADC resolution
+    } SAMPLE, *PSAMPLE;
+
+    /// Struct used to return sampler statistics.
+    typedef struct {
+        ULONGLONG scans;                    ///< Number of scans stored in the ring
+        ULONGLONG overruns;                 ///< Scans dropped because the ring was full
+        ULONGLONG missedDeadlines;          ///< Sample periods skipped because a scan started too late
+        ULONGLONG achievedRateMilliHz;      ///< Scans per 1000 seconds since the sampler was started
+        ULONGLONG meanJitterNanoseconds;    ///< Average time a scan started after its deadline
+        ULONGLONG maxJitterNanoseconds;     ///< Longest time a scan started after its deadline
+        ULONG bits;                         ///< The resolution of the readings in bits
+    } SAMPLER_STATS, *PSAMPLER_STATS;
+
+    /// Constructor.
+    AdcSamplerClass() :
+        m_pinCount(0),
+        m_periodTicks(0),
+        m_ringMask(0),
+        m_writeIndex(0),
+        m_readIndex(0),
+        m_hThread(NULL),
+        m_hSamplesReady(NULL),
+        m_stopping(FALSE),
+        m_error(S_OK),
+        m_bits(0),
+        m_startTicks(0)
+    {
+        ZeroMemory(m_pins, sizeof(m_pins));
+        ZeroMemory(&m_counts, sizeof(m_counts));
+    }
+
+    /// Destructor.
+    virtual ~AdcSamplerClass()
+    {
+        stop();
+    }
+
+    /// Start sampling a set of analog pins.
+    HRESULT start(const ULONG* pins, ULONG pinCount, ULONG rateHz, ULONG ringSamples);
+
+    /// Stop sampling.  Readings already in the ring can still be read.
+    void stop();
+
+    /// Determine whether the sampler is running.
+    inline BOOL isRunning()
+    {
+        return (m_hThread != NULL) && !m_stopping;
+    }
+
+    /// Get the first error encountered by the sampler thread, if any.
+    inline HRESULT getError()
+    {
+        return m_error;
+    }
+
+    /// Get the number of readings waiting in the ring.
+    inline ULONG available()
+    {
+        ULONG writeIndex = m_writeIndex;
+        MemoryBarrier();
+        return writeIndex - m_readIndex;
+    }
+
+    /// Read a block of readings from the ring.
+    HRESULT read(PSAMPLE samples, ULONG maxSamples, ULONG & samplesRead, DWORD timeoutMs = 0);
+
+    /// Get the statistics for the sampler.
+    void getStats(SAMPLER_STATS & stats);
+
+private:
+
+    /// Struct used to accumulate sampler statistics in QPC ticks.
+    typedef struct {
+        ULONGLONG scans;
+        ULONGLONG overruns;
+        ULONGLONG missedDeadlines;
+        ULONGLONG jitterTicks;
+        ULONGLONG maxJitterTicks;
+    } COUNTS;
+
+    /// The analog pins to scan.
+    ULONG m_pins[ADC_SAMPLER_MAX_PINS];
+
+    /// The number of analog pins to scan.
+    ULONG m_pinCount;
+
+    /// The sample period in QPC ticks.
+    ULONGLONG m_periodTicks;
+
+    /// The ring buffer.  Its size is a power of two.
+    std::vector<SAMPLE> m_ring;
+
+    /// Mask used to turn a ring index into a position in the ring.
+    ULONG m_ringMask;
+
+    /// Count of readings written to the ring.  Only changed by the sampler thread.
+    volatile ULONG m_writeIndex;
+
+    /// Count of readings read from the ring.  Only changed by the consumer.
+    volatile ULONG m_readIndex;
+
+    /// Handle of the sampler thread.
+    HANDLE m_hThread;
+
+    /// Event signalled each time a scan is stored in the ring.
+    HANDLE m_hSamplesReady;
+
+    /// Set to TRUE to ask the sampler thread to exit.
+    volatile BOOL m_stopping;
+
+    /// First error encountered on the sampler thread.
+    HRESULT m_error;
+
+    /// The resolution of the readings in bits.
+    ULONG m_bits;
+
+    /// Sampler statistics.
+    COUNTS m_counts;
+
+    /// g_hiResClock reading when the sampler was started.
+    ULONGLONG m_startTicks;
+
+    /// Entry point of the sampler thread.
+    static DWORD WINAPI _samplerThread(LPVOID param)
+    {
+        ((AdcSamplerClass*)param)->_runSampler();
+        return 0;
+    }
+
+    /// Method to scan the pins at each deadline.
+    void _runSampler();
+
+    /// Method to wait for a deadline.
+    inline void _waitUntil(ULONGLONG deadline)
+    {
+        ULONGLONG now;
+        ULONGLONG spinTicks = g_hiResClock.microsecondsToTicks(ADC_SAMPLER_SPIN_MICROSECONDS);
+
+        // A simulated clock only advances when it is waited on.
+        if (_WindowsTime.getTimeSource() != nullptr)
+        {
+            g_hiResClock.waitUntil(deadline);
+            return;
+        }
+
+        now = g_hiResClock.now();
+        while ((now < deadline) && !m_stopping)
+        {
+            if ((deadline - now) > spinTicks)
+            {
+                Sleep(1);
+            }
+            else
+            {
+                YieldProcessor();
+            }
+            now = g_hiResClock.now();
+        }
+    }
+};
+
+/**
+\param[in] pins Array of the analog pins to scan (A0-An).
+\param[in] pinCount The number of pins to scan (1 to ADC_SAMPLER_MAX_PINS).
+\param[in] rateHz The number of scans per second.
+\param[in] ringSamples The minimum number of readings the ring should hold.  This is rounded
+up to a power of two.
+\return HRESULT success or error code.
+*/
+inline HRESULT AdcSamplerClass::start(const ULONG* pins, ULONG pinCount, ULONG rateHz, ULONG ringSamples)
+{
+    HRESULT hr = S_OK;
+    ULONG ringSize;
+    ULONG i;
+
+    if (m_hThread != NULL)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_STATE);
+    }
+
+    if (SUCCEEDED(hr) && ((pinCount == 0) || (pinCount > ADC_SAMPLER_MAX_PINS) || (rateHz == 0) ||
+        (rateHz > g_hiResClock.getFrequency()) || (ringSamples < pinCount) || (ringSamples > ADC_SAMPLER_MAX_RING_SAMPLES)))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        for (i = 0; i < pinCount; i++)
+        {
+            m_pins[i] = pins[i];
+        }
+        m_pinCount = pinCount;
+        m_periodTicks = g_hiResClock.getFrequency() / rateHz;
+
+        ringSize = 1;
+        while (ringSize < ringSamples)
+        {
+            ringSize = ringSize << 1;
+        }
+        m_ring.assign(ringSize, SAMPLE());
+        m_ringMask = ringSize - 1;
+        m_writeIndex = 0;
+        m_readIndex = 0;
+
+        m_stopping = FALSE;
+        m_error = S_OK;
+        m_bits = 0;
+        ZeroMemory(&m_counts, sizeof(m_counts));
+
+        m_hSamplesReady = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (m_hSamplesReady == NULL)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        m_startTicks = g_hiResClock.now();
+
+        m_hThread = CreateThread(NULL, 0, _samplerThread, this, 0, NULL);
+
+        if (m_hThread == NULL)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            CloseHandle(m_hSamplesReady);
+            m_hSamplesReady = NULL;
+        }
+        else
+        {
+            // Keep the sampler from being preempted by ordinary sketch threads,
+            // so scans start close to their deadlines.
+            SetThreadPriority(m_hThread, THREAD_PRIORITY_TIME_CRITICAL);
+        }
+    }
+
+    return hr;
+}
+
+inline void AdcSamplerClass::stop()
+{
+    m_stopping = TRUE;
+
+    if (m_hThread != NULL)
+    {
+        WaitForSingleObject(m_hThread, INFINITE);
+        CloseHandle(m_hThread);
+        m_hThread = NULL;
+    }
+
+    if (m_hSamplesReady != NULL)
+    {
+        CloseHandle(m_hSamplesReady);
+        m_hSamplesReady = NULL;
+    }
+}
+
+/**
+Readings are returned in the order they were taken, a whole scan at a time if maxSamples is
+a multiple of the number of pins scanned.
+\param[out] samples Buffer to receive the readings.
+\param[in] maxSamples The number of readings the buffer can hold.
+\param[out] samplesRead The number of readings returned.
+\param[in] timeoutMs How long to wait for a reading if the ring is empty.  Zero to return
+immediately.
+\return HRESULT success or error code.  No readings within the timeout is not an error.
+*/
+inline HRESULT AdcSamplerClass::read(PSAMPLE samples, ULONG maxSamples, ULONG & samplesRead, DWORD timeoutMs)
+{
+    ULONG readIndex = m_readIndex;
+    ULONG count;
+    ULONG i;
+
+    samplesRead = 0;
+
+    count = available();
+    if ((count == 0) && (timeoutMs != 0) && (m_hSamplesReady != NULL) && isRunning())
+    {
+        WaitForSingleObject(m_hSamplesReady, timeoutMs);
+        count = available();
+    }
+
+    if (count > maxSamples)
+    {
+        count = maxSamples;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        samples[i] = m_ring[(readIndex + i) & m_ringMask];
+    }
+
+    // Make sure the readings have been copied before the writer can reuse their slots.
+    MemoryBarrier();
+    m_readIndex = readIndex + count;
+
+    samplesRead = count;
+
+    return m_error;
+}
+
+/**
+\param[out] stats The statistics for the sampler.
+*/
+inline void AdcSamplerClass::getStats(SAMPLER_STATS & stats)
+{
+    ULONGLONG elapsedMicroseconds;
+    ULONGLONG attempts;
+
+    elapsedMicroseconds = g_hiResClock.ticksToMicroseconds(g_hiResClock.now() - m_startTicks);
+
+    stats.scans = m_counts.scans;
+    stats.overruns = m_counts.overruns;
+    stats.missedDeadlines = m_counts.missedDeadlines;
+    stats.achievedRateMilliHz = 0;
+    if (elapsedMicroseconds > 0)
+    {
+        stats.achievedRateMilliHz = (m_counts.scans * 1000000000ULL) / elapsedMicroseconds;
+    }
+
+    attempts = m_counts.scans + m_counts.overruns;
+    stats.meanJitterNanoseconds = 0;
+    if (attempts > 0)
+    {
+        stats.meanJitterNanoseconds = g_hiResClock.ticksToNanoseconds(m_counts.jitterTicks / attempts);
+    }
+    stats.maxJitterNanoseconds = g_hiResClock.ticksToNanoseconds(m_counts.maxJitterTicks);
+    stats.bits = m_bits;
+}
+
+inline void AdcSamplerClass::_runSampler()
+{
+    HRESULT hr = S_OK;
+    ULONGLONG deadline = m_startTicks + m_periodTicks;
+    ULONGLONG lateTicks;
+    ULONGLONG missed;
+    ULONGLONG scanTime;
+    ULONG values[ADC_SAMPLER_MAX_PINS];
+    ULONG writeIndex;
+    ULONG readIndex;
+    ULONG bits;
+    PSAMPLE sample;
+    ULONG i;
+
+    while (!m_stopping && SUCCEEDED(hr))
+    {
+        _waitUntil(deadline);
+        if (m_stopping)
+        {
+            break;
+        }
+
+        scanTime = g_hiResClock.now();
+        lateTicks = scanTime - deadline;
+
+        // If whole periods have gone by, skip their deadlines rather than trying to catch up.
+        if (lateTicks >= m_periodTicks)
+        {
+            missed = lateTicks / m_periodTicks;
+            m_counts.missedDeadlines += missed;
+            deadline += missed * m_periodTicks;
+            lateTicks -= missed * m_periodTicks;
+        }
+
+        m_counts.jitterTicks += lateTicks;
+        if (lateTicks > m_counts.maxJitterTicks)
+        {
+            m_counts.maxJitterTicks = lateTicks;
+        }
+
+        hr = g_adc.readValues(m_pins, values, m_pinCount, bits);
+
+        if (SUCCEEDED(hr))
+        {
+            m_bits = bits;
+
+            writeIndex = m_writeIndex;
+            readIndex = m_readIndex;
+            MemoryBarrier();
+
+            // Only store whole scans.
+            if ((m_ring.size() - (writeIndex - readIndex)) < m_pinCount)
+            {
+                m_counts.overruns++;
+            }
+            else
+            {
+                for (i = 0; i < m_pinCount; i++)
+                {
+                    sample = &m_ring[(writeIndex + i) & m_ringMask];
+                    sample->timestampMicroseconds = g_hiResClock.ticksToMicroseconds(scanTime - m_startTicks);
+                    sample->pin = m_pins[i];
+                    sample->value = values[i];
+                }
+
+                // Make sure the readings are in the ring before the reader can see them.
+                MemoryBarrier();
+                m_writeIndex = writeIndex + m_pinCount;
+                m_counts.scans++;
+
+                SetEvent(m_hSamplesReady);
+            }
+        }
+
+        deadline += m_periodTicks;
+    }
+
+    if (FAILED(hr))
+    {
+        m_error = hr;
+    }
+}
+
+#endif  // _ADC_SAMPLER_H_
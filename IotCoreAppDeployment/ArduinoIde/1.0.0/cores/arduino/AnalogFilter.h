@@ -0,0 +1,648 @@
+// Copyright (c) Microsoft Open Technologies, Inc.  All rights reserved.  
+// Licensed under the BSD 2-Clause License.  
+// See License.txt in the project root for license information.
+
+#ifndef _ANALOG_FILTER_H_
+#define _ANALOG_FILTER_H_
+
+#include <Windows.h>
+#include <math.h>
+#include <vector>
+
+#include "AdcSampler.h"
+#include "HiResTimer.h"
+
+/// The largest supported oversampling factor.
+#define ANALOG_FILTER_MAX_OVERSAMPLING 256
+
+/// The longest supported moving average.
+#define ANALOG_FILTER_MAX_AVERAGE_LENGTH 1024
+
+/// The largest supported number of FIR filter taps.
+#define ANALOG_FILTER_MAX_FIR_TAPS 128
+
+/// The number of fraction bits in FIR filter coefficients.
+#define ANALOG_FILTER_FIR_FRACTION_BITS 15
+
+/// The number of fraction bits in the IIR filter coefficient.
+#define ANALOG_FILTER_IIR_FRACTION_BITS 16
+
+/// Class used to filter a stream of readings from one analog input.
+/**
+Readings are processed in blocks.  Each block first passes through an optional oversampling
+stage, which sums groups of N readings and keeps the extra resolution that averaging provides
+(half a bit for each doubling of N), then through one of a moving average, a single pole IIR
+low pass, or an FIR filter.  Minimum, maximum, mean and RMS statistics are kept for the output
+of the last block processed.
+
+All the arithmetic is integer.  The filter state carries over from one block to the next, so
+a stream can be processed in blocks of any size, including readings taken from an
+AdcSamplerClass ring with processSamples().
+*/
+class AnalogFilterClass
+{
+public:
+    /// The types of filter that can follow the oversampling stage.
+    enum FILTER_TYPE {
+        FILTER_NONE,                ///< Pass the oversampled values through unchanged
+        FILTER_MOVING_AVERAGE,      ///< Average of the last N values
+        FILTER_IIR,                 ///< Single pole low pass: y += alpha * (x - y)
+        FILTER_FIR                  ///< Finite impulse response filter with fixed point coefficients
+    };
+
+    /// Struct used to return statistics for a block of output values.
+    typedef struct {
+        ULONG count;                ///< Number of values in the block
+        LONG min;                   ///< Smallest value in the block
+        LONG max;                   ///< Largest value in the block
+        double mean;                ///< Average of the values in the block
+        double rms;                 ///< Root mean square of the values in the block
+    } BLOCK_STATS, *PBLOCK_STATS;
+
+    /// Struct used to return filter throughput information.
+    typedef struct {
+        ULONGLONG samplesIn;        ///< Number of readings processed
+        ULONGLONG samplesOut;       ///< Number of filtered values produced
+        ULONGLONG samplesPerSecond; ///< Rate at which readings are processed
+    } PERF_STATS, *PPERF_STATS;
+
+    /// Constructor.
+    AnalogFilterClass() :
+        m_inputBits(0),
+        m_oversampling(1),
+        m_extraBits(0),
+        m_decimationShift(0),
+        m_filterType(FILTER_NONE),
+        m_averageLength(0),
+        m_iirAlpha(0),
+        m_firTaps(0)
+    {
+        ZeroMemory(&m_blockStats, sizeof(m_blockStats));
+        resetStats();
+        reset();
+    }
+
+    /// Destructor.
+    virtual ~AnalogFilterClass()
+    {
+    }
+
+    /// Set the oversampling factor.
+    HRESULT setOversampling(ULONG factor, ULONG inputBits);
+
+    /// Remove any filter following the oversampling stage.
+    inline void setNoFilter()
+    {
+        m_filterType = FILTER_NONE;
+        reset();
+    }
+
+    /// Use a moving average filter.
+    HRESULT setMovingAverage(ULONG length);
+
+    /// Use a single pole IIR low pass filter.
+    HRESULT setIirFilter(ULONG alpha);
+
+    /// Use an FIR filter.
+    HRESULT setFirFilter(const LONG* coefficients, ULONG taps);
+
+    /// Get the type of filter in use.
+    inline FILTER_TYPE getFilterType()
+    {
+        return m_filterType;
+    }
+
+    /// Get the resolution of the filtered values in bits.
+    inline ULONG getOutputBits()
+    {
+        return m_inputBits + m_extraBits;
+    }
+
+    /// Discard the filter history, so the next block starts a new stream.
+    void reset();
+
+    /// Filter a block of readings.
+    HRESULT process(const ULONG* input, ULONG inputCount, PLONG output, ULONG & outputCount);
+
+    /// Filter the readings for one pin from a block of sampler readings.
+    HRESULT processSamples(const AdcSamplerClass::SAMPLE* samples, ULONG sampleCount, ULONG pin, PLONG output, ULONG & outputCount);
+
+    /// Get the statistics for the output of the last block processed.
+    inline void getBlockStats(BLOCK_STATS & stats)
+    {
+        stats = m_blockStats;
+    }
+
+    /// Get the filter throughput information.
+    inline void getStats(PERF_STATS & stats)
+    {
+        ULONGLONG processMicroseconds = g_hiResClock.ticksToMicroseconds(m_processTicks);
+
+        stats.samplesIn = m_samplesIn;
+        stats.samplesOut = m_samplesOut;
+        stats.samplesPerSecond = 0;
+        if (processMicroseconds > 0)
+        {
+            stats.samplesPerSecond = (m_samplesIn * 1000000ULL) / processMicroseconds;
+        }
+    }
+
+    /// Reset the filter throughput information.
+    inline void resetStats()
+    {
+        m_samplesIn = 0;
+        m_samplesOut = 0;
+        m_processTicks = 0;
+    }
+
+    /// Compute the statistics for a block of values.
+    static void computeBlockStats(const LONG* values, ULONG count, BLOCK_STATS & stats);
+
+private:
+
+    /// The resolution of the readings being filtered.
+    ULONG m_inputBits;
+
+    /// The number of readings summed into each oversampled value.
+    ULONG m_oversampling;
+
+    /// The resolution added by oversampling.
+    ULONG m_extraBits;
+
+    /// The shift that scales a sum of readings to the oversampled resolution.
+    ULONG m_decimationShift;
+
+    /// The sum of the readings in the current oversampling group.
+    LONGLONG m_oversampleSum;
+
+    /// The number of readings in the current oversampling group.
+    ULONG m_oversampleCount;
+
+    /// The type of filter following the oversampling stage.
+    FILTER_TYPE m_filterType;
+
+    /// The number of values in the moving average.
+    ULONG m_averageLength;
+
+    /// The values in the moving average.
+    std::vector<LONG> m_averageHistory;
+
+    /// The sum of the values in the moving average.
+    LONGLONG m_averageSum;
+
+    /// The position of the oldest value in the moving average history.
+    ULONG m_averageIndex;
+
+    /// The number of values in the moving average history.
+    ULONG m_averageFill;
+
+    /// The IIR filter coefficient, with ANALOG_FILTER_IIR_FRACTION_BITS of fraction.
+    ULONG m_iirAlpha;
+
+    /// The IIR filter output, with ANALOG_FILTER_IIR_FRACTION_BITS of fraction.
+    LONGLONG m_iirState;
+
+    /// TRUE once the IIR filter has been seeded with its first value.
+    BOOL m_iirPrimed;
+
+    /// The FIR filter coefficients, oldest value first.
+    std::vector<LONG> m_firCoefficients;
+
+    /// The number of FIR filter taps.
+    ULONG m_firTaps;
+
+    /// The FIR filter history.  Each value is stored twice, taps apart, so the
+    /// last "taps" values are always contiguous and the inner loop needs no wrap.
+    std::vector<LONG> m_firHistory;
+
+    /// The position at which the next value is stored in the FIR history.
+    ULONG m_firIndex;
+
+    /// Readings for one pin gathered by processSamples().
+    std::vector<ULONG> m_pinReadings;
+
+    /// Statistics for the output of the last block processed.
+    BLOCK_STATS m_blockStats;
+
+    /// Throughput counters.
+    ULONGLONG m_samplesIn;
+    ULONGLONG m_samplesOut;
+    ULONGLONG m_processTicks;
+
+    /// Method to oversample a block of readings.
+    ULONG _decimate(const ULONG* input, ULONG inputCount, PLONG output);
+
+    /// Methods to run each type of filter over a block of values in place.
+    void _movingAverage(PLONG values, ULONG count);
+    void _iir(PLONG values, ULONG count);
+    void _fir(PLONG values, ULONG count);
+};
+
+/**
+Oversampling by a factor of 4 adds one bit of resolution, by 16 adds two bits, and so on.
+An odd power of two adds the same resolution as the power of four below it, with the remaining
+factor of two used for averaging.  Setting the oversampling discards the filter history.
+\param[in] factor The number of readings combined into each value: a power of two from 1 to
+ANALOG_FILTER_MAX_OVERSAMPLING.  1 disables oversampling.
+\param[in] inputBits The resolution of the readings to be filtered, in bits (1 to 24).
+\return HRESULT success or error code.
+*/
+inline HRESULT AnalogFilterClass::setOversampling(ULONG factor, ULONG inputBits)
+{
+    HRESULT hr = S_OK;
+    ULONG factorBits = 0;
+
+    if ((factor == 0) || (factor > ANALOG_FILTER_MAX_OVERSAMPLING) || ((factor & (factor - 1)) != 0) ||
+        (inputBits == 0) || (inputBits > 24))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        while ((1UL << factorBits) < factor)
+        {
+            factorBits++;
+        }
+
+        m_inputBits = inputBits;
+        m_oversampling = factor;
+        m_extraBits = factorBits / 2;
+        m_decimationShift = factorBits - m_extraBits;
+        reset();
+    }
+
+    return hr;
+}
+
+/**
+\param[in] length The number of values to average (1 to ANALOG_FILTER_MAX_AVERAGE_LENGTH).
+Until that many values have been seen, the values seen so far are averaged.
+\return HRESULT success or error code.
+*/
+inline HRESULT AnalogFilterClass::setMovingAverage(ULONG length)
+{
+    HRESULT hr = S_OK;
+
+    if ((length == 0) || (length > ANALOG_FILTER_MAX_AVERAGE_LENGTH))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        m_averageLength = length;
+        m_averageHistory.assign(length, 0);
+        m_filterType = FILTER_MOVING_AVERAGE;
+        reset();
+    }
+
+    return hr;
+}
+
+/**
+\param[in] alpha The weight given to each new value, with ANALOG_FILTER_IIR_FRACTION_BITS of
+fraction: 1 to 65536, where 65536 passes values through unchanged and smaller values filter
+more heavily.
+\return HRESULT success or error code.
+*/
+inline HRESULT AnalogFilterClass::setIirFilter(ULONG alpha)
+{
+    HRESULT hr = S_OK;
+
+    if ((alpha == 0) || (alpha > (1UL << ANALOG_FILTER_IIR_FRACTION_BITS)))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        m_iirAlpha = alpha;
+        m_filterType = FILTER_IIR;
+        reset();
+    }
+
+    return hr;
+}
+
+/**
+The history is primed with zeros, so the first "taps - 1" outputs include the filter's
+step response.
+\param[in] coefficients The filter coefficients, with ANALOG_FILTER_FIR_FRACTION_BITS of
+fraction (32768 is 1.0).  coefficients[0] is applied to the newest value.
+\param[in] taps The number of coefficients (1 to ANALOG_FILTER_MAX_FIR_TAPS).
+\return HRESULT success or error code.
+*/
+inline HRESULT AnalogFilterClass::setFirFilter(const LONG* coefficients, ULONG taps)
+{
+    HRESULT hr = S_OK;
+    ULONG i;
+
+    if ((coefficients == nullptr) || (taps == 0) || (taps > ANALOG_FILTER_MAX_FIR_TAPS))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        // Store the coefficients in history order (oldest value first).
+        m_firCoefficients.resize(taps);
+        for (i = 0; i < taps; i++)
+        {
+            m_firCoefficients[taps - 1 - i] = coefficients[i];
+        }
+        m_firTaps = taps;
+        m_firHistory.assign(taps * 2, 0);
+        m_filterType = FILTER_FIR;
+        reset();
+    }
+
+    return hr;
+}
+
+inline void AnalogFilterClass::reset()
+{
+    m_oversampleSum = 0;
+    m_oversampleCount = 0;
+
+    m_averageSum = 0;
+    m_averageIndex = 0;
+    m_averageFill = 0;
+
+    m_iirState = 0;
+    m_iirPrimed = FALSE;
+
+    if (!m_firHistory.empty())
+    {
+        ZeroMemory(m_firHistory.data(), m_firHistory.size() * sizeof(LONG));
+    }
+    m_firIndex = 0;
+}
+
+/**
+\param[in] input The readings to filter.
+\param[in] inputCount The number of readings.
+\param[out] output Array that receives the filtered values.  It must have room for inputCount
+values.  Fewer are produced when oversampling; readings that do not complete an oversampling
+group are kept for the next block.
+\param[out] outputCount The number of filtered values produced.
+\return HRESULT success or error code.
+*/
+inline HRESULT AnalogFilterClass::process(const ULONG* input, ULONG inputCount, PLONG output, ULONG & outputCount)
+{
+    HRESULT hr = S_OK;
+    ULONGLONG start;
+
+    outputCount = 0;
+
+    if ((inputCount > 0) && ((input == nullptr) || (output == nullptr)))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr) && (inputCount > 0))
+    {
+        start = g_hiResClock.now();
+
+        outputCount = _decimate(input, inputCount, output);
+
+        if (m_filterType == FILTER_MOVING_AVERAGE)
+        {
+            _movingAverage(output, outputCount);
+        }
+        else if (m_filterType == FILTER_IIR)
+        {
+            _iir(output, outputCount);
+        }
+        else if (m_filterType == FILTER_FIR)
+        {
+            _fir(output, outputCount);
+        }
+
+        computeBlockStats(output, outputCount, m_blockStats);
+
+        m_processTicks += g_hiResClock.now() - start;
+        m_samplesIn += inputCount;
+        m_samplesOut += outputCount;
+    }
+
+    return hr;
+}
+
+/**
+\param[in] samples The readings returned by AdcSamplerClass::read().
+\param[in] sampleCount The number of readings.
+\param[in] pin The analog pin whose readings are to be filtered.  Readings of other pins are
+ignored.
+\param[out] output Array that receives the filtered values.  It must have room for one value
+for each reading of the pin.
+\param[out] outputCount The number of filtered values produced.
+\return HRESULT success or error code.
+*/
+inline HRESULT AnalogFilterClass::processSamples(const AdcSamplerClass::SAMPLE* samples, ULONG sampleCount, ULONG pin, PLONG output, ULONG & outputCount)
+{
+    ULONG i;
+
+    m_pinReadings.clear();
+    for (i = 0; i < sampleCount; i++)
+    {
+        if (samples[i].pin == pin)
+        {
+            m_pinReadings.push_back(samples[i].value);
+        }
+    }
+
+    return process(m_pinReadings.data(), (ULONG)m_pinReadings.size(), output, outputCount);
+}
+
+/**
+\param[in] values The values.
+\param[in] count The number of values.
+\param[out] stats The statistics for the values.  All zero if count is zero.
+*/
+inline void AnalogFilterClass::computeBlockStats(const LONG* values, ULONG count, BLOCK_STATS & stats)
+{
+    LONGLONG sum = 0;
+    double sumSquares = 0.0;
+    LONG minValue;
+    LONG maxValue;
+    ULONG i;
+
+    ZeroMemory(&stats, sizeof(stats));
+
+    if (count > 0)
+    {
+        minValue = values[0];
+        maxValue = values[0];
+        for (i = 0; i < count; i++)
+        {
+            if (values[i] < minValue)
+            {
+                minValue = values[i];
+            }
+            if (values[i] > maxValue)
+            {
+                maxValue = values[i];
+            }
+            sum += values[i];
+            sumSquares += (double)values[i] * (double)values[i];
+        }
+
+        stats.count = count;
+        stats.min = minValue;
+        stats.max = maxValue;
+        stats.mean = (double)sum / count;
+        stats.rms = sqrt(sumSquares / count);
+    }
+}
+
+/**
+\param[in] input The readings.
+\param[in] inputCount The number of readings.
+\param[out] output Array that receives the oversampled values.
+\return The number of oversampled values produced.
+*/
+inline ULONG AnalogFilterClass::_decimate(const ULONG* input, ULONG inputCount, PLONG output)
+{
+    ULONG outputCount = 0;
+    ULONG i;
+
+    if (m_oversampling == 1)
+    {
+        for (i = 0; i < inputCount; i++)
+        {
+            output[i] = (LONG)input[i];
+        }
+        outputCount = inputCount;
+    }
+    else
+    {
+        for (i = 0; i < inputCount; i++)
+        {
+            m_oversampleSum += input[i];
+            m_oversampleCount++;
+            if (m_oversampleCount == m_oversampling)
+            {
+                output[outputCount] = (LONG)(m_oversampleSum >> m_decimationShift);
+                outputCount++;
+                m_oversampleSum = 0;
+                m_oversampleCount = 0;
+            }
+        }
+    }
+
+    return outputCount;
+}
+
+/**
+\param[in,out] values The values to filter, replaced by the filtered values.
+\param[in] count The number of values.
+*/
+inline void AnalogFilterClass::_movingAverage(PLONG values, ULONG count)
+{
+    ULONG i;
+
+    for (i = 0; i < count; i++)
+    {
+        // Replace the oldest value in the running sum with the new one.
+        if (m_averageFill == m_averageLength)
+        {
+            m_averageSum -= m_averageHistory[m_averageIndex];
+        }
+        else
+        {
+            m_averageFill++;
+        }
+        m_averageSum += values[i];
+        m_averageHistory[m_averageIndex] = values[i];
+        m_averageIndex++;
+        if (m_averageIndex == m_averageLength)
+        {
+            m_averageIndex = 0;
+        }
+
+        values[i] = (LONG)(m_averageSum / (LONGLONG)m_averageFill);
+    }
+}
+
+/**
+\param[in,out] values The values to filter, replaced by the filtered values.
+\param[in] count The number of values.
+*/
+inline void AnalogFilterClass::_iir(PLONG values, ULONG count)
+{
+    const LONGLONG one = 1LL << ANALOG_FILTER_IIR_FRACTION_BITS;
+    LONGLONG state = m_iirState;
+    ULONG i;
+
+    // Start from the first value rather than ramping up from zero.
+    if (!m_iirPrimed && (count > 0))
+    {
+        state = (LONGLONG)values[0] * one;
+        m_iirPrimed = TRUE;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        state += (((LONGLONG)values[i] * one - state) * (LONGLONG)m_iirAlpha) >> ANALOG_FILTER_IIR_FRACTION_BITS;
+        values[i] = (LONG)((state + (one / 2)) >> ANALOG_FILTER_IIR_FRACTION_BITS);
+    }
+
+    m_iirState = state;
+}
+
+/**
+Each output is the dot product of the coefficients and a contiguous window of the history.
+The dot product is unrolled four ways with independent accumulators, which lets the compiler
+keep the multiplies in flight together and vectorize the loop where the target allows.
+\param[in,out] values The values to filter, replaced by the filtered values.
+\param[in] count The number of values.
+*/
+inline void AnalogFilterClass::_fir(PLONG values, ULONG count)
+{
+    const ULONG taps = m_firTaps;
+    const LONG* coefficients = m_firCoefficients.data();
+    PLONG history = m_firHistory.data();
+    const LONG* window;
+    LONGLONG sum0;
+    LONGLONG sum1;
+    LONGLONG sum2;
+    LONGLONG sum3;
+    ULONG i;
+    ULONG t;
+
+    for (i = 0; i < count; i++)
+    {
+        // Store the new value in both copies of the history.
+        history[m_firIndex] = values[i];
+        history[m_firIndex + taps] = values[i];
+        m_firIndex++;
+        if (m_firIndex == taps)
+        {
+            m_firIndex = 0;
+        }
+
+        // The last "taps" values, oldest first, start at the next store position.
+        window = history + m_firIndex;
+
+        sum0 = 0;
+        sum1 = 0;
+        sum2 = 0;
+        sum3 = 0;
+        for (t = 0; (t + 4) <= taps; t += 4)
+        {
+            sum0 += (LONGLONG)window[t] * coefficients[t];
+            sum1 += (LONGLONG)window[t + 1] * coefficients[t + 1];
+            sum2 += (LONGLONG)window[t + 2] * coefficients[t + 2];
+            sum3 += (LONGLONG)window[t + 3] * coefficients[t + 3];
+        }
+        for (; t < taps; t++)
+        {
+            sum0 += (LONGLONG)window[t] * coefficients[t];
+        }
+
+        values[i] = (LONG)((sum0 + sum1 + sum2 + sum3 + (1LL << (ANALOG_FILTER_FIR_FRACTION_BITS - 1))) >> ANALOG_FILTER_FIR_FRACTION_BITS);
+    }
+}
+
+#endif  // _ANALOG_FILTER_H_
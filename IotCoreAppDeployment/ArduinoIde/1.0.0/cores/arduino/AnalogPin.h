@@ -0,0 +1,183 @@
+// Copyright (c) Microsoft Open Technologies, Inc.  All rights reserved.  
+// Licensed under the BSD 2-Clause License.  
+// See License.txt in the project root for license information.
+
+#ifndef _ANALOG_PIN_H_
+#define _ANALOG_PIN_H_
+
+#include <Windows.h>
+
+/// Class used to read one analog input pin many times.
+/**
+analogRead() looks up the board type and verifies the pin function on every call.  An
+AnalogIn object does that once, when it is created, and keeps the shift that scales ADC
+readings to the resolution set with analogReadResolution().  Each read() is then a single
+call to the ADC followed by a shift.
+
+\note If the function of the pin is changed after the object is created (for example
+with pinMode()), a new AnalogIn object should be created for it.
+*/
+class AnalogIn
+{
+public:
+    /// Constructor.
+    AnalogIn(int pin);
+
+    /// Perform an analog to digital conversion on the pin.
+    inline int read();
+
+    /// Get the GPIO pin number read by this object.
+    inline ULONG getPin()
+    {
+        return m_ioPin;
+    }
+
+private:
+    /// The GPIO pin number passed to the ADC.
+    ULONG m_ioPin;
+
+    /// The ADC resolution the shift was computed for.
+    ULONG m_adcBits;
+
+    /// The analog read resolution the shift was computed for.
+    ULONG m_valueBits;
+
+    /// The number of bits to shift readings left (if positive) or right (if negative).
+    LONG m_shift;
+};
+
+/// Class used to set the duty cycle of one PWM pin many times.
+/**
+analogWrite() looks up the board type, verifies the pin function and scales the duty
+cycle on every call.  An AnalogOut object does the lookup and verification once, when it
+is created, and keeps the shift that scales duty cycles from the resolution set with
+analogWriteResolution().  Each write() is then a range check, a shift, and a single call
+to set the duty cycle.
+
+\note If the function of the pin is changed after the object is created (for example
+with pinMode()), a new AnalogOut object should be created for it.
+*/
+class AnalogOut
+{
+public:
+    /// Constructor.
+    AnalogOut(unsigned int pin);
+
+    /// Set the PWM duty cycle for the pin.
+    inline void write(unsigned int dutyCycle);
+
+    /// Get the PWM pin number written by this object.
+    inline ULONG getPin()
+    {
+        return m_ioPin;
+    }
+
+private:
+    /// The pin number passed to BoardPinsClass::setPwmDutyCycle().
+    ULONG m_ioPin;
+
+    /// The PWM resolution the scaling was computed for.
+    ULONG m_pwmBits;
+
+    /// The largest duty cycle allowed at that resolution.
+    ULONG m_maxDutyCycle;
+
+    /// The number of bits to shift a duty cycle left to make it a fraction of 2^32.
+    ULONG m_shift;
+
+    /// Method to compute the duty cycle scaling for the current PWM resolution.
+    inline void _computeScale()
+    {
+        m_pwmBits = g_pwmResolutionBits;
+        m_shift = 32 - m_pwmBits;
+        m_maxDutyCycle = 0xFFFFFFFF >> m_shift;
+    }
+};
+
+/**
+\param[in] pin The analog pin to read (A0-A5, or 0-5).
+\note This call throws an error if the pin can't be used as an analog input.
+*/
+inline AnalogIn::AnalogIn(int pin) :
+    m_adcBits(0),
+    m_valueBits(0),
+    m_shift(0)
+{
+    m_ioPin = _AnalogInPin(pin);
+}
+
+/**
+\return Digitized analog value read from the pin, scaled to the resolution set with
+analogReadResolution().
+*/
+inline int AnalogIn::read()
+{
+    HRESULT hr;
+    ULONG value;
+    ULONG bits;
+
+    hr = g_adc.readValue(m_ioPin, value, bits);
+
+    if (FAILED(hr))
+    {
+        ThrowError(hr, "Error performing analogRead on pin: %d, Error: 0x%08x", m_ioPin, hr);
+    }
+
+    // The shift only needs to be recomputed if a resolution has changed.
+    if ((bits != m_adcBits) || (g_analogValueBits != m_valueBits))
+    {
+        m_adcBits = bits;
+        m_valueBits = g_analogValueBits;
+        m_shift = (LONG)m_valueBits - (LONG)m_adcBits;
+    }
+
+    if (m_shift >= 0)
+    {
+        value = value << m_shift;
+    }
+    else
+    {
+        value = value >> -m_shift;
+    }
+
+    return value;
+}
+
+/**
+\param[in] pin The number of the pin for the PWM output, as passed to analogWrite().
+\note This call throws an error if the pin can't be used for PWM output.
+*/
+inline AnalogOut::AnalogOut(unsigned int pin)
+{
+    m_ioPin = _AnalogOutPin(pin);
+    _computeScale();
+}
+
+/**
+\param[in] dutyCycle The high pulse time, range 0 to pwm_resolution_count - 1, as for
+analogWrite().
+*/
+inline void AnalogOut::write(unsigned int dutyCycle)
+{
+    HRESULT hr;
+
+    // The scaling only needs to be recomputed if the PWM resolution has changed.
+    if (g_pwmResolutionBits != m_pwmBits)
+    {
+        _computeScale();
+    }
+
+    if (dutyCycle > m_maxDutyCycle)
+    {
+        ThrowError(E_INVALIDARG, "Specified duty cycle: %d is greater than PWM resolution: %d bits.", dutyCycle, m_pwmBits);
+    }
+
+    hr = g_pins.setPwmDutyCycle(m_ioPin, (ULONG)dutyCycle << m_shift);
+
+    if (FAILED(hr))
+    {
+        ThrowError(hr, "Error occurred setting pin: %d PWM duty cycle to: %d, Error: %08x", m_ioPin, dutyCycle, hr);
+    }
+}
+
+#endif  // _ANALOG_PIN_H_
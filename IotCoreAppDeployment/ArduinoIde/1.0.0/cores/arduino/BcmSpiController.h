@@ -69,10 +69,7 @@ public:
     inline HRESULT _transfer(ULONG dataOut, ULONG & dataIn, ULONG bits) override;
 
     /// Transfer a buffer of data on the SPI bus.
-    inline HRESULT transferBuffer(PBYTE dataOut, PBYTE dataIn, size_t bufferBytes) override
-    {
-        return DMAP_E_SPI_BUFFER_TRANSFER_NOT_IMPLEMENTED;
-    }
+    inline HRESULT transferBuffer(PBYTE dataOut, PBYTE dataIn, size_t bufferBytes) override;
 
 private:
 
@@ -209,6 +206,10 @@ private:
 
     /// The maximum width of a transfer on this controller.
     const UINT m_maxTransferBits = 32;
+
+    /// The number of bytes that can be outstanding in the TX and RX FIFOs.  This is static so
+    /// the object layout matches the library that constructs these controllers.
+    static const ULONG FIFO_DEPTH = 16;
 };
 
 /**
@@ -267,4 +268,57 @@ inline HRESULT BcmSpiControllerClass::_transfer(ULONG dataOut, ULONG & dataIn, U
     return hr;
 }
 
+/**
+Transfer a buffer of bytes on the SPI bus.  The TX FIFO is kept topped up while the RX FIFO
+is drained, so the bus clock runs continuously for the length of the buffer instead of
+stopping after each byte.
+\param[in] dataOut Buffer of data to send, or nullptr to send zeros.
+\param[out] dataIn Buffer to receive data, or nullptr to discard the received data.
+\param[in] bufferBytes The number of bytes to transfer.
+\return HRESULT success or error code.
+*/
+inline HRESULT BcmSpiControllerClass::transferBuffer(PBYTE dataOut, PBYTE dataIn, size_t bufferBytes)
+{
+    HRESULT hr = S_OK;
+    size_t txCount = 0;
+    size_t rxCount = 0;
+    _CS cs;
+    BYTE rxData;
+
+
+    if (m_registers == nullptr)
+    {
+        hr = DMAP_E_DMAP_INTERNAL_ERROR;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        while (rxCount < bufferBytes)
+        {
+            cs.ALL_BITS = m_registers->CS.ALL_BITS;
+
+            // Queue more data if there is room, without getting so far ahead of the
+            // received data that the RX FIFO could overflow.
+            if ((txCount < bufferBytes) && (cs.TXD == 1) && ((txCount - rxCount) < FIFO_DEPTH))
+            {
+                m_registers->FIFO.DATA_BYTE0 = (dataOut != nullptr) ? dataOut[txCount] : 0;
+                txCount++;
+            }
+
+            // Collect any data that has been received.
+            if (cs.RXD == 1)
+            {
+                rxData = (BYTE)(m_registers->FIFO.ALL_BITS & 0x000000FF);
+                if (dataIn != nullptr)
+                {
+                    dataIn[rxCount] = rxData;
+                }
+                rxCount++;
+            }
+        }
+    }
+
+    return hr;
+}
+
 #endif  // _BCM_SPI_CONTROLLER_H_
\ No newline at end of file
@@ -6,6 +6,7 @@
 #define _GALILEO_PINS_H_
 
 #include <Windows.h>
+#include <vector>
 
 #include "ArduinoCommon.h"
 #include "GpioController.h"
@@ -135,6 +136,9 @@ public:
     /// Method to set the PWM duty cycle for a pin.
     HRESULT setPwmDutyCycle(ULONG pin, ULONG dutyCycle);
 
+    /// Method to set the PWM duty cycles for several pins at once.
+    inline HRESULT setPwmDutyCycles(const ULONG* pins, const ULONG* dutyCycles, ULONG count);
+
     /// Method to set the PWM pulse repetition frequency.
     HRESULT setPwmFrequency(ULONG pin, ULONG frequency);
 
@@ -153,6 +157,12 @@ public:
     /// Method to get the number of GPIO pins present on the current board
     inline HRESULT getGpioPinCount(ULONG & pinCount);
 
+    /// Method to get the port bit that a pin is attached to.
+    inline HRESULT getPinPortBit(ULONG pin, ULONG & portBit);
+
+    /// Method to determine whether a pin supports a function.
+    inline BOOL pinHasFunction(ULONG pin, ULONG function);
+
 private:
 
     /// Pointer to the array of pin attributes.
@@ -206,6 +216,9 @@ private:
     /// Method to set a mux to a desired state.
     HRESULT _setMux(ULONG pin, ULONG mux, ULONG selection);
 
+    /// Method to determine whether a pin's PWM output comes from a PCA9685 chip.
+    inline BOOL _pinUsesPca9685(ULONG pin);
+
     /// Method to set the direction on an I/O Expander port pin.
     HRESULT _setExpBitDirection(ULONG expNo, ULONG bitNo, ULONG directin, BOOL pullup);
 
@@ -272,6 +285,125 @@ inline HRESULT BoardPinsClass::getBoardType(BOARD_TYPE & board)
     return hr;
 }
 
+/**
+On boards that use PCA9685 PWM chips, the pins driven by each chip are updated with a single
+I2C transaction, and their outputs all change at the same time.  The transactions for all the
+chips are run back to back.  Other pins are updated one at a time with setPwmDutyCycle().
+\param[in] pins Array of the pins to set.  Each must already be configured for PWM use.
+\param[in] dutyCycles Array of the duty cycle for each pin, as a fraction of 2^32 (as for
+setPwmDutyCycle()).
+\param[in] count The number of pins to set.
+\return HRESULT error or success code.
+*/
+inline HRESULT BoardPinsClass::setPwmDutyCycles(const ULONG* pins, const ULONG* dutyCycles, ULONG count)
+{
+    HRESULT hr = S_OK;
+    std::vector<BOOL> done(count, FALSE);
+    std::vector<ULONG> channels;
+    std::vector<ULONG> pulseWidths;
+    ULONG expander;
+    ULONG pwmBits = PCA9685Device::GetResolution();
+    PCA9685Device* chip = nullptr;
+    ULONG i;
+    ULONG j;
+
+    hr = _verifyBoardType();
+
+    for (i = 0; SUCCEEDED(hr) && (i < count); i++)
+    {
+        if (done[i])
+        {
+            continue;
+        }
+
+        // Pins whose PWM is not generated by a PCA9685 (Galileo Gen1 uses a CY8C9540A,
+        // which has no multi-output update), and pins with no PWM channel, are set on their own.
+        if (!_pinUsesPca9685(pins[i]))
+        {
+            hr = setPwmDutyCycle(pins[i], dutyCycles[i]);
+            done[i] = TRUE;
+            continue;
+        }
+
+        // Gather this pin and any later pins driven by the same PWM chip.
+        expander = m_PwmChannels[pins[i]].expander;
+        channels.clear();
+        pulseWidths.clear();
+        for (j = i; j < count; j++)
+        {
+            if (!done[j] && _pinUsesPca9685(pins[j]) && (m_PwmChannels[pins[j]].expander == expander))
+            {
+                channels.push_back(m_PwmChannels[pins[j]].channel);
+                pulseWidths.push_back((ULONG)((((ULONGLONG)dutyCycles[j] << pwmBits) + 0x80000000ULL) >> 32));
+                done[j] = TRUE;
+            }
+        }
+
+        hr = PCA9685Device::GetChip(m_ExpAttributes[expander].I2c_Address, chip);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = chip->stagePulseWidths(channels.data(), pulseWidths.data(), (ULONG)channels.size());
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = PCA9685Device::FlushAllChips();
+    }
+
+    return hr;
+}
+
+/**
+\param[in] pin The number of the pin.
+\return TRUE if the pin has a PWM channel on a PCA9685 chip, FALSE otherwise.
+*/
+inline BOOL BoardPinsClass::_pinUsesPca9685(ULONG pin)
+{
+    return pinHasFunction(pin, FUNC_PWM) && (m_PwmChannels != nullptr) && (m_ExpAttributes != nullptr) &&
+        (m_ExpAttributes[m_PwmChannels[pin].expander].Exp_Type == EXP_TYPE_PCA9685);
+}
+
+/**
+The port bit is the bit number on the GPIO controller or I/O expander given by the pin's GPIO
+type.  On a bare PI2 it is the BCM2836 GPIO number.
+\param[in] pin The number of the pin.
+\param[out] portBit The port bit the pin is attached to.
+\return HRESULT error or success code.
+*/
+inline HRESULT BoardPinsClass::getPinPortBit(ULONG pin, ULONG & portBit)
+{
+    HRESULT hr = S_OK;
+
+    hr = _verifyBoardType();
+
+    if (SUCCEEDED(hr) && !pinNumberIsSafe(pin))
+    {
+        hr = DMAP_E_PIN_NUMBER_TOO_LARGE_FOR_BOARD;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        portBit = m_PinAttributes[pin].portBit;
+    }
+
+    return hr;
+}
+
+/**
+This only looks at the board's pin table.  It does not configure the pin, or check whether
+the pin is locked to another function.
+\param[in] pin The number of the pin.
+\param[in] function The function to look for (FUNC_DIO, FUNC_PWM, etc.)
+\return TRUE if the pin exists on this board and supports the function, FALSE otherwise.
+*/
+inline BOOL BoardPinsClass::pinHasFunction(ULONG pin, ULONG function)
+{
+    return SUCCEEDED(_verifyBoardType()) && pinNumberIsSafe(pin) &&
+        ((m_PinAttributes[pin].funcMask & function) != 0);
+}
+
 /**
 Method to determine if a pin number is in the legal range or not.
 \param[in] pin the pin number to check for range
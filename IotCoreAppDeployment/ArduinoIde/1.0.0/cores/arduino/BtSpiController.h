@@ -50,15 +50,14 @@ public:
     HRESULT setMode(ULONG mode) override;
 
     /// Set the number of bits in an SPI transfer.
-    HRESULT setDataWidth(ULONG bits) override
-    {
-        if ((bits < m_minTransferBits) || (bits > m_maxTransferBits))
-        {
-            return DMAP_E_SPI_DATA_WIDTH_SPECIFIED_IS_INVALID;
-        }
-        m_dataBits = bits;
-        return S_OK;
-    }
+    HRESULT setDataWidth(ULONG bits) override;
+
+    /// Enable or disable internal loopback of transmitted data to the receiver.
+    /**
+    This is not virtual, so SpiControllerClass keeps the vtable layout of the library that
+    builds the controllers.  SpiBusManagerClass::setLoopbackMode() calls it.
+    */
+    HRESULT setLoopbackMode(BOOL enable);
 
     /// Perform a transfer on the SPI bus.
     /**
@@ -69,10 +68,7 @@ public:
     HRESULT _transfer(ULONG dataOut, ULONG & dataIn, ULONG bits) override;
 
     /// Transfer a buffer of data on the SPI bus.
-    inline HRESULT transferBuffer(PBYTE dataOut, PBYTE dataIn, size_t bufferBytes) override
-    {
-        return DMAP_E_SPI_BUFFER_TRANSFER_NOT_IMPLEMENTED;
-    }
+    inline HRESULT transferBuffer(PBYTE dataOut, PBYTE dataIn, size_t bufferBytes) override;
 
 private:
 
@@ -410,6 +406,10 @@ private:
 
     /// The maximum width of a transfer on this controller.
     const UINT m_maxTransferBits = 32;
+
+    /// The number of entries that can be outstanding in the TX and RX FIFOs.  This is static so
+    /// the object layout matches the library that constructs these controllers.
+    static const ULONG FIFO_DEPTH = 16;
 };
 
 
@@ -463,4 +463,122 @@ inline HRESULT BtSpiControllerClass::_transfer(ULONG dataOut, ULONG & dataIn, UL
     return hr;
 }
 
+/**
+If the controller is running, the new width is programmed into the DSS and EDSS fields
+right away.  The controller is disabled while the data size is changed.
+\param[in] bits The number of bits in each transfer (4-32).
+\return HRESULT success or error code.
+*/
+inline HRESULT BtSpiControllerClass::setDataWidth(ULONG bits)
+{
+    _SSCR0 sscr0;
+
+    if ((bits < m_minTransferBits) || (bits > m_maxTransferBits))
+    {
+        return DMAP_E_SPI_DATA_WIDTH_SPECIFIED_IS_INVALID;
+    }
+
+    if ((m_registers != nullptr) && (bits != m_dataBits))
+    {
+        // Data size is (EDSS * 16) + DSS + 1 bits.
+        sscr0.ALL_BITS = m_registers->SSCR0.ALL_BITS;
+        sscr0.SSE = 0;
+        m_registers->SSCR0.ALL_BITS = sscr0.ALL_BITS;
+
+        sscr0.EDSS = (bits - 1) >> 4;
+        sscr0.DSS = (bits - 1) & 0x0F;
+        m_registers->SSCR0.ALL_BITS = sscr0.ALL_BITS;
+    }
+
+    m_dataBits = bits;
+    return S_OK;
+}
+
+/**
+In loopback mode the transmit shifter output is connected to the receive shifter input
+inside the controller, so data sent is received back without any external wiring.
+\param[in] enable TRUE to enable loopback mode, FALSE for normal operation.
+\return HRESULT success or error code.
+*/
+inline HRESULT BtSpiControllerClass::setLoopbackMode(BOOL enable)
+{
+    _SSCR1 sscr1;
+
+    if (m_registers == nullptr)
+    {
+        return DMAP_E_DMAP_INTERNAL_ERROR;
+    }
+
+    sscr1.ALL_BITS = m_registers->SSCR1.ALL_BITS;
+    sscr1.LBM = enable ? 1 : 0;
+    m_registers->SSCR1.ALL_BITS = sscr1.ALL_BITS;
+
+    return S_OK;
+}
+
+/**
+Transfer a buffer of bytes on the SPI bus.  The TX FIFO is kept topped up while the RX FIFO
+is drained, so the bus clock runs continuously for the length of the buffer instead of
+stopping after each byte.
+\param[in] dataOut Buffer of data to send, or nullptr to send zeros.
+\param[out] dataIn Buffer to receive data, or nullptr to discard the received data.
+\param[in] bufferBytes The number of bytes to transfer.
+\return HRESULT success or error code.
+\note The controller must be set to 8-bit transfers.
+*/
+inline HRESULT BtSpiControllerClass::transferBuffer(PBYTE dataOut, PBYTE dataIn, size_t bufferBytes)
+{
+    HRESULT hr = S_OK;
+    size_t txCount = 0;
+    size_t rxCount = 0;
+    _SSCR0 sscr0;
+    _SSSR sssr;
+    ULONG rxData;
+
+
+    if (m_registers == nullptr)
+    {
+        hr = DMAP_E_DMAP_INTERNAL_ERROR;
+    }
+
+    if (SUCCEEDED(hr) && (m_dataBits != 8))
+    {
+        hr = DMAP_E_SPI_DATA_WIDTH_MISMATCH;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        // Make sure the SPI bus is enabled.
+        sscr0.ALL_BITS = m_registers->SSCR0.ALL_BITS;
+        sscr0.SSE = 1;
+        m_registers->SSCR0.ALL_BITS = sscr0.ALL_BITS;
+
+        while (rxCount < bufferBytes)
+        {
+            sssr.ALL_BITS = m_registers->SSSR.ALL_BITS;
+
+            // Queue more data if there is room, without getting so far ahead of the
+            // received data that the RX FIFO could overflow.
+            if ((txCount < bufferBytes) && (sssr.TNF == 1) && ((txCount - rxCount) < FIFO_DEPTH))
+            {
+                m_registers->SSDR.ALL_BITS = (dataOut != nullptr) ? dataOut[txCount] : 0;
+                txCount++;
+            }
+
+            // Collect any data that has been received.
+            if (sssr.RNE == 1)
+            {
+                rxData = m_registers->SSDR.ALL_BITS;
+                if (dataIn != nullptr)
+                {
+                    dataIn[rxCount] = (BYTE)rxData;
+                }
+                rxCount++;
+            }
+        }
+    }
+
+    return hr;
+}
+
 #endif  // _BT_SPI_CONTROLLER_H_
\ No newline at end of file
@@ -0,0 +1,206 @@
+// Copyright (c) Microsoft Open Technologies, Inc.  All rights reserved.  
+// Licensed under the BSD 2-Clause License.  
+// See License.txt in the project root for license information.
+
+#ifndef _CONVERSION_WAIT_H_
+#define _CONVERSION_WAIT_H_
+
+#include <Windows.h>
+#include "HiResTimer.h"
+
+/// Remaining wait above which the waiting thread sleeps rather than spins.
+#define CONVERSION_WAIT_SPIN_MICROSECONDS 2000
+
+/// Percentage of the conversion time after which polling for completion starts.
+#define CONVERSION_WAIT_EARLY_PERCENT 90
+
+/// Number of polls per conversion time once polling has started.
+#define CONVERSION_WAIT_POLLS_PER_CONVERSION 10
+
+/// The shortest time between polls.
+#define CONVERSION_WAIT_MIN_POLL_MICROSECONDS 20
+
+/// The shortest time to poll before giving up on a conversion.
+#define CONVERSION_WAIT_MIN_TIMEOUT_MICROSECONDS 10000
+
+/// Class used by device drivers to wait for a conversion to finish without flooding the bus.
+/**
+A driver sets the expected conversion time (usually derived from the data rate programmed
+into the device), calls startConversion() when it starts a conversion, then calls waitForPoll()
+before each status read.  The first call sleeps or spins until shortly before the conversion
+should be done, and later calls space the polls out, so a device that is slower than expected
+is polled at a bounded rate rather than back to back.  A conversion that takes much longer than
+expected times out instead of hanging.
+*/
+class ConversionWaitClass
+{
+public:
+    /// Struct used to return wait statistics.
+    typedef struct {
+        ULONGLONG conversions;      ///< Number of conversions waited for
+        ULONGLONG polls;            ///< Number of status polls made
+        ULONGLONG maxPolls;         ///< Most polls needed for one conversion
+        ULONGLONG timeouts;         ///< Number of conversions that timed out
+    } WAIT_STATS, *PWAIT_STATS;
+
+    /// Constructor.
+    ConversionWaitClass() :
+        m_conversionTicks(0),
+        m_firstPollTicks(0),
+        m_pollIntervalTicks(0),
+        m_timeoutTicks(0),
+        m_spinTicks(0),
+        m_startTicks(0),
+        m_nextPollTicks(0),
+        m_polls(0)
+    {
+        m_spinTicks = g_hiResClock.microsecondsToTicks(CONVERSION_WAIT_SPIN_MICROSECONDS);
+        resetStats();
+    }
+
+    /// Destructor.
+    virtual ~ConversionWaitClass()
+    {
+    }
+
+    /// Set the expected time for a conversion.
+    /**
+    \param[in] conversionMicroseconds The time the device should take to convert.
+    */
+    inline void setConversionTime(ULONG conversionMicroseconds)
+    {
+        ULONG pollMicroseconds;
+        ULONG timeoutMicroseconds;
+
+        pollMicroseconds = conversionMicroseconds / CONVERSION_WAIT_POLLS_PER_CONVERSION;
+        if (pollMicroseconds < CONVERSION_WAIT_MIN_POLL_MICROSECONDS)
+        {
+            pollMicroseconds = CONVERSION_WAIT_MIN_POLL_MICROSECONDS;
+        }
+
+        timeoutMicroseconds = conversionMicroseconds * 4;
+        if (timeoutMicroseconds < CONVERSION_WAIT_MIN_TIMEOUT_MICROSECONDS)
+        {
+            timeoutMicroseconds = CONVERSION_WAIT_MIN_TIMEOUT_MICROSECONDS;
+        }
+
+        m_conversionTicks = g_hiResClock.microsecondsToTicks(conversionMicroseconds);
+        m_firstPollTicks = (m_conversionTicks * CONVERSION_WAIT_EARLY_PERCENT) / 100;
+        m_pollIntervalTicks = g_hiResClock.microsecondsToTicks(pollMicroseconds);
+        m_timeoutTicks = g_hiResClock.microsecondsToTicks(timeoutMicroseconds);
+    }
+
+    /// Get the expected time for a conversion in high resolution timer ticks.
+    inline ULONGLONG getConversionTicks()
+    {
+        return m_conversionTicks;
+    }
+
+    /// Record that a conversion has just been started.
+    inline void startConversion()
+    {
+        m_startTicks = g_hiResClock.now();
+        m_nextPollTicks = m_startTicks + m_firstPollTicks;
+        m_polls = 0;
+    }
+
+    /// Wait until it is time to check whether the conversion is done.
+    /**
+    \return HRESULT success or error code.  HRESULT_FROM_WIN32(ERROR_TIMEOUT) is returned if
+    the conversion has taken too long.
+    */
+    inline HRESULT waitForPoll()
+    {
+        if ((m_nextPollTicks - m_startTicks) > m_timeoutTicks)
+        {
+            m_stats.timeouts++;
+            conversionDone();
+            return HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+        }
+
+        waitUntil(m_nextPollTicks);
+
+        m_nextPollTicks += m_pollIntervalTicks;
+        m_polls++;
+        m_stats.polls++;
+
+        return S_OK;
+    }
+
+    /// Record that the conversion is done.
+    inline void conversionDone()
+    {
+        m_stats.conversions++;
+        if (m_polls > m_stats.maxPolls)
+        {
+            m_stats.maxPolls = m_polls;
+        }
+        m_polls = 0;
+    }
+
+    /// Wait until the high resolution timer reaches a value.
+    /**
+    The thread sleeps while the wait is long, then spins for the last part of it.
+    \param[in] ticks The high resolution timer value to wait for.
+    */
+    inline void waitUntil(ULONGLONG ticks)
+    {
+        ULONGLONG now = g_hiResClock.now();
+
+        while (now < ticks)
+        {
+            if ((ticks - now) > m_spinTicks)
+            {
+                Sleep(1);
+            }
+            else
+            {
+                YieldProcessor();
+            }
+            now = g_hiResClock.now();
+        }
+    }
+
+    /// Get the wait statistics.
+    inline void getStats(WAIT_STATS & stats)
+    {
+        stats = m_stats;
+    }
+
+    /// Reset the wait statistics.
+    inline void resetStats()
+    {
+        ZeroMemory(&m_stats, sizeof(m_stats));
+    }
+
+private:
+
+    /// The expected conversion time.
+    ULONGLONG m_conversionTicks;
+
+    /// Time from the start of a conversion to the first poll.
+    ULONGLONG m_firstPollTicks;
+
+    /// Time between polls.
+    ULONGLONG m_pollIntervalTicks;
+
+    /// Time from the start of a conversion after which it is considered to have failed.
+    ULONGLONG m_timeoutTicks;
+
+    /// Remaining wait below which waitUntil() spins rather than sleeps.
+    ULONGLONG m_spinTicks;
+
+    /// Timer reading when the current conversion was started.
+    ULONGLONG m_startTicks;
+
+    /// Timer reading at which the next poll should be made.
+    ULONGLONG m_nextPollTicks;
+
+    /// Polls made for the current conversion.
+    ULONGLONG m_polls;
+
+    /// Wait statistics.
+    WAIT_STATS m_stats;
+};
+
+#endif  // _CONVERSION_WAIT_H_
@@ -172,6 +172,18 @@ set the desired width, then call SPI.begin() to start the contrller again.
 /// The specified number of bits per transfer is not supported by the SPI controller.
 #define DMAP_E_SPI_DATA_WIDTH_SPECIFIED_IS_INVALID MAKE_HRESULT(SEVERITY_ERROR, FACILITY_ITF, 0x9245)
 
+/// HexValue: 0x80049246
+/// All the device slots on the SPI bus are already in use.
+#define DMAP_E_SPI_TOO_MANY_DEVICES_ON_BUS MAKE_HRESULT(SEVERITY_ERROR, FACILITY_ITF, 0x9246)
+
+/// HexValue: 0x80049247
+/// The specified device ID does not refer to a device registered on the SPI bus.
+#define DMAP_E_SPI_DEVICE_NOT_REGISTERED MAKE_HRESULT(SEVERITY_ERROR, FACILITY_ITF, 0x9247)
+
+/// HexValue: 0x80049248
+/// This SPI controller does not support internal loopback mode.
+#define DMAP_E_SPI_LOOPBACK_NOT_SUPPORTED MAKE_HRESULT(SEVERITY_ERROR, FACILITY_ITF, 0x9248)
+
 //
 // PWM related error codes.
 //
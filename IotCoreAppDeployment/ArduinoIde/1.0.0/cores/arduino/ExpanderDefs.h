@@ -5,6 +5,11 @@
 #ifndef _EXPANDER_DEFS_H_
 #define _EXPANDER_DEFS_H_
 
+// I/O Expander types, as stored in the Exp_Type field of the board's expander table.
+#define EXP_TYPE_PCAL9535A 0
+#define EXP_TYPE_PCA9685 1
+#define EXP_TYPE_CY8C9540A 2
+
 // I/O Expander bit values.
 // Note: Values from P0_0 through P1_7 must fit in 4-bits for the
 //      pin attributes table to work.
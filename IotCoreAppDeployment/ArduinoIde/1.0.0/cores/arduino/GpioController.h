@@ -687,6 +687,9 @@ public:
     /// Method to set the state of a GPIO port bit.
     inline HRESULT setPinState(ULONG gpioNo, ULONG state);
 
+    /// Method to set and clear several of GPIO 00-31 at once.
+    inline HRESULT setPortBits(ULONG setMask, ULONG clearMask);
+
     /// Method to read the state of a GPIO bit.
     inline HRESULT getPinState(ULONG gpioNo, ULONG & state);
 
@@ -707,6 +710,9 @@ private:
     // Value to write to GPPUD to turn pullup on for a pin.
     const ULONG pullupOn = 2;
 
+    // Nanoseconds to wait for the 150 cycle GPPUD/GPPUDCLK set-up and hold times.
+    const ULONG pullSetupNs = 600;
+
     /// Layout of the BCM2836 GPIO Controller registers in memory.
     typedef struct _BCM_GPIO {
         ULONG   GPFSELN[6];         ///< 0x00-0x17 - Function select GPIO 00-53
@@ -1598,6 +1604,34 @@ inline HRESULT BcmGpioControllerClass::setPinState(ULONG gpioNo, ULONG state)
 }
 #endif // defined(_M_ARM)
 
+#if defined(_M_ARM)
+/**
+Each mask is written to its register with a single store, so all the bits in it change at
+the same time.  The clear mask is written first.  A bit in both masks ends up set.
+\param[in] setMask Mask of GPIO 00-31 to set HIGH.
+\param[in] clearMask Mask of GPIO 00-31 to set LOW.
+\return HRESULT error or success code.
+*/
+inline HRESULT BcmGpioControllerClass::setPortBits(ULONG setMask, ULONG clearMask)
+{
+    HRESULT hr = mapIfNeeded();
+
+    if (SUCCEEDED(hr))
+    {
+        if (clearMask != 0)
+        {
+            m_registers->GPCLR0 = clearMask;
+        }
+        if (setMask != 0)
+        {
+            m_registers->GPSET0 = setMask;
+        }
+    }
+
+    return hr;
+}
+#endif // defined(_M_ARM)
+
 #if defined(_M_ARM)
 /**
 This method assumes the caller has checked the input parameters.
@@ -1728,7 +1762,6 @@ inline HRESULT BcmGpioControllerClass::setPinPullup(ULONG gpioNo, BOOL pullup)
 {
     HRESULT hr = S_OK;
     ULONG gpioPull = 0;
-    HiResTimerClass timer;
 
 
     hr = mapIfNeeded();
@@ -1758,18 +1791,17 @@ inline HRESULT BcmGpioControllerClass::setPinPullup(ULONG gpioNo, BOOL pullup)
         // 5) Write to GPPUD to remove state
         // 6) Write to GPPUDCLK0/1 to remove clock bits
         //
-        // 150 cycles is 0.25 microseconds with a cpu clock of 600 Mhz.
+        // 150 cycles is 0.25 microseconds with a cpu clock of 600 Mhz, and 0.6 microseconds
+        // with the 250 Mhz core clock, so wait for the longer of the two.
         //
         m_registers->GPPUD = gpioPull;         // 1)
 
-        timer.StartTimeout(1);
-        while (!timer.TimeIsUp());              // 2)
+        g_hiResClock.spinNanoseconds(pullSetupNs);    // 2)
         
         m_registers->GPPUDCLK0 = 1 << gpioNo;
         m_registers->GPPUDCLK1 = 0;            // 3)
         
-        timer.StartTimeout(1);
-        while (!timer.TimeIsUp());              // 4)
+        g_hiResClock.spinNanoseconds(pullSetupNs);    // 4)
         
         m_registers->GPPUD = 0;                // 5)
         
@@ -6,23 +6,275 @@
 #define _HI_RES_TIMER_H_
 
 #include <Windows.h>
+#include "WindowsTime.h"
+
+/// Number of spin loop iterations timed to calibrate spinNanoseconds().
+#define HI_RES_CLOCK_CALIBRATION_SPINS 4096
+
+/// Number of times the calibration is repeated, keeping the fastest.
+#define HI_RES_CLOCK_CALIBRATION_PASSES 4
+
+/// Waits of up to this many timer ticks are timed by spinNanoseconds() with a spin count.
+#define HI_RES_CLOCK_SPIN_TICKS 4
+
+/// Class that is used to read the system high resolution timer and convert times for it.
+/**
+One object of this class (g_hiResClock) is shared by all the drivers.  The timer frequency is
+read once, and the conversions from microseconds and nanoseconds to timer ticks are kept as
+fixed point multipliers, so starting a timeout costs one timer read, two multiplies and a
+shift.  Deadlines are absolute timer readings, so several can be in progress at once without
+any per-timeout object.
+
+Waits shorter than a few timer ticks can't be timed with the timer itself (a tick is 52 to
+100 nanoseconds on most systems), so spinNanoseconds() uses a spin loop whose speed is
+measured when the object is created.
+
+If a TimeSource has been installed with _WindowsTime.setTimeSource(), now() reads that clock
+instead, converted to timer ticks, and the waits are handed to it.  Drivers timed with this
+clock then follow a simulated clock the same way millis() and delay() do.
+*/
+class HiResClockClass
+{
+public:
+    /// Constructor.
+    HiResClockClass()
+    {
+        LARGE_INTEGER frequency;
+
+        QueryPerformanceFrequency(&frequency);
+        m_frequency = frequency.QuadPart;
+
+        m_ticksPerMicrosecondWhole = m_frequency / 1000000ULL;
+        m_ticksPerMicrosecondFraction = ((m_frequency % 1000000ULL) << 32) / 1000000ULL;
+        m_ticksPerNanosecondFraction = (m_frequency << 32) / 1000000000ULL;
+
+        _calibrateSpin();
+    }
+
+    /// Destructor.
+    virtual ~HiResClockClass()
+    {
+    }
+
+    /// Get the high resolution timer frequency in ticks per second.
+    inline ULONGLONG getFrequency()
+    {
+        return m_frequency;
+    }
+
+    /// Read the high resolution timer, or the installed TimeSource.
+    inline ULONGLONG now()
+    {
+        TimeSource* source = _WindowsTime.getTimeSource();
+
+        if (source != nullptr)
+        {
+            return _microsecondsToTicks64(source->micros64());
+        }
+        return _readCounter();
+    }
+
+    /// Convert microseconds to timer ticks, rounding to the nearest tick.
+    inline ULONGLONG microsecondsToTicks(ULONG microseconds)
+    {
+        return ((ULONGLONG)microseconds * m_ticksPerMicrosecondWhole) +
+            ((((ULONGLONG)microseconds * m_ticksPerMicrosecondFraction) + 0x80000000ULL) >> 32);
+    }
+
+    /// Convert nanoseconds to timer ticks, rounding up so a wait is never too short.
+    inline ULONGLONG nanosecondsToTicks(ULONG nanoseconds)
+    {
+        return (((ULONGLONG)nanoseconds * m_ticksPerNanosecondFraction) + 0xFFFFFFFFULL) >> 32;
+    }
+
+    /// Convert timer ticks to microseconds.
+    /**
+    This divides, so it is meant for reporting rather than for timing.
+    */
+    inline ULONGLONG ticksToMicroseconds(ULONGLONG ticks)
+    {
+        return ((ticks / m_frequency) * 1000000ULL) + (((ticks % m_frequency) * 1000000ULL) / m_frequency);
+    }
+
+    /// Convert timer ticks to nanoseconds.
+    /**
+    This divides, so it is meant for reporting rather than for timing.
+    */
+    inline ULONGLONG ticksToNanoseconds(ULONGLONG ticks)
+    {
+        return ((ticks / m_frequency) * 1000000000ULL) + (((ticks % m_frequency) * 1000000000ULL) / m_frequency);
+    }
+
+    /// Get the timer reading a number of microseconds from now.
+    inline ULONGLONG deadlineAfterMicroseconds(ULONG microseconds)
+    {
+        return now() + microsecondsToTicks(microseconds);
+    }
+
+    /// Determine whether the timer has reached a deadline.
+    inline BOOL isPast(ULONGLONG deadline)
+    {
+        return now() >= deadline;
+    }
+
+    /// Spin until the timer reaches a deadline.
+    /**
+    If a TimeSource is installed the wait is made with its delayMicroseconds(), so a virtual
+    clock advances to the deadline instead of the thread spinning forever.
+    \param[in] deadline The timer reading to wait for.
+    */
+    inline void waitUntil(ULONGLONG deadline)
+    {
+        TimeSource* source = _WindowsTime.getTimeSource();
+        ULONGLONG nowTicks;
+        ULONGLONG microseconds;
+
+        if (source != nullptr)
+        {
+            // Whole microseconds can stop just short of the deadline, so finish with 1us waits.
+            while ((nowTicks = now()) < deadline)
+            {
+                microseconds = ticksToMicroseconds(deadline - nowTicks);
+                source->delayMicroseconds((microseconds > 0) ? microseconds : 1, FALSE);
+            }
+            return;
+        }
+
+        while (!isPast(deadline))
+        {
+            YieldProcessor();
+        }
+    }
+
+    /// Spin for a number of timer ticks.
+    inline void waitTicks(ULONGLONG ticks)
+    {
+        waitUntil(now() + ticks);
+    }
+
+    /// Spin for a number of microseconds.
+    inline void waitMicroseconds(ULONG microseconds)
+    {
+        waitUntil(deadlineAfterMicroseconds(microseconds));
+    }
+
+    /// Spin for at least a number of nanoseconds.
+    /**
+    Waits shorter than HI_RES_CLOCK_SPIN_TICKS timer ticks are timed by counting spin loop
+    iterations, which does not read the timer at all.  Longer waits are timed with the timer.
+    \param[in] nanoseconds The shortest time to wait.
+    */
+    inline void spinNanoseconds(ULONG nanoseconds)
+    {
+        ULONGLONG ticks = nanosecondsToTicks(nanoseconds);
+        ULONGLONG spins;
+
+        if ((ticks > HI_RES_CLOCK_SPIN_TICKS) || (_WindowsTime.getTimeSource() != nullptr))
+        {
+            waitTicks(ticks);
+        }
+        else
+        {
+            spins = (((ULONGLONG)nanoseconds * m_spinsPerNanosecond) >> 16) + 1;
+            while (spins-- > 0)
+            {
+                YieldProcessor();
+            }
+        }
+    }
+
+private:
+
+    /// The high resolution timer frequency.
+    ULONGLONG m_frequency;
+
+    /// Timer ticks per microsecond, as a whole number and a 32-bit binary fraction.
+    ULONGLONG m_ticksPerMicrosecondWhole;
+    ULONGLONG m_ticksPerMicrosecondFraction;
+
+    /// Timer ticks per nanosecond as a 32-bit binary fraction (there is always less than one).
+    ULONGLONG m_ticksPerNanosecondFraction;
+
+    /// Spin loop iterations per nanosecond, as a 16-bit binary fraction.
+    ULONGLONG m_spinsPerNanosecond;
+
+    /// Method to read the high resolution timer itself.
+    inline ULONGLONG _readCounter()
+    {
+        LARGE_INTEGER nowTime;
+        QueryPerformanceCounter(&nowTime);
+        return nowTime.QuadPart;
+    }
+
+    /// Method to convert a time from a TimeSource to timer ticks, rounding down.
+    inline ULONGLONG _microsecondsToTicks64(ULONGLONG microseconds)
+    {
+        return ((microseconds / 1000000ULL) * m_frequency) + (((microseconds % 1000000ULL) * m_frequency) / 1000000ULL);
+    }
+
+    /// Method to measure how fast the spin loop in spinNanoseconds() runs.
+    /**
+    The fastest of several passes is kept, so a pass slowed by an interrupt makes the spin
+    longer rather than shorter than asked for.  The timer itself is read, since the loop
+    runs in real time whatever clock is installed.
+    */
+    inline void _calibrateSpin()
+    {
+        ULONGLONG start;
+        ULONGLONG ticks;
+        ULONGLONG fastestTicks = 0;
+        ULONG pass;
+        ULONG i;
+
+        for (pass = 0; pass < HI_RES_CLOCK_CALIBRATION_PASSES; pass++)
+        {
+            start = _readCounter();
+            for (i = 0; i < HI_RES_CLOCK_CALIBRATION_SPINS; i++)
+            {
+                YieldProcessor();
+            }
+            ticks = _readCounter() - start;
+
+            if ((pass == 0) || (ticks < fastestTicks))
+            {
+                fastestTicks = ticks;
+            }
+        }
+
+        if (fastestTicks == 0)
+        {
+            fastestTicks = 1;
+        }
+
+        // spins per ns = spins / (ticks * 1e9 / frequency), scaled by 2^16.
+        m_spinsPerNanosecond = (((ULONGLONG)HI_RES_CLOCK_CALIBRATION_SPINS * m_frequency) << 16) /
+            (fastestTicks * 1000000000ULL);
+        if (m_spinsPerNanosecond == 0)
+        {
+            m_spinsPerNanosecond = 1;
+        }
+    }
+};
+
+__declspec(selectany) HiResClockClass g_hiResClock;
 
 /// Class that is used to work with the system high resolution timer.
+/**
+Each object holds one timeout.  The timer frequency and conversions come from g_hiResClock,
+so creating an object does no system calls.
+*/
 class HiResTimerClass
 {
 public:
     /// Constructor.
     HiResTimerClass()
     {
-        QueryPerformanceFrequency(&m_frequency);
-        m_startReading.QuadPart = 0;
         m_targetReading.QuadPart = 0;
     }
 
     /// Destructor.
     virtual ~HiResTimerClass()
     {
-        m_frequency.QuadPart = 0;
     }
 
     /// Method to start a timeout.
@@ -31,12 +283,7 @@ public:
     */
     inline void StartTimeout(ULONG microseconds)
     {
-        LARGE_INTEGER nowTime = { 0 };
-        
-        QueryPerformanceCounter(&nowTime);
-        m_targetReading.QuadPart = (((LONGLONG)microseconds) * m_frequency.QuadPart) + 500000LL;
-        m_targetReading.QuadPart = m_targetReading.QuadPart / 1000000LL;
-        m_targetReading.QuadPart = m_targetReading.QuadPart + nowTime.QuadPart;
+        m_targetReading.QuadPart = g_hiResClock.deadlineAfterMicroseconds(microseconds);
     }
 
     /// Method to determine whether the timeout has expired or not.
@@ -45,21 +292,231 @@ public:
     */
     inline BOOL TimeIsUp()
     {
-        LARGE_INTEGER nowTime;
-        QueryPerformanceCounter(&nowTime);
-        return (nowTime.QuadPart >= m_targetReading.QuadPart);
+        return g_hiResClock.isPast(m_targetReading.QuadPart);
     }
 
 private:
 
-    /// The high resolution timer frequencey on this system.
-    LARGE_INTEGER m_frequency;
-
-    /// The timer reading when the timer was started.
-    LARGE_INTEGER m_startReading;
-
     /// The target timer reading.
     LARGE_INTEGER m_targetReading;
 };
 
-#endif  // _HI_RES_TIMER_H_
\ No newline at end of file
+/// Time before a deadline at which HiResWaitTimerClass stops sleeping and starts spinning.
+/**
+The first value is used if a high resolution waitable timer could be created, the second if
+only the normal timer, with a resolution of one system tick, is available.
+*/
+#define HI_RES_WAIT_SPIN_MICROSECONDS 100
+#define HI_RES_WAIT_LOW_RES_SPIN_MICROSECONDS 2000
+
+/// Time an engine destructor waits for its thread to exit, in milliseconds.
+#define HI_RES_THREAD_EXIT_TIMEOUT_MILLISECONDS 1000
+
+/// Class used by the engine threads (SoftPwm, StepperEngine, ToneGenerator) to wait for deadlines.
+/**
+A wait sleeps on a waitable timer until shortly before the deadline, then spins on g_hiResClock
+until it is reached, so the thread uses little CPU between deadlines but still wakes on time.
+The sleep can be cut short by an event, so a thread can be told about new work.  If a
+TimeSource is installed the waits are handed to g_hiResClock instead, so they follow the
+simulated clock.
+
+The timer is closed by close(), not by the destructor, so a global engine that is destroyed
+with its thread still running does not close a handle the thread is waiting on.
+*/
+class HiResWaitTimerClass
+{
+public:
+    /// Constructor.
+    HiResWaitTimerClass() :
+        m_hTimer(NULL),
+        m_spinTicks(0)
+    {
+    }
+
+    /// Destructor.
+    virtual ~HiResWaitTimerClass()
+    {
+    }
+
+    /// Create the waitable timer, preferring a high resolution one.
+    HRESULT open();
+
+    /// Close the waitable timer.
+    void close();
+
+    /// Sleep until shortly before a deadline, without spinning.
+    BOOL sleepUntil(ULONGLONG deadline, HANDLE hWake = NULL);
+
+    /// Wait until a deadline, sleeping first and then spinning.
+    /**
+    \param[in] deadline The timer reading to wait for.
+    \param[in] hWake Optional event that ends the wait early when it is signalled.
+    \return The timer reading when the wait ended.  This is before the deadline only if the
+    wait was ended by hWake.
+    */
+    inline ULONGLONG waitUntil(ULONGLONG deadline, HANDLE hWake = NULL)
+    {
+        ULONGLONG now;
+
+        if (!sleepUntil(deadline, hWake))
+        {
+            return g_hiResClock.now();
+        }
+
+        if (_WindowsTime.getTimeSource() != nullptr)
+        {
+            g_hiResClock.waitUntil(deadline);
+            return g_hiResClock.now();
+        }
+
+        while ((now = g_hiResClock.now()) < deadline)
+        {
+            YieldProcessor();
+        }
+        return now;
+    }
+
+    /// Create a thread and raise it to time critical priority.
+    static HRESULT startThread(LPTHREAD_START_ROUTINE routine, LPVOID param, HANDLE & hThread);
+
+    /// Wait a bounded time for a thread that has been told to stop to exit.
+    static BOOL waitForThreadExit(HANDLE & hThread);
+
+    /// Get the CPU time used by a thread in microseconds.
+    static inline ULONGLONG threadCpuMicroseconds(HANDLE hThread)
+    {
+        FILETIME creationTime;
+        FILETIME exitTime;
+        FILETIME kernelTime;
+        FILETIME userTime;
+        ULONGLONG time100ns = 0;
+
+        if ((hThread != NULL) && GetThreadTimes(hThread, &creationTime, &exitTime, &kernelTime, &userTime))
+        {
+            time100ns = (((ULONGLONG)kernelTime.dwHighDateTime << 32) | kernelTime.dwLowDateTime) +
+                (((ULONGLONG)userTime.dwHighDateTime << 32) | userTime.dwLowDateTime);
+        }
+        return time100ns / 10;
+    }
+
+private:
+
+    /// The waitable timer.
+    HANDLE m_hTimer;
+
+    /// Time before a deadline at which a wait starts spinning, in timer ticks.
+    ULONGLONG m_spinTicks;
+};
+
+/**
+\return HRESULT success or error code.
+*/
+inline HRESULT HiResWaitTimerClass::open()
+{
+    HRESULT hr = S_OK;
+
+    if (m_hTimer != NULL)
+    {
+        return S_OK;
+    }
+
+    m_spinTicks = g_hiResClock.microsecondsToTicks(HI_RES_WAIT_SPIN_MICROSECONDS);
+    m_hTimer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (m_hTimer == NULL)
+    {
+        m_spinTicks = g_hiResClock.microsecondsToTicks(HI_RES_WAIT_LOW_RES_SPIN_MICROSECONDS);
+        m_hTimer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+    }
+    if (m_hTimer == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    return hr;
+}
+
+inline void HiResWaitTimerClass::close()
+{
+    if (m_hTimer != NULL)
+    {
+        CloseHandle(m_hTimer);
+        m_hTimer = NULL;
+    }
+}
+
+/**
+If a TimeSource is installed, hWake is polled once and the sleep is handed to g_hiResClock.
+\param[in] deadline The timer reading to wait for.
+\param[in] hWake Optional event that ends the sleep early when it is signalled.
+\return FALSE if the sleep was ended by hWake, TRUE otherwise.
+*/
+inline BOOL HiResWaitTimerClass::sleepUntil(ULONGLONG deadline, HANDLE hWake)
+{
+    ULONGLONG now = g_hiResClock.now();
+    LARGE_INTEGER dueTime;
+    HANDLE handles[2] = { m_hTimer, hWake };
+
+    if ((deadline <= now) || ((deadline - now) <= m_spinTicks))
+    {
+        return TRUE;
+    }
+
+    if (_WindowsTime.getTimeSource() != nullptr)
+    {
+        if ((hWake != NULL) && (WaitForSingleObject(hWake, 0) == WAIT_OBJECT_0))
+        {
+            return FALSE;
+        }
+        g_hiResClock.waitUntil(deadline - m_spinTicks);
+        return TRUE;
+    }
+
+    // Relative due times are negative, in 100 ns units.
+    dueTime.QuadPart = -(LONGLONG)(g_hiResClock.ticksToMicroseconds(deadline - now - m_spinTicks) * 10);
+    if (!SetWaitableTimer(m_hTimer, &dueTime, 0, NULL, NULL, FALSE))
+    {
+        return TRUE;
+    }
+
+    return WaitForMultipleObjects((hWake != NULL) ? 2 : 1, handles, FALSE, INFINITE) == WAIT_OBJECT_0;
+}
+
+/**
+Time critical priority keeps the thread from being preempted by ordinary sketch threads, so it
+wakes close to its deadlines.
+\param[in] routine The thread entry point.
+\param[in] param The parameter passed to the entry point.
+\param[out] hThread Handle of the new thread.
+\return HRESULT success or error code.
+*/
+inline HRESULT HiResWaitTimerClass::startThread(LPTHREAD_START_ROUTINE routine, LPVOID param, HANDLE & hThread)
+{
+    hThread = CreateThread(NULL, 0, routine, param, 0, NULL);
+    if (hThread == NULL)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    SetThreadPriority(hThread, THREAD_PRIORITY_TIME_CRITICAL);
+    return S_OK;
+}
+
+/**
+This is for destructors, which run during static destruction.  There the thread may be
+unable to finish exiting, for instance while the loader lock is held to unload a DLL, so
+the wait is limited to HI_RES_THREAD_EXIT_TIMEOUT_MILLISECONDS.  A thread stuck like that
+has already returned from its thread routine.
+\param[in,out] hThread The thread handle.  It is closed and set to NULL if the thread exited.
+\return TRUE if the thread exited, FALSE if it was still running when the wait timed out.
+*/
+inline BOOL HiResWaitTimerClass::waitForThreadExit(HANDLE & hThread)
+{
+    if (WaitForSingleObject(hThread, HI_RES_THREAD_EXIT_TIMEOUT_MILLISECONDS) != WAIT_OBJECT_0)
+    {
+        return FALSE;
+    }
+    CloseHandle(hThread);
+    hThread = NULL;
+    return TRUE;
+}
+
+#endif  // _HI_RES_TIMER_H_
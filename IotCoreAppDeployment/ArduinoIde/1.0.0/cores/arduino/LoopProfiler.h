@@ -0,0 +1,297 @@
+// Copyright (c) Microsoft Open Technologies, Inc.  All rights reserved.  
+// Licensed under the BSD 2-Clause License.  
+// See License.txt in the project root for license information.
+
+#ifndef _LOOP_PROFILER_H_
+#define _LOOP_PROFILER_H_
+
+#include <Windows.h>
+#include <intrin.h>
+#include "HiResTimer.h"
+
+// Forward declaration(s):
+int Log(const char *format, ...);
+
+/// Number of bits of precision kept for each loop duration recorded.
+/**
+Durations are recorded with a relative error of at most 1 in 2^LOOP_PROFILER_SUB_BUCKET_BITS
+(about 3%), whatever their size.
+*/
+#define LOOP_PROFILER_SUB_BUCKET_BITS 5
+
+/// Durations of 2^LOOP_PROFILER_MAX_VALUE_BITS timer ticks or more are recorded as the largest bucket.
+#define LOOP_PROFILER_MAX_VALUE_BITS 40
+
+/// Number of buckets in the duration histogram.
+#define LOOP_PROFILER_BUCKETS ((LOOP_PROFILER_MAX_VALUE_BITS - LOOP_PROFILER_SUB_BUCKET_BITS + 1) << LOOP_PROFILER_SUB_BUCKET_BITS)
+
+/// Class used to measure how long each pass of the sketch loop takes.
+/**
+RunArduinoSketch() calls markIteration() once per pass of its loop, before each call to
+loop().  It returns at once unless profiling has been turned on with begin(); when it is on it
+reads the high resolution timer once and adds the time since the last pass to a histogram
+with logarithmically sized
+buckets (an HDR histogram), which costs the same for any duration and needs no allocation.
+Percentiles are only worked out when getStats() is called.
+
+The profiler is not synchronized, so begin(), end(), reset() and getStats() should be called on
+the sketch thread, for example from setup(), loop() or a scheduler task.
+*/
+class LoopProfilerClass
+{
+public:
+    /// Struct used to return pass duration statistics.
+    typedef struct {
+        ULONGLONG iterations;           ///< Number of passes measured
+        ULONGLONG iterationsPerSecond;  ///< Rate of passes since profiling started or was reset
+        ULONGLONG meanNanoseconds;      ///< Average pass duration
+        ULONGLONG p50Nanoseconds;       ///< Median pass duration
+        ULONGLONG p99Nanoseconds;       ///< 99th percentile pass duration
+        ULONGLONG p999Nanoseconds;      ///< 99.9th percentile pass duration
+        ULONGLONG maxNanoseconds;       ///< Longest pass duration
+    } LOOP_STATS, *PLOOP_STATS;
+
+    /// Constructor.
+    LoopProfilerClass() :
+        m_enabled(FALSE),
+        m_logIntervalTicks(0),
+        m_nextLogTicks(0),
+        m_iterationStart(0),
+        m_started(FALSE)
+    {
+        reset();
+    }
+
+    /// Destructor.
+    virtual ~LoopProfilerClass()
+    {
+    }
+
+    /// Start measuring the duration of each pass of the sketch loop.
+    inline void begin(ULONG logIntervalMilliseconds = 0);
+
+    /// Stop measuring.  The statistics gathered so far are kept.
+    inline void end()
+    {
+        m_enabled = FALSE;
+    }
+
+    /// Determine whether pass durations are being measured.
+    inline BOOL isEnabled()
+    {
+        return m_enabled;
+    }
+
+    /// Clear the statistics.
+    inline void reset()
+    {
+        ZeroMemory(m_counts, sizeof(m_counts));
+        m_iterations = 0;
+        m_totalTicks = 0;
+        m_maxTicks = 0;
+        m_started = FALSE;
+        m_startTicks = g_hiResClock.now();
+    }
+
+    /// Record the end of one pass of the sketch loop and the start of the next.
+    /**
+    The duration recorded is the time since the previous call, so it covers loop() and
+    everything else RunArduinoSketch() does between calls to it.  The first call after
+    begin() or reset() only records the start time.
+    */
+    inline void markIteration()
+    {
+        ULONGLONG now;
+        ULONGLONG ticks;
+
+        if (m_enabled)
+        {
+            now = g_hiResClock.now();
+            ticks = now - m_iterationStart;
+            m_iterationStart = now;
+
+            if (m_started)
+            {
+                m_counts[_bucketIndex(ticks)]++;
+                m_iterations++;
+                m_totalTicks += ticks;
+                if (ticks > m_maxTicks)
+                {
+                    m_maxTicks = ticks;
+                }
+
+                if ((m_logIntervalTicks != 0) && (now >= m_nextLogTicks))
+                {
+                    m_nextLogTicks = now + m_logIntervalTicks;
+                    logStats();
+                }
+            }
+            else
+            {
+                m_started = TRUE;
+                m_startTicks = now;
+            }
+        }
+    }
+
+    /// Get the pass duration statistics.
+    inline void getStats(LOOP_STATS & stats);
+
+    /// Write the pass duration statistics with Log().
+    inline void logStats();
+
+private:
+
+    /// TRUE while pass durations are being measured.
+    BOOL m_enabled;
+
+    /// Time between writes of the statistics with Log(), or zero for no writes.
+    ULONGLONG m_logIntervalTicks;
+
+    /// Timer reading at which the statistics are next written with Log().
+    ULONGLONG m_nextLogTicks;
+
+    /// Timer reading when the current pass started.
+    ULONGLONG m_iterationStart;
+
+    /// TRUE once the start of the first pass has been recorded.
+    BOOL m_started;
+
+    /// Timer reading when profiling started or was reset.
+    ULONGLONG m_startTicks;
+
+    /// Number of durations recorded, their total, and the longest of them.
+    ULONGLONG m_iterations;
+    ULONGLONG m_totalTicks;
+    ULONGLONG m_maxTicks;
+
+    /// Number of durations recorded in each histogram bucket.
+    ULONG m_counts[LOOP_PROFILER_BUCKETS];
+
+    /// Method to find the histogram bucket for a duration.
+    /**
+    Durations below 2^(LOOP_PROFILER_SUB_BUCKET_BITS + 1) ticks each have their own bucket.
+    Above that, each power of two is split into 2^LOOP_PROFILER_SUB_BUCKET_BITS buckets.
+    */
+    static inline ULONG _bucketIndex(ULONGLONG ticks)
+    {
+        ULONG highBit;
+        ULONG shift;
+
+        if (ticks < (2ULL << LOOP_PROFILER_SUB_BUCKET_BITS))
+        {
+            return (ULONG)ticks;
+        }
+        if (ticks >= (1ULL << LOOP_PROFILER_MAX_VALUE_BITS))
+        {
+            return LOOP_PROFILER_BUCKETS - 1;
+        }
+
+        if ((ticks >> 32) != 0)
+        {
+            _BitScanReverse(&highBit, (ULONG)(ticks >> 32));
+            highBit += 32;
+        }
+        else
+        {
+            _BitScanReverse(&highBit, (ULONG)ticks);
+        }
+
+        shift = highBit - LOOP_PROFILER_SUB_BUCKET_BITS;
+        return ((shift + 1) << LOOP_PROFILER_SUB_BUCKET_BITS) + (ULONG)(ticks >> shift) - (1 << LOOP_PROFILER_SUB_BUCKET_BITS);
+    }
+
+    /// Method to get the largest duration recorded in a histogram bucket.
+    static inline ULONGLONG _bucketHighestTicks(ULONG index)
+    {
+        ULONG shift;
+        ULONGLONG subBucket;
+
+        if (index < (2UL << LOOP_PROFILER_SUB_BUCKET_BITS))
+        {
+            return index;
+        }
+
+        shift = (index >> LOOP_PROFILER_SUB_BUCKET_BITS) - 1;
+        subBucket = (index & ((1 << LOOP_PROFILER_SUB_BUCKET_BITS) - 1)) + (1ULL << LOOP_PROFILER_SUB_BUCKET_BITS);
+        return ((subBucket + 1) << shift) - 1;
+    }
+
+    /// Method to find the duration that a given fraction of the recorded durations do not exceed.
+    /**
+    \param[in] perThousand The fraction in parts per thousand.
+    \return The duration in timer ticks.
+    */
+    inline ULONGLONG _percentileTicks(ULONG perThousand)
+    {
+        ULONGLONG target = ((m_iterations * perThousand) + 999) / 1000;
+        ULONGLONG seen = 0;
+        ULONGLONG ticks;
+        ULONG i;
+
+        for (i = 0; i < LOOP_PROFILER_BUCKETS; i++)
+        {
+            seen += m_counts[i];
+            if ((seen >= target) && (seen > 0))
+            {
+                ticks = _bucketHighestTicks(i);
+                return (ticks < m_maxTicks) ? ticks : m_maxTicks;
+            }
+        }
+        return m_maxTicks;
+    }
+};
+
+/**
+\param[in] logIntervalMilliseconds If not zero, the statistics are written with Log() at
+this interval, from the sketch thread, at the end of the pass in which the interval ends.
+*/
+inline void LoopProfilerClass::begin(ULONG logIntervalMilliseconds)
+{
+    reset();
+    m_logIntervalTicks = ((ULONGLONG)logIntervalMilliseconds * g_hiResClock.getFrequency()) / 1000;
+    m_nextLogTicks = g_hiResClock.now() + m_logIntervalTicks;
+    m_enabled = TRUE;
+}
+
+/**
+The percentiles are the largest duration in the histogram bucket they fall in, so they may
+be up to 1 part in 2^LOOP_PROFILER_SUB_BUCKET_BITS above the exact value.
+\param[out] stats The statistics gathered since profiling started or was reset.
+*/
+inline void LoopProfilerClass::getStats(LOOP_STATS & stats)
+{
+    ULONGLONG elapsedTicks;
+
+    elapsedTicks = g_hiResClock.now() - m_startTicks;
+
+    stats.iterations = m_iterations;
+    stats.iterationsPerSecond = 0;
+    stats.meanNanoseconds = 0;
+    if (elapsedTicks > 0)
+    {
+        stats.iterationsPerSecond = (m_iterations * g_hiResClock.getFrequency()) / elapsedTicks;
+    }
+    if (m_iterations > 0)
+    {
+        stats.meanNanoseconds = g_hiResClock.ticksToNanoseconds(m_totalTicks / m_iterations);
+    }
+    stats.p50Nanoseconds = g_hiResClock.ticksToNanoseconds(_percentileTicks(500));
+    stats.p99Nanoseconds = g_hiResClock.ticksToNanoseconds(_percentileTicks(990));
+    stats.p999Nanoseconds = g_hiResClock.ticksToNanoseconds(_percentileTicks(999));
+    stats.maxNanoseconds = g_hiResClock.ticksToNanoseconds(m_maxTicks);
+}
+
+inline void LoopProfilerClass::logStats()
+{
+    LOOP_STATS stats;
+
+    getStats(stats);
+    Log("Sketch loop: %llu passes, %llu/s, mean %llu ns, p50 %llu ns, p99 %llu ns, p99.9 %llu ns, max %llu ns\n",
+        stats.iterations, stats.iterationsPerSecond, stats.meanNanoseconds,
+        stats.p50Nanoseconds, stats.p99Nanoseconds, stats.p999Nanoseconds, stats.maxNanoseconds);
+}
+
+__declspec(selectany) LoopProfilerClass LoopProfiler;
+
+#endif  // _LOOP_PROFILER_H_
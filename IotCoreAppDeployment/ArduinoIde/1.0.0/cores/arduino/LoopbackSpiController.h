@@ -0,0 +1,203 @@
+// Copyright (c) Microsoft Open Technologies, Inc.  All rights reserved.  
+// Licensed under the BSD 2-Clause License.  
+// See License.txt in the project root for license information.
+
+#ifndef _LOOPBACK_SPI_CONTROLLER_H_
+#define _LOOPBACK_SPI_CONTROLLER_H_
+
+#include <Windows.h>
+#include "SpiController.h"
+#include "ErrorCodes.h"
+
+/// Simulated SPI Controller Class that returns the data sent on each transfer.
+/**
+This controller does not touch any hardware.  It behaves like an SPI controller in loopback
+mode, so it is only a smoke test for code built on SpiControllerClass, such as the self-test
+and the transferBuffer16/32 word packing.  It echoes in software, so it does not exercise the
+FIFO or register code of the BT, BCM or Quark controllers; use a board for that.  A fault can
+be injected to verify that data integrity checks catch corrupted transfers.
+*/
+class LoopbackSpiControllerClass : public SpiControllerClass
+{
+public:
+    /// Constructor.
+    LoopbackSpiControllerClass() :
+        m_isOpen(FALSE),
+        m_mode(DEFAULT_SPI_MODE),
+        m_clockKhz(DEFAULT_SPI_CLOCK_KHZ),
+        m_faultMask(0),
+        m_transfers(0)
+    {
+    }
+
+    /// Destructor.
+    virtual ~LoopbackSpiControllerClass()
+    {
+        this->end();
+    }
+
+    /// Record the pin assignments for this SPI controller.
+    HRESULT configurePins(ULONG misoPin, ULONG mosiPin, ULONG sckPin) override
+    {
+        m_misoPin = misoPin;
+        m_mosiPin = mosiPin;
+        m_sckPin = sckPin;
+        return S_OK;
+    }
+
+    /// Open the simulated SPI bus, using the default mode and clock rate.
+    HRESULT begin(ULONG busNumber) override
+    {
+        return begin(busNumber, DEFAULT_SPI_MODE, DEFAULT_SPI_CLOCK_KHZ, DEFAULT_SPI_BITS);
+    }
+
+    /// Open the simulated SPI bus.
+    HRESULT begin(ULONG busNumber, ULONG mode, ULONG clockKhz, ULONG dataBits) override
+    {
+        HRESULT hr = S_OK;
+
+        UNREFERENCED_PARAMETER(busNumber);
+
+        hr = setMode(mode);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = setClock(clockKhz);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = setDataWidth(dataBits);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            m_isOpen = TRUE;
+        }
+
+        return hr;
+    }
+
+    /// Close the simulated SPI bus.
+    void end() override
+    {
+        m_isOpen = FALSE;
+    }
+
+    /// Set the simulated SPI clock rate.
+    HRESULT setClock(ULONG clockKhz) override
+    {
+        if (clockKhz == 0)
+        {
+            return DMAP_E_SPI_SPEED_SPECIFIED_IS_INVALID;
+        }
+        m_clockKhz = clockKhz;
+        return S_OK;
+    }
+
+    /// Set the simulated SPI mode.
+    HRESULT setMode(ULONG mode) override
+    {
+        if (mode > 3)
+        {
+            return DMAP_E_SPI_MODE_SPECIFIED_IS_INVALID;
+        }
+        m_mode = mode;
+        return S_OK;
+    }
+
+    /// Set the number of bits in an SPI transfer.
+    HRESULT setDataWidth(ULONG bits) override
+    {
+        if ((bits < m_minTransferBits) || (bits > m_maxTransferBits))
+        {
+            return DMAP_E_SPI_DATA_WIDTH_SPECIFIED_IS_INVALID;
+        }
+        m_dataBits = bits;
+        return S_OK;
+    }
+
+    /// The simulated controller is always in loopback mode.
+    HRESULT setLoopbackMode(BOOL enable)
+    {
+        return enable ? S_OK : DMAP_E_SPI_LOOPBACK_NOT_SUPPORTED;
+    }
+
+    /// Return the data sent as the data received.
+    HRESULT _transfer(ULONG dataOut, ULONG & dataIn, ULONG bits) override
+    {
+        if (!m_isOpen)
+        {
+            return DMAP_E_DMAP_INTERNAL_ERROR;
+        }
+        if ((bits == 0) || (bits > 32))
+        {
+            return DMAP_E_SPI_DATA_WIDTH_SPECIFIED_IS_INVALID;
+        }
+        dataIn = (dataOut ^ m_faultMask) & (0xFFFFFFFF >> (32 - bits));
+        m_transfers++;
+        return S_OK;
+    }
+
+    /// Return a buffer of data sent as the data received.
+    HRESULT transferBuffer(PBYTE dataOut, PBYTE dataIn, size_t bufferBytes) override
+    {
+        size_t i;
+
+        if (!m_isOpen)
+        {
+            return DMAP_E_DMAP_INTERNAL_ERROR;
+        }
+        if (m_dataBits != 8)
+        {
+            return DMAP_E_SPI_DATA_WIDTH_MISMATCH;
+        }
+
+        for (i = 0; i < bufferBytes; i++)
+        {
+            if (dataIn != nullptr)
+            {
+                dataIn[i] = (BYTE)(((dataOut != nullptr) ? dataOut[i] : 0) ^ m_faultMask);
+            }
+        }
+        m_transfers += bufferBytes;
+        return S_OK;
+    }
+
+    /// Set bits to invert in all received data, to simulate a faulty bus.
+    inline void injectFault(ULONG faultMask)
+    {
+        m_faultMask = faultMask;
+    }
+
+    /// Get the number of words transferred since the controller was created.
+    inline ULONGLONG getTransferCount()
+    {
+        return m_transfers;
+    }
+
+private:
+
+    /// TRUE while the simulated bus is open.
+    BOOL m_isOpen;
+
+    /// The SPI mode that has been set.
+    ULONG m_mode;
+
+    /// The SPI clock rate that has been set.
+    ULONG m_clockKhz;
+
+    /// Bits inverted in all received data.
+    ULONG m_faultMask;
+
+    /// Count of words transferred.
+    ULONGLONG m_transfers;
+
+    /// The minimum width of a transfer on this controller.
+    const UINT m_minTransferBits = 4;
+
+    /// The maximum width of a transfer on this controller.
+    const UINT m_maxTransferBits = 32;
+};
+
+#endif  // _LOOPBACK_SPI_CONTROLLER_H_
@@ -8,6 +8,7 @@
 #include <Windows.h>
 
 #include "Spi.h"
+#include "SpiBusManager.h"
 #include "GpioController.h"
 
 #define MBM_SPI_CS_PIN 5
@@ -22,7 +23,8 @@ class MCP3008Device
 public:
     /// Constructor.
     MCP3008Device() :
-        m_csPin(0)
+        m_csPin(0),
+        m_deviceId(SPI_BUS_NO_DEVICE)
     {
     }
 
@@ -47,52 +49,41 @@ public:
             hr = DMAP_E_BOARD_TYPE_NOT_RECOGNIZED;
         }
 
-        // Create and initialize the SPI Controller object if we don't already have one.
         if (SUCCEEDED(hr))
         {
             if (board == BoardPinsClass::BOARD_TYPE::MBM_BARE)
             {
                 m_csPin = MBM_SPI_CS_PIN;
-                m_spi = new BtSpiControllerClass;
-                hr = m_spi->configurePins(MBM_PIN_MISO, MBM_PIN_MOSI, MBM_PIN_SCK);
             }
             else if (board == BoardPinsClass::BOARD_TYPE::PI2_BARE)
             {
                 m_csPin = PI2_SPI_CS_PIN;
-                m_spi = new BcmSpiControllerClass;
-                hr = m_spi->configurePins(PI2_PIN_SPI0_MISO, PI2_PIN_SPI0_MOSI, PI2_PIN_SPI0_SCK);
             }
             else
             {
                 hr = DMAP_E_BOARD_TYPE_NOT_RECOGNIZED;
             }
+        }
 
-            if (SUCCEEDED(hr))
-            {
-                hr = g_pins.setPinMode(m_csPin, DIRECTION_OUT, FALSE);
-
-                if (SUCCEEDED(hr))
-                {
-                    hr = g_pins.setPinState(m_csPin, HIGH);
-                }
-
-                if (SUCCEEDED(hr))
-                {
-                    hr = g_pins.verifyPinFunction(m_csPin, FUNC_DIO, BoardPinsClass::LOCK_FUNCTION);
-                }
-            }
+        // Open the shared SPI bus and register the ADC on it.
+        if (SUCCEEDED(hr))
+        {
+            hr = g_spiBus.begin();
         }
 
         if (SUCCEEDED(hr))
         {
-            // Set the SPI bit shifting order to MSB First.
-            m_spi->setMsbFirstBitOrder();
-
-            // Map the SPI1 controller registers into memory.
-            hr = m_spi->begin(EXTERNAL_SPI_BUS,
-                              MCP3008_SPI_MODE,
-                              MCP3008_MAX_SPI_KHZ,
-                              MCP3008_SPI_TRANSFER_BITS);
+            hr = g_spiBus.addDevice(m_csPin,
+                                    MCP3008_SPI_MODE,
+                                    MCP3008_MAX_SPI_KHZ,
+                                    MCP3008_SPI_TRANSFER_BITS,
+                                    FALSE,
+                                    m_deviceId);
+
+            if (FAILED(hr))
+            {
+                g_spiBus.end();
+            }
         }
         
         return hr;
@@ -101,14 +92,17 @@ public:
     /// Release the ADC.
     inline void end()
     {
-        // Release the ADC SPI bus.
-        m_spi->end();
-
-        // Revert the dedicated SPI pins to GPIO.
-        m_spi->revertPinsToGpio();
-
-        // Unlock the CS line so it can be used for non-GPIO function.
-        g_pins.verifyPinFunction(m_csPin, FUNC_DIO, BoardPinsClass::UNLOCK_FUNCTION);
+        if (m_deviceId != SPI_BUS_NO_DEVICE)
+        {
+            // Remove the ADC from the SPI bus.  This also unlocks the CS line so it can
+            // be used for non-GPIO function.
+            g_spiBus.removeDevice(m_deviceId);
+            m_deviceId = SPI_BUS_NO_DEVICE;
+
+            // Release our hold on the SPI bus.  When the last user of the bus releases
+            // it, the dedicated SPI pins are reverted to GPIO.
+            g_spiBus.end();
+        }
     }
 
     /// Take a reading with the ADC used on the Gen2 board.
@@ -124,6 +118,7 @@ public:
         
         ULONG dataOut = FIXED_CMD_BITS;
         ULONG dataIn = 0;
+        SpiControllerClass* spi;
 
         // Make sure the channel number is in range.
         if (channel >= ADC_CHANNELS)
@@ -136,12 +131,16 @@ public:
             // Prepare to send the channel number to the SPI controller.
             dataOut |= channel << CHAN_SHIFT;
 
-            // Perform a conversion and get the result.
-            g_pins.setPinState(m_csPin, LOW);
+            // Perform a conversion and get the result.  The bus asserts the
+            // ADC chip select for the duration of the transaction.
+            hr = g_spiBus.beginTransaction(m_deviceId, spi);
+
+            if (SUCCEEDED(hr))
+            {
+                hr = spi->transfer24(dataOut, dataIn);
 
-            hr = m_spi->transfer24(dataOut, dataIn);
-                
-            g_pins.setPinState(m_csPin, HIGH);
+                g_spiBus.endTransaction(m_deviceId);
+            }
         }
 
         if (SUCCEEDED(hr))
@@ -154,6 +153,70 @@ public:
         return hr;
     }
 
+    /// Take readings from several channels of the ADC in one scan.
+    /**
+    The bus is held for the whole scan and chip select is pulsed between the 24-bit
+    frames, so the conversions run back to back.
+    \param[in] channels Array of channel numbers to read.
+    \param[out] values Array that receives the value read from each channel.
+    \param[in] count The number of channels to read.
+    \param[out] bits The size of each reading in "values" in bits.
+    \return HRESULT success or error code.
+    */
+    inline HRESULT readValues(const ULONG* channels, PULONG values, ULONG count, ULONG & bits)
+    {
+        HRESULT hr = S_OK;
+        
+        ULONG dataIn = 0;
+        ULONG i;
+        SpiControllerClass* spi;
+
+        // Make sure the channel numbers are in range.
+        for (i = 0; SUCCEEDED(hr) && (i < count); i++)
+        {
+            if (channels[i] >= ADC_CHANNELS)
+            {
+                hr = DMAP_E_ADC_DOES_NOT_HAVE_REQUESTED_CHANNEL;
+            }
+        }
+
+        if (SUCCEEDED(hr) && (count > 0))
+        {
+            hr = g_spiBus.beginTransaction(m_deviceId, spi);
+
+            if (SUCCEEDED(hr))
+            {
+                for (i = 0; SUCCEEDED(hr) && (i < count); i++)
+                {
+                    // Each conversion is started by the falling edge of chip select.
+                    if (i > 0)
+                    {
+                        hr = g_spiBus.cycleChipSelect(m_deviceId);
+                    }
+
+                    if (SUCCEEDED(hr))
+                    {
+                        hr = spi->transfer24(FIXED_CMD_BITS | (channels[i] << CHAN_SHIFT), dataIn);
+                    }
+
+                    if (SUCCEEDED(hr))
+                    {
+                        values[i] = dataIn & ((1 << ADC_BITS) - 1);
+                    }
+                }
+
+                g_spiBus.endTransaction(m_deviceId);
+            }
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            bits = ADC_BITS;
+        }
+        
+        return hr;
+    }
+
 private:
     /// The number of channels on the ADC.
     const ULONG ADC_CHANNELS = 8;
@@ -170,8 +233,8 @@ private:
     /// The pin number of the CS pin.
     ULONG m_csPin;
 
-    /// The SPI Controller object used to talk to the ADC.
-    SpiControllerClass* m_spi;
+    /// The ID of the ADC on the shared SPI bus.
+    ULONG m_deviceId;
 
 };
 
@@ -6,6 +6,17 @@
 #define _PCA9685_SUPPORT_H_
 
 #include <Windows.h>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "ErrorCodes.h"
+#include "HiResTimer.h"
+#include "I2c.h"
+#include "I2cTransaction.h"
+
+/// The frequency of the PCA9685 internal oscillator.
+#define PCA9685_OSC_HZ 25000000UL
 
 class PCA9685Device
 {
@@ -20,6 +31,9 @@ public:
     /// Set the PWM pulse width.
     static HRESULT SetPwmDutyCycle(ULONG i2cAdr, ULONG bit, ULONG pulseWidth);
 
+    /// Set the PWM pulse widths of several outputs with one I2C transaction.
+    static HRESULT SetPwmDutyCycles(ULONG i2cAdr, const ULONG* bits, const ULONG* pulseWidths, ULONG count);
+
     /// Set the PWM pulse repetition rate.
     static HRESULT SetPwmFrequency(ULONG i2cAdr, ULONG frequencyHz);
 
@@ -32,6 +46,35 @@ public:
         return PWM_BITS;
     }
 
+    /// Get the object for the PWM chip at an I2C address.
+    static HRESULT GetChip(ULONG i2cAdr, PCA9685Device* & chip);
+
+    /// Write the pulse widths staged on all PWM chips.
+    static HRESULT FlushAllChips();
+
+    /// Destructor.
+    virtual ~PCA9685Device()
+    {
+    }
+
+    /// Get the I2C address of this PWM chip.
+    inline ULONG getAddress()
+    {
+        return m_i2cAdr;
+    }
+
+    /// Set the PWM pulse repetition rate of this chip.
+    HRESULT setFrequency(ULONG frequencyHz);
+
+    /// Get the actual PWM pulse repetition rate of this chip.
+    HRESULT getFrequency(ULONG & frequencyHz);
+
+    /// Stage new pulse widths for outputs of this chip, to be written by flush().
+    HRESULT stagePulseWidths(const ULONG* bits, const ULONG* pulseWidths, ULONG count);
+
+    /// Write the staged pulse widths to the chip.
+    HRESULT flush();
+
 private:
     static const ULONG PWM_BITS;        ///< Number of bits of resolution this PWM chip has
     static const ULONG MODE1_ADR;       ///< Address of MODE1 register
@@ -77,22 +120,576 @@ private:
     {
     }
 
-    /// Destructor.
-    virtual ~PCA9685Device()
+    /// Constructor for the object used for the chip at an I2C address.
+    PCA9685Device(ULONG i2cAdr) :
+        m_i2cAdr(i2cAdr),
+        m_initialized(FALSE),
+        m_preScale(0),
+        m_staged(0)
     {
+        m_stagedRegs.assign(LED_COUNT * REGS_PER_LED, 0);
     }
 
-    // If/when multiple PCA9685 chips are supported, the data unique to the chip
-    //    should be indexed by I2C address.
-
     /// Set to TRUE when the chip is known to have been initialized.
+    /// (Used by the static methods, which address one chip at a time.)
     static BOOL m_chipIsInitialized;
 
     /// The current PWM pulse rate pre-scale value for all channels.
+    /// (Used by the static methods, which address one chip at a time.)
     static UCHAR m_freqPreScale;
 
+    /// The PWM chip objects, indexed by I2C address.
+    static std::map<ULONG, std::unique_ptr<PCA9685Device>> & _Chips()
+    {
+        static std::map<ULONG, std::unique_ptr<PCA9685Device>> chips;
+        return chips;
+    }
+
+    /// The lock that serializes use of the PWM chip objects and their staged contents.
+    static CRITICAL_SECTION & _ChipsLock()
+    {
+        static struct ChipsLock
+        {
+            ChipsLock()
+            {
+                InitializeCriticalSection(&cs);
+            }
+            CRITICAL_SECTION cs;
+        } lock;
+        return lock.cs;
+    }
+
+    /// The I2C address of this chip.
+    ULONG m_i2cAdr;
+
+    /// Set to TRUE when this chip has been initialized for use by this object.
+    BOOL m_initialized;
+
+    /// The PWM pulse rate pre-scale value of this chip.
+    UCHAR m_preScale;
+
+    /// LED register contents waiting to be written to the chip.
+    std::vector<UCHAR> m_stagedRegs;
+
+    /// Bit mask of the outputs with staged contents.
+    ULONG m_staged;
+
+    /// Buffer for the register writes of a flush.  Kept until the write is done.
+    std::vector<UCHAR> m_writeBuffer;
+
     /// Method to take any necessary actions to initialize the PWM chip.
     static HRESULT _InitializeChip(ULONG i2cAdr);
+
+    /// Method to prepare this chip for use by this object.
+    HRESULT _initialize();
+
+    /// Method to queue the writes needed to update the chip with the staged contents.
+    HRESULT _queueFlush(I2cTransactionClass & transaction, ULONG & written);
+
+    /// Method to record that the queued writes have been done.
+    void _flushDone(ULONG written);
+
+    /// Method to read one chip register.
+    HRESULT _readRegister(ULONG reg, UCHAR & value);
+
+    /// Method to write one chip register.
+    HRESULT _writeRegister(ULONG reg, UCHAR value);
 };
 
-#endif  // _PCA9685_SUPPORT_H_
\ No newline at end of file
+/**
+Each chip is represented by one object, created the first time its address is used.  The
+object tracks the chip's initialization and frequency pre-scale, and stages LED register
+updates so they can be written together.  The objects are created and used under a lock, so
+they can be reached from more than one thread.
+\param[in] i2cAdr The I2C address of the PWM chip.
+\param[out] chip The object for the chip.
+\return HRESULT success or error code.
+*/
+inline HRESULT PCA9685Device::GetChip(ULONG i2cAdr, PCA9685Device* & chip)
+{
+    HRESULT hr = S_OK;
+
+    EnterCriticalSection(&_ChipsLock());
+
+    std::unique_ptr<PCA9685Device> & entry = _Chips()[i2cAdr];
+
+    if (!entry)
+    {
+        entry.reset(new PCA9685Device(i2cAdr));
+    }
+
+    hr = entry->_initialize();
+
+    if (SUCCEEDED(hr))
+    {
+        chip = entry.get();
+    }
+
+    LeaveCriticalSection(&_ChipsLock());
+
+    return hr;
+}
+
+/**
+The I2C transactions for all the chips with staged changes are built first, then run back
+to back, so the chips are updated as close together in time as the bus allows.  Each chip
+updates all its outputs at the STOP that ends its transaction.
+\return HRESULT success or error code.
+*/
+inline HRESULT PCA9685Device::FlushAllChips()
+{
+    HRESULT hr = S_OK;
+    std::vector<std::unique_ptr<I2cTransactionClass>> transactions;
+    std::vector<PCA9685Device*> chips;
+    std::vector<ULONG> written;
+    ULONG chipWritten;
+    ULONG i;
+
+    EnterCriticalSection(&_ChipsLock());
+
+    // Build the transactions.
+    for (auto & entry : _Chips())
+    {
+        if (SUCCEEDED(hr) && (entry.second->m_staged != 0))
+        {
+            transactions.emplace_back(new I2cTransactionClass);
+            hr = entry.second->_queueFlush(*transactions.back(), chipWritten);
+            chips.push_back(entry.second.get());
+            written.push_back(chipWritten);
+        }
+    }
+
+    // Run them.
+    for (i = 0; SUCCEEDED(hr) && (i < transactions.size()); i++)
+    {
+        if (written[i] != 0)
+        {
+            hr = transactions[i]->execute(g_i2c.getController());
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            chips[i]->_flushDone(written[i]);
+        }
+    }
+
+    LeaveCriticalSection(&_ChipsLock());
+
+    return hr;
+}
+
+/**
+\param[in] i2cAdr The I2C address of the PWM chip.
+\param[in] bits Array of the outputs to set (0 to LED_COUNT - 1).  If an output appears more
+than once the last pulse width given for it is used.
+\param[in] pulseWidths Array of the pulse width for each output, in PWM clock counts: 0 is
+constant off, 2^PWM_BITS or more is constant on.
+\param[in] count The number of outputs to set.
+\return HRESULT success or error code.
+*/
+inline HRESULT PCA9685Device::SetPwmDutyCycles(ULONG i2cAdr, const ULONG* bits, const ULONG* pulseWidths, ULONG count)
+{
+    HRESULT hr = S_OK;
+    PCA9685Device* chip = nullptr;
+
+    // Hold the lock from staging through the write, so no other thread's changes are mixed in.
+    EnterCriticalSection(&_ChipsLock());
+
+    hr = GetChip(i2cAdr, chip);
+
+    if (SUCCEEDED(hr))
+    {
+        hr = chip->stagePulseWidths(bits, pulseWidths, count);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = chip->flush();
+    }
+
+    LeaveCriticalSection(&_ChipsLock());
+
+    return hr;
+}
+
+/**
+The chip must be put to sleep to change the pre-scale value, so this interrupts its outputs
+briefly.  If the requested rate is what the chip already has, nothing is written.  The
+pre-scale register is read first, since SetPwmFrequency() can change it without going
+through this object.  The value written is also stored in m_freqPreScale, so the static
+methods see the rate the chip now has rather than skipping or undoing the change.
+\param[in] frequencyHz The desired PWM pulse rate (about 24 to 1526 Hz).
+\return HRESULT success or error code.
+*/
+inline HRESULT PCA9685Device::setFrequency(ULONG frequencyHz)
+{
+    HRESULT hr = S_OK;
+    ULONG preScale;
+    UCHAR mode1Value;
+    PMODE1 mode1 = (PMODE1)&mode1Value;
+
+    if (frequencyHz == 0)
+    {
+        hr = E_INVALIDARG;
+    }
+
+    EnterCriticalSection(&_ChipsLock());
+
+    if (SUCCEEDED(hr))
+    {
+        // Pre-scale = round(25 MHz / (4096 * frequency)) - 1, limited to the chip's range.
+        preScale = ((PCA9685_OSC_HZ + ((1UL << PWM_BITS) * frequencyHz / 2)) / ((1UL << PWM_BITS) * frequencyHz)) - 1;
+        if (preScale < 3)
+        {
+            preScale = 3;
+        }
+        if (preScale > 255)
+        {
+            preScale = 255;
+        }
+
+        hr = _readRegister(PRE_SCALE_ADR, m_preScale);
+    }
+
+    if (SUCCEEDED(hr) && (preScale != m_preScale))
+    {
+        hr = _readRegister(MODE1_ADR, mode1Value);
+
+        // Sleep, set the pre-scale value, wake up, then restart the outputs.
+        if (SUCCEEDED(hr))
+        {
+            mode1->RESTART = 0;
+            mode1->SLEEP = 1;
+            hr = _writeRegister(MODE1_ADR, mode1Value);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = _writeRegister(PRE_SCALE_ADR, (UCHAR)preScale);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            mode1->SLEEP = 0;
+            hr = _writeRegister(MODE1_ADR, mode1Value);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            // The oscillator needs 500 microseconds to stabilize before the restart.
+            g_hiResClock.waitMicroseconds(500);
+            mode1->RESTART = 1;
+            hr = _writeRegister(MODE1_ADR, mode1Value);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            m_preScale = (UCHAR)preScale;
+            m_freqPreScale = m_preScale;
+        }
+    }
+
+    LeaveCriticalSection(&_ChipsLock());
+
+    return hr;
+}
+
+/**
+\param[out] frequencyHz The PWM pulse rate produced by the chip's pre-scale register.
+\return HRESULT success or error code.
+*/
+inline HRESULT PCA9685Device::getFrequency(ULONG & frequencyHz)
+{
+    HRESULT hr = S_OK;
+
+    EnterCriticalSection(&_ChipsLock());
+
+    hr = _readRegister(PRE_SCALE_ADR, m_preScale);
+
+    if (SUCCEEDED(hr))
+    {
+        frequencyHz = PCA9685_OSC_HZ / ((1UL << PWM_BITS) * (m_preScale + 1));
+    }
+
+    LeaveCriticalSection(&_ChipsLock());
+
+    return hr;
+}
+
+/**
+\param[in] bits Array of the outputs to set (0 to LED_COUNT - 1).  If an output appears more
+than once the last pulse width given for it is used.
+\param[in] pulseWidths Array of the pulse width for each output, in PWM clock counts: 0 is
+constant off, 2^PWM_BITS or more is constant on.
+\param[in] count The number of outputs to set.
+\return HRESULT success or error code.
+*/
+inline HRESULT PCA9685Device::stagePulseWidths(const ULONG* bits, const ULONG* pulseWidths, ULONG count)
+{
+    HRESULT hr = S_OK;
+    ULONG fullOn = 1 << PWM_BITS;
+    PUCHAR regs;
+    ULONG i;
+
+    EnterCriticalSection(&_ChipsLock());
+
+    for (i = 0; SUCCEEDED(hr) && (i < count); i++)
+    {
+        if (bits[i] >= LED_COUNT)
+        {
+            hr = DMAP_E_INVALID_PORT_BIT_FOR_DEVICE;
+        }
+    }
+
+    for (i = 0; SUCCEEDED(hr) && (i < count); i++)
+    {
+        regs = &m_stagedRegs[bits[i] * REGS_PER_LED];
+
+        // Turn on at the start of the cycle, off after the pulse width.
+        regs[0] = 0x00;
+        regs[1] = 0x00;
+        regs[2] = (UCHAR)(pulseWidths[i] & 0xFF);
+        regs[3] = (UCHAR)((pulseWidths[i] >> 8) & 0x0F);
+        if (pulseWidths[i] == 0)
+        {
+            // Full off.
+            regs[3] = 0x10;
+        }
+        else if (pulseWidths[i] >= fullOn)
+        {
+            // Full on.
+            regs[1] = 0x10;
+            regs[2] = 0x00;
+            regs[3] = 0x00;
+        }
+        m_staged |= 1 << bits[i];
+    }
+
+    LeaveCriticalSection(&_ChipsLock());
+
+    return hr;
+}
+
+/**
+The LED registers for each run of consecutive changed outputs are written with a single
+auto-increment write.  All the writes are made in one I2C transaction, with a repeated start
+between runs and one STOP at the end.  Since the chip is set to update its outputs on STOP,
+all the outputs change together, at the same point in the PWM cycle.
+\return HRESULT success or error code.
+*/
+inline HRESULT PCA9685Device::flush()
+{
+    HRESULT hr = S_OK;
+    I2cTransactionClass transaction;
+    ULONG written = 0;
+
+    EnterCriticalSection(&_ChipsLock());
+
+    hr = _queueFlush(transaction, written);
+
+    if (SUCCEEDED(hr) && (written != 0))
+    {
+        hr = transaction.execute(g_i2c.getController());
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        _flushDone(written);
+    }
+
+    LeaveCriticalSection(&_ChipsLock());
+
+    return hr;
+}
+
+/**
+Initializes the chip, reads its pre-scale value, and turns on register auto-increment in
+MODE1.  It also makes sure MODE2 has the outputs change on the I2C STOP rather than on each
+ACK.  Neither setting changes what the static methods do: auto-increment only matters to
+writes of more than one data byte, and each of their transactions still takes effect when it
+ends.
+The pre-scale value read is stored in m_freqPreScale, so the static methods start from what
+the chip really has.
+\return HRESULT success or error code.
+*/
+inline HRESULT PCA9685Device::_initialize()
+{
+    HRESULT hr = S_OK;
+    UCHAR mode1Value;
+    UCHAR mode2Value;
+    PMODE1 mode1 = (PMODE1)&mode1Value;
+    PMODE2 mode2 = (PMODE2)&mode2Value;
+
+    if (!m_initialized)
+    {
+        hr = _InitializeChip(m_i2cAdr);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = _readRegister(PRE_SCALE_ADR, m_preScale);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            m_freqPreScale = m_preScale;
+            hr = _readRegister(MODE1_ADR, mode1Value);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = _readRegister(MODE2_ADR, mode2Value);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            mode1->AI = 1;
+            mode1->RESTART = 0;     // Writing 0 leaves RESTART unchanged
+            hr = _writeRegister(MODE1_ADR, mode1Value);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            mode2->OCH = 0;
+            hr = _writeRegister(MODE2_ADR, mode2Value);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            m_initialized = TRUE;
+        }
+    }
+
+    return hr;
+}
+
+/**
+\param[in] transaction The transaction to queue the writes on.  Its address is set to the
+address of this chip.
+\param[out] written Bit mask of the outputs whose registers are written by the queued writes.
+\return HRESULT success or error code.
+\note Every staged output is written, even if it was last set to the same value.  The
+single output methods (SetPwmDutyCycle(), SetBitState()) write the chip directly, so a
+copy of what this object last wrote could not be trusted to match the chip.
+*/
+inline HRESULT PCA9685Device::_queueFlush(I2cTransactionClass & transaction, ULONG & written)
+{
+    HRESULT hr = S_OK;
+    ULONG changed = m_staged;
+    ULONG runStart;
+    ULONG led;
+
+    written = 0;
+
+    hr = transaction.setAddress(m_i2cAdr);
+
+    if (SUCCEEDED(hr) && (changed != 0))
+    {
+        // Reserve the worst case (a register address for every LED) so the buffer
+        // addresses queued on the transaction stay valid.
+        m_writeBuffer.clear();
+        m_writeBuffer.reserve(LED_COUNT * (REGS_PER_LED + 1));
+
+        led = 0;
+        while (SUCCEEDED(hr) && (led < LED_COUNT))
+        {
+            if ((changed & (1 << led)) == 0)
+            {
+                led++;
+                continue;
+            }
+
+            // Build one write for this run of consecutive outputs.
+            runStart = (ULONG)m_writeBuffer.size();
+            m_writeBuffer.push_back((UCHAR)(LEDS_BASE_ADR + (led * REGS_PER_LED)));
+            while ((led < LED_COUNT) && ((changed & (1 << led)) != 0))
+            {
+                m_writeBuffer.insert(m_writeBuffer.end(),
+                    m_stagedRegs.begin() + (led * REGS_PER_LED),
+                    m_stagedRegs.begin() + ((led + 1) * REGS_PER_LED));
+                led++;
+            }
+
+            hr = transaction.queueWrite(m_writeBuffer.data() + runStart, (ULONG)m_writeBuffer.size() - runStart, (runStart != 0));
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        written = changed;
+    }
+
+    return hr;
+}
+
+/**
+\param[in] written Bit mask of the outputs whose registers have been written.
+*/
+inline void PCA9685Device::_flushDone(ULONG written)
+{
+    m_staged &= ~written;
+}
+
+/**
+\param[in] reg The address of the register to read.
+\param[out] value The contents of the register.
+\return HRESULT success or error code.
+*/
+inline HRESULT PCA9685Device::_readRegister(ULONG reg, UCHAR & value)
+{
+    HRESULT hr = S_OK;
+    I2cTransactionClass transaction;
+    UCHAR regAdr[1] = { (UCHAR)reg };
+    UCHAR data[1] = { 0 };
+
+    hr = transaction.setAddress(m_i2cAdr);
+
+    if (SUCCEEDED(hr))
+    {
+        hr = transaction.queueWrite(regAdr, 1);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = transaction.queueRead(data, 1, TRUE);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = transaction.execute(g_i2c.getController());
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        value = data[0];
+    }
+
+    return hr;
+}
+
+/**
+\param[in] reg The address of the register to write.
+\param[in] value The value to write to the register.
+\return HRESULT success or error code.
+*/
+inline HRESULT PCA9685Device::_writeRegister(ULONG reg, UCHAR value)
+{
+    HRESULT hr = S_OK;
+    I2cTransactionClass transaction;
+    UCHAR data[2] = { (UCHAR)reg, value };
+
+    hr = transaction.setAddress(m_i2cAdr);
+
+    if (SUCCEEDED(hr))
+    {
+        hr = transaction.queueWrite(data, 2);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = transaction.execute(g_i2c.getController());
+    }
+
+    return hr;
+}
+
+#endif  // _PCA9685_SUPPORT_H_
@@ -49,13 +49,20 @@ public:
     HRESULT setMode(ULONG mode) override;
 
     /// Set the number of bits in an SPI transfer.
-    HRESULT setDataWidth(ULONG bits) override
+    HRESULT setDataWidth(ULONG bits) override;
+
+    /// Enable or disable internal loopback of transmitted data to the receiver.
+    /**
+    This is not virtual, so SpiControllerClass keeps the vtable layout of the library that
+    builds the controllers.  SpiBusManagerClass::setLoopbackMode() calls it.
+    */
+    HRESULT setLoopbackMode(BOOL enable)
     {
-        if ((bits < m_minTransferBits) || (bits > m_maxTransferBits))
+        if (m_registers == nullptr)
         {
-            return DMAP_E_SPI_DATA_WIDTH_SPECIFIED_IS_INVALID;
+            return DMAP_E_DMAP_INTERNAL_ERROR;
         }
-        m_dataBits = bits;
+        m_registers->SSCR1.LBM = enable ? 1 : 0;
         return S_OK;
     }
 
@@ -192,6 +199,36 @@ private:
     const UINT m_maxTransferBits = 32;
 };
 
+/**
+If the controller is running, the new width is programmed into the DSS field right away.
+The controller is disabled while the data size is changed; _transfer() enables it again.
+\param[in] bits The number of bits in each transfer (4-32).
+\return HRESULT success or error code.
+*/
+inline HRESULT QuarkSpiControllerClass::setDataWidth(ULONG bits)
+{
+    _SSCR0 sscr0;
+
+    if ((bits < m_minTransferBits) || (bits > m_maxTransferBits))
+    {
+        return DMAP_E_SPI_DATA_WIDTH_SPECIFIED_IS_INVALID;
+    }
+
+    if ((m_registers != nullptr) && (bits != m_dataBits))
+    {
+        // Data size is DSS + 1 bits.
+        sscr0.ALL_BITS = m_registers->SSCR0.ALL_BITS;
+        sscr0.SSE = 0;
+        m_registers->SSCR0.ALL_BITS = sscr0.ALL_BITS;
+
+        sscr0.DSS = bits - 1;
+        m_registers->SSCR0.ALL_BITS = sscr0.ALL_BITS;
+    }
+
+    m_dataBits = bits;
+    return S_OK;
+}
+
 /**
 Transfer a number of bits on the SPI bus.
 \param[in] dataOut Data to send on the SPI bus
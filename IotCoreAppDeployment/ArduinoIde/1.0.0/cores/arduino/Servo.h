@@ -2,6 +2,9 @@
 // Licensed under the BSD 2-Clause License.  
 // See License.txt in the project root for license information.
 
+#ifndef _SERVO_H_
+#define _SERVO_H_
+
 #define MIN_PULSE_WIDTH 544
 #define MAX_PULSE_WIDTH 2400
 #define DEFAULT_PULSE_WIDTH 1500
@@ -48,3 +51,4 @@ inline ULONG Servo::readMicroseconds()
     return _currentPulseMicroseconds;
 }
 
+#endif // _SERVO_H_
@@ -0,0 +1,521 @@
+// Copyright (c) Microsoft Open Technologies, Inc.  All rights reserved.  
+// Licensed under the BSD 2-Clause License.  
+// See License.txt in the project root for license information.
+
+#ifndef _SERVO_GROUP_H_
+#define _SERVO_GROUP_H_
+
+#include "arduino.h"
+#include "Servo.h"
+
+/// The maximum number of servos in the group.
+#define SERVO_GROUP_MAX_SERVOS 32
+
+/// The longest time step used to move the servos in one frame, in microseconds.
+/**
+If frames are missed, the servos move as if this much time had passed, so a stalled sketch
+thread does not make them jump when it resumes.
+*/
+#define SERVO_GROUP_MAX_STEP_MICROSECONDS (4 * REFRESH_INTERVAL)
+
+/// Class used to move a group of servos smoothly with one PWM update per frame.
+/**
+Servo::write() moves a servo's pulse width straight to the target and writes each servo with
+its own PWM call.  The servo group instead moves each servo's pulse width toward its target no
+faster than its velocity limit, speeding up and slowing down no faster than its acceleration
+limit, so the servo arrives at the target at rest.
+
+The servos are moved once per frame of REFRESH_INTERVAL microseconds, the servo pulse period,
+by a task on the sketch thread's scheduler (see TaskSchedulerClass).  All the pulse widths that
+changed in the frame are written with one call to BoardPinsClass::setPwmDutyCycles(), so on
+boards with PCA9685 PWM chips each chip gets one I2C transaction per frame, however many of its
+servos moved, and chips with no changes get none.
+
+The group is not synchronized, so its methods should be called on the sketch thread, for
+example from setup(), loop() or a scheduler task.
+*/
+class ServoGroupClass
+{
+public:
+    /// Struct used to return group statistics.
+    typedef struct {
+        ULONGLONG frames;                   ///< Number of frames evaluated
+        ULONGLONG batches;                  ///< Number of frames that wrote pulse widths
+        ULONGLONG pulseWidthsWritten;       ///< Number of pulse widths written
+        ULONGLONG meanFrameMicroseconds;    ///< Average time taken by a frame, including the PWM update
+        ULONGLONG maxFrameMicroseconds;     ///< Longest time taken by a frame
+    } SERVO_GROUP_STATS, *PSERVO_GROUP_STATS;
+
+    /// Constructor.
+    ServoGroupClass() :
+        m_attached(0),
+        m_taskId(0),
+        m_lastFrame(0)
+    {
+        ZeroMemory(m_servos, sizeof(m_servos));
+        ZeroMemory(&m_counts, sizeof(m_counts));
+    }
+
+    /// Destructor.
+    virtual ~ServoGroupClass()
+    {
+    }
+
+    /// Start moving the servos once per frame.
+    HRESULT begin();
+
+    /// Stop moving the servos.  They hold their current pulse widths.
+    void end();
+
+    /// Add a servo to the group.
+    HRESULT attach(ULONG pin, ULONG & servo, ULONG minMicroseconds = MIN_PULSE_WIDTH, ULONG maxMicroseconds = MAX_PULSE_WIDTH);
+
+    /// Remove a servo from the group.  Its pulse width is left as it is.
+    HRESULT detach(ULONG servo);
+
+    /// Set the velocity and acceleration limits of a servo.
+    HRESULT setLimits(ULONG servo, ULONG microsecondsPerSecond, ULONG microsecondsPerSecondSquared);
+
+    /// Set the target angle of a servo, in degrees.
+    HRESULT write(ULONG servo, ULONG angle);
+
+    /// Set the target pulse width of a servo, in microseconds.
+    HRESULT writeMicroseconds(ULONG servo, ULONG microseconds);
+
+    /// Get the pulse width a servo is at now, in microseconds.
+    inline ULONG readMicroseconds(ULONG servo)
+    {
+        return (servo < SERVO_GROUP_MAX_SERVOS) ? m_servos[servo].sentMicroseconds : 0;
+    }
+
+    /// Determine whether a servo is still moving toward its target.
+    inline BOOL isMoving(ULONG servo)
+    {
+        return (servo < SERVO_GROUP_MAX_SERVOS) && ((m_attached >> servo) & 1) &&
+            ((m_servos[servo].position != m_servos[servo].target) || (m_servos[servo].velocity != 0.0));
+    }
+
+    /// Move the servos by one frame and write the pulse widths that changed.
+    HRESULT update();
+
+    /// Get the group statistics.
+    void getStats(SERVO_GROUP_STATS & stats);
+
+    /// Clear the group statistics.
+    inline void resetStats()
+    {
+        ZeroMemory(&m_counts, sizeof(m_counts));
+    }
+
+private:
+
+    /// Struct used to hold the state of one servo.
+    typedef struct {
+        ULONG pin;                  ///< The PWM pin, as passed to BoardPinsClass::setPwmDutyCycle()
+        ULONG minMicroseconds;      ///< Pulse width for 0 degrees
+        ULONG maxMicroseconds;      ///< Pulse width for 180 degrees
+        ULONG periodMicroseconds;   ///< The PWM period of the pin
+        double position;            ///< Pulse width now, in microseconds
+        double velocity;            ///< Rate of change of the pulse width, in microseconds per second
+        double target;              ///< Pulse width to move to, in microseconds
+        double maxVelocity;         ///< Velocity limit, or zero for none
+        double maxAcceleration;     ///< Acceleration limit, or zero for none
+        ULONG sentMicroseconds;     ///< Pulse width last written, or zero if none has been
+    } SERVO;
+
+    /// Struct used to accumulate group statistics.
+    typedef struct {
+        ULONGLONG frames;
+        ULONGLONG batches;
+        ULONGLONG pulseWidthsWritten;
+        ULONGLONG frameTicks;
+        ULONGLONG maxFrameTicks;
+    } COUNTS;
+
+    /// The servos.
+    SERVO m_servos[SERVO_GROUP_MAX_SERVOS];
+
+    /// Mask of the servos in the group.
+    ULONG m_attached;
+
+    /// The scheduler task that calls update(), or zero if there is none.
+    ULONG m_taskId;
+
+    /// micros64() time of the last frame, or zero before the first one.
+    ULONGLONG m_lastFrame;
+
+    /// Group statistics.
+    COUNTS m_counts;
+
+    /// Method to check a servo number.
+    inline HRESULT _checkServo(ULONG servo)
+    {
+        return ((servo < SERVO_GROUP_MAX_SERVOS) && ((m_attached >> servo) & 1)) ? S_OK : E_INVALIDARG;
+    }
+
+    /// Method to move one servo toward its target by one time step.
+    static void _moveServo(SERVO & servo, double seconds);
+
+    /// Entry point of the scheduler task.
+    static void _refreshTask();
+};
+
+/// The global servo group.
+__declspec(selectany) ServoGroupClass ServoGroup;
+
+inline void ServoGroupClass::_refreshTask()
+{
+    ServoGroup.update();
+}
+
+/**
+The first frame runs one REFRESH_INTERVAL after the call.
+\return HRESULT success or error code.
+*/
+inline HRESULT ServoGroupClass::begin()
+{
+    HRESULT hr = S_OK;
+
+    if (m_taskId == 0)
+    {
+        m_lastFrame = 0;
+        hr = TaskScheduler.addPeriodicTask(_refreshTask, REFRESH_INTERVAL, REFRESH_INTERVAL, 0, m_taskId);
+    }
+
+    return hr;
+}
+
+inline void ServoGroupClass::end()
+{
+    if (m_taskId != 0)
+    {
+        TaskScheduler.removeTask(m_taskId);
+        m_taskId = 0;
+    }
+}
+
+/**
+The pin is set to the servo pulse rate and locked to PWM use.  The servo's target is set to
+the middle of its range, DEFAULT_PULSE_WIDTH, but nothing is written until update() runs.
+The servo has no velocity or acceleration limit until setLimits() is called.
+\param[in] pin The number of the pin, as passed to analogWrite().
+\param[out] servo The number of the servo, used to refer to it in other calls.
+\param[in] minMicroseconds Pulse width for 0 degrees.
+\param[in] maxMicroseconds Pulse width for 180 degrees.
+\return HRESULT success or error code.
+\note This call throws an error if the pin can't be used for PWM output (see analogWrite()).
+*/
+inline HRESULT ServoGroupClass::attach(ULONG pin, ULONG & servo, ULONG minMicroseconds, ULONG maxMicroseconds)
+{
+    HRESULT hr = S_OK;
+    ULONG ioPin;
+    ULONG frequency;
+    ULONG index = 0;
+    BOOL locked = FALSE;
+    SERVO* newServo;
+
+    if ((minMicroseconds >= maxMicroseconds) || (maxMicroseconds >= (1000000 / SERVO_FREQUENCY_HZ)))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr) && !_BitScanForward(&index, ~m_attached))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_NO_MORE_ITEMS);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        ioPin = _AnalogOutPin(pin);
+        hr = g_pins.verifyPinFunction(ioPin, FUNC_PWM, BoardPinsClass::LOCK_FUNCTION);
+        locked = SUCCEEDED(hr);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = g_pins.setPwmFrequency(ioPin, SERVO_FREQUENCY_HZ);
+    }
+
+    if (FAILED(hr) && locked)
+    {
+        // Release the pin, so it can be attached again.
+        g_pins.verifyPinFunction(ioPin, FUNC_PWM, BoardPinsClass::UNLOCK_FUNCTION);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        frequency = g_pins.getActualPwmFrequency(ioPin);
+        if (frequency == 0)
+        {
+            frequency = SERVO_FREQUENCY_HZ;
+        }
+
+        newServo = &m_servos[index];
+        ZeroMemory(newServo, sizeof(*newServo));
+        newServo->pin = ioPin;
+        newServo->minMicroseconds = minMicroseconds;
+        newServo->maxMicroseconds = maxMicroseconds;
+        newServo->periodMicroseconds = 1000000 / frequency;
+        newServo->position = DEFAULT_PULSE_WIDTH;
+        newServo->target = DEFAULT_PULSE_WIDTH;
+
+        m_attached |= 1UL << index;
+        servo = index;
+    }
+
+    return hr;
+}
+
+/**
+\param[in] servo The number of the servo.
+\return HRESULT success or error code.
+*/
+inline HRESULT ServoGroupClass::detach(ULONG servo)
+{
+    HRESULT hr = _checkServo(servo);
+
+    if (SUCCEEDED(hr))
+    {
+        m_attached &= ~(1UL << servo);
+        hr = g_pins.verifyPinFunction(m_servos[servo].pin, FUNC_PWM, BoardPinsClass::UNLOCK_FUNCTION);
+    }
+
+    return hr;
+}
+
+/**
+\param[in] servo The number of the servo.
+\param[in] microsecondsPerSecond The fastest the pulse width may change, in microseconds per
+second, or zero for no limit.
+\param[in] microsecondsPerSecondSquared The fastest the rate of change of the pulse width may
+change, in microseconds per second per second, or zero for no limit.
+\return HRESULT success or error code.
+*/
+inline HRESULT ServoGroupClass::setLimits(ULONG servo, ULONG microsecondsPerSecond, ULONG microsecondsPerSecondSquared)
+{
+    HRESULT hr = _checkServo(servo);
+
+    if (SUCCEEDED(hr))
+    {
+        m_servos[servo].maxVelocity = microsecondsPerSecond;
+        m_servos[servo].maxAcceleration = microsecondsPerSecondSquared;
+    }
+
+    return hr;
+}
+
+/**
+As with Servo::write(), values below MIN_PULSE_WIDTH are taken as angles, 0 to 180 degrees,
+and larger values as pulse widths in microseconds.
+\param[in] servo The number of the servo.
+\param[in] angle The target angle or pulse width.
+\return HRESULT success or error code.
+*/
+inline HRESULT ServoGroupClass::write(ULONG servo, ULONG angle)
+{
+    HRESULT hr = _checkServo(servo);
+    ULONG minMicroseconds;
+    ULONG maxMicroseconds;
+
+    if (SUCCEEDED(hr))
+    {
+        if (angle >= MIN_PULSE_WIDTH)
+        {
+            hr = writeMicroseconds(servo, angle);
+        }
+        else
+        {
+            if (angle > 180)
+            {
+                angle = 180;
+            }
+            minMicroseconds = m_servos[servo].minMicroseconds;
+            maxMicroseconds = m_servos[servo].maxMicroseconds;
+            hr = writeMicroseconds(servo, minMicroseconds + ((((maxMicroseconds - minMicroseconds) * angle) + 90) / 180));
+        }
+    }
+
+    return hr;
+}
+
+/**
+The servo starts moving toward the new target at the next frame.  The target is limited to
+the servo's pulse width range.
+\param[in] servo The number of the servo.
+\param[in] microseconds The target pulse width.
+\return HRESULT success or error code.
+*/
+inline HRESULT ServoGroupClass::writeMicroseconds(ULONG servo, ULONG microseconds)
+{
+    HRESULT hr = _checkServo(servo);
+    SERVO* target;
+
+    if (SUCCEEDED(hr))
+    {
+        target = &m_servos[servo];
+        if (microseconds < target->minMicroseconds)
+        {
+            microseconds = target->minMicroseconds;
+        }
+        if (microseconds > target->maxMicroseconds)
+        {
+            microseconds = target->maxMicroseconds;
+        }
+        target->target = microseconds;
+    }
+
+    return hr;
+}
+
+/**
+Each servo accelerates toward its target until it reaches its velocity limit, then
+decelerates as late as its acceleration limit allows so it stops at the target.  If it can't
+stop in time (because the target moved toward it), it passes the target and comes back.
+\param[in,out] servo The servo to move.
+\param[in] seconds The time step.
+*/
+inline void ServoGroupClass::_moveServo(SERVO & servo, double seconds)
+{
+    double distance = servo.target - servo.position;
+    double direction = (distance >= 0.0) ? 1.0 : -1.0;
+    double speed;
+    double stopSpeed;
+    double stopDistance;
+    double halfStep;
+    double newVelocity;
+
+    if (servo.maxVelocity == 0.0)
+    {
+        // No limit: jump to the target, like Servo::write().
+        servo.position = servo.target;
+        servo.velocity = 0.0;
+        return;
+    }
+
+    // The fastest speed toward the target from which the servo can still stop at it.  The
+    // step moves at the average of the old and new velocities, then stopping from speed v
+    // takes v^2 / 2a + v * dt / 2, so v = sqrt((a * dt / 2)^2 + 2 * a * d) - a * dt / 2, where
+    // d is the distance left after the old velocity's half of the step.
+    speed = servo.maxVelocity;
+    if (servo.maxAcceleration != 0.0)
+    {
+        halfStep = (servo.maxAcceleration * seconds) / 2.0;
+        stopDistance = (distance - ((servo.velocity * seconds) / 2.0)) * direction;
+        stopSpeed = 0.0;
+        if (stopDistance > 0.0)
+        {
+            stopSpeed = sqrt((halfStep * halfStep) + (2.0 * servo.maxAcceleration * stopDistance)) - halfStep;
+        }
+        if (stopSpeed < speed)
+        {
+            speed = stopSpeed;
+        }
+    }
+    newVelocity = speed * direction;
+
+    // Change the velocity no faster than the acceleration limit allows.
+    if (servo.maxAcceleration != 0.0)
+    {
+        if (newVelocity > (servo.velocity + (servo.maxAcceleration * seconds)))
+        {
+            newVelocity = servo.velocity + (servo.maxAcceleration * seconds);
+        }
+        if (newVelocity < (servo.velocity - (servo.maxAcceleration * seconds)))
+        {
+            newVelocity = servo.velocity - (servo.maxAcceleration * seconds);
+        }
+    }
+
+    // Move, using the average velocity over the step.  A servo that reaches the target
+    // slowly enough to stop within one step stops there rather than overshooting.
+    servo.position += ((servo.velocity + newVelocity) / 2.0) * seconds;
+    servo.velocity = newVelocity;
+    if ((((servo.target - servo.position) * direction) <= 0.0) &&
+        ((servo.maxAcceleration == 0.0) || (fabs(servo.velocity) <= (servo.maxAcceleration * seconds))))
+    {
+        servo.position = servo.target;
+        servo.velocity = 0.0;
+    }
+}
+
+/**
+update() is called by the scheduler task started by begin(), but it can also be called
+directly, for example by a sketch that does not use begin().  The time step is the time since
+the last call, up to SERVO_GROUP_MAX_STEP_MICROSECONDS.
+\return HRESULT success or error code.
+*/
+inline HRESULT ServoGroupClass::update()
+{
+    HRESULT hr = S_OK;
+    ULONGLONG start = g_hiResClock.now();
+    ULONGLONG now = _WindowsTime.micros64();
+    ULONGLONG step;
+    ULONG pins[SERVO_GROUP_MAX_SERVOS];
+    ULONG dutyCycles[SERVO_GROUP_MAX_SERVOS];
+    ULONG count = 0;
+    ULONG attached = m_attached;
+    ULONG index;
+    ULONG microseconds;
+    ULONGLONG frameTicks;
+    SERVO* servo;
+
+    step = (m_lastFrame == 0) ? REFRESH_INTERVAL : (now - m_lastFrame);
+    if (step > SERVO_GROUP_MAX_STEP_MICROSECONDS)
+    {
+        step = SERVO_GROUP_MAX_STEP_MICROSECONDS;
+    }
+    m_lastFrame = now;
+
+    while (_BitScanForward(&index, attached))
+    {
+        attached &= attached - 1;
+        servo = &m_servos[index];
+
+        _moveServo(*servo, step / 1000000.0);
+
+        // Only pulse widths that changed by a whole microsecond are written.
+        microseconds = (ULONG)(servo->position + 0.5);
+        if (microseconds != servo->sentMicroseconds)
+        {
+            pins[count] = servo->pin;
+            dutyCycles[count] = (ULONG)(((ULONGLONG)microseconds << 32) / servo->periodMicroseconds);
+            servo->sentMicroseconds = microseconds;
+            count++;
+        }
+    }
+
+    if (count > 0)
+    {
+        hr = g_pins.setPwmDutyCycles(pins, dutyCycles, count);
+        m_counts.batches++;
+        m_counts.pulseWidthsWritten += count;
+    }
+
+    frameTicks = g_hiResClock.now() - start;
+    m_counts.frames++;
+    m_counts.frameTicks += frameTicks;
+    if (frameTicks > m_counts.maxFrameTicks)
+    {
+        m_counts.maxFrameTicks = frameTicks;
+    }
+
+    return hr;
+}
+
+/**
+\param[out] stats The statistics gathered since the group was created or they were cleared.
+*/
+inline void ServoGroupClass::getStats(SERVO_GROUP_STATS & stats)
+{
+    stats.frames = m_counts.frames;
+    stats.batches = m_counts.batches;
+    stats.pulseWidthsWritten = m_counts.pulseWidthsWritten;
+    stats.meanFrameMicroseconds = 0;
+    if (m_counts.frames > 0)
+    {
+        stats.meanFrameMicroseconds = g_hiResClock.ticksToMicroseconds(m_counts.frameTicks / m_counts.frames);
+    }
+    stats.maxFrameMicroseconds = g_hiResClock.ticksToMicroseconds(m_counts.maxFrameTicks);
+}
+
+#endif  // _SERVO_GROUP_H_
@@ -0,0 +1,838 @@
+// Copyright (c) Microsoft Open Technologies, Inc.  All rights reserved.  
+// Licensed under the BSD 2-Clause License.  
+// See License.txt in the project root for license information.
+
+#ifndef _SOFT_PWM_H_
+#define _SOFT_PWM_H_
+
+#include <Windows.h>
+#include <algorithm>
+#include <vector>
+
+#include "ArduinoCommon.h"
+#include "BoardPins.h"
+#include "GpioController.h"
+#include "HiResTimer.h"
+
+/// The maximum number of pins the software PWM engine can drive.
+#define SOFT_PWM_MAX_CHANNELS 32
+
+/// The highest PWM frequency that can be set on a channel.
+#define SOFT_PWM_MAX_FREQUENCY 10000
+
+/// The length of the time window the edge schedule is computed for.
+#define SOFT_PWM_FRAME_MICROSECONDS 2000
+
+/// Edges less than this far apart are written together.
+#define SOFT_PWM_MERGE_NANOSECONDS 1000
+
+/// Class used to generate PWM outputs on ordinary digital I/O pins.
+/**
+One high priority thread drives up to SOFT_PWM_MAX_CHANNELS pins, each with its own frequency
+and duty cycle.  The engine works in frames of SOFT_PWM_FRAME_MICROSECONDS.  At the start of
+each frame it lists every rising and falling edge due in the frame, sorts them by time, and
+merges edges less than SOFT_PWM_MERGE_NANOSECONDS apart into a single write.  It then sleeps
+until shortly before each write and spins until it is due.
+
+On a bare PI2 each write is one store to the GPSET0 register and one to GPCLR0, so all the
+pins that change together change at the same instant, and the cost of a write does not depend
+on the number of pins.  Pins above GPIO 31, and all pins on other boards, are written one at a
+time with BoardPinsClass::setPinState(), so on boards where digital I/O goes through an I2C
+port expander the achievable frequency is much lower.
+
+Duty cycle and frequency changes take effect at the start of the channel's next period, so
+they never produce a runt pulse.  Edge jitter (the time from when an edge was due to when it
+was written) and the CPU time used by the engine are reported by getStats().
+*/
+class SoftPwmClass
+{
+public:
+    /// Struct used to return engine statistics.
+    typedef struct {
+        ULONGLONG frames;                   ///< Number of frames scheduled
+        ULONGLONG edges;                    ///< Number of channel edges written
+        ULONGLONG writes;                   ///< Number of writes used for those edges
+        ULONGLONG overruns;                 ///< Times the engine fell a whole frame behind and restarted the channels
+        ULONGLONG meanJitterNanoseconds;    ///< Average time a write was made after it was due
+        ULONGLONG maxJitterNanoseconds;     ///< Longest time a write was made after it was due
+        ULONGLONG cpuMicroseconds;          ///< CPU time used by the engine thread
+        ULONGLONG elapsedMicroseconds;      ///< Time over which the statistics were gathered
+        ULONG channels;                     ///< Number of pins being driven
+    } SOFT_PWM_STATS, *PSOFT_PWM_STATS;
+
+    /// Constructor.
+    SoftPwmClass() :
+        m_activeChannels(0),
+        m_slowChannels(0),
+        m_hThread(NULL),
+        m_hChannelsChanged(NULL),
+        m_stopping(FALSE),
+        m_error(S_OK),
+        m_frameStart(0),
+        m_framesBuilt(0)
+    {
+        InitializeCriticalSection(&m_lock);
+        ZeroMemory(m_channels, sizeof(m_channels));
+        ZeroMemory(&m_counts, sizeof(m_counts));
+        m_frameTicks = g_hiResClock.microsecondsToTicks(SOFT_PWM_FRAME_MICROSECONDS);
+        m_mergeTicks = g_hiResClock.nanosecondsToTicks(SOFT_PWM_MERGE_NANOSECONDS);
+        m_statsStart = g_hiResClock.now();
+        m_statsCpuStart = 0;
+    }
+
+    /// Destructor.
+    /**
+    A running engine thread is told to stop and waited for, with a time limit (see
+    HiResWaitTimerClass::waitForThreadExit()), before the frame buffers it uses are freed.
+    The pins are not released, since g_pins can't safely be called during static
+    destruction; call end() first for a full shutdown.  If the thread is still exiting when
+    the wait times out, the handles and the lock are left for the process to clean up.
+    */
+    virtual ~SoftPwmClass()
+    {
+        m_stopping = TRUE;
+        if (m_hThread != NULL)
+        {
+            SetEvent(m_hChannelsChanged);
+            if (!HiResWaitTimerClass::waitForThreadExit(m_hThread))
+            {
+                return;
+            }
+        }
+
+        if (m_hChannelsChanged != NULL)
+        {
+            CloseHandle(m_hChannelsChanged);
+        }
+        m_waitTimer.close();
+        DeleteCriticalSection(&m_lock);
+    }
+
+    /// Start generating PWM on a pin.
+    HRESULT attach(ULONG pin, ULONG frequencyHz, ULONG dutyCycle);
+
+    /// Set the duty cycle of a pin.
+    HRESULT setDutyCycle(ULONG pin, ULONG dutyCycle);
+
+    /// Set the PWM frequency of a pin.
+    HRESULT setFrequency(ULONG pin, ULONG frequencyHz);
+
+    /// Stop generating PWM on a pin and leave it LOW.
+    HRESULT detach(ULONG pin);
+
+    /// Stop generating PWM on all pins, leave them LOW, and stop the engine thread.
+    void end();
+
+    /// Get the first error encountered by the engine thread, if any.
+    inline HRESULT getError()
+    {
+        return m_error;
+    }
+
+    /// Get the engine statistics.
+    void getStats(SOFT_PWM_STATS & stats);
+
+    /// Clear the engine statistics.
+    void resetStats();
+
+private:
+
+    /// Struct used to hold the state of one channel.
+    typedef struct {
+        ULONG pin;                  ///< The pin driven by the channel
+        ULONG portMask;             ///< Mask of the pin's bit in GPSET0/GPCLR0, or zero if it is written on its own
+        ULONGLONG periodTicks;      ///< Period in use, in timer ticks
+        ULONGLONG highTicks;        ///< High time in use, in timer ticks
+        ULONGLONG newPeriodTicks;   ///< Period to use from the start of the next period
+        ULONGLONG newHighTicks;     ///< High time to use from the start of the next period
+        ULONGLONG periodStart;      ///< Timer reading at the start of the current period
+        ULONGLONG nextEdge;         ///< Timer reading of the next edge, or zero to start at the next frame
+        BOOL nextIsFall;            ///< TRUE if the next edge is the fall in the current period
+        BOOL high;                  ///< The level last written to the pin
+    } CHANNEL;
+
+    /// Struct used to hold one channel edge while the schedule is sorted.
+    typedef struct {
+        ULONGLONG time;             ///< Timer reading when the edge is due
+        ULONG channel;              ///< The channel number
+        BOOL rise;                  ///< TRUE for a rising edge
+    } EDGE;
+
+    /// Struct used to hold one write of the schedule.
+    typedef struct {
+        ULONGLONG time;             ///< Timer reading when the write is due
+        ULONG setChannels;          ///< Mask of channels going HIGH
+        ULONG clearChannels;        ///< Mask of channels going LOW
+        ULONG setBits;              ///< Mask of GPSET0 bits for the channels going HIGH
+        ULONG clearBits;            ///< Mask of GPCLR0 bits for the channels going LOW
+    } WRITE;
+
+    /// Struct used to accumulate engine statistics in timer ticks.
+    typedef struct {
+        ULONGLONG frames;
+        ULONGLONG edges;
+        ULONGLONG writes;
+        ULONGLONG overruns;
+        ULONGLONG jitterTicks;
+        ULONGLONG maxJitterTicks;
+    } COUNTS;
+
+    /// Lock that protects the channel table.
+    CRITICAL_SECTION m_lock;
+
+    /// The channel table.  Bit N of a channel mask refers to m_channels[N].
+    CHANNEL m_channels[SOFT_PWM_MAX_CHANNELS];
+
+    /// Mask of the channels in use.
+    ULONG m_activeChannels;
+
+    /// Mask of the channels whose pins are written one at a time.
+    ULONG m_slowChannels;
+
+    /// The edges of the frame being scheduled.  Only used by the engine thread.
+    std::vector<EDGE> m_edges;
+
+    /// The writes of the frame being generated.  Only used by the engine thread.
+    std::vector<WRITE> m_writes;
+
+    /// Handle of the engine thread.
+    HANDLE m_hThread;
+
+    /// Event signalled when a channel is attached, to wake an idle engine thread.
+    HANDLE m_hChannelsChanged;
+
+    /// Timer the engine thread waits on between writes.
+    HiResWaitTimerClass m_waitTimer;
+
+    /// Set to TRUE to ask the engine thread to exit.
+    volatile BOOL m_stopping;
+
+    /// First error encountered on the engine thread.
+    HRESULT m_error;
+
+    /// Frame length in timer ticks.
+    ULONGLONG m_frameTicks;
+
+    /// Greatest distance between edges that are written together, in timer ticks.
+    ULONGLONG m_mergeTicks;
+
+    /// Timer reading at the start of the frame being scheduled.
+    ULONGLONG m_frameStart;
+
+    /// Count of frames scheduled.  Only changed by the engine thread, with m_lock held.
+    volatile ULONGLONG m_framesBuilt;
+
+    /// Engine statistics.  Changed and read with m_lock held.
+    COUNTS m_counts;
+
+    /// Timer reading and engine thread CPU time (in microseconds) when the statistics were last cleared.
+    ULONGLONG m_statsStart;
+    ULONGLONG m_statsCpuStart;
+
+    /// Entry point of the engine thread.
+    static DWORD WINAPI _engineThread(LPVOID param)
+    {
+        ((SoftPwmClass*)param)->_runEngine();
+        return 0;
+    }
+
+    /// Method to generate the frames.
+    void _runEngine();
+
+    /// Method to compute the writes for one frame.
+    void _buildFrame(ULONGLONG frameEnd);
+
+    /// Method to start the engine thread if it is not running.
+    HRESULT _startEngine();
+
+    /// Method to find the channel driving a pin.
+    inline ULONG _findChannel(ULONG pin)
+    {
+        ULONG i;
+
+        for (i = 0; i < SOFT_PWM_MAX_CHANNELS; i++)
+        {
+            if (((m_activeChannels >> i) & 1) && (m_channels[i].pin == pin))
+            {
+                break;
+            }
+        }
+        return i;
+    }
+
+    /// Method to convert a frequency in Hz to a period in timer ticks.
+    static inline ULONGLONG _periodTicks(ULONG frequencyHz)
+    {
+        return (g_hiResClock.getFrequency() + (frequencyHz / 2)) / frequencyHz;
+    }
+
+    /// Method to convert a duty cycle (a fraction of 2^32) to a high time in timer ticks.
+    static inline ULONGLONG _highTicks(ULONGLONG periodTicks, ULONG dutyCycle)
+    {
+        return ((periodTicks * dutyCycle) + 0x80000000ULL) >> 32;
+    }
+
+    /// Method to write one entry of the schedule to the pins.
+    inline HRESULT _write(const WRITE & write)
+    {
+        HRESULT hr = S_OK;
+        ULONG slow;
+        ULONG channel;
+
+#if defined(_M_ARM)
+        if ((write.setBits | write.clearBits) != 0)
+        {
+            hr = g_bcmGpio.setPortBits(write.setBits, write.clearBits);
+        }
+#endif // defined(_M_ARM)
+
+        slow = (write.setChannels | write.clearChannels) & m_slowChannels;
+        while (SUCCEEDED(hr) && _BitScanForward(&channel, slow))
+        {
+            slow &= slow - 1;
+            hr = g_pins.setPinState(m_channels[channel].pin, ((write.setChannels >> channel) & 1) ? HIGH : LOW);
+        }
+
+        return hr;
+    }
+};
+
+/// The global software PWM engine.
+__declspec(selectany) SoftPwmClass SoftPwm;
+
+/**
+The pin is configured as a digital output and locked to digital I/O use until it is
+detached.  If the pin is already attached, its frequency and duty cycle are changed.
+The lookup, the pin setup and the insert are done in one critical section, so concurrent
+calls for the same pin can't attach it twice, and the engine is only started once.
+\param[in] pin The number of the pin.
+\param[in] frequencyHz The PWM frequency, range 1 to SOFT_PWM_MAX_FREQUENCY.
+\param[in] dutyCycle The high time as a fraction of 2^32 (as for setPwmDutyCycle()).
+\return HRESULT success or error code.
+*/
+inline HRESULT SoftPwmClass::attach(ULONG pin, ULONG frequencyHz, ULONG dutyCycle)
+{
+    HRESULT hr = S_OK;
+    ULONG portMask = 0;
+    ULONG channel;
+    CHANNEL* ch;
+    BOOL locked = FALSE;
+
+    if ((frequencyHz == 0) || (frequencyHz > SOFT_PWM_MAX_FREQUENCY))
+    {
+        return E_INVALIDARG;
+    }
+
+    EnterCriticalSection(&m_lock);
+
+    channel = _findChannel(pin);
+    if (channel < SOFT_PWM_MAX_CHANNELS)
+    {
+        hr = setFrequency(pin, frequencyHz);
+        if (SUCCEEDED(hr))
+        {
+            hr = setDutyCycle(pin, dutyCycle);
+        }
+        LeaveCriticalSection(&m_lock);
+        return hr;
+    }
+
+    if (!_BitScanForward(&channel, ~m_activeChannels) || (channel >= SOFT_PWM_MAX_CHANNELS))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_NO_MORE_ITEMS);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = g_pins.verifyPinFunction(pin, FUNC_DIO, BoardPinsClass::LOCK_FUNCTION);
+        locked = SUCCEEDED(hr);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = g_pins.setPinMode(pin, DIRECTION_OUT, FALSE);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = g_pins.setPinState(pin, LOW);
+    }
+
+#if defined(_M_ARM)
+    // On a bare PI2, pins on GPIO 00-31 are written with port-wide set and clear writes.
+    BoardPinsClass::BOARD_TYPE board;
+    ULONG portBit;
+
+    if (SUCCEEDED(hr))
+    {
+        hr = g_pins.getBoardType(board);
+    }
+
+    if (SUCCEEDED(hr) && (board == BoardPinsClass::PI2_BARE))
+    {
+        hr = g_pins.getPinPortBit(pin, portBit);
+        if (SUCCEEDED(hr) && (portBit < 32))
+        {
+            portMask = 1UL << portBit;
+        }
+    }
+#endif // defined(_M_ARM)
+
+    if (SUCCEEDED(hr))
+    {
+        hr = _startEngine();
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        ch = &m_channels[channel];
+        ZeroMemory(ch, sizeof(*ch));
+        ch->pin = pin;
+        ch->portMask = portMask;
+        ch->newPeriodTicks = _periodTicks(frequencyHz);
+        ch->newHighTicks = _highTicks(ch->newPeriodTicks, dutyCycle);
+
+        m_activeChannels |= 1UL << channel;
+        if (portMask == 0)
+        {
+            m_slowChannels |= 1UL << channel;
+        }
+
+        SetEvent(m_hChannelsChanged);
+    }
+    else if (locked)
+    {
+        g_pins.verifyPinFunction(pin, FUNC_DIO, BoardPinsClass::UNLOCK_FUNCTION);
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    return hr;
+}
+
+/**
+The new duty cycle takes effect at the start of the pin's next PWM period.
+\param[in] pin The number of the pin.  It must have been attached.
+\param[in] dutyCycle The high time as a fraction of 2^32.  Zero leaves the pin LOW, and
+0xFFFFFFFF leaves it HIGH.
+\return HRESULT success or error code.
+*/
+inline HRESULT SoftPwmClass::setDutyCycle(ULONG pin, ULONG dutyCycle)
+{
+    HRESULT hr = S_OK;
+    ULONG channel;
+
+    EnterCriticalSection(&m_lock);
+
+    channel = _findChannel(pin);
+    if (channel < SOFT_PWM_MAX_CHANNELS)
+    {
+        m_channels[channel].newHighTicks = _highTicks(m_channels[channel].newPeriodTicks, dutyCycle);
+    }
+    else
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    return hr;
+}
+
+/**
+The new frequency takes effect at the start of the pin's next PWM period.  The duty cycle, as
+a fraction of the period, is kept.
+\param[in] pin The number of the pin.  It must have been attached.
+\param[in] frequencyHz The PWM frequency, range 1 to SOFT_PWM_MAX_FREQUENCY.
+\return HRESULT success or error code.
+*/
+inline HRESULT SoftPwmClass::setFrequency(ULONG pin, ULONG frequencyHz)
+{
+    HRESULT hr = S_OK;
+    ULONG channel;
+    ULONGLONG periodTicks;
+    CHANNEL* ch;
+
+    if ((frequencyHz == 0) || (frequencyHz > SOFT_PWM_MAX_FREQUENCY))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        EnterCriticalSection(&m_lock);
+
+        channel = _findChannel(pin);
+        if (channel < SOFT_PWM_MAX_CHANNELS)
+        {
+            ch = &m_channels[channel];
+            periodTicks = _periodTicks(frequencyHz);
+            ch->newHighTicks = (ch->newPeriodTicks == 0) ? 0 :
+                ((ch->newHighTicks * periodTicks) + (ch->newPeriodTicks / 2)) / ch->newPeriodTicks;
+            ch->newPeriodTicks = periodTicks;
+        }
+        else
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+        }
+
+        LeaveCriticalSection(&m_lock);
+    }
+
+    return hr;
+}
+
+/**
+The pin is set LOW once the engine has stopped writing to it, which can take up to one frame,
+and is unlocked from digital I/O use.
+\param[in] pin The number of the pin.
+\return HRESULT success or error code.
+*/
+inline HRESULT SoftPwmClass::detach(ULONG pin)
+{
+    HRESULT hr = S_OK;
+    ULONG channel;
+    ULONGLONG framesBuilt;
+
+    EnterCriticalSection(&m_lock);
+
+    channel = _findChannel(pin);
+    if (channel < SOFT_PWM_MAX_CHANNELS)
+    {
+        m_activeChannels &= ~(1UL << channel);
+        m_slowChannels &= ~(1UL << channel);
+    }
+    else
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+    }
+    framesBuilt = m_framesBuilt;
+
+    LeaveCriticalSection(&m_lock);
+
+    if (SUCCEEDED(hr))
+    {
+        // The frame being generated may still write the pin.  The next one will not.
+        while ((m_hThread != NULL) && !m_stopping && (m_framesBuilt == framesBuilt))
+        {
+            SetEvent(m_hChannelsChanged);
+            Sleep(1);
+        }
+
+        hr = g_pins.setPinState(pin, LOW);
+        g_pins.verifyPinFunction(pin, FUNC_DIO, BoardPinsClass::UNLOCK_FUNCTION);
+    }
+
+    return hr;
+}
+
+inline void SoftPwmClass::end()
+{
+    ULONG active;
+    ULONG channel;
+
+    m_stopping = TRUE;
+
+    if (m_hThread != NULL)
+    {
+        SetEvent(m_hChannelsChanged);
+        WaitForSingleObject(m_hThread, INFINITE);
+        CloseHandle(m_hThread);
+        m_hThread = NULL;
+    }
+
+    if (m_hChannelsChanged != NULL)
+    {
+        CloseHandle(m_hChannelsChanged);
+        m_hChannelsChanged = NULL;
+    }
+
+    m_waitTimer.close();
+
+    EnterCriticalSection(&m_lock);
+    active = m_activeChannels;
+    m_activeChannels = 0;
+    m_slowChannels = 0;
+    LeaveCriticalSection(&m_lock);
+
+    while (_BitScanForward(&channel, active))
+    {
+        active &= active - 1;
+        g_pins.setPinState(m_channels[channel].pin, LOW);
+        g_pins.verifyPinFunction(m_channels[channel].pin, FUNC_DIO, BoardPinsClass::UNLOCK_FUNCTION);
+    }
+}
+
+/**
+\param[out] stats The statistics gathered since the engine started or they were cleared.
+*/
+inline void SoftPwmClass::getStats(SOFT_PWM_STATS & stats)
+{
+    ULONG active;
+
+    EnterCriticalSection(&m_lock);
+
+    active = m_activeChannels;
+    stats.frames = m_counts.frames;
+    stats.edges = m_counts.edges;
+    stats.writes = m_counts.writes;
+    stats.overruns = m_counts.overruns;
+    stats.meanJitterNanoseconds = 0;
+    if (m_counts.writes > 0)
+    {
+        stats.meanJitterNanoseconds = g_hiResClock.ticksToNanoseconds(m_counts.jitterTicks) / m_counts.writes;
+    }
+    stats.maxJitterNanoseconds = g_hiResClock.ticksToNanoseconds(m_counts.maxJitterTicks);
+    stats.cpuMicroseconds = HiResWaitTimerClass::threadCpuMicroseconds(m_hThread) - m_statsCpuStart;
+    stats.elapsedMicroseconds = g_hiResClock.ticksToMicroseconds(g_hiResClock.now() - m_statsStart);
+
+    LeaveCriticalSection(&m_lock);
+
+    stats.channels = 0;
+    while (active != 0)
+    {
+        active &= active - 1;
+        stats.channels++;
+    }
+}
+
+inline void SoftPwmClass::resetStats()
+{
+    EnterCriticalSection(&m_lock);
+    ZeroMemory(&m_counts, sizeof(m_counts));
+    m_statsStart = g_hiResClock.now();
+    m_statsCpuStart = HiResWaitTimerClass::threadCpuMicroseconds(m_hThread);
+    LeaveCriticalSection(&m_lock);
+}
+
+inline HRESULT SoftPwmClass::_startEngine()
+{
+    HRESULT hr = S_OK;
+
+    if (m_hThread != NULL)
+    {
+        return S_OK;
+    }
+
+    m_stopping = FALSE;
+    m_error = S_OK;
+
+    m_hChannelsChanged = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (m_hChannelsChanged == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = m_waitTimer.open();
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        m_edges.reserve(SOFT_PWM_MAX_CHANNELS * 4);
+        m_writes.reserve(SOFT_PWM_MAX_CHANNELS * 4);
+        m_frameStart = 0;
+
+        // Clear the statistics before the thread starts counting.
+        resetStats();
+        hr = HiResWaitTimerClass::startThread(_engineThread, this, m_hThread);
+    }
+
+    if (FAILED(hr))
+    {
+        m_waitTimer.close();
+        if (m_hChannelsChanged != NULL)
+        {
+            CloseHandle(m_hChannelsChanged);
+            m_hChannelsChanged = NULL;
+        }
+    }
+
+    return hr;
+}
+
+/**
+Each channel's edges are generated from its own period start, so channels at different
+frequencies drift past each other freely.  Edges that fall within m_mergeTicks of the first
+edge of a write are added to it, unless their channel already changes in that write.
+\param[in] frameEnd Timer reading at the end of the frame.  Edges before it are scheduled.
+*/
+inline void SoftPwmClass::_buildFrame(ULONGLONG frameEnd)
+{
+    ULONG active = m_activeChannels;
+    ULONG channel;
+    ULONG mask;
+    EDGE edge;
+    CHANNEL* ch;
+    WRITE* write;
+    size_t i;
+
+    m_edges.clear();
+    m_writes.clear();
+
+    while (_BitScanForward(&channel, active))
+    {
+        active &= active - 1;
+        ch = &m_channels[channel];
+
+        // A new channel, or one left behind by an overrun, starts a period with this frame.
+        if (ch->nextEdge < m_frameStart)
+        {
+            ch->nextEdge = m_frameStart;
+            ch->nextIsFall = FALSE;
+        }
+
+        while (ch->nextEdge < frameEnd)
+        {
+            edge.time = ch->nextEdge;
+            edge.channel = channel;
+
+            if (!ch->nextIsFall)
+            {
+                // Start of a period: pick up any new frequency or duty cycle.
+                ch->periodTicks = ch->newPeriodTicks;
+                ch->highTicks = ch->newHighTicks;
+                ch->periodStart = ch->nextEdge;
+
+                edge.rise = (ch->highTicks != 0);
+                if ((ch->highTicks != 0) && (ch->highTicks < ch->periodTicks))
+                {
+                    ch->nextEdge = ch->periodStart + ch->highTicks;
+                    ch->nextIsFall = TRUE;
+                }
+                else
+                {
+                    ch->nextEdge = ch->periodStart + ch->periodTicks;
+                }
+            }
+            else
+            {
+                edge.rise = FALSE;
+                ch->nextEdge = ch->periodStart + ch->periodTicks;
+                ch->nextIsFall = FALSE;
+            }
+
+            // A period that starts at the level the pin is already at needs no write.
+            if (edge.rise != ch->high)
+            {
+                ch->high = edge.rise;
+                m_edges.push_back(edge);
+            }
+        }
+    }
+
+    std::sort(m_edges.begin(), m_edges.end(),
+        [](const EDGE & a, const EDGE & b) { return a.time < b.time; });
+
+    write = nullptr;
+    for (i = 0; i < m_edges.size(); i++)
+    {
+        mask = 1UL << m_edges[i].channel;
+
+        if ((write == nullptr) || ((m_edges[i].time - write->time) > m_mergeTicks) ||
+            (((write->setChannels | write->clearChannels) & mask) != 0))
+        {
+            m_writes.push_back(WRITE());
+            write = &m_writes.back();
+            ZeroMemory(write, sizeof(*write));
+            write->time = m_edges[i].time;
+        }
+
+        if (m_edges[i].rise)
+        {
+            write->setChannels |= mask;
+            write->setBits |= m_channels[m_edges[i].channel].portMask;
+        }
+        else
+        {
+            write->clearChannels |= mask;
+            write->clearBits |= m_channels[m_edges[i].channel].portMask;
+        }
+    }
+
+    m_framesBuilt++;
+}
+
+inline void SoftPwmClass::_runEngine()
+{
+    HRESULT hr = S_OK;
+    ULONGLONG frameEnd;
+    ULONGLONG now;
+    ULONGLONG lateTicks;
+    ULONGLONG jitterTicks;
+    ULONGLONG maxJitterTicks;
+    BOOL idle;
+    size_t i;
+
+    // Start the first frame one frame from now, so its first edges are not already late.
+    m_frameStart = g_hiResClock.now() + m_frameTicks;
+
+    while (!m_stopping && SUCCEEDED(hr))
+    {
+        // Schedule each frame at most half a frame ahead, so changes are picked up promptly
+        // and frames with no edges don't run ahead of time.
+        m_waitTimer.sleepUntil(m_frameStart - (m_frameTicks / 2));
+        frameEnd = m_frameStart + m_frameTicks;
+
+        EnterCriticalSection(&m_lock);
+        _buildFrame(frameEnd);
+        idle = (m_activeChannels == 0);
+        m_counts.frames++;
+        m_counts.edges += m_edges.size();
+        LeaveCriticalSection(&m_lock);
+
+        // Jitter is totalled over the frame and added to the statistics once, so the lock
+        // is not taken between writes.
+        jitterTicks = 0;
+        maxJitterTicks = 0;
+        for (i = 0; (i < m_writes.size()) && !m_stopping && SUCCEEDED(hr); i++)
+        {
+            now = m_waitTimer.waitUntil(m_writes[i].time);
+            hr = _write(m_writes[i]);
+
+            lateTicks = now - m_writes[i].time;
+            jitterTicks += lateTicks;
+            if (lateTicks > maxJitterTicks)
+            {
+                maxJitterTicks = lateTicks;
+            }
+        }
+
+        EnterCriticalSection(&m_lock);
+        m_counts.writes += i;
+        m_counts.jitterTicks += jitterTicks;
+        if (maxJitterTicks > m_counts.maxJitterTicks)
+        {
+            m_counts.maxJitterTicks = maxJitterTicks;
+        }
+        LeaveCriticalSection(&m_lock);
+
+        if (idle)
+        {
+            // Nothing to generate until a channel is attached.
+            WaitForSingleObject(m_hChannelsChanged, INFINITE);
+            m_frameStart = g_hiResClock.now() + m_frameTicks;
+            continue;
+        }
+
+        // If the engine has fallen a whole frame behind, restart every channel's period rather
+        // than trying to catch up with a burst of late edges.
+        m_frameStart = frameEnd;
+        now = g_hiResClock.now();
+        if (now > frameEnd)
+        {
+            EnterCriticalSection(&m_lock);
+            m_counts.overruns++;
+            LeaveCriticalSection(&m_lock);
+            m_frameStart = now + m_mergeTicks;
+        }
+    }
+
+    if (FAILED(hr))
+    {
+        m_error = hr;
+    }
+}
+
+#endif  // _SOFT_PWM_H_
@@ -0,0 +1,791 @@
+// Copyright (c) Microsoft Open Technologies, Inc.  All rights reserved.  
+// Licensed under the BSD 2-Clause License.  
+// See License.txt in the project root for license information.
+
+#ifndef _SPI_BUS_MANAGER_H_
+#define _SPI_BUS_MANAGER_H_
+
+#include <Windows.h>
+
+#include "ArduinoCommon.h"
+#include "ErrorCodes.h"
+#include "SpiController.h"
+#include "QuarkSpiController.h"
+#include "BtSpiController.h"
+#include "BcmSpiController.h"
+#include "BoardPins.h"
+#include "HiResTimer.h"
+
+/// The maximum number of devices that can be registered on one SPI bus.
+#define SPI_BUS_MAX_DEVICES 8
+
+/// Device ID value used to indicate no device.
+#define SPI_BUS_NO_DEVICE 0xFFFFFFFF
+
+/// Chip select pin value used for devices whose chip select is not managed by the bus.
+#define SPI_BUS_NO_CS_PIN 0xFFFFFFFF
+
+/// Class used to share one SPI controller between all the devices attached to an SPI bus.
+/**
+This class owns the only SPI controller object for its bus.  Each driver registers its device
+with the chip select pin and bus settings the device needs, then brackets each exchange with
+the device in beginTransaction()/endTransaction().  Transactions from different threads are
+serialized, and the controller is only reconfigured when the settings of the device being
+addressed differ from those currently programmed.
+*/
+class SpiBusManagerClass
+{
+public:
+    /// Struct used to return usage statistics for a device on the bus.
+    typedef struct {
+        ULONGLONG transactions;         ///< Number of transactions performed with the device
+        ULONGLONG reconfigurations;     ///< Number of times the controller was reconfigured for the device
+        ULONGLONG waitMicroseconds;     ///< Total time spent waiting for the bus
+        ULONGLONG maxWaitMicroseconds;  ///< Longest single wait for the bus
+        ULONGLONG busyMicroseconds;     ///< Total time the device held the bus
+    } DEVICE_STATS, *PDEVICE_STATS;
+
+    /// Struct used to return usage statistics for the bus as a whole.
+    typedef struct {
+        ULONGLONG transactions;         ///< Number of transactions performed on the bus
+        ULONGLONG reconfigurations;     ///< Number of times the controller was reconfigured
+        ULONGLONG busyMicroseconds;     ///< Total time the bus was held by a device
+        ULONGLONG elapsedMicroseconds;  ///< Time since the bus was opened or stats were reset
+        ULONG utilizationPercent;       ///< Busy time as a percentage of elapsed time
+    } BUS_STATS, *PBUS_STATS;
+
+    /// Constructor.
+    SpiBusManagerClass(ULONG busNumber) :
+        m_busNumber(busNumber),
+        m_controller(nullptr),
+        m_refCount(0),
+        m_activeDevice(SPI_BUS_NO_DEVICE),
+        m_currentMode(DEFAULT_SPI_MODE),
+        m_currentClockKhz(DEFAULT_SPI_CLOCK_KHZ),
+        m_currentDataBits(DEFAULT_SPI_BITS),
+        m_currentLsbFirst(FALSE),
+        m_settingsKnown(FALSE),
+        m_statsStart(0),
+        m_holdStart(0)
+    {
+        ZeroMemory(m_devices, sizeof(m_devices));
+        InitializeCriticalSection(&m_lock);
+    }
+
+    /// Destructor.
+    /**
+    The global bus object is destroyed during static destruction, where g_pins may already be
+    gone, so this only releases the controller's handles.  The pins are reverted to GPIO use
+    by end().
+    */
+    virtual ~SpiBusManagerClass()
+    {
+        if (m_controller != nullptr)
+        {
+            delete m_controller;
+            m_controller = nullptr;
+        }
+        DeleteCriticalSection(&m_lock);
+    }
+
+    /// Prepare to use the SPI bus managed by this object.
+    HRESULT begin();
+
+    /// Finish using the SPI bus managed by this object.
+    void end();
+
+    /// Register a device on the bus.
+    HRESULT addDevice(ULONG csPin, ULONG mode, ULONG clockKhz, ULONG dataBits, BOOL lsbFirst, ULONG & deviceId);
+
+    /// Remove a device from the bus.
+    HRESULT removeDevice(ULONG deviceId);
+
+    /// Change the bus settings used for a registered device.
+    HRESULT configureDevice(ULONG deviceId, ULONG mode, ULONG clockKhz, ULONG dataBits, BOOL lsbFirst);
+
+    /// Claim the bus for a transaction with a device.
+    inline HRESULT beginTransaction(ULONG deviceId, SpiControllerClass* & controller);
+
+    /// Release the bus at the end of a transaction with a device.
+    inline void endTransaction(ULONG deviceId);
+
+    /// End one frame and start the next without releasing the bus.
+    inline HRESULT cycleChipSelect(ULONG deviceId);
+
+    /// Enable or disable internal loopback of transmitted data to the receiver.
+    HRESULT setLoopbackMode(BOOL enable);
+
+    /// Forget the settings programmed into the controller, so the next transaction sets them all.
+    void invalidateSettings();
+
+    /// Get the usage statistics for a device on the bus.
+    HRESULT getDeviceStats(ULONG deviceId, DEVICE_STATS & stats);
+
+    /// Get the usage statistics for the bus.
+    void getBusStats(BUS_STATS & stats);
+
+    /// Clear all bus and device statistics.
+    void resetStats();
+
+private:
+
+    /// Struct used to track a device registered on the bus.
+    typedef struct {
+        BOOL inUse;                     ///< TRUE if this slot holds a registered device
+        ULONG csPin;                    ///< Chip select pin, or SPI_BUS_NO_CS_PIN
+        ULONG mode;                     ///< SPI mode needed by the device
+        ULONG clockKhz;                 ///< SPI clock rate needed by the device
+        ULONG dataBits;                 ///< SPI transfer width needed by the device
+        BOOL lsbFirst;                  ///< TRUE if the device shifts data LSB first
+        ULONGLONG transactions;         ///< Count of transactions with the device
+        ULONGLONG reconfigurations;     ///< Count of controller reconfigurations for the device
+        ULONGLONG waitTicks;            ///< Total g_hiResClock ticks spent waiting for the bus
+        ULONGLONG maxWaitTicks;         ///< Longest single wait for the bus in g_hiResClock ticks
+        ULONGLONG busyTicks;            ///< Total g_hiResClock ticks the device held the bus
+    } SPI_DEVICE, *PSPI_DEVICE;
+
+    /// The number of the SPI bus managed by this object.
+    ULONG m_busNumber;
+
+    /// The SPI controller object shared by all devices on this bus.
+    SpiControllerClass* m_controller;
+
+    /// Count of how many times this bus is currently open by this process.
+    LONG m_refCount;
+
+    /// The devices registered on this bus.
+    SPI_DEVICE m_devices[SPI_BUS_MAX_DEVICES];
+
+    /// The device the controller is currently configured for.
+    ULONG m_activeDevice;
+
+    /// The SPI mode currently programmed into the controller.
+    ULONG m_currentMode;
+
+    /// The SPI clock rate currently programmed into the controller.
+    ULONG m_currentClockKhz;
+
+    /// The SPI transfer width currently programmed into the controller.
+    ULONG m_currentDataBits;
+
+    /// The bit order currently set on the controller.
+    BOOL m_currentLsbFirst;
+
+    /// FALSE if the controller may have been changed behind this object's back.
+    BOOL m_settingsKnown;
+
+    /// Timer reading when statistics collection started.
+    ULONGLONG m_statsStart;
+
+    /// Timer reading when the current transaction claimed the bus.
+    ULONGLONG m_holdStart;
+
+    /// Lock used to serialize transactions and bus configuration changes.
+    RTL_CRITICAL_SECTION m_lock;
+
+    /// Method to create the SPI controller object for the board we are running on.
+    HRESULT _createController();
+
+    /// Method to program the controller with the settings for a device.
+    HRESULT _applyDeviceSettings(ULONG deviceId);
+};
+
+/**
+The first call to this method creates the SPI controller and opens the bus with default
+settings.  Later calls only add a reference to the already open bus.
+\return HRESULT success or error code.
+*/
+inline HRESULT SpiBusManagerClass::begin()
+{
+    HRESULT hr = S_OK;
+
+    EnterCriticalSection(&m_lock);
+
+    if (m_refCount == 0)
+    {
+        if (m_controller == nullptr)
+        {
+            hr = _createController();
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            m_controller->setMsbFirstBitOrder();
+            hr = m_controller->begin(m_busNumber, DEFAULT_SPI_MODE, DEFAULT_SPI_CLOCK_KHZ, DEFAULT_SPI_BITS);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            m_currentMode = DEFAULT_SPI_MODE;
+            m_currentClockKhz = DEFAULT_SPI_CLOCK_KHZ;
+            m_currentDataBits = DEFAULT_SPI_BITS;
+            m_currentLsbFirst = FALSE;
+            m_settingsKnown = TRUE;
+            m_activeDevice = SPI_BUS_NO_DEVICE;
+            m_statsStart = g_hiResClock.now();
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        m_refCount++;
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    return hr;
+}
+
+/**
+When the last user of the bus calls this method the controller is released, its pins
+are reverted to GPIO use and the controller object is deleted.
+*/
+inline void SpiBusManagerClass::end()
+{
+    EnterCriticalSection(&m_lock);
+
+    if (m_refCount > 0)
+    {
+        m_refCount--;
+
+        if ((m_refCount == 0) && (m_controller != nullptr))
+        {
+            m_controller->end();
+            m_controller->revertPinsToGpio();
+            delete m_controller;
+            m_controller = nullptr;
+            m_activeDevice = SPI_BUS_NO_DEVICE;
+        }
+    }
+
+    LeaveCriticalSection(&m_lock);
+}
+
+/**
+\param[in] csPin The pin used as chip select for the device.  The pin is driven LOW for the
+duration of each transaction.  Use SPI_BUS_NO_CS_PIN if the caller drives chip select itself.
+\param[in] mode The SPI mode the device uses (0-3).
+\param[in] clockKhz The SPI clock rate to use with the device.
+\param[in] dataBits The width of each transfer with the device.
+\param[in] lsbFirst TRUE if the device shifts data LSB first, FALSE for MSB first.
+\param[out] deviceId The ID used to refer to the device in later calls.
+\return HRESULT success or error code.
+*/
+inline HRESULT SpiBusManagerClass::addDevice(ULONG csPin, ULONG mode, ULONG clockKhz, ULONG dataBits, BOOL lsbFirst, ULONG & deviceId)
+{
+    HRESULT hr = S_OK;
+    ULONG i;
+
+    deviceId = SPI_BUS_NO_DEVICE;
+
+    if (mode > 3)
+    {
+        hr = DMAP_E_SPI_MODE_SPECIFIED_IS_INVALID;
+    }
+
+    if (SUCCEEDED(hr) && (csPin != SPI_BUS_NO_CS_PIN))
+    {
+        hr = g_pins.setPinMode(csPin, DIRECTION_OUT, FALSE);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = g_pins.setPinState(csPin, HIGH);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = g_pins.verifyPinFunction(csPin, FUNC_DIO, BoardPinsClass::LOCK_FUNCTION);
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        EnterCriticalSection(&m_lock);
+
+        for (i = 0; i < SPI_BUS_MAX_DEVICES; i++)
+        {
+            if (!m_devices[i].inUse)
+            {
+                ZeroMemory(&m_devices[i], sizeof(m_devices[i]));
+                m_devices[i].inUse = TRUE;
+                m_devices[i].csPin = csPin;
+                m_devices[i].mode = mode;
+                m_devices[i].clockKhz = clockKhz;
+                m_devices[i].dataBits = dataBits;
+                m_devices[i].lsbFirst = lsbFirst;
+                deviceId = i;
+                break;
+            }
+        }
+
+        LeaveCriticalSection(&m_lock);
+
+        if (deviceId == SPI_BUS_NO_DEVICE)
+        {
+            hr = DMAP_E_SPI_TOO_MANY_DEVICES_ON_BUS;
+        }
+    }
+
+    return hr;
+}
+
+/**
+\param[in] deviceId The ID of the device to remove, as returned by addDevice().
+\return HRESULT success or error code.
+*/
+inline HRESULT SpiBusManagerClass::removeDevice(ULONG deviceId)
+{
+    HRESULT hr = S_OK;
+    ULONG csPin = SPI_BUS_NO_CS_PIN;
+
+    EnterCriticalSection(&m_lock);
+
+    if ((deviceId >= SPI_BUS_MAX_DEVICES) || !m_devices[deviceId].inUse)
+    {
+        hr = DMAP_E_SPI_DEVICE_NOT_REGISTERED;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        csPin = m_devices[deviceId].csPin;
+        m_devices[deviceId].inUse = FALSE;
+
+        if (m_activeDevice == deviceId)
+        {
+            m_activeDevice = SPI_BUS_NO_DEVICE;
+        }
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    // Unlock the CS line so it can be used for non-GPIO function.
+    if (SUCCEEDED(hr) && (csPin != SPI_BUS_NO_CS_PIN))
+    {
+        g_pins.verifyPinFunction(csPin, FUNC_DIO, BoardPinsClass::UNLOCK_FUNCTION);
+    }
+
+    return hr;
+}
+
+/**
+If the bus is open the new settings are programmed into the controller right away, so
+invalid settings are reported to the caller of this method.
+\param[in] deviceId The ID of the device, as returned by addDevice().
+\param[in] mode The SPI mode the device uses (0-3).
+\param[in] clockKhz The SPI clock rate to use with the device.
+\param[in] dataBits The width of each transfer with the device.
+\param[in] lsbFirst TRUE if the device shifts data LSB first, FALSE for MSB first.
+\return HRESULT success or error code.
+*/
+inline HRESULT SpiBusManagerClass::configureDevice(ULONG deviceId, ULONG mode, ULONG clockKhz, ULONG dataBits, BOOL lsbFirst)
+{
+    HRESULT hr = S_OK;
+
+    EnterCriticalSection(&m_lock);
+
+    if ((deviceId >= SPI_BUS_MAX_DEVICES) || !m_devices[deviceId].inUse)
+    {
+        hr = DMAP_E_SPI_DEVICE_NOT_REGISTERED;
+    }
+
+    if (SUCCEEDED(hr) && (mode > 3))
+    {
+        hr = DMAP_E_SPI_MODE_SPECIFIED_IS_INVALID;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        m_devices[deviceId].mode = mode;
+        m_devices[deviceId].clockKhz = clockKhz;
+        m_devices[deviceId].dataBits = dataBits;
+        m_devices[deviceId].lsbFirst = lsbFirst;
+
+        if (m_controller != nullptr)
+        {
+            hr = _applyDeviceSettings(deviceId);
+        }
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    return hr;
+}
+
+/**
+This method waits for any transaction in progress on the bus to finish, configures the
+controller for the device if needed, and asserts the device's chip select.  Each successful
+call must be followed by a call to endTransaction() from the same thread.
+\param[in] deviceId The ID of the device, as returned by addDevice().
+\param[out] controller The SPI controller to use for transfers during the transaction.
+\return HRESULT success or error code.
+*/
+inline HRESULT SpiBusManagerClass::beginTransaction(ULONG deviceId, SpiControllerClass* & controller)
+{
+    HRESULT hr = S_OK;
+    ULONGLONG requestTime;
+    ULONGLONG waitTicks;
+    PSPI_DEVICE device;
+
+    controller = nullptr;
+
+    if (deviceId >= SPI_BUS_MAX_DEVICES)
+    {
+        return DMAP_E_SPI_DEVICE_NOT_REGISTERED;
+    }
+    device = &m_devices[deviceId];
+
+    requestTime = g_hiResClock.now();
+    EnterCriticalSection(&m_lock);
+    m_holdStart = g_hiResClock.now();
+
+    if (!device->inUse)
+    {
+        hr = DMAP_E_SPI_DEVICE_NOT_REGISTERED;
+    }
+
+    if (SUCCEEDED(hr) && (m_controller == nullptr))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_STATE);
+    }
+
+    if (SUCCEEDED(hr) && (m_activeDevice != deviceId))
+    {
+        hr = _applyDeviceSettings(deviceId);
+    }
+
+    if (SUCCEEDED(hr) && (device->csPin != SPI_BUS_NO_CS_PIN))
+    {
+        hr = g_pins.setPinState(device->csPin, LOW);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        waitTicks = m_holdStart - requestTime;
+        device->waitTicks += waitTicks;
+        if (waitTicks > device->maxWaitTicks)
+        {
+            device->maxWaitTicks = waitTicks;
+        }
+        device->transactions++;
+        controller = m_controller;
+    }
+    else
+    {
+        LeaveCriticalSection(&m_lock);
+    }
+
+    return hr;
+}
+
+/**
+\param[in] deviceId The ID of the device passed to the matching beginTransaction() call.
+*/
+inline void SpiBusManagerClass::endTransaction(ULONG deviceId)
+{
+    PSPI_DEVICE device = &m_devices[deviceId];
+
+    if (device->csPin != SPI_BUS_NO_CS_PIN)
+    {
+        g_pins.setPinState(device->csPin, HIGH);
+    }
+
+    device->busyTicks += g_hiResClock.now() - m_holdStart;
+
+    LeaveCriticalSection(&m_lock);
+}
+
+/**
+Devices such as ADCs that start a conversion on the falling edge of chip select need it
+pulsed between frames.  This lets a series of frames be sent under one transaction, so no
+other device can get onto the bus between them.
+\param[in] deviceId The ID of the device passed to the matching beginTransaction() call.
+\return HRESULT success or error code.
+*/
+inline HRESULT SpiBusManagerClass::cycleChipSelect(ULONG deviceId)
+{
+    HRESULT hr = S_OK;
+    PSPI_DEVICE device = &m_devices[deviceId];
+
+    if (device->csPin != SPI_BUS_NO_CS_PIN)
+    {
+        hr = g_pins.setPinState(device->csPin, HIGH);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = g_pins.setPinState(device->csPin, LOW);
+        }
+    }
+
+    return hr;
+}
+
+/**
+\param[in] deviceId The ID of the device, as returned by addDevice().
+\param[out] stats The usage statistics for the device.
+\return HRESULT success or error code.
+*/
+inline HRESULT SpiBusManagerClass::getDeviceStats(ULONG deviceId, DEVICE_STATS & stats)
+{
+    HRESULT hr = S_OK;
+
+    EnterCriticalSection(&m_lock);
+
+    if ((deviceId >= SPI_BUS_MAX_DEVICES) || !m_devices[deviceId].inUse)
+    {
+        hr = DMAP_E_SPI_DEVICE_NOT_REGISTERED;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        stats.transactions = m_devices[deviceId].transactions;
+        stats.reconfigurations = m_devices[deviceId].reconfigurations;
+        stats.waitMicroseconds = g_hiResClock.ticksToMicroseconds(m_devices[deviceId].waitTicks);
+        stats.maxWaitMicroseconds = g_hiResClock.ticksToMicroseconds(m_devices[deviceId].maxWaitTicks);
+        stats.busyMicroseconds = g_hiResClock.ticksToMicroseconds(m_devices[deviceId].busyTicks);
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    return hr;
+}
+
+/**
+\param[out] stats The usage statistics for the bus, summed over all registered devices.
+*/
+inline void SpiBusManagerClass::getBusStats(BUS_STATS & stats)
+{
+    ULONGLONG busyTicks = 0;
+    ULONG i;
+
+    ZeroMemory(&stats, sizeof(stats));
+
+    EnterCriticalSection(&m_lock);
+
+    for (i = 0; i < SPI_BUS_MAX_DEVICES; i++)
+    {
+        if (m_devices[i].inUse)
+        {
+            stats.transactions += m_devices[i].transactions;
+            stats.reconfigurations += m_devices[i].reconfigurations;
+            busyTicks += m_devices[i].busyTicks;
+        }
+    }
+
+    if (m_statsStart != 0)
+    {
+        stats.elapsedMicroseconds = g_hiResClock.ticksToMicroseconds(g_hiResClock.now() - m_statsStart);
+    }
+    stats.busyMicroseconds = g_hiResClock.ticksToMicroseconds(busyTicks);
+
+    LeaveCriticalSection(&m_lock);
+
+    if (stats.elapsedMicroseconds > 0)
+    {
+        stats.utilizationPercent = (ULONG)((stats.busyMicroseconds * 100) / stats.elapsedMicroseconds);
+    }
+}
+
+inline void SpiBusManagerClass::resetStats()
+{
+    ULONG i;
+
+    EnterCriticalSection(&m_lock);
+
+    for (i = 0; i < SPI_BUS_MAX_DEVICES; i++)
+    {
+        m_devices[i].transactions = 0;
+        m_devices[i].reconfigurations = 0;
+        m_devices[i].waitTicks = 0;
+        m_devices[i].maxWaitTicks = 0;
+        m_devices[i].busyTicks = 0;
+    }
+    m_statsStart = g_hiResClock.now();
+
+    LeaveCriticalSection(&m_lock);
+}
+
+/**
+Loopback is not a virtual method of SpiControllerClass, because the controllers are built
+by a library with a fixed vtable layout.  _createController() picks the controller class
+from the board type, so the board type also tells which class to call here.  The SPI block
+on a PI2 has no loopback mode, so there MOSI must be wired to MISO.
+\param[in] enable TRUE to loop MOSI back to MISO inside the controller, FALSE for normal operation.
+\return HRESULT success or error code.
+*/
+inline HRESULT SpiBusManagerClass::setLoopbackMode(BOOL enable)
+{
+    HRESULT hr = S_OK;
+    BoardPinsClass::BOARD_TYPE board;
+
+    EnterCriticalSection(&m_lock);
+
+    if (m_controller == nullptr)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_STATE);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = g_pins.getBoardType(board);
+        if (FAILED(hr))
+        {
+            hr = DMAP_E_BOARD_TYPE_NOT_RECOGNIZED;
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        if (board == BoardPinsClass::BOARD_TYPE::MBM_BARE)
+        {
+            hr = static_cast<BtSpiControllerClass*>(m_controller)->setLoopbackMode(enable);
+        }
+        else if (board == BoardPinsClass::BOARD_TYPE::PI2_BARE)
+        {
+            hr = DMAP_E_SPI_LOOPBACK_NOT_SUPPORTED;
+        }
+        else
+        {
+            hr = static_cast<QuarkSpiControllerClass*>(m_controller)->setLoopbackMode(enable);
+        }
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    return hr;
+}
+
+/**
+Code that uses the controller other than through a device's settings, such as the SPI
+loopback self-test, must call this afterwards.  It can be called during a transaction.
+*/
+inline void SpiBusManagerClass::invalidateSettings()
+{
+    EnterCriticalSection(&m_lock);
+    m_settingsKnown = FALSE;
+    m_activeDevice = SPI_BUS_NO_DEVICE;
+    LeaveCriticalSection(&m_lock);
+}
+
+/**
+This method assumes the caller holds the bus lock.
+\return HRESULT success or error code.
+*/
+inline HRESULT SpiBusManagerClass::_createController()
+{
+    HRESULT hr = S_OK;
+    BoardPinsClass::BOARD_TYPE board;
+
+    hr = g_pins.getBoardType(board);
+
+    if (FAILED(hr))
+    {
+        hr = DMAP_E_BOARD_TYPE_NOT_RECOGNIZED;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        if (board == BoardPinsClass::BOARD_TYPE::MBM_BARE)
+        {
+            m_controller = new BtSpiControllerClass;
+            hr = m_controller->configurePins(MBM_PIN_MISO, MBM_PIN_MOSI, MBM_PIN_SCK);
+        }
+        else if (board == BoardPinsClass::BOARD_TYPE::PI2_BARE)
+        {
+            m_controller = new BcmSpiControllerClass;
+            hr = m_controller->configurePins(PI2_PIN_SPI0_MISO, PI2_PIN_SPI0_MOSI, PI2_PIN_SPI0_SCK);
+        }
+        else
+        {
+            m_controller = new QuarkSpiControllerClass;
+            hr = m_controller->configurePins(ARDUINO_PIN_MISO, ARDUINO_PIN_MOSI, ARDUINO_PIN_SCK);
+        }
+
+        if (FAILED(hr))
+        {
+            delete m_controller;
+            m_controller = nullptr;
+        }
+    }
+
+    return hr;
+}
+
+/**
+Only the settings that differ from those currently programmed into the controller are
+changed, so switching between devices with identical settings costs nothing.  After
+invalidateSettings() every setting is written.  This method assumes the caller holds the
+bus lock.
+\param[in] deviceId The ID of the device whose settings should be applied.
+\return HRESULT success or error code.
+*/
+inline HRESULT SpiBusManagerClass::_applyDeviceSettings(ULONG deviceId)
+{
+    HRESULT hr = S_OK;
+    PSPI_DEVICE device = &m_devices[deviceId];
+    BOOL changed = FALSE;
+
+    if (!m_settingsKnown || (device->mode != m_currentMode))
+    {
+        hr = m_controller->setMode(device->mode);
+        if (SUCCEEDED(hr))
+        {
+            m_currentMode = device->mode;
+            changed = TRUE;
+        }
+    }
+
+    if (SUCCEEDED(hr) && (!m_settingsKnown || (device->clockKhz != m_currentClockKhz)))
+    {
+        hr = m_controller->setClock(device->clockKhz);
+        if (SUCCEEDED(hr))
+        {
+            m_currentClockKhz = device->clockKhz;
+            changed = TRUE;
+        }
+    }
+
+    if (SUCCEEDED(hr) && (!m_settingsKnown || (device->dataBits != m_currentDataBits)))
+    {
+        hr = m_controller->setDataWidth(device->dataBits);
+        if (SUCCEEDED(hr))
+        {
+            m_currentDataBits = device->dataBits;
+            changed = TRUE;
+        }
+    }
+
+    if (SUCCEEDED(hr) && (!m_settingsKnown || (device->lsbFirst != m_currentLsbFirst)))
+    {
+        if (device->lsbFirst)
+        {
+            m_controller->setLsbFirstBitOrder();
+        }
+        else
+        {
+            m_controller->setMsbFirstBitOrder();
+        }
+        m_currentLsbFirst = device->lsbFirst;
+        changed = TRUE;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        m_settingsKnown = TRUE;
+        m_activeDevice = deviceId;
+        if (changed)
+        {
+            device->reconfigurations++;
+        }
+    }
+    else
+    {
+        m_activeDevice = SPI_BUS_NO_DEVICE;
+    }
+
+    return hr;
+}
+
+/// The global object used to share the external SPI bus.
+__declspec(selectany) SpiBusManagerClass g_spiBus(EXTERNAL_SPI_BUS);
+
+#endif  // _SPI_BUS_MANAGER_H_
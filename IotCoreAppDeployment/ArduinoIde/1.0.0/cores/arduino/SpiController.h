@@ -6,6 +6,8 @@
 #define _SPI_CONTROLLER_H_
 
 #include <Windows.h>
+#include <stdlib.h>
+#include <vector>
 #include "DmapSupport.h"
 #include "BoardPins.h"
 
@@ -270,6 +272,12 @@ public:
     */
     virtual inline HRESULT transferBuffer(PBYTE dataOut, PBYTE dataIn, size_t bufferBytes) = 0;
 
+    /// Transfer a buffer of 16-bit words on the SPI bus.
+    inline HRESULT transferBuffer16(PUSHORT dataOut, PUSHORT dataIn, size_t wordCount, BOOL swapBytes = FALSE);
+
+    /// Transfer a buffer of 32-bit words on the SPI bus.
+    inline HRESULT transferBuffer32(PULONG dataOut, PULONG dataIn, size_t wordCount, BOOL swapBytes = FALSE);
+
 protected:
     /// SPI Clock pin number.
     ULONG m_sckPin;
@@ -299,6 +307,187 @@ private:
     \return HRESULT success or error code.
     */
     virtual inline HRESULT _transfer(ULONG dataOut, ULONG & dataIn, ULONG bits) = 0;
+
+    /// Method to transfer a buffer of words that are already in wire order.
+    inline HRESULT _transferWireWords(std::vector<ULONG> & words, ULONG bits);
+
+    /// Method to convert a 16-bit word between buffer order and wire order.
+    inline USHORT _wireWord16(USHORT word, BOOL swapBytes)
+    {
+        if (swapBytes)
+        {
+            word = _byteswap_ushort(word);
+        }
+        if (m_flipBitOrder)
+        {
+            word = (m_byteFlips[word & 0xFF] << 8) | m_byteFlips[word >> 8];
+        }
+        return word;
+    }
+
+    /// Method to convert a 32-bit word between buffer order and wire order.
+    inline ULONG _wireWord32(ULONG word, BOOL swapBytes)
+    {
+        if (swapBytes)
+        {
+            word = _byteswap_ulong(word);
+        }
+        if (m_flipBitOrder)
+        {
+            word = (m_byteFlips[word & 0xFF] << 24) | (m_byteFlips[(word >> 8) & 0xFF] << 16) |
+                (m_byteFlips[(word >> 16) & 0xFF] << 8) | m_byteFlips[word >> 24];
+        }
+        return word;
+    }
 };
 
+/**
+The words are sent as one continuous stream on controllers that support buffer transfers,
+and as one 8-bit transfer per byte, most significant byte first, on other controllers.  The data width is restored to its
+previous value afterwards.
+\param[in] dataOut Buffer of words to send, or nullptr to send zeros.
+\param[out] dataIn Buffer to receive words, or nullptr to discard the received data.
+\param[in] wordCount The number of words to transfer.
+\param[in] swapBytes TRUE if the words in the buffers are stored in the opposite byte order
+from the host (for example big-endian pixel data), FALSE if they are native words.
+\return HRESULT success or error code.
+\note Each word is sent MSbit first unless LSbit first order has been selected.
+*/
+inline HRESULT SpiControllerClass::transferBuffer16(PUSHORT dataOut, PUSHORT dataIn, size_t wordCount, BOOL swapBytes)
+{
+    HRESULT hr = S_OK;
+    std::vector<ULONG> words(wordCount, 0);
+    size_t i;
+
+    if (dataOut != nullptr)
+    {
+        for (i = 0; i < wordCount; i++)
+        {
+            words[i] = _wireWord16(dataOut[i], swapBytes);
+        }
+    }
+
+    hr = _transferWireWords(words, 16);
+
+    if (SUCCEEDED(hr) && (dataIn != nullptr))
+    {
+        for (i = 0; i < wordCount; i++)
+        {
+            dataIn[i] = _wireWord16((USHORT)words[i], swapBytes);
+        }
+    }
+
+    return hr;
+}
+
+/**
+The words are sent as one continuous stream on controllers that support buffer transfers,
+and as one 8-bit transfer per byte, most significant byte first, on other controllers.  The data width is restored to its
+previous value afterwards.
+\param[in] dataOut Buffer of words to send, or nullptr to send zeros.
+\param[out] dataIn Buffer to receive words, or nullptr to discard the received data.
+\param[in] wordCount The number of words to transfer.
+\param[in] swapBytes TRUE if the words in the buffers are stored in the opposite byte order
+from the host, FALSE if they are native words.
+\return HRESULT success or error code.
+\note Each word is sent MSbit first unless LSbit first order has been selected.
+*/
+inline HRESULT SpiControllerClass::transferBuffer32(PULONG dataOut, PULONG dataIn, size_t wordCount, BOOL swapBytes)
+{
+    HRESULT hr = S_OK;
+    std::vector<ULONG> words(wordCount, 0);
+    size_t i;
+
+    if (dataOut != nullptr)
+    {
+        for (i = 0; i < wordCount; i++)
+        {
+            words[i] = _wireWord32(dataOut[i], swapBytes);
+        }
+    }
+
+    hr = _transferWireWords(words, 32);
+
+    if (SUCCEEDED(hr) && (dataIn != nullptr))
+    {
+        for (i = 0; i < wordCount; i++)
+        {
+            dataIn[i] = _wireWord32(words[i], swapBytes);
+        }
+    }
+
+    return hr;
+}
+
+/**
+The words are first sent as a byte buffer, most significant byte first, through
+transferBuffer().  With chip select held for the whole transfer that puts exactly the same
+bits on the wire as word transfers would, and lets the controller keep its FIFO full.
+Controllers that don't implement buffer transfers fall back to one 8-bit transfer per byte,
+in the same order, so the result doesn't depend on the controller's support for wider
+frames.
+\param[in,out] words The words to send, MSbit first, replaced by the words received.
+\param[in] bits The width of each word, 16 or 32.
+\return HRESULT success or error code.
+*/
+inline HRESULT SpiControllerClass::_transferWireWords(std::vector<ULONG> & words, ULONG bits)
+{
+    HRESULT hr = S_OK;
+    HRESULT restoreHr = S_OK;
+    ULONG oldDataBits = m_dataBits;
+    ULONG wordBytes = bits / 8;
+    std::vector<BYTE> wireBytes(words.size() * wordBytes);
+    ULONG rxData = 0;
+    size_t i;
+    ULONG j;
+
+    hr = setDataWidth(8);
+
+    if (SUCCEEDED(hr))
+    {
+        for (i = 0; i < words.size(); i++)
+        {
+            for (j = 0; j < wordBytes; j++)
+            {
+                wireBytes[(i * wordBytes) + j] = (BYTE)(words[i] >> (((wordBytes - 1) - j) * 8));
+            }
+        }
+
+        hr = transferBuffer(wireBytes.data(), wireBytes.data(), wireBytes.size());
+
+        if (hr == DMAP_E_SPI_BUFFER_TRANSFER_NOT_IMPLEMENTED)
+        {
+            hr = S_OK;
+            for (i = 0; SUCCEEDED(hr) && (i < wireBytes.size()); i++)
+            {
+                hr = _transfer(wireBytes[i], rxData, 8);
+                wireBytes[i] = (BYTE)rxData;
+            }
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        for (i = 0; i < words.size(); i++)
+        {
+            words[i] = 0;
+            for (j = 0; j < wordBytes; j++)
+            {
+                words[i] = (words[i] << 8) | wireBytes[(i * wordBytes) + j];
+            }
+        }
+    }
+
+    if (oldDataBits != m_dataBits)
+    {
+        restoreHr = setDataWidth(oldDataBits);
+        if (SUCCEEDED(hr))
+        {
+            hr = restoreHr;
+        }
+    }
+
+    return hr;
+}
+
 #endif  // _SPI_CONTROLLER_H_
\ No newline at end of file
@@ -0,0 +1,380 @@
+// Copyright (c) Microsoft Open Technologies, Inc.  All rights reserved.  
+// Licensed under the BSD 2-Clause License.  
+// See License.txt in the project root for license information.
+
+#ifndef _SPI_SELF_TEST_H_
+#define _SPI_SELF_TEST_H_
+
+#include <Windows.h>
+#include <vector>
+#include <algorithm>
+
+#include "ErrorCodes.h"
+#include "SpiController.h"
+#include "SpiBusManager.h"
+#include "HiResTimer.h"
+
+// Forward declaration(s):
+int Log(const char *format, ...);
+
+/// Class used to verify and benchmark an SPI controller with its output looped back to its input.
+/**
+The test sweeps the configured clock rates, data widths and buffer sizes.  For each combination
+it sends a pseudo-random pattern, checks that the same data comes back, and measures throughput
+and per-transfer latency.  The data must come back to the controller before the test is run:
+either put the controller in internal loopback mode with SpiBusManagerClass::setLoopbackMode()
+(or the controller's own setLoopbackMode()), or wire MOSI to MISO.  Running the test on a
+LoopbackSpiControllerClass object is only a smoke test of the test itself; it does not
+exercise any controller hardware code.  Widths the controller can't transfer are left out
+of the sweep.
+*/
+class SpiLoopbackTestClass
+{
+public:
+    /// Struct used to specify the combinations the test sweeps.
+    typedef struct {
+        std::vector<ULONG> clocksKhz;       ///< Clock rates to test
+        ULONG minDataBits;                  ///< Smallest word width to test
+        ULONG maxDataBits;                  ///< Largest word width to test
+        ULONG wordTransfers;                ///< Number of single word transfers per width
+        std::vector<size_t> bufferSizes;    ///< Buffer sizes to test with 8-bit transfers
+        ULONG bufferTransfers;              ///< Number of buffer transfers per size
+    } SWEEP, *PSWEEP;
+
+    /// Struct used to return the results for one combination of settings.
+    typedef struct {
+        ULONG clockKhz;                     ///< Clock rate used
+        ULONG dataBits;                     ///< Word width used
+        size_t bufferBytes;                 ///< Buffer size used, zero for single word transfers
+        ULONG transfers;                    ///< Number of transfers performed
+        ULONG errors;                       ///< Number of transfers that returned the wrong data
+        HRESULT hr;                         ///< Result of the transfers, or of configuring the controller
+        ULONGLONG bytesPerSecond;           ///< Achieved throughput
+        ULONGLONG p50Nanoseconds;           ///< Median transfer latency
+        ULONGLONG p99Nanoseconds;           ///< 99th percentile transfer latency
+        ULONGLONG maxNanoseconds;           ///< Longest transfer latency
+    } RESULT, *PRESULT;
+
+    /// Constructor.
+    SpiLoopbackTestClass() :
+        m_seed(0x12345678)
+    {
+    }
+
+    /// Destructor.
+    virtual ~SpiLoopbackTestClass()
+    {
+    }
+
+    /// Get the default sweep: common clock rates, every supported width from 4 to 32 bits, and 1 to 4096 byte buffers.
+    static void getDefaultSweep(SWEEP & sweep)
+    {
+        sweep.clocksKhz = { 125, 1000, 4000, 8000, 12500 };
+        sweep.minDataBits = 4;
+        sweep.maxDataBits = 32;
+        sweep.wordTransfers = 256;
+        sweep.bufferSizes = { 1, 16, 64, 256, 1024, 4096 };
+        sweep.bufferTransfers = 32;
+    }
+
+    /// Run the test on a controller that has already been opened with begin().
+    HRESULT run(SpiControllerClass* controller, const SWEEP & sweep);
+
+    /// Run the test on the controller of a shared SPI bus, in a transaction for one of its devices.
+    HRESULT run(SpiBusManagerClass & bus, ULONG deviceId, const SWEEP & sweep);
+
+    /// Get the results of the last run.
+    inline const std::vector<RESULT> & getResults()
+    {
+        return m_results;
+    }
+
+    /// Determine whether every transfer in the last run returned the data sent.
+    /**
+    Buffer transfers that the controller does not support (on the Quark controller, for
+    example) are reported as not run, and don't make the test fail.
+    */
+    inline BOOL passed()
+    {
+        for (auto & result : m_results)
+        {
+            if ((result.errors != 0) || (FAILED(result.hr) && !_isUnsupported(result.hr)))
+            {
+                return FALSE;
+            }
+        }
+        return !m_results.empty();
+    }
+
+    /// Write the results of the last run with Log().
+    void logResults();
+
+private:
+
+    /// State of the test pattern generator.
+    ULONG m_seed;
+
+    /// Results of the last run.
+    std::vector<RESULT> m_results;
+
+    /// Method to determine whether an error means the controller can't do a transfer at all.
+    static inline BOOL _isUnsupported(HRESULT hr)
+    {
+        return (hr == DMAP_E_SPI_DATA_WIDTH_SPECIFIED_IS_INVALID) ||
+            (hr == DMAP_E_SPI_BUFFER_TRANSFER_NOT_IMPLEMENTED);
+    }
+
+    /// Method to get the next word of the test pattern.
+    inline ULONG _nextPattern()
+    {
+        // xorshift32
+        m_seed ^= m_seed << 13;
+        m_seed ^= m_seed >> 17;
+        m_seed ^= m_seed << 5;
+        return m_seed;
+    }
+
+    /// Method to test single word transfers at one width.
+    void _testWords(SpiControllerClass* controller, ULONG clockKhz, ULONG dataBits, ULONG transfers);
+
+    /// Method to test buffer transfers at one size.
+    void _testBuffers(SpiControllerClass* controller, ULONG clockKhz, size_t bufferBytes, ULONG transfers);
+
+    /// Method to fill in the timing fields of a result.
+    void _summarize(RESULT & result, std::vector<ULONGLONG> & latencyTicks, ULONGLONG totalTicks, ULONGLONG totalBytes);
+};
+
+/**
+The controller is left with 8-bit transfers and its original clock rate unknown.  Loopback mode
+is left as the caller set it.  If the controller belongs to an SpiBusManagerClass bus, use the
+bus version of run(), so the bus knows to program its devices' settings again.
+\param[in] controller The SPI controller to test.
+\param[in] sweep The combinations of settings to test.
+\return HRESULT success or error code.  Data mismatches are reported in the results, not here.
+*/
+inline HRESULT SpiLoopbackTestClass::run(SpiControllerClass* controller, const SWEEP & sweep)
+{
+    HRESULT hr = S_OK;
+    RESULT result;
+    ULONG bits;
+
+    m_results.clear();
+
+    if (controller == nullptr)
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        controller->setMsbFirstBitOrder();
+    }
+
+    for (ULONG clockKhz : sweep.clocksKhz)
+    {
+        if (FAILED(hr))
+        {
+            break;
+        }
+
+        ZeroMemory(&result, sizeof(result));
+        result.clockKhz = clockKhz;
+        result.hr = controller->setClock(clockKhz);
+        if (FAILED(result.hr))
+        {
+            m_results.push_back(result);
+            continue;
+        }
+
+        for (bits = sweep.minDataBits; bits <= sweep.maxDataBits; bits++)
+        {
+            _testWords(controller, clockKhz, bits, sweep.wordTransfers);
+        }
+
+        for (size_t bufferBytes : sweep.bufferSizes)
+        {
+            _testBuffers(controller, clockKhz, bufferBytes, sweep.bufferTransfers);
+        }
+    }
+
+    if (controller != nullptr)
+    {
+        controller->setDataWidth(8);
+    }
+
+    return hr;
+}
+
+/**
+The test runs inside a transaction for the device, so it does not disturb other threads using
+the bus.  Afterwards the bus is told that the controller settings it cached are no longer
+valid, so the next transaction with any device programs them again.
+\param[in] bus The SPI bus to test.  It must have been opened with begin().
+\param[in] deviceId The ID of a device registered on the bus.  Its chip select is asserted
+during the test.
+\param[in] sweep The combinations of settings to test.
+\return HRESULT success or error code.  Data mismatches are reported in the results, not here.
+*/
+inline HRESULT SpiLoopbackTestClass::run(SpiBusManagerClass & bus, ULONG deviceId, const SWEEP & sweep)
+{
+    HRESULT hr = S_OK;
+    SpiControllerClass* controller = nullptr;
+
+    hr = bus.beginTransaction(deviceId, controller);
+
+    if (SUCCEEDED(hr))
+    {
+        hr = run(controller, sweep);
+        bus.invalidateSettings();
+        bus.endTransaction(deviceId);
+    }
+
+    return hr;
+}
+
+inline void SpiLoopbackTestClass::logResults()
+{
+    for (auto & result : m_results)
+    {
+        if (FAILED(result.hr))
+        {
+            Log("SPI %6lu kHz %2lu bits %5Iu bytes: not run, error 0x%08x\n",
+                result.clockKhz, result.dataBits, result.bufferBytes, result.hr);
+        }
+        else
+        {
+            Log("SPI %6lu kHz %2lu bits %5Iu bytes: %lu/%lu ok, %8.3f MB/s, p50 %llu ns, p99 %llu ns, max %llu ns\n",
+                result.clockKhz, result.dataBits, result.bufferBytes,
+                result.transfers - result.errors, result.transfers,
+                (double)result.bytesPerSecond / 1000000.0,
+                result.p50Nanoseconds, result.p99Nanoseconds, result.maxNanoseconds);
+        }
+    }
+    Log("SPI loopback self-test %s\n", passed() ? "PASSED" : "FAILED");
+}
+
+inline void SpiLoopbackTestClass::_testWords(SpiControllerClass* controller, ULONG clockKhz, ULONG dataBits, ULONG transfers)
+{
+    RESULT result;
+    std::vector<ULONGLONG> latencyTicks;
+    ULONGLONG start;
+    ULONGLONG ticks;
+    ULONGLONG totalTicks = 0;
+    ULONG mask = 0xFFFFFFFF >> (32 - dataBits);
+    ULONG dataOut;
+    ULONG dataIn;
+    ULONG i;
+
+    ZeroMemory(&result, sizeof(result));
+    result.clockKhz = clockKhz;
+    result.dataBits = dataBits;
+
+    // Skip widths the controller can't do.  Some controllers accept any width in
+    // setDataWidth() but only transfer whole bytes, so one transfer is tried as well.
+    result.hr = controller->setDataWidth(dataBits);
+    if (SUCCEEDED(result.hr))
+    {
+        result.hr = controller->transferN(0, dataIn, dataBits);
+    }
+    if (result.hr == DMAP_E_SPI_DATA_WIDTH_SPECIFIED_IS_INVALID)
+    {
+        return;
+    }
+
+    latencyTicks.reserve(transfers);
+    for (i = 0; SUCCEEDED(result.hr) && (i < transfers); i++)
+    {
+        dataOut = _nextPattern() & mask;
+        dataIn = ~dataOut;
+
+        start = g_hiResClock.now();
+        result.hr = controller->transferN(dataOut, dataIn, dataBits);
+        ticks = g_hiResClock.now() - start;
+
+        latencyTicks.push_back(ticks);
+        totalTicks += ticks;
+        result.transfers++;
+        if (SUCCEEDED(result.hr) && ((dataIn & mask) != dataOut))
+        {
+            result.errors++;
+        }
+    }
+
+    if (SUCCEEDED(result.hr))
+    {
+        _summarize(result, latencyTicks, totalTicks, (ULONGLONG)result.transfers * ((dataBits + 7) / 8));
+    }
+    m_results.push_back(result);
+}
+
+inline void SpiLoopbackTestClass::_testBuffers(SpiControllerClass* controller, ULONG clockKhz, size_t bufferBytes, ULONG transfers)
+{
+    RESULT result;
+    std::vector<ULONGLONG> latencyTicks;
+    std::vector<BYTE> dataOut(bufferBytes);
+    std::vector<BYTE> dataIn(bufferBytes);
+    ULONGLONG start;
+    ULONGLONG ticks;
+    ULONGLONG totalTicks = 0;
+    ULONG i;
+    size_t j;
+
+    ZeroMemory(&result, sizeof(result));
+    result.clockKhz = clockKhz;
+    result.dataBits = 8;
+    result.bufferBytes = bufferBytes;
+
+    result.hr = controller->setDataWidth(8);
+
+    latencyTicks.reserve(transfers);
+    for (i = 0; SUCCEEDED(result.hr) && (i < transfers); i++)
+    {
+        for (j = 0; j < bufferBytes; j++)
+        {
+            dataOut[j] = (BYTE)_nextPattern();
+            dataIn[j] = ~dataOut[j];
+        }
+
+        start = g_hiResClock.now();
+        result.hr = controller->transferBuffer(dataOut.data(), dataIn.data(), bufferBytes);
+        ticks = g_hiResClock.now() - start;
+
+        latencyTicks.push_back(ticks);
+        totalTicks += ticks;
+        result.transfers++;
+        if (SUCCEEDED(result.hr) && (dataOut != dataIn))
+        {
+            result.errors++;
+        }
+    }
+
+    if (SUCCEEDED(result.hr))
+    {
+        _summarize(result, latencyTicks, totalTicks, (ULONGLONG)result.transfers * bufferBytes);
+    }
+    m_results.push_back(result);
+}
+
+inline void SpiLoopbackTestClass::_summarize(RESULT & result, std::vector<ULONGLONG> & latencyTicks, ULONGLONG totalTicks, ULONGLONG totalBytes)
+{
+    ULONGLONG totalNanoseconds;
+
+    if (latencyTicks.empty())
+    {
+        return;
+    }
+
+    std::sort(latencyTicks.begin(), latencyTicks.end());
+
+    result.p50Nanoseconds = g_hiResClock.ticksToNanoseconds(latencyTicks[latencyTicks.size() / 2]);
+    result.p99Nanoseconds = g_hiResClock.ticksToNanoseconds(latencyTicks[(latencyTicks.size() * 99) / 100]);
+    result.maxNanoseconds = g_hiResClock.ticksToNanoseconds(latencyTicks.back());
+
+    totalNanoseconds = g_hiResClock.ticksToNanoseconds(totalTicks);
+    if (totalNanoseconds > 0)
+    {
+        result.bytesPerSecond = (totalBytes * 1000000000ULL) / totalNanoseconds;
+    }
+}
+
+#endif  // _SPI_SELF_TEST_H_
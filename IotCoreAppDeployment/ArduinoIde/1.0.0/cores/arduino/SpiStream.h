@@ -0,0 +1,508 @@
+// Copyright (c) Microsoft Open Technologies, Inc.  All rights reserved.  
+// Licensed under the BSD 2-Clause License.  
+// See License.txt in the project root for license information.
+
+#ifndef _SPI_STREAM_H_
+#define _SPI_STREAM_H_
+
+#include <Windows.h>
+#include <functional>
+
+#include "ErrorCodes.h"
+#include "SpiController.h"
+#include "SpiBusManager.h"
+#include "HiResTimer.h"
+
+/// The minimum number of buffers in an SPI stream ring.
+#define SPI_STREAM_MIN_BUFFERS 2
+
+/// The maximum number of buffers in an SPI stream ring.
+#define SPI_STREAM_MAX_BUFFERS 16
+
+/// Class used to stream data continuously to or from a device on an SPI bus.
+/**
+The stream owns a ring of equally sized buffers.  A wire thread transfers the buffers in ring
+order, one bus transaction per buffer, while a service thread runs the producer callback to
+fill the next free buffers and the consumer callback to hand back the data received in
+completed buffers.  Buffer N+1 is therefore prepared while buffer N is on the wire.
+
+The producer is called with a TX buffer to fill and returns FALSE if it has no data ready yet.
+The consumer is called with the RX buffer of each completed transfer, in order.  Either
+callback can be omitted for receive-only or transmit-only streams.
+*/
+class SpiStreamClass
+{
+public:
+    /// Callback used to fill a TX buffer.  Returns FALSE if no data is ready yet.
+    typedef std::function<BOOL(PBYTE buffer, size_t bufferBytes)> PRODUCER;
+
+    /// Callback used to process an RX buffer.
+    typedef std::function<void(PBYTE buffer, size_t bufferBytes)> CONSUMER;
+
+    /// Struct used to return stream statistics.
+    typedef struct {
+        ULONGLONG buffers;              ///< Number of buffers transferred
+        ULONGLONG bytes;                ///< Number of bytes transferred
+        ULONGLONG underruns;            ///< Times the wire went idle waiting for a filled buffer
+        ULONGLONG overruns;             ///< Times received data filled the ring before it was consumed
+        ULONGLONG wireMicroseconds;     ///< Total time spent transferring buffers
+        ULONGLONG gapMicroseconds;      ///< Total idle time between consecutive buffers
+        ULONGLONG maxGapMicroseconds;   ///< Longest idle time between consecutive buffers
+        ULONGLONG elapsedMicroseconds;  ///< Time since the stream was started
+        ULONGLONG bytesPerSecond;       ///< Sustained throughput over the elapsed time
+    } STREAM_STATS, *PSTREAM_STATS;
+
+    /// Constructor.
+    SpiStreamClass() :
+        m_bus(nullptr),
+        m_deviceId(SPI_BUS_NO_DEVICE),
+        m_bufferBytes(0),
+        m_bufferCount(0),
+        m_hWireThread(NULL),
+        m_hServiceThread(NULL),
+        m_stopping(FALSE),
+        m_error(S_OK)
+    {
+        ZeroMemory(m_slots, sizeof(m_slots));
+        ZeroMemory(&m_counts, sizeof(m_counts));
+        m_startTime = 0;
+        InitializeCriticalSection(&m_lock);
+        InitializeConditionVariable(&m_slotChanged);
+    }
+
+    /// Destructor.
+    virtual ~SpiStreamClass()
+    {
+        stop();
+        DeleteCriticalSection(&m_lock);
+    }
+
+    /// Start streaming to or from a device on an SPI bus.
+    HRESULT start(SpiBusManagerClass & bus, ULONG deviceId, size_t bufferBytes, ULONG bufferCount, PRODUCER producer, CONSUMER consumer);
+
+    /// Stop streaming and free the stream buffers.
+    void stop();
+
+    /// Determine whether the stream is running.
+    inline BOOL isRunning()
+    {
+        return (m_hWireThread != NULL) && !m_stopping;
+    }
+
+    /// Get the first error encountered by the wire thread, if any.
+    inline HRESULT getError()
+    {
+        return m_error;
+    }
+
+    /// Get the statistics for the stream.
+    void getStats(STREAM_STATS & stats);
+
+private:
+
+    /// Enum of buffer slot states, in the order a slot moves through them.
+    const enum SLOT_STATE {
+        SLOT_FREE,              ///< Slot is available to the producer
+        SLOT_READY,             ///< Slot has been filled and is waiting for the wire
+        SLOT_ON_WIRE,           ///< Slot is being transferred
+        SLOT_DONE               ///< Slot has been transferred and is waiting for the consumer
+    };
+
+    /// Struct used to track one buffer in the ring.
+    typedef struct {
+        SLOT_STATE state;       ///< Current state of the slot
+        PBYTE txBuffer;         ///< Data to send
+        PBYTE rxBuffer;         ///< Data received
+    } SLOT, *PSLOT;
+
+    /// Struct used to accumulate stream statistics in g_hiResClock ticks.
+    typedef struct {
+        ULONGLONG buffers;
+        ULONGLONG underruns;
+        ULONGLONG overruns;
+        ULONGLONG wireTicks;
+        ULONGLONG gapTicks;
+        ULONGLONG maxGapTicks;
+    } COUNTS;
+
+    /// The SPI bus the stream runs on.
+    SpiBusManagerClass* m_bus;
+
+    /// The ID of the device on the bus the stream talks to.
+    ULONG m_deviceId;
+
+    /// The size of each buffer in the ring.
+    size_t m_bufferBytes;
+
+    /// The number of buffers in the ring.
+    ULONG m_bufferCount;
+
+    /// The buffer ring.
+    SLOT m_slots[SPI_STREAM_MAX_BUFFERS];
+
+    /// Callback used to fill TX buffers.
+    PRODUCER m_producer;
+
+    /// Callback used to process RX buffers.
+    CONSUMER m_consumer;
+
+    /// Handle of the thread that transfers the buffers.
+    HANDLE m_hWireThread;
+
+    /// Handle of the thread that runs the producer and consumer.
+    HANDLE m_hServiceThread;
+
+    /// Set to TRUE to ask the stream threads to exit.
+    volatile BOOL m_stopping;
+
+    /// First error encountered on the wire thread.
+    HRESULT m_error;
+
+    /// Stream statistics.
+    COUNTS m_counts;
+
+    /// Timer reading when the stream was started.
+    ULONGLONG m_startTime;
+
+    /// Lock protecting the slot states and statistics.
+    RTL_CRITICAL_SECTION m_lock;
+
+    /// Signalled whenever a slot changes state.
+    CONDITION_VARIABLE m_slotChanged;
+
+    /// Entry point of the wire thread.
+    static DWORD WINAPI _wireThread(LPVOID param)
+    {
+        ((SpiStreamClass*)param)->_runWire();
+        return 0;
+    }
+
+    /// Entry point of the service thread.
+    static DWORD WINAPI _serviceThread(LPVOID param)
+    {
+        ((SpiStreamClass*)param)->_runService();
+        return 0;
+    }
+
+    /// Method to transfer buffers as they become ready.
+    void _runWire();
+
+    /// Method to fill free buffers and drain completed buffers.
+    void _runService();
+
+    /// Method to free the buffer ring.
+    void _freeBuffers();
+};
+
+/**
+\param[in] bus The SPI bus the device is on.  The bus must already be open.
+\param[in] deviceId The ID of the device on the bus, as returned by addDevice().
+\param[in] bufferBytes The size of each buffer.  Each buffer is sent as one bus transaction.
+\param[in] bufferCount The number of buffers in the ring (SPI_STREAM_MIN_BUFFERS to
+SPI_STREAM_MAX_BUFFERS).
+\param[in] producer Callback used to fill TX buffers, or nullptr to send zeros.
+\param[in] consumer Callback used to process RX buffers, or nullptr to discard received data.
+\return HRESULT success or error code.
+*/
+inline HRESULT SpiStreamClass::start(SpiBusManagerClass & bus, ULONG deviceId, size_t bufferBytes, ULONG bufferCount, PRODUCER producer, CONSUMER consumer)
+{
+    HRESULT hr = S_OK;
+    ULONG i;
+
+    if (m_hWireThread != NULL)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_STATE);
+    }
+
+    if (SUCCEEDED(hr) && ((bufferBytes == 0) || (bufferCount < SPI_STREAM_MIN_BUFFERS) || (bufferCount > SPI_STREAM_MAX_BUFFERS)))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        m_bus = &bus;
+        m_deviceId = deviceId;
+        m_bufferBytes = bufferBytes;
+        m_bufferCount = bufferCount;
+        m_producer = producer;
+        m_consumer = consumer;
+        m_stopping = FALSE;
+        m_error = S_OK;
+        ZeroMemory(&m_counts, sizeof(m_counts));
+
+        for (i = 0; SUCCEEDED(hr) && (i < m_bufferCount); i++)
+        {
+            m_slots[i].state = SLOT_FREE;
+            m_slots[i].txBuffer = new BYTE[m_bufferBytes];
+            m_slots[i].rxBuffer = new BYTE[m_bufferBytes];
+            if ((m_slots[i].txBuffer == nullptr) || (m_slots[i].rxBuffer == nullptr))
+            {
+                hr = E_OUTOFMEMORY;
+            }
+            else
+            {
+                ZeroMemory(m_slots[i].txBuffer, m_bufferBytes);
+            }
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        m_startTime = g_hiResClock.now();
+
+        m_hServiceThread = CreateThread(NULL, 0, _serviceThread, this, 0, NULL);
+        m_hWireThread = CreateThread(NULL, 0, _wireThread, this, 0, NULL);
+
+        if ((m_hServiceThread == NULL) || (m_hWireThread == NULL))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            stop();
+        }
+        else
+        {
+            // The wire thread spins on the controller FIFOs, so keep it from being
+            // preempted by ordinary sketch threads.
+            SetThreadPriority(m_hWireThread, THREAD_PRIORITY_TIME_CRITICAL);
+        }
+    }
+    else
+    {
+        _freeBuffers();
+    }
+
+    return hr;
+}
+
+/**
+Any buffers that have been filled but not yet sent are discarded.
+*/
+inline void SpiStreamClass::stop()
+{
+    EnterCriticalSection(&m_lock);
+    m_stopping = TRUE;
+    WakeAllConditionVariable(&m_slotChanged);
+    LeaveCriticalSection(&m_lock);
+
+    if (m_hWireThread != NULL)
+    {
+        WaitForSingleObject(m_hWireThread, INFINITE);
+        CloseHandle(m_hWireThread);
+        m_hWireThread = NULL;
+    }
+
+    if (m_hServiceThread != NULL)
+    {
+        WaitForSingleObject(m_hServiceThread, INFINITE);
+        CloseHandle(m_hServiceThread);
+        m_hServiceThread = NULL;
+    }
+
+    _freeBuffers();
+}
+
+/**
+\param[out] stats The statistics for the stream.
+*/
+inline void SpiStreamClass::getStats(STREAM_STATS & stats)
+{
+    EnterCriticalSection(&m_lock);
+
+    stats.buffers = m_counts.buffers;
+    stats.bytes = m_counts.buffers * m_bufferBytes;
+    stats.underruns = m_counts.underruns;
+    stats.overruns = m_counts.overruns;
+    stats.wireMicroseconds = g_hiResClock.ticksToMicroseconds(m_counts.wireTicks);
+    stats.gapMicroseconds = g_hiResClock.ticksToMicroseconds(m_counts.gapTicks);
+    stats.maxGapMicroseconds = g_hiResClock.ticksToMicroseconds(m_counts.maxGapTicks);
+
+    LeaveCriticalSection(&m_lock);
+
+    stats.elapsedMicroseconds = g_hiResClock.ticksToMicroseconds(g_hiResClock.now() - m_startTime);
+    stats.bytesPerSecond = 0;
+    if (stats.elapsedMicroseconds > 0)
+    {
+        stats.bytesPerSecond = (stats.bytes * 1000000ULL) / stats.elapsedMicroseconds;
+    }
+}
+
+inline void SpiStreamClass::_runWire()
+{
+    HRESULT hr = S_OK;
+    ULONG next = 0;
+    ULONG i;
+    ULONG doneCount;
+    PSLOT slot;
+    SpiControllerClass* controller;
+    ULONGLONG startTime;
+    ULONGLONG endTime;
+    ULONGLONG lastEndTime = 0;
+    ULONGLONG gapTicks;
+    BOOL haveEndTime = FALSE;
+
+    while (SUCCEEDED(hr))
+    {
+        slot = &m_slots[next];
+
+        // Wait for the next buffer in the ring to be filled.
+        EnterCriticalSection(&m_lock);
+        if (!m_stopping && (slot->state != SLOT_READY) && haveEndTime)
+        {
+            m_counts.underruns++;
+        }
+        while (!m_stopping && (slot->state != SLOT_READY))
+        {
+            SleepConditionVariableCS(&m_slotChanged, &m_lock, INFINITE);
+        }
+        if (m_stopping)
+        {
+            LeaveCriticalSection(&m_lock);
+            break;
+        }
+        slot->state = SLOT_ON_WIRE;
+        LeaveCriticalSection(&m_lock);
+
+        // Send the buffer as one transaction with the device.
+        hr = m_bus->beginTransaction(m_deviceId, controller);
+        if (SUCCEEDED(hr))
+        {
+            startTime = g_hiResClock.now();
+            hr = controller->transferBuffer(slot->txBuffer, slot->rxBuffer, m_bufferBytes);
+            endTime = g_hiResClock.now();
+            m_bus->endTransaction(m_deviceId);
+        }
+
+        EnterCriticalSection(&m_lock);
+        if (SUCCEEDED(hr))
+        {
+            // The gap is the time the bus clock was idle between the end of the
+            // previous buffer and the start of this one.
+            if (haveEndTime)
+            {
+                gapTicks = startTime - lastEndTime;
+                m_counts.gapTicks += gapTicks;
+                if (gapTicks > m_counts.maxGapTicks)
+                {
+                    m_counts.maxGapTicks = gapTicks;
+                }
+            }
+            lastEndTime = endTime;
+            m_counts.buffers++;
+            m_counts.wireTicks += endTime - startTime;
+        }
+        slot->state = SLOT_DONE;
+
+        // If every buffer is now waiting for the consumer, received data is backing up.
+        doneCount = 0;
+        for (i = 0; i < m_bufferCount; i++)
+        {
+            if (m_slots[i].state == SLOT_DONE)
+            {
+                doneCount++;
+            }
+        }
+        if (doneCount == m_bufferCount)
+        {
+            m_counts.overruns++;
+        }
+
+        WakeAllConditionVariable(&m_slotChanged);
+        LeaveCriticalSection(&m_lock);
+
+        next = (next + 1) % m_bufferCount;
+        haveEndTime = SUCCEEDED(hr);
+    }
+
+    if (FAILED(hr))
+    {
+        EnterCriticalSection(&m_lock);
+        m_error = hr;
+        m_stopping = TRUE;
+        WakeAllConditionVariable(&m_slotChanged);
+        LeaveCriticalSection(&m_lock);
+    }
+}
+
+inline void SpiStreamClass::_runService()
+{
+    ULONG nextDone = 0;
+    ULONG nextFree = 0;
+    PSLOT slot;
+    BOOL didWork;
+    BOOL filled;
+
+    EnterCriticalSection(&m_lock);
+
+    while (!m_stopping)
+    {
+        didWork = FALSE;
+
+        // Hand completed buffers to the consumer, in ring order.
+        slot = &m_slots[nextDone];
+        if (slot->state == SLOT_DONE)
+        {
+            LeaveCriticalSection(&m_lock);
+            if (m_consumer)
+            {
+                m_consumer(slot->rxBuffer, m_bufferBytes);
+            }
+            EnterCriticalSection(&m_lock);
+
+            slot->state = SLOT_FREE;
+            nextDone = (nextDone + 1) % m_bufferCount;
+            didWork = TRUE;
+        }
+
+        // Fill free buffers, in ring order.
+        slot = &m_slots[nextFree];
+        if (!m_stopping && (slot->state == SLOT_FREE))
+        {
+            LeaveCriticalSection(&m_lock);
+            filled = TRUE;
+            if (m_producer)
+            {
+                filled = m_producer(slot->txBuffer, m_bufferBytes);
+            }
+            EnterCriticalSection(&m_lock);
+
+            if (filled)
+            {
+                slot->state = SLOT_READY;
+                nextFree = (nextFree + 1) % m_bufferCount;
+                WakeAllConditionVariable(&m_slotChanged);
+                didWork = TRUE;
+            }
+        }
+
+        if (!didWork && !m_stopping)
+        {
+            // If the producer had no data, poll it again shortly rather than waiting
+            // for a slot to change state.
+            SleepConditionVariableCS(&m_slotChanged, &m_lock, (slot->state == SLOT_FREE) ? 1 : INFINITE);
+        }
+    }
+
+    LeaveCriticalSection(&m_lock);
+}
+
+inline void SpiStreamClass::_freeBuffers()
+{
+    ULONG i;
+
+    for (i = 0; i < SPI_STREAM_MAX_BUFFERS; i++)
+    {
+        if (m_slots[i].txBuffer != nullptr)
+        {
+            delete[] m_slots[i].txBuffer;
+            m_slots[i].txBuffer = nullptr;
+        }
+        if (m_slots[i].rxBuffer != nullptr)
+        {
+            delete[] m_slots[i].rxBuffer;
+            m_slots[i].rxBuffer = nullptr;
+        }
+        m_slots[i].state = SLOT_FREE;
+    }
+}
+
+#endif  // _SPI_STREAM_H_
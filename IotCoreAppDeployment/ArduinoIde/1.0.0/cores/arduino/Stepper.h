@@ -73,6 +73,10 @@
  * The circuits can be found at
  *
  * http://www.arduino.cc/en/Tutorial/Stepper
+ *
+ * step() blocks until all the steps are done and runs at a constant speed.
+ * For moves that return at once, with acceleration, and with several motors
+ * moving together, see StepperEngine.h.
  */
 
 // ensure this library description is only included once
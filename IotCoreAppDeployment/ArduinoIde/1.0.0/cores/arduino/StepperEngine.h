@@ -0,0 +1,1180 @@
+// Copyright (c) Microsoft Open Technologies, Inc.  All rights reserved.  
+// Licensed under the BSD 2-Clause License.  
+// See License.txt in the project root for license information.
+
+#ifndef _STEPPER_ENGINE_H_
+#define _STEPPER_ENGINE_H_
+
+#include <Windows.h>
+#include <math.h>
+
+#include "ArduinoCommon.h"
+#include "BoardPins.h"
+#include "GpioController.h"
+#include "HiResTimer.h"
+
+/// The maximum number of motors the stepper engine can drive.
+#define STEPPER_ENGINE_MAX_MOTORS 8
+
+/// The maximum number of control pins on one motor.
+#define STEPPER_ENGINE_MAX_PINS 5
+
+/// The highest speed that can be set on a motor, in steps per second.
+#define STEPPER_ENGINE_MAX_STEP_RATE 20000
+
+/// Steps due less than this far apart are written together.
+#define STEPPER_ENGINE_MERGE_NANOSECONDS 1000
+
+/// Class used to move stepper motors without blocking the sketch.
+/**
+This is a non-blocking alternative to the Stepper library, for the same 2, 4 and 5 wire
+motors and coil sequences.  moveTo() starts a move and returns at once; one high priority
+thread generates the steps for all the motors, and isRunning() tells when a move is done.
+
+Each move follows a speed profile that accelerates from rest to the motor's maximum speed,
+cruises, and decelerates to rest at the target.  The trapezoid profile changes speed at a
+constant acceleration.  The S-curve profile eases the speed in and out along a raised cosine,
+which has no step changes in acceleration (so less jerk).  Its peak acceleration is the
+setting, so it takes pi/2 times as long as the trapezoid to reach full speed.  The time of
+each step is worked out from the profile when the step before it is taken, so timing errors
+do not accumulate.
+
+Several motors can be moved together with a coordinated move.  The motor with the most steps
+to go follows the profile, and the others step in proportion to it (by Bresenham's line
+algorithm), so the motors move in a straight line and all finish together.  The profile is
+slowed if needed so that no motor goes over its own maximum speed or acceleration.
+
+On a bare PI2, the pins of all the motors that step at the same time are written with one
+store to GPCLR0 and one to GPSET0.  Pins above GPIO 31, and all pins on other boards, are
+written one at a time with BoardPinsClass::setPinState().
+*/
+class StepperEngineClass
+{
+public:
+    /// Speed profile shapes.
+    enum PROFILE {
+        PROFILE_TRAPEZOID,      ///< Constant acceleration
+        PROFILE_S_CURVE         ///< Raised cosine speed ramps
+    };
+
+    /// Struct used to return engine statistics.
+    typedef struct {
+        ULONGLONG steps;                    ///< Number of motor steps taken
+        ULONGLONG writes;                   ///< Number of pin writes used for those steps
+        ULONGLONG meanLateNanoseconds;      ///< Average time a write was made after it was due
+        ULONGLONG maxLateNanoseconds;       ///< Longest time a write was made after it was due
+        ULONGLONG cpuMicroseconds;          ///< CPU time used by the engine thread
+        ULONGLONG elapsedMicroseconds;      ///< Time over which the statistics were gathered
+    } STEPPER_STATS, *PSTEPPER_STATS;
+
+    /// Constructor.
+    StepperEngineClass() :
+        m_motorCount(0),
+        m_hThread(NULL),
+        m_hMovesChanged(NULL),
+        m_stopping(FALSE),
+        m_error(S_OK),
+        m_statsCpuStart(0)
+    {
+        InitializeCriticalSection(&m_lock);
+        ZeroMemory(m_motors, sizeof(m_motors));
+        ZeroMemory(m_moves, sizeof(m_moves));
+        ZeroMemory(&m_counts, sizeof(m_counts));
+        m_mergeTicks = g_hiResClock.nanosecondsToTicks(STEPPER_ENGINE_MERGE_NANOSECONDS);
+        m_statsStart = g_hiResClock.now();
+    }
+
+    /// Destructor.
+    /**
+    Stops a running engine thread and waits a bounded time for it to exit, so it is not
+    using the motor state when that is freed.  The pins are not released, since g_pins
+    can't safely be called during static destruction; call end() first for a full shutdown.
+    */
+    virtual ~StepperEngineClass()
+    {
+        m_stopping = TRUE;
+        if (m_hThread != NULL)
+        {
+            SetEvent(m_hMovesChanged);
+            if (!HiResWaitTimerClass::waitForThreadExit(m_hThread))
+            {
+                return;
+            }
+        }
+
+        if (m_hMovesChanged != NULL)
+        {
+            CloseHandle(m_hMovesChanged);
+        }
+        m_waitTimer.close();
+        DeleteCriticalSection(&m_lock);
+    }
+
+    /// Add a motor to the engine.
+    HRESULT addMotor(ULONG pinCount, const ULONG* pins, ULONG & motor);
+
+    /// Set the top speed of a motor.
+    HRESULT setMaxSpeed(ULONG motor, ULONG stepsPerSecond);
+
+    /// Set the acceleration of a motor.
+    HRESULT setAcceleration(ULONG motor, ULONG stepsPerSecondPerSecond);
+
+    /// Set the speed profile shape of a motor.
+    HRESULT setProfile(ULONG motor, PROFILE profile);
+
+    /// Start moving a motor to a position.
+    inline HRESULT moveTo(ULONG motor, LONG position)
+    {
+        return moveTo(&motor, &position, 1);
+    }
+
+    /// Start a coordinated move of several motors, so that they all finish together.
+    HRESULT moveTo(const ULONG* motors, const LONG* positions, ULONG count);
+
+    /// Determine whether a motor is moving.
+    BOOL isRunning(ULONG motor);
+
+    /// Determine whether any motor is moving.
+    BOOL isRunning();
+
+    /// Decelerate a motor, and any motors in the same coordinated move, to a stop.
+    HRESULT stop(ULONG motor);
+
+    /// Get the position of a motor, in steps.
+    HRESULT getPosition(ULONG motor, LONG & position);
+
+    /// Set the position of a motor that is not moving, in steps.
+    HRESULT setPosition(ULONG motor, LONG position);
+
+    /// Stop all motors at once (without decelerating), remove them, and stop the engine thread.
+    void end();
+
+    /// Get the first error encountered by the engine thread, if any.
+    inline HRESULT getError()
+    {
+        return m_error;
+    }
+
+    /// Get the engine statistics.
+    void getStats(STEPPER_STATS & stats);
+
+    /// Clear the engine statistics.
+    void resetStats();
+
+private:
+
+    /// Value of MOTOR::move for a motor that is not moving.
+    static const ULONG NO_MOVE = 0xFFFFFFFF;
+
+    /// Struct used to hold the state of one motor.
+    typedef struct {
+        ULONG pins[STEPPER_ENGINE_MAX_PINS];        ///< The control pins
+        ULONG portMasks[STEPPER_ENGINE_MAX_PINS];   ///< Mask of each pin's bit in GPSET0/GPCLR0, or zero if it is written on its own
+        ULONG pinCount;                 ///< Number of control pins (2, 4 or 5)
+        ULONG phase;                    ///< Position in the coil sequence
+        ULONG pattern;                  ///< Pin levels last written, one bit per pin
+        BOOL energized;                 ///< TRUE once the pins have been written
+        LONG position;                  ///< Position in steps
+        ULONG maxSpeed;                 ///< Top speed in steps per second
+        ULONG acceleration;             ///< Acceleration in steps per second per second
+        PROFILE profile;                ///< Speed profile shape
+        ULONG move;                     ///< Index of the move the motor is part of, or NO_MOVE
+        ULONG steps;                    ///< Steps to take in the move
+        ULONG error;                    ///< Bresenham error term for the move
+        LONG direction;                 ///< 1 or -1
+    } MOTOR;
+
+    /// Struct used to hold the state of one move of one or more motors.
+    typedef struct {
+        BOOL active;                    ///< TRUE while the move is in progress
+        ULONG motors;                   ///< Mask of the motors in the move
+        ULONG major;                    ///< The motor with the most steps, which follows the profile
+        ULONG steps;                    ///< Steps the major motor takes in the move
+        ULONG step;                     ///< Steps the major motor has taken
+        PROFILE profile;                ///< Speed profile shape
+        double speed;                   ///< Cruise speed of the major motor, in steps per second
+        double rampTime;                ///< Time to accelerate to the cruise speed, in seconds
+        double rampSteps;               ///< Steps taken while accelerating to the cruise speed
+        double totalTime;               ///< Time the whole move takes, in seconds
+        double acceleration;            ///< Acceleration of the major motor, in steps per second per second
+        double stepTime;                ///< Time the next step is due, in seconds from the start of the move
+        double lastInterval;            ///< Time between the last two steps, in seconds
+        BOOL stopping;                  ///< TRUE once stop() has been called
+        ULONG stopStep;                 ///< Step at which the stop started
+        double stopTime;                ///< Time of the last step before the stop started
+        double stopSpeed;               ///< Speed at which the stop started
+        ULONGLONG startTicks;           ///< Timer reading at the start of the move
+        ULONGLONG nextTicks;            ///< Timer reading when the next step is due
+    } MOVE;
+
+    /// Struct used to gather the pin changes of one write.
+    typedef struct {
+        ULONG setBits;                  ///< Mask of GPSET0 bits to set
+        ULONG clearBits;                ///< Mask of GPCLR0 bits to set
+        ULONG slowCount;                ///< Number of pins to write on their own
+        ULONG slowPins[STEPPER_ENGINE_MAX_MOTORS * STEPPER_ENGINE_MAX_PINS];
+        ULONG slowStates[STEPPER_ENGINE_MAX_MOTORS * STEPPER_ENGINE_MAX_PINS];
+    } WRITE;
+
+    /// Struct used to accumulate engine statistics in timer ticks.
+    typedef struct {
+        ULONGLONG steps;
+        ULONGLONG writes;
+        ULONGLONG lateTicks;
+        ULONGLONG maxLateTicks;
+    } COUNTS;
+
+    /// Lock that protects the motors and moves.
+    CRITICAL_SECTION m_lock;
+
+    /// The motors.
+    MOTOR m_motors[STEPPER_ENGINE_MAX_MOTORS];
+
+    /// The number of motors added.
+    ULONG m_motorCount;
+
+    /// The moves.  There can't be more moves than motors.
+    MOVE m_moves[STEPPER_ENGINE_MAX_MOTORS];
+
+    /// Handle of the engine thread.
+    HANDLE m_hThread;
+
+    /// Event signalled when a move is started, to wake the engine thread.
+    HANDLE m_hMovesChanged;
+
+    /// Timer the engine thread waits on between steps.
+    HiResWaitTimerClass m_waitTimer;
+
+    /// Steps due within this many timer ticks of each other are written together.
+    ULONGLONG m_mergeTicks;
+
+    /// Set to TRUE to ask the engine thread to exit.
+    volatile BOOL m_stopping;
+
+    /// First error encountered on the engine thread.
+    HRESULT m_error;
+
+    /// Engine statistics.  Changed and read with m_lock held.
+    COUNTS m_counts;
+
+    /// Timer reading and engine thread CPU time (in microseconds) when the statistics were last cleared.
+    ULONGLONG m_statsStart;
+    ULONGLONG m_statsCpuStart;
+
+    /// Entry point of the engine thread.
+    static DWORD WINAPI _engineThread(LPVOID param)
+    {
+        ((StepperEngineClass*)param)->_runEngine();
+        return 0;
+    }
+
+    /// Method to take the steps as they come due.
+    void _runEngine();
+
+    /// Method to start the engine thread if it is not running.
+    HRESULT _startEngine();
+
+    /// Method to take one step of a move and work out when the next one is due.
+    void _stepMove(ULONG moveIndex, WRITE & write);
+
+    /// Method to take one step of a motor.
+    void _stepMotor(MOTOR & motor, WRITE & write);
+
+    /// Method to write the pin changes for the steps taken together.
+    HRESULT _write(const WRITE & write);
+
+    /// Method to end a move and free its motors.
+    void _endMove(ULONG moveIndex);
+
+    /// Method to work out the speed profile of a move.
+    static void _planMove(MOVE & move, double maxSpeed, double acceleration);
+
+    /// Method to work out when a step of a move is due.
+    static double _stepTime(const MOVE & move, ULONG step);
+
+    /// Method to work out when a step in the acceleration ramp of a move is due.
+    static double _rampTime(const MOVE & move, double steps, double after);
+
+    /// Method to get the coil pattern for a position in the coil sequence.
+    static inline ULONG _coilPattern(ULONG pinCount, ULONG phase)
+    {
+        // One bit per control pin, bit 0 for the first pin, from the sequences in Stepper.h.
+        static const UCHAR twoWire[4] = { 0x02, 0x03, 0x01, 0x00 };
+        static const UCHAR fourWire[4] = { 0x05, 0x06, 0x0A, 0x09 };
+        static const UCHAR fiveWire[10] = { 0x16, 0x12, 0x1A, 0x0A, 0x0B, 0x09, 0x0D, 0x05, 0x15, 0x14 };
+
+        switch (pinCount)
+        {
+        case 2:
+            return twoWire[phase];
+        case 4:
+            return fourWire[phase];
+        default:
+            return fiveWire[phase];
+        }
+    }
+
+    /// Method to check a motor number.
+    inline HRESULT _checkMotor(ULONG motor)
+    {
+        return (motor < m_motorCount) ? S_OK : E_INVALIDARG;
+    }
+};
+
+/// The global stepper engine.
+__declspec(selectany) StepperEngineClass StepperEngine;
+
+/**
+The pins are configured as digital outputs and locked to digital I/O use.  They are not
+written until the motor first steps.  The motor starts at position zero, with a top speed of
+200 steps per second, an acceleration of 400 steps per second per second, and the trapezoid
+profile.
+\param[in] pinCount The number of control pins: 2, 4 or 5, as for the Stepper library.
+\param[in] pins Array of the control pins, in the order of the Stepper constructor arguments.
+\param[out] motor The number of the motor, used to refer to it in other calls.
+\return HRESULT success or error code.
+*/
+inline HRESULT StepperEngineClass::addMotor(ULONG pinCount, const ULONG* pins, ULONG & motor)
+{
+    HRESULT hr = S_OK;
+    MOTOR* newMotor;
+    ULONG locked = 0;
+    ULONG i;
+
+    if (((pinCount != 2) && (pinCount != 4) && (pinCount != 5)) || (pins == nullptr))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr) && (m_motorCount >= STEPPER_ENGINE_MAX_MOTORS))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_NO_MORE_ITEMS);
+    }
+
+    for (i = 0; SUCCEEDED(hr) && (i < pinCount); i++)
+    {
+        hr = g_pins.verifyPinFunction(pins[i], FUNC_DIO, BoardPinsClass::LOCK_FUNCTION);
+
+        if (SUCCEEDED(hr))
+        {
+            locked = i + 1;
+            hr = g_pins.setPinMode(pins[i], DIRECTION_OUT, FALSE);
+        }
+    }
+
+    if (FAILED(hr))
+    {
+        // Release the pins this call locked, so they can be used again.
+        for (i = 0; i < locked; i++)
+        {
+            g_pins.verifyPinFunction(pins[i], FUNC_DIO, BoardPinsClass::UNLOCK_FUNCTION);
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        EnterCriticalSection(&m_lock);
+
+        newMotor = &m_motors[m_motorCount];
+        ZeroMemory(newMotor, sizeof(*newMotor));
+        newMotor->pinCount = pinCount;
+        newMotor->maxSpeed = 200;
+        newMotor->acceleration = 400;
+        newMotor->profile = PROFILE_TRAPEZOID;
+        newMotor->move = NO_MOVE;
+        for (i = 0; i < pinCount; i++)
+        {
+            newMotor->pins[i] = pins[i];
+        }
+
+#if defined(_M_ARM)
+        // On a bare PI2, pins on GPIO 00-31 are written with port-wide set and clear writes.
+        BoardPinsClass::BOARD_TYPE board;
+        ULONG portBit;
+
+        if (SUCCEEDED(g_pins.getBoardType(board)) && (board == BoardPinsClass::PI2_BARE))
+        {
+            for (i = 0; i < pinCount; i++)
+            {
+                if (SUCCEEDED(g_pins.getPinPortBit(pins[i], portBit)) && (portBit < 32))
+                {
+                    newMotor->portMasks[i] = 1UL << portBit;
+                }
+            }
+        }
+#endif // defined(_M_ARM)
+
+        motor = m_motorCount;
+        m_motorCount++;
+
+        LeaveCriticalSection(&m_lock);
+    }
+
+    return hr;
+}
+
+/**
+The new speed is used by moves started after the call.
+\param[in] motor The number of the motor.
+\param[in] stepsPerSecond The top speed, range 1 to STEPPER_ENGINE_MAX_STEP_RATE.
+\return HRESULT success or error code.
+*/
+inline HRESULT StepperEngineClass::setMaxSpeed(ULONG motor, ULONG stepsPerSecond)
+{
+    HRESULT hr = _checkMotor(motor);
+
+    if (SUCCEEDED(hr) && ((stepsPerSecond == 0) || (stepsPerSecond > STEPPER_ENGINE_MAX_STEP_RATE)))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        m_motors[motor].maxSpeed = stepsPerSecond;
+    }
+
+    return hr;
+}
+
+/**
+The new acceleration is used by moves started after the call, and by stop().
+\param[in] motor The number of the motor.
+\param[in] stepsPerSecondPerSecond The acceleration and deceleration.  Must not be zero.
+\return HRESULT success or error code.
+*/
+inline HRESULT StepperEngineClass::setAcceleration(ULONG motor, ULONG stepsPerSecondPerSecond)
+{
+    HRESULT hr = _checkMotor(motor);
+
+    if (SUCCEEDED(hr) && (stepsPerSecondPerSecond == 0))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        m_motors[motor].acceleration = stepsPerSecondPerSecond;
+    }
+
+    return hr;
+}
+
+/**
+The new profile is used by moves started after the call.  A coordinated move uses the profile
+of the motor with the most steps to take.
+\param[in] motor The number of the motor.
+\param[in] profile The speed profile shape.
+\return HRESULT success or error code.
+*/
+inline HRESULT StepperEngineClass::setProfile(ULONG motor, PROFILE profile)
+{
+    HRESULT hr = _checkMotor(motor);
+
+    if (SUCCEEDED(hr) && (profile != PROFILE_TRAPEZOID) && (profile != PROFILE_S_CURVE))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        m_motors[motor].profile = profile;
+    }
+
+    return hr;
+}
+
+/**
+None of the motors may already be moving.  Motors that are already at their target take part
+in the move without stepping.
+\param[in] motors Array of the numbers of the motors to move.  No motor may appear twice.
+\param[in] positions Array of the target position for each motor, in steps.
+\param[in] count The number of motors to move.
+\return HRESULT success or error code.
+*/
+inline HRESULT StepperEngineClass::moveTo(const ULONG* motors, const LONG* positions, ULONG count)
+{
+    HRESULT hr = S_OK;
+    MOVE* move = nullptr;
+    MOTOR* motor;
+    ULONG moveIndex = 0;
+    ULONG mask = 0;
+    ULONG steps;
+    double scale;
+    double maxSpeed = 0.0;
+    double acceleration = 0.0;
+    ULONG i;
+
+    if ((motors == nullptr) || (positions == nullptr) || (count == 0) || (count > STEPPER_ENGINE_MAX_MOTORS))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    for (i = 0; SUCCEEDED(hr) && (i < count); i++)
+    {
+        hr = _checkMotor(motors[i]);
+        if (FAILED(hr))
+        {
+            break;
+        }
+        if ((mask & (1UL << motors[i])) != 0)
+        {
+            hr = E_INVALIDARG;
+        }
+        mask |= 1UL << motors[i];
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = _startEngine();
+    }
+
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    EnterCriticalSection(&m_lock);
+
+    for (i = 0; SUCCEEDED(hr) && (i < count); i++)
+    {
+        if (m_motors[motors[i]].move != NO_MOVE)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_BUSY);
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        // There is one move slot per motor, so a free one is always found.
+        while (m_moves[moveIndex].active)
+        {
+            moveIndex++;
+        }
+        move = &m_moves[moveIndex];
+        ZeroMemory(move, sizeof(*move));
+        move->motors = mask;
+
+        // The motor with the most steps leads.
+        for (i = 0; i < count; i++)
+        {
+            motor = &m_motors[motors[i]];
+            motor->direction = (positions[i] >= motor->position) ? 1 : -1;
+            motor->steps = (ULONG)((positions[i] - motor->position) * motor->direction);
+            motor->error = 0;
+            if (motor->steps > move->steps)
+            {
+                move->steps = motor->steps;
+                move->major = motors[i];
+            }
+        }
+    }
+
+    if (SUCCEEDED(hr) && (move->steps > 0))
+    {
+        // Limit the lead motor's speed and acceleration so no motor exceeds its own.
+        for (i = 0; i < count; i++)
+        {
+            motor = &m_motors[motors[i]];
+            steps = motor->steps;
+            if (steps == 0)
+            {
+                continue;
+            }
+
+            scale = (double)move->steps / steps;
+            if ((maxSpeed == 0.0) || ((motor->maxSpeed * scale) < maxSpeed))
+            {
+                maxSpeed = motor->maxSpeed * scale;
+            }
+            if ((acceleration == 0.0) || ((motor->acceleration * scale) < acceleration))
+            {
+                acceleration = motor->acceleration * scale;
+            }
+
+            // Start each follower half a step along, so its steps are centred on the line.
+            motor->error = move->steps / 2;
+            motor->move = moveIndex;
+        }
+
+        move->profile = m_motors[move->major].profile;
+        _planMove(*move, maxSpeed, acceleration);
+
+        move->startTicks = g_hiResClock.now();
+        move->stepTime = _stepTime(*move, 1);
+        move->nextTicks = move->startTicks + (ULONGLONG)(move->stepTime * g_hiResClock.getFrequency());
+        move->active = TRUE;
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    if (SUCCEEDED(hr))
+    {
+        SetEvent(m_hMovesChanged);
+    }
+
+    return hr;
+}
+
+/**
+\param[in] motor The number of the motor.
+\return TRUE if the motor is part of a move that has not finished.
+*/
+inline BOOL StepperEngineClass::isRunning(ULONG motor)
+{
+    return SUCCEEDED(_checkMotor(motor)) && (m_motors[motor].move != NO_MOVE);
+}
+
+inline BOOL StepperEngineClass::isRunning()
+{
+    ULONG i;
+
+    for (i = 0; i < m_motorCount; i++)
+    {
+        if (m_motors[i].move != NO_MOVE)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/**
+The motors decelerate at the lead motor's acceleration from the speed they are at, and the
+move ends when they come to rest, short of the target.  Motors in a coordinated move stay in
+line.  Use isRunning() to find out when the motors have stopped.
+\param[in] motor The number of a motor in the move to stop.
+\return HRESULT success or error code.  Stopping a motor that is not moving is not an error.
+*/
+inline HRESULT StepperEngineClass::stop(ULONG motor)
+{
+    HRESULT hr = _checkMotor(motor);
+    MOVE* move;
+    double stopSteps;
+
+    if (SUCCEEDED(hr))
+    {
+        EnterCriticalSection(&m_lock);
+
+        if ((m_motors[motor].move != NO_MOVE) && !m_moves[m_motors[motor].move].stopping)
+        {
+            move = &m_moves[m_motors[motor].move];
+            move->stopping = TRUE;
+            move->stopStep = move->step;
+            move->stopTime = move->stepTime - move->lastInterval;
+            move->stopSpeed = 0.0;
+            if ((move->step > 0) && (move->lastInterval > 0.0))
+            {
+                move->stopSpeed = 1.0 / move->lastInterval;
+            }
+
+            // Steps needed to come to rest: v^2 / 2a.
+            stopSteps = floor((move->stopSpeed * move->stopSpeed) / (2.0 * move->acceleration));
+            if ((move->step + stopSteps) < move->steps)
+            {
+                move->steps = move->step + (ULONG)stopSteps;
+            }
+
+            if (move->step >= move->steps)
+            {
+                _endMove(m_motors[motor].move);
+            }
+            else
+            {
+                move->stepTime = _stepTime(*move, move->step + 1);
+                move->nextTicks = move->startTicks + (ULONGLONG)(move->stepTime * g_hiResClock.getFrequency());
+            }
+        }
+
+        LeaveCriticalSection(&m_lock);
+    }
+
+    return hr;
+}
+
+/**
+\param[in] motor The number of the motor.
+\param[out] position The position of the motor, in steps.
+\return HRESULT success or error code.
+*/
+inline HRESULT StepperEngineClass::getPosition(ULONG motor, LONG & position)
+{
+    HRESULT hr = _checkMotor(motor);
+
+    if (SUCCEEDED(hr))
+    {
+        position = m_motors[motor].position;
+    }
+
+    return hr;
+}
+
+/**
+\param[in] motor The number of the motor.
+\param[in] position The new position of the motor, in steps.
+\return HRESULT success or error code.
+*/
+inline HRESULT StepperEngineClass::setPosition(ULONG motor, LONG position)
+{
+    HRESULT hr = _checkMotor(motor);
+
+    if (SUCCEEDED(hr))
+    {
+        EnterCriticalSection(&m_lock);
+
+        if (m_motors[motor].move != NO_MOVE)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_BUSY);
+        }
+        else
+        {
+            m_motors[motor].position = position;
+        }
+
+        LeaveCriticalSection(&m_lock);
+    }
+
+    return hr;
+}
+
+inline void StepperEngineClass::end()
+{
+    ULONG i;
+    ULONG j;
+
+    m_stopping = TRUE;
+
+    if (m_hThread != NULL)
+    {
+        SetEvent(m_hMovesChanged);
+        WaitForSingleObject(m_hThread, INFINITE);
+        CloseHandle(m_hThread);
+        m_hThread = NULL;
+    }
+
+    if (m_hMovesChanged != NULL)
+    {
+        CloseHandle(m_hMovesChanged);
+        m_hMovesChanged = NULL;
+    }
+
+    m_waitTimer.close();
+
+    EnterCriticalSection(&m_lock);
+
+    for (i = 0; i < m_motorCount; i++)
+    {
+        for (j = 0; j < m_motors[i].pinCount; j++)
+        {
+            g_pins.verifyPinFunction(m_motors[i].pins[j], FUNC_DIO, BoardPinsClass::UNLOCK_FUNCTION);
+        }
+    }
+    ZeroMemory(m_moves, sizeof(m_moves));
+    m_motorCount = 0;
+
+    LeaveCriticalSection(&m_lock);
+}
+
+/**
+\param[out] stats The statistics gathered since the engine started or they were cleared.
+*/
+inline void StepperEngineClass::getStats(STEPPER_STATS & stats)
+{
+    EnterCriticalSection(&m_lock);
+
+    stats.steps = m_counts.steps;
+    stats.writes = m_counts.writes;
+    stats.meanLateNanoseconds = 0;
+    if (m_counts.writes > 0)
+    {
+        stats.meanLateNanoseconds = g_hiResClock.ticksToNanoseconds(m_counts.lateTicks) / m_counts.writes;
+    }
+    stats.maxLateNanoseconds = g_hiResClock.ticksToNanoseconds(m_counts.maxLateTicks);
+    stats.cpuMicroseconds = HiResWaitTimerClass::threadCpuMicroseconds(m_hThread) - m_statsCpuStart;
+    stats.elapsedMicroseconds = g_hiResClock.ticksToMicroseconds(g_hiResClock.now() - m_statsStart);
+
+    LeaveCriticalSection(&m_lock);
+}
+
+inline void StepperEngineClass::resetStats()
+{
+    EnterCriticalSection(&m_lock);
+    ZeroMemory(&m_counts, sizeof(m_counts));
+    m_statsStart = g_hiResClock.now();
+    m_statsCpuStart = HiResWaitTimerClass::threadCpuMicroseconds(m_hThread);
+    LeaveCriticalSection(&m_lock);
+}
+
+inline HRESULT StepperEngineClass::_startEngine()
+{
+    HRESULT hr = S_OK;
+
+    if (m_hThread != NULL)
+    {
+        return S_OK;
+    }
+
+    m_stopping = FALSE;
+    m_error = S_OK;
+
+    m_hMovesChanged = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (m_hMovesChanged == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = m_waitTimer.open();
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        // Clear the statistics before the thread starts counting.
+        resetStats();
+        hr = HiResWaitTimerClass::startThread(_engineThread, this, m_hThread);
+    }
+
+    if (FAILED(hr))
+    {
+        m_waitTimer.close();
+        if (m_hMovesChanged != NULL)
+        {
+            CloseHandle(m_hMovesChanged);
+            m_hMovesChanged = NULL;
+        }
+    }
+
+    return hr;
+}
+
+/**
+Both profiles are planned with their mean acceleration over the ramp: rampTime = speed /
+acceleration, and rampSteps = speed * rampTime / 2.  The raised cosine peaks at pi/2 times its
+mean, so for the S-curve the mean is the setting times 2/pi.  A move too short to reach the
+top speed accelerates for half its steps and decelerates for the other half.
+\param[in,out] move The move.  Its steps and profile must be set.
+\param[in] maxSpeed The top speed of the lead motor, in steps per second.
+\param[in] acceleration The highest acceleration allowed for the lead motor, in steps per
+second per second.
+*/
+inline void StepperEngineClass::_planMove(MOVE & move, double maxSpeed, double acceleration)
+{
+    const double pi = 3.14159265358979323846;
+
+    if (move.profile == PROFILE_S_CURVE)
+    {
+        acceleration = (acceleration * 2.0) / pi;
+    }
+
+    move.acceleration = acceleration;
+    move.speed = maxSpeed;
+    if (((maxSpeed * maxSpeed) / acceleration) > move.steps)
+    {
+        move.speed = sqrt(move.steps * acceleration);
+    }
+
+    move.rampTime = move.speed / acceleration;
+    move.rampSteps = (move.speed * move.rampTime) / 2.0;
+    move.totalTime = (2.0 * move.rampTime) + ((move.steps - (2.0 * move.rampSteps)) / move.speed);
+}
+
+/**
+\param[in] move The move.
+\param[in] steps The number of steps from rest, no more than move.rampSteps.
+\param[in] after A time known to be no later than the answer, to start the search from.
+\return The time taken to accelerate from rest through the steps, in seconds.
+*/
+inline double StepperEngineClass::_rampTime(const MOVE & move, double steps, double after)
+{
+    const double pi = 3.14159265358979323846;
+    double low = after;
+    double high = move.rampTime;
+    double time;
+    double position;
+    double speed;
+    ULONG i;
+
+    if (move.profile == PROFILE_TRAPEZOID)
+    {
+        // steps = speed * t^2 / (2 * rampTime)
+        return sqrt((2.0 * steps * move.rampTime) / move.speed);
+    }
+
+    // S-curve: speed(t) = speed * (1 - cos(pi * t / rampTime)) / 2, so
+    // steps(t) = speed * (t - (rampTime / pi) * sin(pi * t / rampTime)) / 2.
+    // Solve for t by Newton's method, kept inside a bracket that bisection narrows.
+    time = (low + high) / 2.0;
+    for (i = 0; i < 60; i++)
+    {
+        position = (move.speed * (time - ((move.rampTime / pi) * sin((pi * time) / move.rampTime)))) / 2.0;
+        if (position < steps)
+        {
+            low = time;
+        }
+        else
+        {
+            high = time;
+        }
+        if ((high - low) < 1e-9)
+        {
+            break;
+        }
+
+        speed = (move.speed * (1.0 - cos((pi * time) / move.rampTime))) / 2.0;
+        if (speed > 0.0)
+        {
+            time = time - ((position - steps) / speed);
+        }
+        if ((speed <= 0.0) || (time <= low) || (time >= high))
+        {
+            time = (low + high) / 2.0;
+        }
+    }
+    return time;
+}
+
+/**
+\param[in] move The move.
+\param[in] step The step number, from 1 to move.steps.
+\return The time the step is due, in seconds from the start of the move.
+*/
+inline double StepperEngineClass::_stepTime(const MOVE & move, ULONG step)
+{
+    double remaining;
+    double steps;
+
+    if (move.stopping)
+    {
+        // Constant deceleration from the speed the stop started at:
+        // steps = v * t - a * t^2 / 2.
+        steps = (double)(step - move.stopStep);
+        remaining = (move.stopSpeed * move.stopSpeed) - (2.0 * move.acceleration * steps);
+        return move.stopTime + ((move.stopSpeed - sqrt((remaining > 0.0) ? remaining : 0.0)) / move.acceleration);
+    }
+
+    if (step <= move.rampSteps)
+    {
+        return _rampTime(move, step, move.stepTime);
+    }
+
+    if (step <= (move.steps - move.rampSteps))
+    {
+        return move.rampTime + ((step - move.rampSteps) / move.speed);
+    }
+
+    // Deceleration mirrors the acceleration ramp.
+    return move.totalTime - _rampTime(move, move.steps - step, 0.0);
+}
+
+/**
+\param[in,out] motor The motor.
+\param[in,out] write Gathers the pin changes for the step.
+*/
+inline void StepperEngineClass::_stepMotor(MOTOR & motor, WRITE & write)
+{
+    ULONG phases = (motor.pinCount == 5) ? 10 : 4;
+    ULONG pattern;
+    ULONG changed;
+    ULONG level;
+    ULONG i;
+
+    motor.position += motor.direction;
+    motor.phase = (motor.phase + phases + motor.direction) % phases;
+
+    pattern = _coilPattern(motor.pinCount, motor.phase);
+    changed = motor.energized ? (pattern ^ motor.pattern) : ((1UL << motor.pinCount) - 1);
+    motor.pattern = pattern;
+    motor.energized = TRUE;
+
+    for (i = 0; i < motor.pinCount; i++)
+    {
+        if (((changed >> i) & 1) == 0)
+        {
+            continue;
+        }
+
+        level = (pattern >> i) & 1;
+        if (motor.portMasks[i] != 0)
+        {
+            if (level)
+            {
+                write.setBits |= motor.portMasks[i];
+            }
+            else
+            {
+                write.clearBits |= motor.portMasks[i];
+            }
+        }
+        else
+        {
+            write.slowPins[write.slowCount] = motor.pins[i];
+            write.slowStates[write.slowCount] = level ? HIGH : LOW;
+            write.slowCount++;
+        }
+    }
+}
+
+/**
+Called with m_lock held.
+\param[in] moveIndex The index of the move.
+\param[in,out] write Gathers the pin changes for the step.
+*/
+inline void StepperEngineClass::_stepMove(ULONG moveIndex, WRITE & write)
+{
+    MOVE & move = m_moves[moveIndex];
+    ULONG motors = move.motors;
+    ULONG motorIndex;
+    MOTOR* motor;
+    double nextTime;
+
+    while (_BitScanForward(&motorIndex, motors))
+    {
+        motors &= motors - 1;
+        motor = &m_motors[motorIndex];
+
+        if (motorIndex == move.major)
+        {
+            _stepMotor(*motor, write);
+            m_counts.steps++;
+        }
+        else
+        {
+            // Bresenham: step this motor each time its share of the lead motor's steps
+            // adds up to a whole step.
+            motor->error += motor->steps;
+            if (motor->error >= move.steps)
+            {
+                motor->error -= move.steps;
+                _stepMotor(*motor, write);
+                m_counts.steps++;
+            }
+        }
+    }
+
+    move.step++;
+    if (move.step >= move.steps)
+    {
+        _endMove(moveIndex);
+    }
+    else
+    {
+        nextTime = _stepTime(move, move.step + 1);
+        move.lastInterval = nextTime - move.stepTime;
+        move.stepTime = nextTime;
+        move.nextTicks = move.startTicks + (ULONGLONG)(nextTime * g_hiResClock.getFrequency());
+    }
+}
+
+/**
+Called with m_lock held.
+\param[in] moveIndex The index of the move.
+*/
+inline void StepperEngineClass::_endMove(ULONG moveIndex)
+{
+    ULONG motors = m_moves[moveIndex].motors;
+    ULONG motorIndex;
+
+    while (_BitScanForward(&motorIndex, motors))
+    {
+        motors &= motors - 1;
+        m_motors[motorIndex].move = NO_MOVE;
+    }
+    m_moves[moveIndex].active = FALSE;
+}
+
+/**
+\param[in] write The pin changes to make.
+\return HRESULT success or error code.
+*/
+inline HRESULT StepperEngineClass::_write(const WRITE & write)
+{
+    HRESULT hr = S_OK;
+    ULONG i;
+
+#if defined(_M_ARM)
+    if ((write.setBits | write.clearBits) != 0)
+    {
+        hr = g_bcmGpio.setPortBits(write.setBits, write.clearBits);
+    }
+#endif // defined(_M_ARM)
+
+    for (i = 0; SUCCEEDED(hr) && (i < write.slowCount); i++)
+    {
+        hr = g_pins.setPinState(write.slowPins[i], write.slowStates[i]);
+    }
+
+    return hr;
+}
+
+inline void StepperEngineClass::_runEngine()
+{
+    HRESULT hr = S_OK;
+    WRITE write;
+    ULONGLONG next;
+    ULONGLONG now;
+    ULONGLONG lateTicks;
+    BOOL found;
+    ULONG i;
+
+    while (!m_stopping && SUCCEEDED(hr))
+    {
+        // Find the step that is due first.
+        found = FALSE;
+        next = 0;
+        EnterCriticalSection(&m_lock);
+        for (i = 0; i < STEPPER_ENGINE_MAX_MOTORS; i++)
+        {
+            if (m_moves[i].active && (!found || (m_moves[i].nextTicks < next)))
+            {
+                next = m_moves[i].nextTicks;
+                found = TRUE;
+            }
+        }
+        LeaveCriticalSection(&m_lock);
+
+        if (!found)
+        {
+            // Nothing to do until a move is started.
+            WaitForSingleObject(m_hMovesChanged, INFINITE);
+            continue;
+        }
+
+        if (m_waitTimer.waitUntil(next, m_hMovesChanged) < next)
+        {
+            // A move was started; it may have a step due sooner.
+            continue;
+        }
+
+        // Take every step that is due now, or nearly so, and write their pins together.
+        write.setBits = 0;
+        write.clearBits = 0;
+        write.slowCount = 0;
+        EnterCriticalSection(&m_lock);
+        now = g_hiResClock.now();
+        for (i = 0; i < STEPPER_ENGINE_MAX_MOTORS; i++)
+        {
+            if (m_moves[i].active && (m_moves[i].nextTicks <= (now + m_mergeTicks)))
+            {
+                _stepMove(i, write);
+            }
+        }
+
+        lateTicks = (now > next) ? (now - next) : 0;
+        m_counts.lateTicks += lateTicks;
+        if (lateTicks > m_counts.maxLateTicks)
+        {
+            m_counts.maxLateTicks = lateTicks;
+        }
+        m_counts.writes++;
+        LeaveCriticalSection(&m_lock);
+
+        hr = _write(write);
+    }
+
+    if (FAILED(hr))
+    {
+        m_error = hr;
+    }
+}
+
+#endif  // _STEPPER_ENGINE_H_
@@ -0,0 +1,492 @@
+// Copyright (c) Microsoft Open Technologies, Inc.  All rights reserved.  
+// Licensed under the BSD 2-Clause License.  
+// See License.txt in the project root for license information.
+
+#ifndef _TASK_SCHEDULER_H_
+#define _TASK_SCHEDULER_H_
+
+#include <Windows.h>
+#include <algorithm>
+#include <vector>
+#include "HiResTimer.h"
+#include "WindowsTime.h"
+
+/// The longest time the sketch thread waits when it has nothing scheduled.
+/**
+Tasks added from other threads while the sketch thread is waiting are picked up when
+the wait ends, so this bounds how late such a task can start.
+*/
+#define TASK_SCHEDULER_IDLE_WAIT_MICROSECONDS 10000
+
+/// A loop() call that returns in less than this is taken to be empty.
+/**
+The sketch thread then waits for the next task, as it does after an idle loop().  Define
+this as 0 to call a loop() that returns at once as often as possible.
+*/
+#ifndef TASK_SCHEDULER_EMPTY_LOOP_NANOSECONDS
+#define TASK_SCHEDULER_EMPTY_LOOP_NANOSECONDS 100
+#endif
+
+/// Class used to run periodic and one-shot tasks on the sketch thread.
+/**
+RunArduinoSketch() runs the tasks that are due before each call to loop().  When loop()
+has nothing to do, the sketch thread sleeps until the next task is due instead of
+spinning.  It does this after a loop() that calls loopIdle(), after a loop() that returns
+at once (see TASK_SCHEDULER_EMPTY_LOOP_NANOSECONDS), and on every pass for a sketch built
+with SKETCH_NO_LOOP defined, which has no loop() function at all.
+
+When several tasks are due at once the one with the highest priority runs first, and
+tasks of equal priority run in deadline order.  A periodic task keeps to its original
+schedule: its next deadline is one period after the last deadline, not after the time it
+actually ran.  If a run starts so late that one or more whole periods have been missed,
+the missed runs are skipped and counted as overruns.
+
+Tasks can be added and removed from any thread, including from within a task.  The global
+object is TaskScheduler, so it doesn't clash with the Arduino Scheduler library.
+*/
+class TaskSchedulerClass
+{
+public:
+    /// The type of function run by a task.
+    typedef void (*TASK_FUNCTION)(void);
+
+    /// Struct used to return the statistics of one task.
+    typedef struct {
+        ULONGLONG runs;                 ///< Number of times the task has run
+        ULONGLONG overruns;             ///< Number of periods skipped because the task ran too late
+        ULONGLONG totalLateMicroseconds;    ///< Total time runs started after their deadlines
+        ULONGLONG maxLateMicroseconds;  ///< Longest time a run started after its deadline
+        ULONGLONG maxRunMicroseconds;   ///< Longest time the task function took
+    } TASK_STATS, *PTASK_STATS;
+
+    /// Struct used to return the statistics of the scheduler.
+    typedef struct {
+        ULONGLONG elapsedMicroseconds;  ///< Time since the statistics were reset
+        ULONGLONG waitMicroseconds;     ///< Part of that time spent waiting for tasks to be due
+        ULONGLONG waits;                ///< Number of waits for a task to be due
+        ULONGLONG runs;                 ///< Number of task runs, including one-shot tasks
+    } SCHEDULER_STATS, *PSCHEDULER_STATS;
+
+    /// Constructor.
+    TaskSchedulerClass() :
+        m_nextTaskId(1),
+        m_statsStarted(FALSE),
+        m_statsStart(0),
+        m_waits(0),
+        m_waitMicroseconds(0),
+        m_runs(0),
+        m_loopIdle(FALSE)
+    {
+        InitializeCriticalSection(&m_lock);
+    }
+
+    /// Destructor.
+    virtual ~TaskSchedulerClass()
+    {
+        DeleteCriticalSection(&m_lock);
+    }
+
+    /// Add a task that runs repeatedly at a fixed interval.
+    inline HRESULT addPeriodicTask(TASK_FUNCTION function, ULONG periodMicroseconds, ULONG phaseMicroseconds, ULONG priority, ULONG & taskId);
+
+    /// Add a task that runs once after a delay.
+    inline HRESULT addOneShotTask(TASK_FUNCTION function, ULONG delayMicroseconds, ULONG priority, ULONG & taskId);
+
+    /// Remove a task so it does not run again.
+    inline HRESULT removeTask(ULONG taskId);
+
+    /// Get the statistics of a periodic task.
+    inline HRESULT getTaskStats(ULONG taskId, TASK_STATS & stats);
+
+    /// Run the tasks that are due.
+    inline void runDueTasks();
+
+    /// Wait until the next task is due.
+    inline void waitForNextTask(ULONG maxMicroseconds);
+
+    /// Call loop() once, then wait for the next task if it had nothing to do.
+    inline void runLoop(void (*loopFunction)(void));
+
+    /// Tell the scheduler that this call of loop() had nothing to do.
+    /**
+    Called from loop(), this lets the sketch thread sleep until the next task is due once
+    loop() returns, rather than calling loop() again at once.
+    */
+    inline void loopIdle()
+    {
+        m_loopIdle = TRUE;
+    }
+
+    /// Get the scheduler statistics.
+    /**
+    The fraction of time the sketch thread was idle is waitMicroseconds / elapsedMicroseconds.
+    Wait time includes the short spin that ends each wait (see WindowsTime::delayMicroseconds()).
+    */
+    inline void getStats(SCHEDULER_STATS & stats)
+    {
+        EnterCriticalSection(&m_lock);
+        _startStats();
+        stats.elapsedMicroseconds = _WindowsTime.micros64() - m_statsStart;
+        stats.waitMicroseconds = m_waitMicroseconds;
+        stats.waits = m_waits;
+        stats.runs = m_runs;
+        LeaveCriticalSection(&m_lock);
+    }
+
+    /// Reset the scheduler statistics and the statistics of every task.
+    inline void resetStats()
+    {
+        EnterCriticalSection(&m_lock);
+        m_statsStart = _WindowsTime.micros64();
+        m_statsStarted = TRUE;
+        m_waitMicroseconds = 0;
+        m_waits = 0;
+        m_runs = 0;
+        for (size_t i = 0; i < m_tasks.size(); i++)
+        {
+            ZeroMemory(&m_tasks[i].stats, sizeof(m_tasks[i].stats));
+        }
+        LeaveCriticalSection(&m_lock);
+    }
+
+private:
+
+    /// The state of one task.
+    typedef struct {
+        ULONG id;                       ///< Number used to refer to the task
+        TASK_FUNCTION function;         ///< The function the task runs
+        ULONGLONG deadline;             ///< micros64() time at which the task is next due
+        ULONG period;                   ///< Microseconds between runs, or 0 for a one-shot task
+        ULONG priority;                 ///< Higher values run first when several tasks are due
+        TASK_STATS stats;               ///< Statistics for the task
+    } TASK, *PTASK;
+
+    /// Lock protecting the task list and the statistics.
+    RTL_CRITICAL_SECTION m_lock;
+
+    /// The tasks that have not finished.
+    std::vector<TASK> m_tasks;
+
+    /// The ID to give the next task added.
+    ULONG m_nextTaskId;
+
+    /// Scheduler statistics.  The start time is read when the scheduler is first used, not
+    /// when the global object is constructed, since the clock may not be set up by then.
+    BOOL m_statsStarted;
+    ULONGLONG m_statsStart;
+    ULONGLONG m_waits;
+    ULONGLONG m_waitMicroseconds;
+    ULONGLONG m_runs;
+
+    /// Set by loopIdle() during a call of loop().
+    BOOL m_loopIdle;
+
+    /// Method to start the statistics period if it has not been started, with the lock held.
+    inline void _startStats()
+    {
+        if (!m_statsStarted)
+        {
+            m_statsStart = _WindowsTime.micros64();
+            m_statsStarted = TRUE;
+        }
+    }
+
+    /// Method to add a task to the task list.
+    inline HRESULT _addTask(TASK_FUNCTION function, ULONG period, ULONG delay, ULONG priority, ULONG & taskId);
+
+    /// Method to find a task in the task list, with the lock held.
+    inline PTASK _findTask(ULONG taskId)
+    {
+        for (size_t i = 0; i < m_tasks.size(); i++)
+        {
+            if (m_tasks[i].id == taskId)
+            {
+                return &m_tasks[i];
+            }
+        }
+        return nullptr;
+    }
+};
+
+/**
+\param[in] function The function to run.
+\param[in] periodMicroseconds The time from the start of one run to the start of the next.
+\param[in] phaseMicroseconds The time from now until the first run.
+\param[in] priority The priority of the task.  When several tasks are due, those with
+higher values run first.
+\param[out] taskId Number used to refer to the task in calls to removeTask() and
+getTaskStats().
+\return HRESULT success or error code.
+*/
+inline HRESULT TaskSchedulerClass::addPeriodicTask(TASK_FUNCTION function, ULONG periodMicroseconds, ULONG phaseMicroseconds, ULONG priority, ULONG & taskId)
+{
+    HRESULT hr = S_OK;
+
+    if (periodMicroseconds == 0)
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = _addTask(function, periodMicroseconds, phaseMicroseconds, priority, taskId);
+    }
+
+    return hr;
+}
+
+/**
+The task is removed once it has run, after which its ID is no longer valid.
+\param[in] function The function to run.
+\param[in] delayMicroseconds The time from now until the task runs.
+\param[in] priority The priority of the task.  When several tasks are due, those with
+higher values run first.
+\param[out] taskId Number used to refer to the task in a call to removeTask().
+\return HRESULT success or error code.
+*/
+inline HRESULT TaskSchedulerClass::addOneShotTask(TASK_FUNCTION function, ULONG delayMicroseconds, ULONG priority, ULONG & taskId)
+{
+    return _addTask(function, 0, delayMicroseconds, priority, taskId);
+}
+
+/**
+\param[in] taskId The ID returned when the task was added.
+\return HRESULT success or error code.  HRESULT_FROM_WIN32(ERROR_NOT_FOUND) is returned
+if there is no such task, which includes a one-shot task that has already run.
+*/
+inline HRESULT TaskSchedulerClass::removeTask(ULONG taskId)
+{
+    HRESULT hr = HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+
+    EnterCriticalSection(&m_lock);
+    for (size_t i = 0; i < m_tasks.size(); i++)
+    {
+        if (m_tasks[i].id == taskId)
+        {
+            m_tasks.erase(m_tasks.begin() + i);
+            hr = S_OK;
+            break;
+        }
+    }
+    LeaveCriticalSection(&m_lock);
+
+    return hr;
+}
+
+/**
+The average time runs of the task started after their deadlines (the scheduling jitter)
+is totalLateMicroseconds / runs.
+\param[in] taskId The ID returned when the task was added.
+\param[out] stats The statistics of the task.
+\return HRESULT success or error code.
+*/
+inline HRESULT TaskSchedulerClass::getTaskStats(ULONG taskId, TASK_STATS & stats)
+{
+    HRESULT hr = HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+    PTASK task;
+
+    EnterCriticalSection(&m_lock);
+    task = _findTask(taskId);
+    if (task != nullptr)
+    {
+        stats = task->stats;
+        hr = S_OK;
+    }
+    LeaveCriticalSection(&m_lock);
+
+    return hr;
+}
+
+/**
+Each task runs at most once per call, so a periodic task that takes longer than its
+period can't keep the caller from returning.
+*/
+inline void TaskSchedulerClass::runDueTasks()
+{
+    TASK_FUNCTION function;
+    ULONG taskId;
+    ULONGLONG now;
+    ULONGLONG late;
+    ULONGLONG start;
+    ULONGLONG missed;
+    PTASK task;
+    size_t i;
+    size_t runsLeft;
+    std::vector<ULONG> ranIds;
+
+    EnterCriticalSection(&m_lock);
+    _startStats();
+    runsLeft = m_tasks.size();
+
+    while (runsLeft > 0)
+    {
+        runsLeft--;
+        now = _WindowsTime.micros64();
+
+        // Find the due task with the highest priority, or the earliest deadline among equals.
+        task = nullptr;
+        for (i = 0; i < m_tasks.size(); i++)
+        {
+            if ((m_tasks[i].deadline <= now) &&
+                (std::find(ranIds.begin(), ranIds.end(), m_tasks[i].id) == ranIds.end()) &&
+                ((task == nullptr) ||
+                 (m_tasks[i].priority > task->priority) ||
+                 ((m_tasks[i].priority == task->priority) && (m_tasks[i].deadline < task->deadline))))
+            {
+                task = &m_tasks[i];
+            }
+        }
+        if (task == nullptr)
+        {
+            break;
+        }
+
+        function = task->function;
+        taskId = task->id;
+        late = now - task->deadline;
+
+        if (task->period == 0)
+        {
+            // A one-shot task is finished once it starts.
+            m_tasks.erase(m_tasks.begin() + (task - &m_tasks[0]));
+            task = nullptr;
+        }
+        else
+        {
+            // Keep to the schedule, skipping any whole periods that have been missed.
+            task->deadline += task->period;
+            if (task->deadline <= now)
+            {
+                missed = ((now - task->deadline) / task->period) + 1;
+                task->deadline += missed * task->period;
+                task->stats.overruns += missed;
+            }
+            ranIds.push_back(taskId);
+        }
+        m_runs++;
+
+        // Run the task without the lock, so it can add and remove tasks.
+        LeaveCriticalSection(&m_lock);
+        start = _WindowsTime.micros64();
+        function();
+        now = _WindowsTime.micros64();
+        EnterCriticalSection(&m_lock);
+
+        // The task may have been removed while it ran.
+        task = _findTask(taskId);
+        if (task != nullptr)
+        {
+            task->stats.runs++;
+            task->stats.totalLateMicroseconds += late;
+            if (late > task->stats.maxLateMicroseconds)
+            {
+                task->stats.maxLateMicroseconds = late;
+            }
+            if ((now - start) > task->stats.maxRunMicroseconds)
+            {
+                task->stats.maxRunMicroseconds = now - start;
+            }
+        }
+    }
+
+    LeaveCriticalSection(&m_lock);
+}
+
+/**
+The thread waits in an alertable state, so APCs queued to it still run.
+\param[in] maxMicroseconds The longest time to wait, which is also the wait used when
+no task is scheduled.
+*/
+inline void TaskSchedulerClass::waitForNextTask(ULONG maxMicroseconds)
+{
+    ULONGLONG now;
+    ULONGLONG deadline;
+    LARGE_INTEGER wait;
+    size_t i;
+
+    EnterCriticalSection(&m_lock);
+    _startStats();
+    now = _WindowsTime.micros64();
+    deadline = now + maxMicroseconds;
+    for (i = 0; i < m_tasks.size(); i++)
+    {
+        if (m_tasks[i].deadline < deadline)
+        {
+            deadline = m_tasks[i].deadline;
+        }
+    }
+    LeaveCriticalSection(&m_lock);
+
+    if (deadline > now)
+    {
+        wait.QuadPart = deadline - now;
+        _WindowsTime.delayMicroseconds(wait, TRUE);
+
+        EnterCriticalSection(&m_lock);
+        m_waits++;
+        m_waitMicroseconds += _WindowsTime.micros64() - now;
+        LeaveCriticalSection(&m_lock);
+    }
+}
+
+/**
+The sketch thread waits for the next task, for at most TASK_SCHEDULER_IDLE_WAIT_MICROSECONDS,
+if loop() called loopIdle() or returned in less than TASK_SCHEDULER_EMPTY_LOOP_NANOSECONDS.
+\param[in] loopFunction The sketch's loop() function.
+*/
+inline void TaskSchedulerClass::runLoop(void (*loopFunction)(void))
+{
+    ULONGLONG start;
+    ULONGLONG elapsed;
+
+    m_loopIdle = FALSE;
+    start = g_hiResClock.now();
+    loopFunction();
+    elapsed = g_hiResClock.now() - start;
+
+    if (m_loopIdle || (elapsed < g_hiResClock.nanosecondsToTicks(TASK_SCHEDULER_EMPTY_LOOP_NANOSECONDS)))
+    {
+        waitForNextTask(TASK_SCHEDULER_IDLE_WAIT_MICROSECONDS);
+    }
+}
+
+/**
+\param[in] function The function to run.
+\param[in] period The time between runs in microseconds, or 0 for a one-shot task.
+\param[in] delay The time from now until the first run in microseconds.
+\param[in] priority The priority of the task.
+\param[out] taskId The ID of the new task.
+\return HRESULT success or error code.
+*/
+inline HRESULT TaskSchedulerClass::_addTask(TASK_FUNCTION function, ULONG period, ULONG delay, ULONG priority, ULONG & taskId)
+{
+    HRESULT hr = S_OK;
+    TASK task;
+
+    if (function == nullptr)
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        ZeroMemory(&task, sizeof(task));
+        task.function = function;
+        task.period = period;
+        task.priority = priority;
+
+        EnterCriticalSection(&m_lock);
+        _startStats();
+        task.id = m_nextTaskId++;
+        task.deadline = _WindowsTime.micros64() + delay;
+        m_tasks.push_back(task);
+        taskId = task.id;
+        LeaveCriticalSection(&m_lock);
+    }
+
+    return hr;
+}
+
+__declspec(selectany) TaskSchedulerClass TaskScheduler;
+
+#endif  // _TASK_SCHEDULER_H_
@@ -0,0 +1,966 @@
+// Copyright (c) Microsoft Open Technologies, Inc.  All rights reserved.  
+// Licensed under the BSD 2-Clause License.  
+// See License.txt in the project root for license information.
+
+#ifndef _TONE_GENERATOR_H_
+#define _TONE_GENERATOR_H_
+
+#include <Windows.h>
+
+#include "ArduinoCommon.h"
+#include "BoardPins.h"
+#include "HiResTimer.h"
+#include "SoftPwm.h"
+
+/// The maximum number of pins that can play tones at once.
+#define TONE_GENERATOR_MAX_CHANNELS 8
+
+/// The number of notes that can be queued on each pin.
+#define TONE_GENERATOR_QUEUE_LENGTH 64
+
+/// The number of note reports kept until they are read.
+#define TONE_GENERATOR_REPORT_COUNT 64
+
+/// Class used to play tones and queued sequences of notes without blocking the sketch.
+/**
+Each pin has a queue of notes, and one high priority thread starts each note when it is due.
+Note start times are computed from the start of the sequence, so a note that starts late does
+not delay the ones after it.
+
+Pins that support PWM play notes with the PWM hardware: the PWM frequency is set to the note
+frequency with setPwmFrequency() and the duty cycle to 50%.  The frequency the hardware can
+produce is read back with getActualPwmFrequency().  On boards with a PCA9685 PWM chip all the
+outputs of the chip share one frequency (about 24 to 1526 Hz), so a tone changes the frequency
+of any servos or PWM outputs on the same chip.  Any other digital pin is toggled by the
+software PWM engine (SoftPwm), up to SOFT_PWM_MAX_FREQUENCY.  SoftPwm changes frequency at
+the end of the current period, so a note can sound up to one period of the previous note late.
+
+For each note that is started, a report of the frequency error and of how late the note was
+started is kept for readReport(), and totals are kept for getStats().
+*/
+class ToneGeneratorClass
+{
+public:
+    /// Struct used to describe one note of a sequence.
+    typedef struct {
+        ULONG frequencyHz;          ///< Frequency of the note, zero for a rest
+        ULONG durationMilliseconds; ///< Length of the note, zero to hold it until another note is queued
+    } TONE_NOTE, *PTONE_NOTE;
+
+    /// Struct used to report how one note was played.
+    typedef struct {
+        ULONG pin;                      ///< The pin the note was played on
+        ULONG sequence;                 ///< Number of the note on the pin, counting from zero
+        ULONG frequencyHz;              ///< The requested frequency
+        ULONG actualFrequencyMilliHz;   ///< The frequency produced, in thousandths of a Hz
+        LONG frequencyErrorMilliHz;     ///< Produced minus requested frequency, in thousandths of a Hz
+        LONGLONG startDriftMicroseconds;///< Time the note started after its scheduled start
+        BOOL skipped;                   ///< TRUE if the note was over before it could be started
+    } TONE_NOTE_REPORT, *PTONE_NOTE_REPORT;
+
+    /// Struct used to return generator statistics.
+    typedef struct {
+        ULONGLONG notes;                    ///< Number of notes started
+        ULONGLONG skippedNotes;             ///< Number of notes skipped because they were already over
+        ULONGLONG droppedReports;           ///< Number of note reports lost because they were not read
+        ULONGLONG meanDriftMicroseconds;    ///< Average time a note started after it was due
+        ULONGLONG maxDriftMicroseconds;     ///< Longest time a note started after it was due
+        ULONG maxFrequencyErrorMilliHz;     ///< Largest frequency error of a note, in thousandths of a Hz
+    } TONE_GENERATOR_STATS, *PTONE_GENERATOR_STATS;
+
+    /// Constructor.
+    ToneGeneratorClass() :
+        m_activeChannels(0),
+        m_closingChannels(0),
+        m_reportHead(0),
+        m_reportCount(0),
+        m_hThread(NULL),
+        m_hQueueChanged(NULL),
+        m_stopping(FALSE),
+        m_error(S_OK)
+    {
+        InitializeCriticalSection(&m_lock);
+        ZeroMemory(m_channels, sizeof(m_channels));
+        ZeroMemory(m_reports, sizeof(m_reports));
+        ZeroMemory(&m_counts, sizeof(m_counts));
+    }
+
+    /// Destructor.
+    /**
+    Stops a running generator thread and waits a bounded time for it to exit.  The pins are
+    not silenced, since g_pins can't safely be called during static destruction; call end()
+    first for that.
+    */
+    virtual ~ToneGeneratorClass()
+    {
+        m_stopping = TRUE;
+        if (m_hThread != NULL)
+        {
+            SetEvent(m_hQueueChanged);
+            if (!HiResWaitTimerClass::waitForThreadExit(m_hThread))
+            {
+                return;
+            }
+        }
+
+        if (m_hQueueChanged != NULL)
+        {
+            CloseHandle(m_hQueueChanged);
+        }
+        m_waitTimer.close();
+        DeleteCriticalSection(&m_lock);
+    }
+
+    /// Play one note on a pin now, replacing anything playing or queued on it.
+    HRESULT play(ULONG pin, ULONG frequencyHz, ULONG durationMilliseconds);
+
+    /// Add a sequence of notes to the end of a pin's queue.
+    HRESULT enqueue(ULONG pin, const TONE_NOTE* notes, ULONG count);
+
+    /// Silence a pin, discard its queue, and release the pin.
+    HRESULT stop(ULONG pin);
+
+    /// Silence and release all pins, and stop the generator thread.
+    void end();
+
+    /// Determine whether a pin is playing a note or has notes queued.
+    BOOL isPlaying(ULONG pin);
+
+    /// Get the number of notes that can still be queued on a pin.
+    ULONG getQueueSpace(ULONG pin);
+
+    /// Get the oldest note report that has not been read.
+    BOOL readReport(TONE_NOTE_REPORT & report);
+
+    /// Get the first error encountered by the generator thread, if any.
+    inline HRESULT getError()
+    {
+        return m_error;
+    }
+
+    /// Get the generator statistics.
+    void getStats(TONE_GENERATOR_STATS & stats);
+
+    /// Clear the generator statistics.
+    void resetStats();
+
+private:
+
+    /// Struct used to hold one queued note.
+    typedef struct {
+        TONE_NOTE note;             ///< The note
+        ULONGLONG queuedTime;       ///< Timer reading when the note was queued
+    } QUEUED_NOTE;
+
+    /// Struct used to hold the state of one pin.
+    typedef struct {
+        ULONG pin;                  ///< The pin the channel plays on, as passed to play() and enqueue()
+        ULONG outputPin;            ///< The pin the output is generated on (a PWMn pin on some boards)
+        BOOL pwm;                   ///< TRUE if the pin uses PWM hardware, FALSE if it uses SoftPwm
+        BOOL playing;               ///< TRUE if a note has been started and not finished
+        BOOL cut;                   ///< TRUE to end the current note now, without waiting for its end
+        BOOL sounding;              ///< TRUE if the output is generating a tone
+        ULONGLONG noteEnd;          ///< Timer reading when the current note is due to end, or zero to hold it
+        ULONG sequence;             ///< Count of notes started on the channel
+        ULONG queueHead;            ///< Index of the oldest queued note
+        ULONG queueCount;           ///< Number of queued notes
+        QUEUED_NOTE queue[TONE_GENERATOR_QUEUE_LENGTH];
+    } CHANNEL;
+
+    /// Struct used to accumulate generator statistics in timer ticks.
+    typedef struct {
+        ULONGLONG notes;
+        ULONGLONG skippedNotes;
+        ULONGLONG droppedReports;
+        ULONGLONG driftTicks;
+        ULONGLONG maxDriftTicks;
+        ULONG maxFrequencyErrorMilliHz;
+    } COUNTS;
+
+    /// Lock that protects the channels and reports.  The generator thread holds it while it
+    /// changes outputs, so stop() can't race with a note being started.
+    CRITICAL_SECTION m_lock;
+
+    /// The channel table.  Bit N of m_activeChannels refers to m_channels[N].
+    CHANNEL m_channels[TONE_GENERATOR_MAX_CHANNELS];
+
+    /// Mask of the channels in use.
+    ULONG m_activeChannels;
+
+    /// Mask of the channels whose pins are being detached from SoftPwm with m_lock released.
+    ULONG m_closingChannels;
+
+    /// Ring of note reports that have not been read.
+    TONE_NOTE_REPORT m_reports[TONE_GENERATOR_REPORT_COUNT];
+    ULONG m_reportHead;
+    ULONG m_reportCount;
+
+    /// Handle of the generator thread.
+    HANDLE m_hThread;
+
+    /// Event signalled when notes are queued or removed, to wake the generator thread.
+    HANDLE m_hQueueChanged;
+
+    /// Timer the generator thread waits on between notes.
+    HiResWaitTimerClass m_waitTimer;
+
+    /// Set to TRUE to ask the generator thread to exit.
+    volatile BOOL m_stopping;
+
+    /// First error encountered on the generator thread.
+    HRESULT m_error;
+
+    /// Generator statistics.
+    COUNTS m_counts;
+
+    /// Entry point of the generator thread.
+    static DWORD WINAPI _generatorThread(LPVOID param)
+    {
+        ((ToneGeneratorClass*)param)->_runGenerator();
+        return 0;
+    }
+
+    /// Method to start the notes that are due.
+    void _runGenerator();
+
+    /// Method to finish the current note of a channel and start the ones that are due.
+    HRESULT _advanceChannel(CHANNEL & ch, ULONGLONG now);
+
+    /// Method to set a channel's output to a frequency, or silence it.
+    HRESULT _setOutput(CHANNEL & ch, ULONG frequencyHz, ULONG & actualMilliHz);
+
+    /// Method to find the channel for a pin, claiming the pin if it has no channel yet.
+    HRESULT _openChannel(ULONG pin, CHANNEL* & ch);
+
+    /// Method to silence a channel's pin and release it, or mark it for _detachChannel().
+    BOOL _closeChannel(ULONG channel);
+
+    /// Method to detach a closing channel's pin from SoftPwm.
+    void _detachChannel(ULONG channel);
+
+    /// Method to translate a pin number to the pin its PWM output is on.
+    static ULONG _pwmPin(ULONG pin);
+
+    /// Method to start the generator thread if it is not running.
+    HRESULT _startGenerator();
+
+    /// Method to find the channel playing on a pin.
+    inline ULONG _findChannel(ULONG pin)
+    {
+        ULONG i;
+
+        for (i = 0; i < TONE_GENERATOR_MAX_CHANNELS; i++)
+        {
+            if (((m_activeChannels >> i) & 1) && (m_channels[i].pin == pin))
+            {
+                break;
+            }
+        }
+        return i;
+    }
+
+    /// Method to convert a note duration to timer ticks.
+    static inline ULONGLONG _durationTicks(ULONG durationMilliseconds)
+    {
+        return ((ULONGLONG)durationMilliseconds * g_hiResClock.getFrequency()) / 1000ULL;
+    }
+
+    /// Method to add a report to the ring, overwriting the oldest if it is full.
+    inline void _addReport(const TONE_NOTE_REPORT & report)
+    {
+        if (m_reportCount == TONE_GENERATOR_REPORT_COUNT)
+        {
+            m_reportHead = (m_reportHead + 1) % TONE_GENERATOR_REPORT_COUNT;
+            m_reportCount--;
+            m_counts.droppedReports++;
+        }
+        m_reports[(m_reportHead + m_reportCount) % TONE_GENERATOR_REPORT_COUNT] = report;
+        m_reportCount++;
+    }
+
+    /// Method to wait until a note change is due.
+    /**
+    Returns early if the queues are changed while sleeping.
+    \param[in] deadline Timer reading to wait for, or zero to wait only for a queue change.
+    */
+    inline void _waitUntil(ULONGLONG deadline)
+    {
+        if (deadline == 0)
+        {
+            WaitForSingleObject(m_hQueueChanged, INFINITE);
+            return;
+        }
+
+        m_waitTimer.waitUntil(deadline, m_hQueueChanged);
+    }
+};
+
+/// The global tone generator.
+__declspec(selectany) ToneGeneratorClass ToneGenerator;
+
+/**
+This is what tone() does: the note starts as soon as the generator thread can start it.
+\param[in] pin The number of the pin.
+\param[in] frequencyHz The frequency of the note, or zero for silence.
+\param[in] durationMilliseconds The length of the note, or zero to play it until stop() is
+called or more notes are queued.
+\return HRESULT success or error code.
+*/
+inline HRESULT ToneGeneratorClass::play(ULONG pin, ULONG frequencyHz, ULONG durationMilliseconds)
+{
+    HRESULT hr = S_OK;
+    CHANNEL* ch = nullptr;
+
+    EnterCriticalSection(&m_lock);
+
+    hr = _openChannel(pin, ch);
+
+    if (SUCCEEDED(hr))
+    {
+        ch->queueHead = 0;
+        ch->queueCount = 1;
+        ch->queue[0].note.frequencyHz = frequencyHz;
+        ch->queue[0].note.durationMilliseconds = durationMilliseconds;
+        ch->queue[0].queuedTime = g_hiResClock.now();
+        ch->cut = ch->playing;
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    if (SUCCEEDED(hr))
+    {
+        SetEvent(m_hQueueChanged);
+    }
+
+    return hr;
+}
+
+/**
+The first note starts when the notes already queued on the pin have finished, or now if the
+pin is idle or holding a note with no duration.  Each following note starts when the one
+before it is scheduled to end.  Either all of the notes are queued or none are.
+\param[in] pin The number of the pin.
+\param[in] notes Array of the notes to play.
+\param[in] count The number of notes, at most the space returned by getQueueSpace().
+\return HRESULT success or error code.  HRESULT_FROM_WIN32(ERROR_NO_MORE_ITEMS) means there is
+not enough space in the queue.
+*/
+inline HRESULT ToneGeneratorClass::enqueue(ULONG pin, const TONE_NOTE* notes, ULONG count)
+{
+    HRESULT hr = S_OK;
+    CHANNEL* ch = nullptr;
+    ULONGLONG now;
+    QUEUED_NOTE* queued;
+    ULONG i;
+
+    if ((notes == nullptr) && (count > 0))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        EnterCriticalSection(&m_lock);
+
+        hr = _openChannel(pin, ch);
+
+        if (SUCCEEDED(hr) && (count > (TONE_GENERATOR_QUEUE_LENGTH - ch->queueCount)))
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_NO_MORE_ITEMS);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            now = g_hiResClock.now();
+            for (i = 0; i < count; i++)
+            {
+                queued = &ch->queue[(ch->queueHead + ch->queueCount) % TONE_GENERATOR_QUEUE_LENGTH];
+                queued->note = notes[i];
+                queued->queuedTime = now;
+                ch->queueCount++;
+            }
+        }
+
+        LeaveCriticalSection(&m_lock);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        SetEvent(m_hQueueChanged);
+    }
+
+    return hr;
+}
+
+/**
+This is what noTone() does.
+\param[in] pin The number of the pin.
+\return HRESULT success or error code.  HRESULT_FROM_WIN32(ERROR_NOT_FOUND) means no tone has
+been played on the pin.
+*/
+inline HRESULT ToneGeneratorClass::stop(ULONG pin)
+{
+    HRESULT hr = S_OK;
+    ULONG channel;
+    BOOL detach = FALSE;
+
+    EnterCriticalSection(&m_lock);
+
+    channel = _findChannel(pin);
+    if (channel < TONE_GENERATOR_MAX_CHANNELS)
+    {
+        detach = _closeChannel(channel);
+    }
+    else
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    if (detach)
+    {
+        _detachChannel(channel);
+    }
+
+    return hr;
+}
+
+inline void ToneGeneratorClass::end()
+{
+    ULONG active;
+    ULONG detach = 0;
+    ULONG channel;
+
+    m_stopping = TRUE;
+
+    if (m_hThread != NULL)
+    {
+        SetEvent(m_hQueueChanged);
+        WaitForSingleObject(m_hThread, INFINITE);
+        CloseHandle(m_hThread);
+        m_hThread = NULL;
+    }
+
+    if (m_hQueueChanged != NULL)
+    {
+        CloseHandle(m_hQueueChanged);
+        m_hQueueChanged = NULL;
+    }
+
+    m_waitTimer.close();
+
+    EnterCriticalSection(&m_lock);
+    active = m_activeChannels;
+    while (_BitScanForward(&channel, active))
+    {
+        active &= active - 1;
+        if (_closeChannel(channel))
+        {
+            detach |= 1UL << channel;
+        }
+    }
+    LeaveCriticalSection(&m_lock);
+
+    while (_BitScanForward(&channel, detach))
+    {
+        detach &= detach - 1;
+        _detachChannel(channel);
+    }
+}
+
+/**
+\param[in] pin The number of the pin.
+\return TRUE if a note is playing on the pin or queued for it, FALSE otherwise.
+*/
+inline BOOL ToneGeneratorClass::isPlaying(ULONG pin)
+{
+    BOOL playing = FALSE;
+    ULONG channel;
+
+    EnterCriticalSection(&m_lock);
+
+    channel = _findChannel(pin);
+    if (channel < TONE_GENERATOR_MAX_CHANNELS)
+    {
+        playing = m_channels[channel].playing || (m_channels[channel].queueCount > 0);
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    return playing;
+}
+
+/**
+\param[in] pin The number of the pin.
+\return The number of notes enqueue() can add to the pin's queue.
+*/
+inline ULONG ToneGeneratorClass::getQueueSpace(ULONG pin)
+{
+    ULONG space = TONE_GENERATOR_QUEUE_LENGTH;
+    ULONG channel;
+
+    EnterCriticalSection(&m_lock);
+
+    channel = _findChannel(pin);
+    if (channel < TONE_GENERATOR_MAX_CHANNELS)
+    {
+        space -= m_channels[channel].queueCount;
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    return space;
+}
+
+/**
+A report is made for each note when it is started.  If more than TONE_GENERATOR_REPORT_COUNT
+reports are waiting, the oldest are dropped.
+\param[out] report The report for the oldest note not yet read.
+\return TRUE if a report was returned, FALSE if there are none waiting.
+*/
+inline BOOL ToneGeneratorClass::readReport(TONE_NOTE_REPORT & report)
+{
+    BOOL found = FALSE;
+
+    EnterCriticalSection(&m_lock);
+
+    if (m_reportCount > 0)
+    {
+        report = m_reports[m_reportHead];
+        m_reportHead = (m_reportHead + 1) % TONE_GENERATOR_REPORT_COUNT;
+        m_reportCount--;
+        found = TRUE;
+    }
+
+    LeaveCriticalSection(&m_lock);
+
+    return found;
+}
+
+/**
+\param[out] stats The statistics gathered since the generator started or they were cleared.
+*/
+inline void ToneGeneratorClass::getStats(TONE_GENERATOR_STATS & stats)
+{
+    EnterCriticalSection(&m_lock);
+
+    stats.notes = m_counts.notes;
+    stats.skippedNotes = m_counts.skippedNotes;
+    stats.droppedReports = m_counts.droppedReports;
+    stats.meanDriftMicroseconds = 0;
+    if (m_counts.notes > 0)
+    {
+        stats.meanDriftMicroseconds = g_hiResClock.ticksToMicroseconds(m_counts.driftTicks / m_counts.notes);
+    }
+    stats.maxDriftMicroseconds = g_hiResClock.ticksToMicroseconds(m_counts.maxDriftTicks);
+    stats.maxFrequencyErrorMilliHz = m_counts.maxFrequencyErrorMilliHz;
+
+    LeaveCriticalSection(&m_lock);
+}
+
+inline void ToneGeneratorClass::resetStats()
+{
+    EnterCriticalSection(&m_lock);
+    ZeroMemory(&m_counts, sizeof(m_counts));
+    LeaveCriticalSection(&m_lock);
+}
+
+/**
+The pin is translated the way analogWrite() translates it, so on boards with a PWM chip pins
+0-15 play on PWM0-PWM15.  A pin with a PWM function is locked to PWM use, and any failure to
+do so is returned.  Only a pin with no PWM function is attached to SoftPwm.  Either way the
+pin is left silent.  Must be called with m_lock held.
+\param[in] pin The number of the pin.
+\param[out] ch The channel for the pin.
+\return HRESULT success or error code.  HRESULT_FROM_WIN32(ERROR_BUSY) means the pin is still
+being released by stop() on another thread.
+*/
+inline HRESULT ToneGeneratorClass::_openChannel(ULONG pin, CHANNEL* & ch)
+{
+    HRESULT hr = S_OK;
+    ULONG channel;
+    ULONG closing = m_closingChannels;
+    ULONG outputPin = _pwmPin(pin);
+    BOOL pwm = FALSE;
+
+    channel = _findChannel(pin);
+    if (channel < TONE_GENERATOR_MAX_CHANNELS)
+    {
+        ch = &m_channels[channel];
+        return S_OK;
+    }
+
+    while (_BitScanForward(&channel, closing))
+    {
+        closing &= closing - 1;
+        if (m_channels[channel].pin == pin)
+        {
+            return HRESULT_FROM_WIN32(ERROR_BUSY);
+        }
+    }
+
+    if (!_BitScanForward(&channel, ~(m_activeChannels | m_closingChannels)) || (channel >= TONE_GENERATOR_MAX_CHANNELS))
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_NO_MORE_ITEMS);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = _startGenerator();
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        if (g_pins.pinHasFunction(outputPin, FUNC_PWM))
+        {
+            pwm = TRUE;
+            hr = g_pins.verifyPinFunction(outputPin, FUNC_PWM, BoardPinsClass::LOCK_FUNCTION);
+            if (SUCCEEDED(hr))
+            {
+                hr = g_pins.setPwmDutyCycle(outputPin, 0);
+                if (FAILED(hr))
+                {
+                    g_pins.verifyPinFunction(outputPin, FUNC_PWM, BoardPinsClass::UNLOCK_FUNCTION);
+                }
+            }
+        }
+        else
+        {
+            // Run silent channels at the highest frequency, so a note that follows starts
+            // within one short period.
+            outputPin = pin;
+            hr = SoftPwm.attach(outputPin, SOFT_PWM_MAX_FREQUENCY, 0);
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        ch = &m_channels[channel];
+        ZeroMemory(ch, sizeof(*ch));
+        ch->pin = pin;
+        ch->outputPin = outputPin;
+        ch->pwm = pwm;
+        m_activeChannels |= 1UL << channel;
+    }
+
+    return hr;
+}
+
+/**
+A PWM pin is silenced and unlocked here.  A SoftPwm pin is only marked as closing, because
+SoftPwmClass::detach() waits for the SoftPwm engine to stop writing the pin, and that must
+not hold up the generator thread or other callers.  Until the caller has passed the channel
+to _detachChannel() its slot is not reused and its pin can't be opened again.  Must be called
+with m_lock held.
+\param[in] channel The number of the channel.
+\return TRUE if the caller must call _detachChannel() after releasing m_lock.
+*/
+inline BOOL ToneGeneratorClass::_closeChannel(ULONG channel)
+{
+    CHANNEL* ch = &m_channels[channel];
+
+    m_activeChannels &= ~(1UL << channel);
+
+    if (ch->pwm)
+    {
+        g_pins.setPwmDutyCycle(ch->outputPin, 0);
+        g_pins.verifyPinFunction(ch->outputPin, FUNC_PWM, BoardPinsClass::UNLOCK_FUNCTION);
+        return FALSE;
+    }
+
+    m_closingChannels |= 1UL << channel;
+    return TRUE;
+}
+
+/**
+Must be called with m_lock released, for a channel _closeChannel() returned TRUE for.
+\param[in] channel The number of the channel.
+*/
+inline void ToneGeneratorClass::_detachChannel(ULONG channel)
+{
+    SoftPwm.detach(m_channels[channel].outputPin);
+
+    EnterCriticalSection(&m_lock);
+    m_closingChannels &= ~(1UL << channel);
+    LeaveCriticalSection(&m_lock);
+}
+
+/**
+On boards that use a PWM chip, the PWM outputs have pseudo pin numbers PWM0-PWMn, and pin
+numbers below PWM0 are translated to them, as analogWrite() does.  Other boards use the
+pin number as it is.
+\param[in] pin The number of the pin.
+\return The pin to look for a PWM function on.
+*/
+inline ULONG ToneGeneratorClass::_pwmPin(ULONG pin)
+{
+    BoardPinsClass::BOARD_TYPE board;
+
+    if (SUCCEEDED(g_pins.getBoardType(board)) &&
+        ((board == BoardPinsClass::BOARD_TYPE::MBM_BARE) || (board == BoardPinsClass::BOARD_TYPE::PI2_BARE)) &&
+        (pin < PWM0))
+    {
+        return PWM0 + pin;
+    }
+    return pin;
+}
+
+/**
+Must be called with m_lock held.
+\param[in] ch The channel.
+\param[in] frequencyHz The frequency to generate, or zero to silence the output.
+\param[out] actualMilliHz The frequency produced, in thousandths of a Hz.
+\return HRESULT success or error code.
+*/
+inline HRESULT ToneGeneratorClass::_setOutput(CHANNEL & ch, ULONG frequencyHz, ULONG & actualMilliHz)
+{
+    HRESULT hr = S_OK;
+    ULONG frequency = frequencyHz;
+    ULONGLONG periodTicks;
+
+    actualMilliHz = 0;
+
+    if (ch.pwm)
+    {
+        if (frequency == 0)
+        {
+            hr = g_pins.setPwmDutyCycle(ch.outputPin, 0);
+        }
+        else
+        {
+            hr = g_pins.setPwmFrequency(ch.outputPin, frequency);
+            if (SUCCEEDED(hr))
+            {
+                actualMilliHz = g_pins.getActualPwmFrequency(ch.outputPin) * 1000;
+                hr = g_pins.setPwmDutyCycle(ch.outputPin, 0x80000000);
+            }
+        }
+    }
+    else
+    {
+        if (frequency == 0)
+        {
+            hr = SoftPwm.setDutyCycle(ch.outputPin, 0);
+            if (SUCCEEDED(hr))
+            {
+                hr = SoftPwm.setFrequency(ch.outputPin, SOFT_PWM_MAX_FREQUENCY);
+            }
+        }
+        else
+        {
+            if (frequency > SOFT_PWM_MAX_FREQUENCY)
+            {
+                frequency = SOFT_PWM_MAX_FREQUENCY;
+            }
+            hr = SoftPwm.setFrequency(ch.outputPin, frequency);
+            if (SUCCEEDED(hr))
+            {
+                hr = SoftPwm.setDutyCycle(ch.outputPin, 0x80000000);
+            }
+
+            // SoftPwm rounds the period to a whole number of timer ticks.
+            periodTicks = (g_hiResClock.getFrequency() + (frequency / 2)) / frequency;
+            actualMilliHz = (ULONG)(((g_hiResClock.getFrequency() * 1000ULL) + (periodTicks / 2)) / periodTicks);
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        ch.sounding = (frequency != 0);
+    }
+
+    return hr;
+}
+
+/**
+A note is over when its end time has passed, when it has no duration and more notes have been
+queued, or when play() has replaced it.  Notes that are already over by the time they would
+start are skipped without changing the output, and the channel catches up with its schedule.
+Must be called with m_lock held.
+\param[in] ch The channel.
+\param[in] now The current timer reading.
+\return HRESULT success or error code.
+*/
+inline HRESULT ToneGeneratorClass::_advanceChannel(CHANNEL & ch, ULONGLONG now)
+{
+    HRESULT hr = S_OK;
+    QUEUED_NOTE* next;
+    TONE_NOTE_REPORT report;
+    ULONGLONG scheduledStart;
+    ULONGLONG startTime;
+    ULONGLONG driftTicks;
+    ULONG actualMilliHz;
+    LONGLONG errorMilliHz;
+    BOOL timed;
+
+    while (SUCCEEDED(hr))
+    {
+        if (ch.playing && !ch.cut &&
+            ((ch.noteEnd == 0) ? (ch.queueCount == 0) : (now < ch.noteEnd)))
+        {
+            break;
+        }
+
+        if (ch.queueCount == 0)
+        {
+            // The sequence has finished.
+            if (ch.sounding)
+            {
+                hr = _setOutput(ch, 0, actualMilliHz);
+            }
+            ch.playing = FALSE;
+            ch.cut = FALSE;
+            break;
+        }
+
+        next = &ch.queue[ch.queueHead];
+        ch.queueHead = (ch.queueHead + 1) % TONE_GENERATOR_QUEUE_LENGTH;
+        ch.queueCount--;
+
+        // A note follows on from a timed note, unless it was queued after that note ended.
+        // Otherwise it is due when it was queued.
+        timed = ch.playing && !ch.cut && (ch.noteEnd != 0) && (ch.noteEnd > next->queuedTime);
+        scheduledStart = timed ? ch.noteEnd : next->queuedTime;
+        ch.noteEnd = 0;
+        if (next->note.durationMilliseconds != 0)
+        {
+            ch.noteEnd = scheduledStart + _durationTicks(next->note.durationMilliseconds);
+        }
+        ch.playing = TRUE;
+        ch.cut = FALSE;
+
+        ZeroMemory(&report, sizeof(report));
+        report.pin = ch.pin;
+        report.sequence = ch.sequence++;
+        report.frequencyHz = next->note.frequencyHz;
+
+        if ((ch.noteEnd != 0) && (ch.noteEnd <= now))
+        {
+            // Too late to play any of this note, go on to the next one.
+            report.skipped = TRUE;
+            m_counts.skippedNotes++;
+        }
+        else
+        {
+            hr = _setOutput(ch, next->note.frequencyHz, actualMilliHz);
+            startTime = g_hiResClock.now();
+
+            driftTicks = (startTime > scheduledStart) ? (startTime - scheduledStart) : 0;
+            errorMilliHz = 0;
+            if (next->note.frequencyHz != 0)
+            {
+                errorMilliHz = (LONGLONG)actualMilliHz - ((LONGLONG)next->note.frequencyHz * 1000);
+            }
+
+            report.actualFrequencyMilliHz = actualMilliHz;
+            report.frequencyErrorMilliHz = (LONG)errorMilliHz;
+            report.startDriftMicroseconds = (startTime >= scheduledStart) ?
+                (LONGLONG)g_hiResClock.ticksToMicroseconds(startTime - scheduledStart) :
+                -(LONGLONG)g_hiResClock.ticksToMicroseconds(scheduledStart - startTime);
+
+            m_counts.notes++;
+            m_counts.driftTicks += driftTicks;
+            if (driftTicks > m_counts.maxDriftTicks)
+            {
+                m_counts.maxDriftTicks = driftTicks;
+            }
+            if (errorMilliHz < 0)
+            {
+                errorMilliHz = -errorMilliHz;
+            }
+            if ((ULONGLONG)errorMilliHz > m_counts.maxFrequencyErrorMilliHz)
+            {
+                m_counts.maxFrequencyErrorMilliHz = (ULONG)errorMilliHz;
+            }
+        }
+
+        _addReport(report);
+    }
+
+    return hr;
+}
+
+inline HRESULT ToneGeneratorClass::_startGenerator()
+{
+    HRESULT hr = S_OK;
+
+    if (m_hThread != NULL)
+    {
+        return S_OK;
+    }
+
+    m_stopping = FALSE;
+    m_error = S_OK;
+
+    m_hQueueChanged = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (m_hQueueChanged == NULL)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = m_waitTimer.open();
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = HiResWaitTimerClass::startThread(_generatorThread, this, m_hThread);
+    }
+
+    if (FAILED(hr))
+    {
+        m_waitTimer.close();
+        if (m_hQueueChanged != NULL)
+        {
+            CloseHandle(m_hQueueChanged);
+            m_hQueueChanged = NULL;
+        }
+    }
+
+    return hr;
+}
+
+inline void ToneGeneratorClass::_runGenerator()
+{
+    HRESULT hr = S_OK;
+    ULONGLONG now;
+    ULONGLONG nextChange;
+    ULONG active;
+    ULONG channel;
+
+    while (!m_stopping && SUCCEEDED(hr))
+    {
+        EnterCriticalSection(&m_lock);
+
+        now = g_hiResClock.now();
+        nextChange = 0;
+        active = m_activeChannels;
+        while (SUCCEEDED(hr) && _BitScanForward(&channel, active))
+        {
+            active &= active - 1;
+            hr = _advanceChannel(m_channels[channel], now);
+
+            if (m_channels[channel].playing && (m_channels[channel].noteEnd != 0) &&
+                ((nextChange == 0) || (m_channels[channel].noteEnd < nextChange)))
+            {
+                nextChange = m_channels[channel].noteEnd;
+            }
+        }
+
+        LeaveCriticalSection(&m_lock);
+
+        if (SUCCEEDED(hr) && !m_stopping)
+        {
+            _waitUntil(nextChange);
+        }
+    }
+
+    if (FAILED(hr))
+    {
+        m_error = hr;
+    }
+}
+
+#endif  // _TONE_GENERATOR_H_
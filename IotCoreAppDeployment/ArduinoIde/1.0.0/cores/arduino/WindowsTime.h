@@ -8,34 +8,318 @@
 #define WINDOWS_TIME_H
 
 #include <Windows.h>
+#if defined(_M_X64) || defined(_M_ARM64)
+#include <intrin.h>
+#endif
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+/// \brief Interface for a clock to use in place of the high resolution timer
+/// \details WindowsTime reads the high resolution timer and blocks the thread
+/// unless a TimeSource has been installed with WindowsTime::setTimeSource(),
+/// in which case millis(), micros(), delay() and delayMicroseconds() all go
+/// to the TimeSource instead.
+class TimeSource {
+public:
+	virtual ~TimeSource() {}
+
+    /// \brief Retrieves the current time of the clock, in microseconds.
+	virtual ULONGLONG micros64(void) = 0;
+
+    /// \brief Waits until the clock has advanced by the given time.
+    /// \param [in] us The number of microseconds to wait
+    /// \param [in] alertable TRUE if APCs queued to the thread may run while it waits
+	virtual void delayMicroseconds(ULONGLONG us, BOOL alertable) = 0;
+};
+
+/// \brief A clock that only moves when it is told to, for simulating sketches
+/// \details A delay advances the clock by its length and returns at once, so a
+/// sketch that waits for hours runs in as long as its own code takes, and every
+/// run sees exactly the same times.  Simulated devices can call advance() to
+/// account for the time their operations would take.  The clock can be used
+/// from several threads, but each delay advances it independently; threads
+/// do not wait for each other.
+class VirtualTimeSource : public TimeSource {
+
+	volatile LONGLONG now;
+
+public:
+
+	VirtualTimeSource(ULONGLONG startUS = 0)
+	{
+		now = (LONGLONG)startUS;
+	}
+
+    /// \brief Retrieves the current time of the clock, in microseconds.
+	ULONGLONG micros64(void)
+	{
+		return (ULONGLONG)InterlockedCompareExchange64(&now, 0, 0);
+	}
+
+    /// \brief Advances the clock by the given time and returns at once.
+	void delayMicroseconds(ULONGLONG us, BOOL alertable)
+	{
+		UNREFERENCED_PARAMETER(alertable);
+		advance(us);
+	}
+
+    /// \brief Advances the clock by the given number of microseconds.
+	void advance(ULONGLONG us)
+	{
+		InterlockedExchangeAdd64(&now, (LONGLONG)us);
+	}
+
+    /// \brief Sets the clock to the given time in microseconds.
+	void setMicros64(ULONGLONG us)
+	{
+		InterlockedExchange64(&now, (LONGLONG)us);
+	}
+};
 
 /// \brief Helper class to implement the Arduino time functions on Windows
 class WindowsTime {
 
-	const   DWORD SLEEP_THRESHOLD_MS = 17;
-	const   DWORD SLEEP_MARGIN_MS = 16;
 	const   DWORD SLEEP_MAX_MS = 0x3fffffff;
+	const   LONGLONG CALIBRATION_WAIT_US = 1000;
+	const   int CALIBRATION_WAITS = 4;
+	const   LONGLONG WAKE_GUARD_US = 20;
+	const   LONGLONG UNCALIBRATED_LATENCY_US = 1000;
+	const   LONGLONG WAKE_LATENCY_LIMIT = 2;
 
 	LARGE_INTEGER qpFrequency;
 	LARGE_INTEGER qpStartCount;
 
-	DWORD qpcDiffToMS(LARGE_INTEGER& qpc, LARGE_INTEGER& qpcStop)
+	// microseconds and milliseconds per QPC tick as a whole number and a
+	// 64-bit binary fraction, so tick counts convert with multiplies instead
+	// of a divide
+	ULONGLONG usPerTickWhole;
+	ULONGLONG usPerTickFraction;
+	ULONGLONG msPerTickWhole;
+	ULONGLONG msPerTickFraction;
+	// QPC ticks per microsecond, the same way, for converting delay lengths
+	ULONGLONG ticksPerUSWhole;
+	ULONGLONG ticksPerUSFraction;
+
+	// false once creating a high resolution waitable timer has failed
+	bool highResolutionTimer;
+	// longest time between a timer expiring and the thread running again
+	// measured at startup, the allowance currently made for it, and the
+	// most the allowance may grow to (WAKE_LATENCY_LIMIT times the first)
+	LONGLONG calibratedLatencyTicks;
+	LONGLONG wakeLatencyTicks;
+	LONGLONG maxLatencyTicks;
+	// shortest remaining time worth waiting for rather than spinning
+	LONGLONG minWaitTicks;
+	// shortest delay that measures the wake-up latency; shorter delays made
+	// before it is measured allow UNCALIBRATED_LATENCY_US instead
+	LONGLONG calibrationTicks;
+
+	// clock used instead of the high resolution timer, if not NULL
+	TimeSource* timeSource;
+
+	// runs calibrateWakeLatency() once, when the first delay needs it
+	INIT_ONCE calibrationOnce;
+	// guards the wake-up latency and delayStats, which delays on any thread
+	// update; never deleted, since other threads may delay during shutdown
+	CRITICAL_SECTION statsLock;
+
+	// convert microseconds to QPC ticks with the scale from initTickScale(),
+	// rounding down to within a tick
+	LONGLONG usToTicks(LONGLONG us)
+	{
+		return (LONGLONG)(((ULONGLONG)us * ticksPerUSWhole) + mulHigh64((ULONGLONG)us, ticksPerUSFraction));
+	}
+
+	// high 64 bits of the 128-bit product of two 64-bit values
+	static ULONGLONG mulHigh64(ULONGLONG a, ULONGLONG b)
+	{
+#if defined(_M_X64) || defined(_M_ARM64)
+		return __umulh(a, b);
+#else
+		ULONGLONG aLo = a & 0xffffffff, aHi = a >> 32;
+		ULONGLONG bLo = b & 0xffffffff, bHi = b >> 32;
+		ULONGLONG loLo = aLo * bLo;
+		ULONGLONG hiLo = aHi * bLo;
+		ULONGLONG loHi = aLo * bHi;
+		ULONGLONG middle = (loLo >> 32) + (hiLo & 0xffffffff) + (loHi & 0xffffffff);
+		return aHi * bHi + (hiLo >> 32) + (loHi >> 32) + (middle >> 32);
+#endif
+	}
+
+	// units per tick of a clock as a whole number and a 64-bit binary fraction
+	static void tickScale(ULONGLONG unitsPerSecond, ULONGLONG frequency, ULONGLONG& whole, ULONGLONG& fraction)
+	{
+		ULONGLONG remainder = unitsPerSecond % frequency;
+
+		whole = unitsPerSecond / frequency;
+
+		// long division of remainder * 2^64 by the frequency, done once here
+		fraction = 0;
+		for (int i = 0; i < 64; i++)
+		{
+			remainder <<= 1;
+			fraction <<= 1;
+			if (remainder >= frequency)
+			{
+				remainder -= frequency;
+				fraction |= 1;
+			}
+		}
+	}
+
+	void initTickScale()
+	{
+		tickScale(1000000, qpFrequency.QuadPart, usPerTickWhole, usPerTickFraction);
+		tickScale(1000, qpFrequency.QuadPart, msPerTickWhole, msPerTickFraction);
+		tickScale(qpFrequency.QuadPart, 1000000, ticksPerUSWhole, ticksPerUSFraction);
+	}
+
+	// convert a QPC tick count with a scale from tickScale(), rounding down;
+	// the truncated fraction can leave the product one low, so it is checked
+	// against the exact 128-bit products of the tick count and of the result
+	ULONGLONG ticksToUnits(ULONGLONG ticks, ULONGLONG unitsPerSecond, ULONGLONG whole, ULONGLONG fraction)
+	{
+		ULONGLONG frequency = qpFrequency.QuadPart;
+		ULONGLONG units = ticks * whole + mulHigh64(ticks, fraction);
+		ULONGLONG next = units + 1;
+		ULONGLONG nextHigh = mulHigh64(next, frequency);
+		ULONGLONG ticksHigh = mulHigh64(ticks, unitsPerSecond);
+
+		// (units + 1) * frequency <= ticks * unitsPerSecond if it is one low
+		if ((nextHigh < ticksHigh) || ((nextHigh == ticksHigh) && (next * frequency <= ticks * unitsPerSecond)))
+		{
+			units = next;
+		}
+		return units;
+	}
+
+	// convert a QPC tick count to microseconds, rounding down; the result
+	// does not overflow for any tick count that can occur in practice
+	ULONGLONG ticksToUS(ULONGLONG ticks)
+	{
+		return ticksToUnits(ticks, 1000000, usPerTickWhole, usPerTickFraction);
+	}
+
+	// convert a QPC tick count to milliseconds, rounding down
+	ULONGLONG ticksToMS(ULONGLONG ticks)
+	{
+		return ticksToUnits(ticks, 1000, msPerTickWhole, msPerTickFraction);
+	}
+
+	// index of the decade range (<10us, <100us, ... >=100ms) a time falls in
+	static int decadeIndex(LONGLONG us)
+	{
+		int index = 0;
+		LONGLONG limit = 10;
+		while ((index < DELAY_STATS_RANGES - 1) && (us >= limit))
+		{
+			index++;
+			limit *= 10;
+		}
+		return index;
+	}
+
+	// a waitable timer, closed when the thread that created it exits
+	struct ThreadWaitTimer {
+		HANDLE handle;
+		ThreadWaitTimer() : handle(NULL) {}
+		~ThreadWaitTimer()
+		{
+			if (handle != NULL)
+			{
+				CloseHandle(handle);
+			}
+		}
+	};
+
+	// the calling thread's timer, created on its first wait, so delays made
+	// on different threads never share one and no delay pays to create one
+	HANDLE threadWaitTimer()
+	{
+		static thread_local ThreadWaitTimer timer;
+		if (timer.handle == NULL)
+		{
+			timer.handle = createWaitTimer();
+		}
+		return timer.handle;
+	}
+
+	HANDLE createWaitTimer()
+	{
+		HANDLE timer = NULL;
+		if (highResolutionTimer)
+		{
+			timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+			highResolutionTimer = (timer != NULL);
+		}
+		if (timer == NULL)
+		{
+			timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+		}
+		return timer;
+	}
+
+	// block the thread for about the number of timer ticks given, using a
+	// waitable timer if there is one, or Sleep if there is not; returns false
+	// if an alertable wait ended early to run an APC
+	bool waitTicks(HANDLE timer, LONGLONG ticks, BOOL alertable)
 	{
-		LARGE_INTEGER qpcDiff;
-		qpcDiff.QuadPart = qpcStop.QuadPart - qpc.QuadPart;
-		if (qpcDiff.QuadPart > 0)
+		if (timer != NULL)
 		{
-			qpcDiff.QuadPart = qpcDiff.QuadPart * 1000 / qpFrequency.QuadPart;
-			if (qpcDiff.QuadPart > SLEEP_MAX_MS)
+			// relative due times are negative, in 100ns units
+			LARGE_INTEGER due;
+			due.QuadPart = -((ticks / qpFrequency.QuadPart) * 10000000 +
+				(ticks % qpFrequency.QuadPart) * 10000000 / qpFrequency.QuadPart);
+			if (due.QuadPart < 0 && SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE))
 			{
-				return SLEEP_MAX_MS;
+				return WaitForSingleObjectEx(timer, INFINITE, alertable) != WAIT_IO_COMPLETION;
 			}
-			else
+		}
+		LONGLONG ms = ticks * 1000 / qpFrequency.QuadPart;
+		return SleepEx(ms > (LONGLONG)SLEEP_MAX_MS ? SLEEP_MAX_MS : (DWORD)ms, alertable) != WAIT_IO_COMPLETION;
+	}
+
+	// measure how late the thread runs after a short timer wait expires
+	void calibrateWakeLatency()
+	{
+		HANDLE timer = threadWaitTimer();
+		LONGLONG waitTicks = usToTicks(CALIBRATION_WAIT_US);
+		LONGLONG latency = 0;
+		for (int i = 0; i < CALIBRATION_WAITS; i++)
+		{
+			LARGE_INTEGER qpc, qpcWake;
+			QueryPerformanceCounter(&qpc);
+			this->waitTicks(timer, waitTicks, FALSE);
+			QueryPerformanceCounter(&qpcWake);
+			LONGLONG late = qpcWake.QuadPart - qpc.QuadPart - waitTicks;
+			if (late > latency)
 			{
-				return qpcDiff.LowPart;
+				latency = late;
 			}
 		}
-		return 0;
+
+		EnterCriticalSection(&statsLock);
+		calibratedLatencyTicks = latency + usToTicks(WAKE_GUARD_US);
+		wakeLatencyTicks = calibratedLatencyTicks;
+		maxLatencyTicks = calibratedLatencyTicks * WAKE_LATENCY_LIMIT;
+		LeaveCriticalSection(&statsLock);
+	}
+
+	static BOOL CALLBACK calibrateOnce(PINIT_ONCE once, PVOID context, PVOID* result)
+	{
+		UNREFERENCED_PARAMETER(once);
+		UNREFERENCED_PARAMETER(result);
+		((WindowsTime*)context)->calibrateWakeLatency();
+		return TRUE;
+	}
+
+	// the calibration takes a few timer waits, so it is done by the first
+	// delay long enough to absorb them rather than at program startup
+	void ensureCalibrated()
+	{
+		InitOnceExecuteOnce(&calibrationOnce, calibrateOnce, this, NULL);
 	}
 
     void operator= (WindowsTime &wt_) {
@@ -44,18 +328,51 @@ class WindowsTime {
 
 public:
 
+	/// \brief Number of delay and wake-up error ranges statistics are kept for.
+	/// \details The ranges are decades: under 10us, 10us to 100us, and so on
+	/// up to 100ms and over.
+	static const int DELAY_STATS_RANGES = 6;
+
+	/// \brief Statistics for the delays whose length falls in one range.
+	typedef struct {
+		ULONGLONG delays;                           ///< Number of delays
+		ULONGLONG waits;                            ///< Number of timer waits made
+		ULONGLONG lateWakes;                        ///< Number of timer waits that woke later than the allowance can grow to
+		ULONGLONG cpuMicroseconds;                  ///< Time spent spinning, which is the CPU time the delays consumed
+		ULONGLONG maxOvershootMicroseconds;         ///< Longest time a delay returned after it was due
+		ULONGLONG wakeErrors[DELAY_STATS_RANGES];   ///< Histogram of timer wake-up errors, by decade range
+	} DELAY_RANGE_STATS;
+
+	/// \brief Struct used to return delay statistics.
+	typedef struct {
+		bool highResolutionTimer;                   ///< True if high resolution waitable timers are used
+		ULONGLONG wakeLatencyMicroseconds;          ///< Wake-up latency the delays currently allow for
+		DELAY_RANGE_STATS ranges[DELAY_STATS_RANGES];   ///< Statistics by requested delay length
+	} DELAY_STATS;
+
 	WindowsTime()
 	{
 		QueryPerformanceFrequency(&qpFrequency);
 		QueryPerformanceCounter(&qpStartCount);
+		initTickScale();
+		timeSource = NULL;
+		highResolutionTimer = true;
+		minWaitTicks = usToTicks(WAKE_GUARD_US);
+		calibrationTicks = usToTicks(CALIBRATION_WAIT_US * CALIBRATION_WAITS * 2);
+		calibratedLatencyTicks = usToTicks(UNCALIBRATED_LATENCY_US);
+		wakeLatencyTicks = calibratedLatencyTicks;
+		maxLatencyTicks = calibratedLatencyTicks * WAKE_LATENCY_LIMIT;
+		ZeroMemory(&delayStats, sizeof(delayStats));
+		InitOnceInitialize(&calibrationOnce);
+		InitializeCriticalSection(&statsLock);
 	}
 
     /// \brief Pauses the program for the amount of time (in miliseconds) 
     /// specified as parameter.
     /// \details There are 1000 milliseconds in a second.
     /// \param [in] ms The number of milliseconds to pause
-    /// \note The windows timer ticks every 16ms, for shorter precise
-    /// delays the thread must spin
+    /// \note The thread blocks on a timer for most of the delay, and spins
+    /// only for the measured wake-up latency at the end
     /// \see <a href="http://arduino.cc/en/Reference/Delay" target="_blank">origin: Arduino::delay</a>
     void delay(unsigned long ms)
 	{
@@ -68,58 +385,194 @@ public:
     /// \brief Pauses the program for the amount of time (in microseconds) 
     /// specified as parameter.
     /// \details There are a thousand microseconds in a millisecond, and
-    /// \param [in] us The number of microseconds to pause
     /// a million microseconds in a second.
+    /// \param [in] us The number of microseconds to pause
+    /// \param [in] alertable If TRUE, APCs queued to the thread run while it
+    /// waits, as they do in SleepEx
+    /// \note The thread blocks on a waitable timer (high resolution where the
+    /// OS supports it) until the measured wake-up latency remains, and spins
+    /// for only that residual.  The latency is measured during the first
+    /// delay of 8ms or more; delays before that allow 1ms for it.  If a timer
+    /// wait is later than the allowance, the allowance grows to match, up to
+    /// twice the measured latency, and decays back toward the measured
+    /// latency on every delay.  Wake-ups later than that are counted as
+    /// outliers and don't change it.
     /// \see <a href="http://arduino.cc/en/Reference/DelayMicroseconds" target="_blank">origin: Arduino::delayMicroseconds</a>
-    void delayMicroseconds(LARGE_INTEGER& us)
+    void delayMicroseconds(LARGE_INTEGER& us, BOOL alertable = FALSE)
 	{
-		LARGE_INTEGER qpc, qpcStop;
+		if (timeSource != NULL)
+		{
+			timeSource->delayMicroseconds(us.QuadPart, alertable);
+			return;
+		}
+
+		LARGE_INTEGER qpc, qpcStop, qpcSpin;
+		LONGLONG latencyTicks;
+		DELAY_RANGE_STATS& stats = delayStats.ranges[decadeIndex(us.QuadPart)];
 
 		QueryPerformanceCounter(&qpcStop);
 		qpc = qpcStop;
-		qpcStop.QuadPart += us.QuadPart * qpFrequency.QuadPart / 1000000;
+		qpcStop.QuadPart += usToTicks(us.QuadPart);
 
-		// use windows Sleep for lengthy wait
-		DWORD delayMS = qpcDiffToMS(qpc, qpcStop);
-		while (delayMS >= SLEEP_THRESHOLD_MS)
+		if (qpcStop.QuadPart - qpc.QuadPart > calibrationTicks)
 		{
-			Sleep(delayMS - SLEEP_MARGIN_MS);
+			ensureCalibrated();
+			QueryPerformanceCounter(&qpc);
+		}
 
+		// let a raised allowance decay back toward the calibration, whether
+		// or not this delay is long enough to wait on a timer
+		EnterCriticalSection(&statsLock);
+		wakeLatencyTicks -= (wakeLatencyTicks - calibratedLatencyTicks) / 16;
+		latencyTicks = wakeLatencyTicks;
+		LeaveCriticalSection(&statsLock);
+
+		// block for all but the expected wake-up latency
+		while (qpcStop.QuadPart - qpc.QuadPart > latencyTicks + minWaitTicks)
+		{
+			LONGLONG waitTicks = qpcStop.QuadPart - qpc.QuadPart - latencyTicks;
+			LONGLONG qpcWake = qpc.QuadPart + waitTicks;
+			bool expired = this->waitTicks(threadWaitTimer(), waitTicks, alertable);
 			QueryPerformanceCounter(&qpc);
+			if (!expired)
+			{
+				// an APC ran; wait again for whatever time is left
+				continue;
+			}
 
-			delayMS = qpcDiffToMS(qpc, qpcStop);
+			LONGLONG wakeError = qpc.QuadPart - qpcWake;
+			EnterCriticalSection(&statsLock);
+			if (wakeError > maxLatencyTicks)
+			{
+				// an outlier, such as a preemption, says nothing about how
+				// late the next wake-up will be
+				stats.lateWakes++;
+			}
+			else if (wakeError > wakeLatencyTicks)
+			{
+				wakeLatencyTicks = wakeError;
+			}
+			latencyTicks = wakeLatencyTicks;
+			stats.waits++;
+			stats.wakeErrors[decadeIndex(ticksToUS(wakeError < 0 ? -wakeError : wakeError))]++;
+			LeaveCriticalSection(&statsLock);
 		}
 
 		// spin remaining time, for s accurate timing
-		do {
+		qpcSpin = qpc;
+		while (qpcStop.QuadPart > qpc.QuadPart)
+		{
+			YieldProcessor();
 			QueryPerformanceCounter(&qpc);
-		} while (qpcStop.QuadPart > qpc.QuadPart);
+		}
+
+		ULONGLONG cpuMicroseconds = ticksToUS(qpc.QuadPart - qpcSpin.QuadPart);
+		ULONGLONG overshoot = ticksToUS(qpc.QuadPart - qpcStop.QuadPart);
+		EnterCriticalSection(&statsLock);
+		stats.delays++;
+		stats.cpuMicroseconds += cpuMicroseconds;
+		if (overshoot > stats.maxOvershootMicroseconds)
+		{
+			stats.maxOvershootMicroseconds = overshoot;
+		}
+		LeaveCriticalSection(&statsLock);
+	}
 
+    /// \brief Retrieves the delay statistics.
+    /// \param [out] stats The statistics gathered since startup or the last reset.
+    /// \note Delays on every thread update the statistics under a lock, so
+    /// the counts are exact and consistent with each other.
+    void getDelayStats(DELAY_STATS& stats)
+	{
+		EnterCriticalSection(&statsLock);
+		stats = delayStats;
+		stats.highResolutionTimer = highResolutionTimer;
+		stats.wakeLatencyMicroseconds = ticksToUS(wakeLatencyTicks);
+		LeaveCriticalSection(&statsLock);
+	}
+
+    /// \brief Clears the delay statistics.
+    void resetDelayStats(void)
+	{
+		EnterCriticalSection(&statsLock);
+		ZeroMemory(&delayStats, sizeof(delayStats));
+		LeaveCriticalSection(&statsLock);
 	}
 
     /// \brief Retrieves the number of milliseconds since the currently running program started.
     /// \returns Number of milliseconds since the program started.
     /// \warning This number will overflow (go back to zero), after approximately 50 days.
+    /// It is the low 32 bits of millis64().
     /// \see <a href="http://arduino.cc/en/Reference/Millis" target="_blank">origin: Arduino::millis</a>
     unsigned long millis(void)
 	{
-		LARGE_INTEGER qpc;
-		QueryPerformanceCounter(&qpc);
-		qpc.QuadPart -= qpStartCount.QuadPart;
-		return (unsigned long)(qpc.QuadPart * 1000 / qpFrequency.QuadPart);
+		return (unsigned long)millis64();
 	}
 
     /// \brief Retrieves the number of microseconds since the currently running program started. 
     /// \returns Number of microseconds since the program started.
     /// \warning This number will overflow (go back to zero), after approximately 70 minutes.
+    /// It is the low 32 bits of micros64().
     /// \see <a href="http://arduino.cc/en/Reference/Micros" target="_blank">origin: Arduino::micros</a>
     unsigned long micros(void)
 	{
+		return (unsigned long)micros64();
+	}
+
+    /// \brief Retrieves the number of milliseconds since the currently running program started,
+    /// as a 64-bit count that does not wrap.
+    /// \returns Number of milliseconds since the program started.
+    /// \note The high resolution timer count is converted with a fixed-point
+    /// scale computed at startup, the same way as micros64(), so no divide
+    /// is done.  Both round down exactly, so millis64() is always
+    /// micros64() / 1000 for the same count.
+    ULONGLONG millis64(void)
+	{
+		if (timeSource != NULL)
+		{
+			return timeSource->micros64() / 1000;
+		}
+
+		LARGE_INTEGER qpc;
+		QueryPerformanceCounter(&qpc);
+		return ticksToMS(qpc.QuadPart - qpStartCount.QuadPart);
+	}
+
+    /// \brief Retrieves the number of microseconds since the currently running program started,
+    /// as a 64-bit count that does not wrap.
+    /// \returns Number of microseconds since the program started.
+    ULONGLONG micros64(void)
+	{
+		if (timeSource != NULL)
+		{
+			return timeSource->micros64();
+		}
+
 		LARGE_INTEGER qpc;
 		QueryPerformanceCounter(&qpc);
-		qpc.QuadPart -= qpStartCount.QuadPart;
-		return (unsigned long)(qpc.QuadPart * 1000000 / qpFrequency.QuadPart);
+		return ticksToUS(qpc.QuadPart - qpStartCount.QuadPart);
 	}
+
+    /// \brief Replaces the high resolution timer with another clock.
+    /// \param [in] source The clock to use, or NULL to go back to the high
+    /// resolution timer.  The caller keeps ownership of it.
+    /// \note The time returned by millis() and micros() jumps to that of the
+    /// new clock, so this is best done before the sketch starts.  The delay
+    /// statistics only cover delays timed with the high resolution timer.
+    void setTimeSource(TimeSource* source)
+	{
+		timeSource = source;
+	}
+
+    /// \brief Retrieves the clock installed with setTimeSource(), or NULL.
+    TimeSource* getTimeSource(void)
+	{
+		return timeSource;
+	}
+
+private:
+
+	DELAY_STATS delayStats;
 };
 
 __declspec(selectany) WindowsTime _WindowsTime;
@@ -0,0 +1,461 @@
+// Copyright (c) Microsoft Open Technologies, Inc.  All rights reserved.  
+// Licensed under the BSD 2-Clause License.  
+// See License.txt in the project root for license information.
+
+#ifndef _WS2812_STRIP_H_
+#define _WS2812_STRIP_H_
+
+#include <Windows.h>
+#include <vector>
+
+#include "ArduinoError.h"
+#include "SpiController.h"
+#include "SpiBusManager.h"
+#include "HiResTimer.h"
+
+/// Each WS2812 data bit is 1.25 microseconds long (800 kHz).
+#define WS2812_BIT_RATE_KHZ 800
+
+/// Encode each data bit as 3 SPI bits (0 = 100, 1 = 110) with a 2.4 MHz SPI clock.
+#define WS2812_SYMBOL_BITS_3 3
+
+/// Encode each data bit as 4 SPI bits (0 = 1000, 1 = 1110) with a 3.2 MHz SPI clock.
+#define WS2812_SYMBOL_BITS_4 4
+
+/// Low time that latches the data into the LEDs.  WS2812B parts need at least 280 microseconds.
+#define WS2812_RESET_MICROSECONDS 300
+
+/// Class used to drive a strip of WS2812 (NeoPixel) LEDs from the SPI MOSI pin.
+/**
+Each bit of LED data is sent as a short group of SPI bits whose high time matches the WS2812
+timing for a 0 or a 1, so the SPI controller generates the waveform rather than software
+toggling a GPIO pin.  Pixel colors are kept in a frame buffer.  Only pixels that have changed
+since the last show() are re-encoded, and show() does nothing if no pixel has changed.
+
+The waveform is only correct if the frame is sent as one unbroken stream of SPI bits, so the
+SPI controller must support buffer transfers.  The Quark controller on Galileo boards does
+not; there begin() fails rather than show() sending a broken waveform.
+*/
+class Ws2812StripClass
+{
+public:
+    /// Struct used to return performance information for the strip.
+    typedef struct {
+        ULONGLONG frames;                   ///< Frames sent to the strip
+        ULONGLONG skippedFrames;            ///< Calls to show() that sent nothing because no pixel changed
+        ULONGLONG encodeNanosecondsPer1000Leds; ///< Average time to encode 1000 LEDs
+        ULONGLONG lastWireMicroseconds;     ///< Time taken to send the last frame on the SPI bus
+        ULONGLONG framesPerSecond;          ///< Frames sent per second since the stats were reset
+        ULONGLONG maxFramesPerSecond;       ///< Frame rate the strip could reach given the last frame time
+    } STRIP_STATS, *PSTRIP_STATS;
+
+    /// Constructor.
+    /**
+    \param[in] numPixels The number of LEDs on the strip.
+    \param[in] symbolBits The number of SPI bits used for each LED data bit (3 or 4).
+    */
+    Ws2812StripClass(ULONG numPixels, ULONG symbolBits = WS2812_SYMBOL_BITS_3) :
+        m_numPixels(numPixels),
+        m_symbolBits(symbolBits),
+        m_deviceId(SPI_BUS_NO_DEVICE),
+        m_dirtyFirst(0),
+        m_dirtyLast(0),
+        m_isDirty(TRUE)
+    {
+        if ((m_symbolBits != WS2812_SYMBOL_BITS_3) && (m_symbolBits != WS2812_SYMBOL_BITS_4))
+        {
+            m_symbolBits = WS2812_SYMBOL_BITS_3;
+        }
+        m_clockKhz = WS2812_BIT_RATE_KHZ * m_symbolBits;
+
+        m_pixels.assign(m_numPixels * 3, 0);
+
+        // One leading zero byte so MOSI is known to be low before the first bit, the pixel
+        // data, then enough zero bytes to hold the line low for the reset time.
+        m_dataOffset = 1;
+        m_resetBytes = ((WS2812_RESET_MICROSECONDS * m_clockKhz) / 1000 + 7) / 8;
+        m_encoded.assign(m_dataOffset + (m_pixels.size() * m_symbolBits) + m_resetBytes, 0);
+
+        _buildExpansionTable();
+        m_dirtyLast = m_numPixels;
+
+        resetStats();
+    }
+
+    /// Destructor.
+    virtual ~Ws2812StripClass()
+    {
+        end();
+    }
+
+    /// Open the SPI bus to drive the strip.
+    /**
+    \note The strip data input must be connected to the SPI MOSI pin.  No chip select is used,
+    so the strip sees all traffic on the bus; other SPI devices should not share it.
+    \note This throws DMAP_E_SPI_BUFFER_TRANSFER_NOT_IMPLEMENTED on boards whose SPI controller
+    can't do buffer transfers (Galileo).  Sending the frame a word at a time would leave gaps
+    in the waveform that the LEDs would read as wrong bits or as a reset.
+    */
+    void begin()
+    {
+        HRESULT hr = S_OK;
+        SpiControllerClass* controller;
+
+        if (m_deviceId == SPI_BUS_NO_DEVICE)
+        {
+            hr = g_spiBus.begin();
+
+            if (SUCCEEDED(hr))
+            {
+                hr = g_spiBus.addDevice(SPI_BUS_NO_CS_PIN, DEFAULT_SPI_MODE, m_clockKhz, 8, FALSE, m_deviceId);
+
+                // An empty buffer transfer finds out whether the controller can send a frame.
+                if (SUCCEEDED(hr))
+                {
+                    hr = g_spiBus.beginTransaction(m_deviceId, controller);
+                    if (SUCCEEDED(hr))
+                    {
+                        hr = controller->transferBuffer(nullptr, nullptr, 0);
+                        g_spiBus.endTransaction(m_deviceId);
+                    }
+
+                    if (FAILED(hr))
+                    {
+                        g_spiBus.removeDevice(m_deviceId);
+                        m_deviceId = SPI_BUS_NO_DEVICE;
+                    }
+                }
+
+                if (FAILED(hr))
+                {
+                    g_spiBus.end();
+                }
+            }
+
+            if (FAILED(hr))
+            {
+                ThrowError(hr, "Error initializing SPI bus for WS2812 strip.  Error: 0x%08x", hr);
+            }
+        }
+    }
+
+    /// Release the SPI bus.
+    void end()
+    {
+        if (m_deviceId != SPI_BUS_NO_DEVICE)
+        {
+            g_spiBus.removeDevice(m_deviceId);
+            m_deviceId = SPI_BUS_NO_DEVICE;
+            g_spiBus.end();
+        }
+    }
+
+    /// Pack 8-bit red, green and blue values into a 32-bit color.
+    static inline ULONG Color(UCHAR red, UCHAR green, UCHAR blue)
+    {
+        return ((ULONG)red << 16) | ((ULONG)green << 8) | blue;
+    }
+
+    /// Get the number of LEDs on the strip.
+    inline ULONG numPixels()
+    {
+        return m_numPixels;
+    }
+
+    /// Set the color of one LED in the frame buffer.
+    inline void setPixelColor(ULONG index, UCHAR red, UCHAR green, UCHAR blue)
+    {
+        PBYTE pixel;
+
+        if (index < m_numPixels)
+        {
+            // WS2812 LEDs take their data in green, red, blue order.
+            pixel = &m_pixels[index * 3];
+            if ((pixel[0] != green) || (pixel[1] != red) || (pixel[2] != blue))
+            {
+                pixel[0] = green;
+                pixel[1] = red;
+                pixel[2] = blue;
+                _markDirty(index);
+            }
+        }
+    }
+
+    /// Set the color of one LED in the frame buffer from a packed 32-bit color.
+    inline void setPixelColor(ULONG index, ULONG color)
+    {
+        setPixelColor(index, (UCHAR)(color >> 16), (UCHAR)(color >> 8), (UCHAR)color);
+    }
+
+    /// Get the color of one LED from the frame buffer as a packed 32-bit color.
+    inline ULONG getPixelColor(ULONG index)
+    {
+        PBYTE pixel;
+
+        if (index >= m_numPixels)
+        {
+            return 0;
+        }
+        pixel = &m_pixels[index * 3];
+        return Color(pixel[1], pixel[0], pixel[2]);
+    }
+
+    /// Set all the LEDs in the frame buffer to one color.
+    inline void fill(ULONG color)
+    {
+        ULONG i;
+
+        for (i = 0; i < m_numPixels; i++)
+        {
+            setPixelColor(i, color);
+        }
+    }
+
+    /// Turn all the LEDs in the frame buffer off.
+    inline void clear()
+    {
+        fill(0);
+    }
+
+    /// Send the frame buffer to the strip.
+    void show(BOOL force = FALSE);
+
+    /// Get performance information for the strip.
+    void getStats(STRIP_STATS & stats);
+
+    /// Reset the performance information for the strip.
+    void resetStats();
+
+private:
+
+    /// The number of LEDs on the strip.
+    ULONG m_numPixels;
+
+    /// The number of SPI bits used for each LED data bit.
+    ULONG m_symbolBits;
+
+    /// The SPI clock rate that gives the WS2812 bit rate.
+    ULONG m_clockKhz;
+
+    /// The ID of this strip on the shared SPI bus.
+    ULONG m_deviceId;
+
+    /// Frame buffer, three bytes per LED in GRB order.
+    std::vector<BYTE> m_pixels;
+
+    /// The frame buffer encoded as SPI data, ready to send.
+    std::vector<BYTE> m_encoded;
+
+    /// Offset of the first pixel byte in the encoded buffer.
+    size_t m_dataOffset;
+
+    /// Number of zero bytes at the end of the encoded buffer for the reset time.
+    size_t m_resetBytes;
+
+    /// SPI bit pattern for each value of a data byte, right justified.
+    ULONG m_expansion[256];
+
+    /// The first LED that has changed since the last frame was encoded.
+    ULONG m_dirtyFirst;
+
+    /// One past the last LED that has changed since the last frame was encoded.
+    ULONG m_dirtyLast;
+
+    /// TRUE if any LED has changed since the last frame was sent.
+    BOOL m_isDirty;
+
+    /// g_hiResClock reading when the stats were last reset.
+    ULONGLONG m_statsStart;
+
+    /// Performance counters.
+    ULONGLONG m_frames;
+    ULONGLONG m_skippedFrames;
+    ULONGLONG m_encodeTicks;
+    ULONGLONG m_encodedPixels;
+    ULONGLONG m_lastWireTicks;
+    ULONGLONG m_lastEncodeTicks;
+
+    /// Method to build the table used to expand each data byte into SPI bits.
+    inline void _buildExpansionTable()
+    {
+        ULONG value;
+        ULONG bit;
+        ULONG pattern;
+        ULONG zeroSymbol = (m_symbolBits == WS2812_SYMBOL_BITS_4) ? 0x8 : 0x4;
+        ULONG oneSymbol = (m_symbolBits == WS2812_SYMBOL_BITS_4) ? 0xE : 0x6;
+
+        for (value = 0; value < 256; value++)
+        {
+            pattern = 0;
+            for (bit = 0; bit < 8; bit++)
+            {
+                pattern = (pattern << m_symbolBits) | (((value << bit) & 0x80) ? oneSymbol : zeroSymbol);
+            }
+            m_expansion[value] = pattern;
+        }
+    }
+
+    /// Method to record that an LED has changed.
+    inline void _markDirty(ULONG index)
+    {
+        if (!m_isDirty || (m_dirtyFirst >= m_dirtyLast))
+        {
+            m_dirtyFirst = index;
+            m_dirtyLast = index + 1;
+        }
+        else
+        {
+            if (index < m_dirtyFirst)
+            {
+                m_dirtyFirst = index;
+            }
+            if (index >= m_dirtyLast)
+            {
+                m_dirtyLast = index + 1;
+            }
+        }
+        m_isDirty = TRUE;
+    }
+
+    /// Method to encode the changed LEDs into SPI data.
+    void _encodeDirtyPixels();
+};
+
+/**
+\param[in] force If TRUE the frame is sent even if no LED has changed, for example to
+restore a strip that has been power cycled.
+\note The frame is sent as one SPI buffer transfer so the waveform has no gaps.
+*/
+inline void Ws2812StripClass::show(BOOL force)
+{
+    HRESULT hr = S_OK;
+    SpiControllerClass* controller;
+    ULONGLONG start;
+
+    if (m_deviceId == SPI_BUS_NO_DEVICE)
+    {
+        ThrowError(HRESULT_FROM_WIN32(ERROR_INVALID_STATE), "Can't update WS2812 strip until begin() has been done.");
+    }
+
+    if (!m_isDirty && !force)
+    {
+        m_skippedFrames++;
+        return;
+    }
+
+    _encodeDirtyPixels();
+
+    hr = g_spiBus.beginTransaction(m_deviceId, controller);
+    if (SUCCEEDED(hr))
+    {
+        start = g_hiResClock.now();
+        hr = controller->transferBuffer(m_encoded.data(), nullptr, m_encoded.size());
+        m_lastWireTicks = g_hiResClock.now() - start;
+        g_spiBus.endTransaction(m_deviceId);
+    }
+
+    if (FAILED(hr))
+    {
+        // Leave the frame dirty so the next show() sends it again.
+        m_isDirty = TRUE;
+        ThrowError(hr, "Error sending data to WS2812 strip.  Error: 0x%08x", hr);
+    }
+
+    m_isDirty = FALSE;
+    m_frames++;
+}
+
+inline void Ws2812StripClass::getStats(STRIP_STATS & stats)
+{
+    ULONGLONG elapsedMicroseconds;
+    ULONGLONG frameNanoseconds;
+
+    elapsedMicroseconds = g_hiResClock.ticksToMicroseconds(g_hiResClock.now() - m_statsStart);
+
+    stats.frames = m_frames;
+    stats.skippedFrames = m_skippedFrames;
+    stats.encodeNanosecondsPer1000Leds = 0;
+    if (m_encodedPixels > 0)
+    {
+        stats.encodeNanosecondsPer1000Leds = (g_hiResClock.ticksToNanoseconds(m_encodeTicks) * 1000) / m_encodedPixels;
+    }
+    stats.lastWireMicroseconds = g_hiResClock.ticksToMicroseconds(m_lastWireTicks);
+    stats.framesPerSecond = 0;
+    if (elapsedMicroseconds > 0)
+    {
+        stats.framesPerSecond = (m_frames * 1000000ULL) / elapsedMicroseconds;
+    }
+    stats.maxFramesPerSecond = 0;
+    frameNanoseconds = g_hiResClock.ticksToNanoseconds(m_lastWireTicks + m_lastEncodeTicks);
+    if (frameNanoseconds > 0)
+    {
+        stats.maxFramesPerSecond = 1000000000ULL / frameNanoseconds;
+    }
+}
+
+inline void Ws2812StripClass::resetStats()
+{
+    m_frames = 0;
+    m_skippedFrames = 0;
+    m_encodeTicks = 0;
+    m_encodedPixels = 0;
+    m_lastWireTicks = 0;
+    m_lastEncodeTicks = 0;
+    m_statsStart = g_hiResClock.now();
+}
+
+/**
+Each data byte is expanded with one table lookup, then written out MSB first as 3 or 4
+bytes of SPI data.  Only the range of LEDs that changed since the last frame is re-encoded.
+*/
+inline void Ws2812StripClass::_encodeDirtyPixels()
+{
+    ULONGLONG start;
+    size_t firstByte = (size_t)m_dirtyFirst * 3;
+    size_t lastByte = (size_t)m_dirtyLast * 3;
+    PBYTE src = m_pixels.data();
+    PBYTE dst;
+    ULONG pattern;
+    size_t i;
+
+    if (m_dirtyFirst >= m_dirtyLast)
+    {
+        return;
+    }
+
+    start = g_hiResClock.now();
+
+    dst = m_encoded.data() + m_dataOffset + (firstByte * m_symbolBits);
+    if (m_symbolBits == WS2812_SYMBOL_BITS_4)
+    {
+        for (i = firstByte; i < lastByte; i++)
+        {
+            pattern = m_expansion[src[i]];
+            dst[0] = (BYTE)(pattern >> 24);
+            dst[1] = (BYTE)(pattern >> 16);
+            dst[2] = (BYTE)(pattern >> 8);
+            dst[3] = (BYTE)pattern;
+            dst += 4;
+        }
+    }
+    else
+    {
+        for (i = firstByte; i < lastByte; i++)
+        {
+            pattern = m_expansion[src[i]];
+            dst[0] = (BYTE)(pattern >> 16);
+            dst[1] = (BYTE)(pattern >> 8);
+            dst[2] = (BYTE)pattern;
+            dst += 3;
+        }
+    }
+
+    m_lastEncodeTicks = g_hiResClock.now() - start;
+    m_encodeTicks += m_lastEncodeTicks;
+    m_encodedPixels += m_dirtyLast - m_dirtyFirst;
+
+    m_dirtyFirst = 0;
+    m_dirtyLast = 0;
+}
+
+#endif  // _WS2812_STRIP_H_
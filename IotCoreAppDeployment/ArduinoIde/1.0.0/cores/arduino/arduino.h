@@ -39,6 +39,7 @@
 #include "Adc.h"
 #include "pins_arduino.h"
 #include "PulseIn.h"
+#include "ToneGenerator.h"
 
 #include <memory>
 #include <map>
@@ -164,6 +165,20 @@ inline unsigned long micros(void)
     return _WindowsTime.micros();
 }
 
+// Returns the number of milliseconds since the currently running program started. 
+// This 64-bit count does not overflow.
+inline unsigned long long millis64(void)
+{
+    return _WindowsTime.millis64();
+}
+
+// Returns the number of microseconds since the currently running program started. 
+// This 64-bit count does not overflow.
+inline unsigned long long micros64(void)
+{
+    return _WindowsTime.micros64();
+}
+
 //
 // Returns true if an Arduino pin number is also an analog input
 //
@@ -246,19 +261,15 @@ inline int digitalRead(int pin)
 /// The number of bits used to return digitized analog values.
 __declspec (selectany) ULONG g_analogValueBits = 10;
 
-/// Perform an analog to digital conversion on one of the analog inputs.
+/// Translate an analogRead() pin number to a GPIO pin number and prepare the pin for use.
 /**
 \param[in] pin The analog pin to read (A0-A5, or 0-5).
-\return Digitized analog value read from the pin.
-\note The number of bits of the digitized analog value can be set by calling the 
-analogReadResolution() API.  By default ten bits are returned (0-1023 for 0-5v pin voltage).
-\sa analogReadResolution
+\return The GPIO pin number to pass to the ADC.
+\note This call throws an error if the pin can't be used as an analog input.
 */
-inline int analogRead(int pin)
+inline ULONG _AnalogInPin(int pin)
 {
     HRESULT hr;
-    ULONG value;
-    ULONG bits;
     ULONG ioPin;
     BoardPinsClass::BOARD_TYPE board;
 
@@ -282,7 +293,7 @@ inline int analogRead(int pin)
         {
             ioPin = pin;
         }
- 
+
         // Make sure the pin is configured as an analog input.
         hr = g_pins.verifyPinFunction(ioPin, FUNC_AIN, BoardPinsClass::NO_LOCK_CHANGE);
 
@@ -295,17 +306,63 @@ inline int analogRead(int pin)
 
     case BoardPinsClass::BOARD_TYPE::MBM_BARE:
     case BoardPinsClass::BOARD_TYPE::PI2_BARE:
-        // Translate the pin number to a fake pin number.
+        // Translate the pin number to a fake pin number, so all the channels of an ADC with
+        // more than NUM_ANALOG_PINS inputs can be read.  There is no pin function to verify.
         if (pin < A0)
         {
             ioPin = A0 + pin;
         }
+        else
+        {
+            ioPin = pin;
+        }
         break;
 
     default:
         ThrowError(hr, "Unrecognized board type: 0x%08x", board);
     }
 
+    return ioPin;
+}
+
+/// Scale a digitized analog value to the currently set analog read resolution.
+/**
+\param[in] value The value read from the ADC.
+\param[in] bits The size of "value" in bits.
+\return The scaled value.
+*/
+inline ULONG _ScaleAnalogValue(ULONG value, ULONG bits)
+{
+    if (g_analogValueBits > bits)
+    {
+        value = value << (g_analogValueBits - bits);
+    }
+    else if (bits > g_analogValueBits)
+    {
+        value = value >> (bits - g_analogValueBits);
+    }
+
+    return value;
+}
+
+/// Perform an analog to digital conversion on one of the analog inputs.
+/**
+\param[in] pin The analog pin to read (A0-A5, or 0-5).
+\return Digitized analog value read from the pin.
+\note The number of bits of the digitized analog value can be set by calling the 
+analogReadResolution() API.  By default ten bits are returned (0-1023 for 0-5v pin voltage).
+\note To read the same pin many times, an AnalogIn object does the pin checks once.
+\sa analogReadResolution
+*/
+inline int analogRead(int pin)
+{
+    HRESULT hr;
+    ULONG value;
+    ULONG bits;
+    ULONG ioPin;
+
+    ioPin = _AnalogInPin(pin);
+
     // Perform the read.
     hr = g_adc.readValue(ioPin, value, bits);
 
@@ -314,17 +371,47 @@ inline int analogRead(int pin)
         ThrowError(hr, "Error performing analogRead on pin: %d, Error: 0x%08x", pin, hr);
     }
 
-    // Scale the digitized analog value to the currently set analog read resolution.
-    if (g_analogValueBits > bits)
+    return _ScaleAnalogValue(value, bits);
+}
+
+/// Read several analog input pins with one scan of the ADC.
+/**
+This is faster than calling analogRead() for each pin, because the ADC driver reads all the
+channels in a single bus operation.
+\param[in] pins Array of analog pins to read, either A0-An or 0-n.
+\param[out] values Array that receives the value read from each pin, scaled to the resolution
+set with analogReadResolution().
+\param[in] count The number of pins to read.
+\sa analogRead
+*/
+inline void analogReadMulti(const int pins[], int values[], int count)
+{
+    HRESULT hr;
+    ULONG bits;
+    std::vector<ULONG> ioPins(count);
+    std::vector<ULONG> readings(count);
+    int i;
+
+    for (i = 0; i < count; i++)
     {
-        value = value << (g_analogValueBits - bits);
+        ioPins[i] = _AnalogInPin(pins[i]);
     }
-    else if (bits > g_analogValueBits)
+
+    // Perform the reads.
+    if (count > 0)
     {
-        value = value >> (bits - g_analogValueBits);
+        hr = g_adc.readValues(ioPins.data(), readings.data(), count, bits);
+
+        if (FAILED(hr))
+        {
+            ThrowError(hr, "Error performing analogReadMulti on %d pins, Error: 0x%08x", count, hr);
+        }
     }
 
-    return value;
+    for (i = 0; i < count; i++)
+    {
+        values[i] = _ScaleAnalogValue(readings[i], bits);
+    }
 }
 
 /// Analog reference value.
@@ -364,22 +451,17 @@ inline void analogReference(int type)
 /// The number of bits used to specify PWM duty cycles.
 __declspec (selectany) ULONG g_pwmResolutionBits = 8;
 
-/// Set the PWM duty cycle for a pin.
+/// Translate an analogWrite() pin number to a PWM pin number and prepare the pin for use.
 /**
-\param[in] pin The number of the pin for the PWM output.  On boards with built-in PWM support
-this is a GPIO pin, on boards that use an external PWM chip, this is a pseudo pin number named 
-PWM0-PWMn, where "n" is one less than the number of PWM pins.
-\param[in] dutyCycle The high pulse time, range 0 to pwm_resolution_count - 1, (defaults 
-to a count of 255, for 8-bit PWM resolution.)
-\Note: This call throws an error if the pin number is outside the range supported
-on the board, or if a pin that does not support PWM is specified.
+\param[in] pin The number of the pin for the PWM output, as passed to analogWrite().
+\return The pin number to pass to BoardPinsClass::setPwmDutyCycle().
+\note This call throws an error if the pin can't be used for PWM output.
 */
-inline void analogWrite(unsigned int pin, unsigned int dutyCycle)
+inline ULONG _AnalogOutPin(unsigned int pin)
 {
     HRESULT hr;
     ULONG ioPin;
     BoardPinsClass::BOARD_TYPE board;
-    ULONGLONG scaledDutyCycle;
 
     hr = g_pins.getBoardType(board);
     if (FAILED(hr))
@@ -421,15 +503,36 @@ inline void analogWrite(unsigned int pin, unsigned int dutyCycle)
         ThrowError(E_INVALIDARG, "Unrecognized board type: 0x%08x", board);
     }
 
-    // Scale the duty cycle passed in using the current analog write resolution.
+    return ioPin;
+}
+
+/// Set the PWM duty cycle for a pin.
+/**
+\param[in] pin The number of the pin for the PWM output.  On boards with built-in PWM support
+this is a GPIO pin, on boards that use an external PWM chip, this is a pseudo pin number named 
+PWM0-PWMn, where "n" is one less than the number of PWM pins.
+\param[in] dutyCycle The high pulse time, range 0 to pwm_resolution_count - 1, (defaults 
+to a count of 255, for 8-bit PWM resolution.)
+\Note: This call throws an error if the pin number is outside the range supported
+on the board, or if a pin that does not support PWM is specified.
+\note To write the same pin many times, an AnalogOut object does the pin checks once.
+*/
+inline void analogWrite(unsigned int pin, unsigned int dutyCycle)
+{
+    HRESULT hr;
+    ULONG ioPin;
+
+    ioPin = _AnalogOutPin(pin);
+
+    // Scale the duty cycle passed in using the current analog write resolution.  The
+    // duty cycle is a fraction of 2^32, so scaling it is a shift.
     if ((g_pwmResolutionBits < 32) && (dutyCycle >= (1UL << g_pwmResolutionBits)))
     {
         ThrowError(E_INVALIDARG, "Specified duty cycle: %d is greater than PWM resolution: %d bits.", dutyCycle, g_pwmResolutionBits);
     }
-    scaledDutyCycle = (((ULONGLONG)dutyCycle * (1ULL << 32)) + (1ULL << (g_pwmResolutionBits - 1))) / (1ULL << g_pwmResolutionBits);
 
     // Set the PWM duty cycle.
-    hr = g_pins.setPwmDutyCycle(ioPin, (ULONG)scaledDutyCycle);
+    hr = g_pins.setPwmDutyCycle(ioPin, (ULONG)dutyCycle << (32 - g_pwmResolutionBits));
 
     if (FAILED(hr))
     {
@@ -437,6 +540,48 @@ inline void analogWrite(unsigned int pin, unsigned int dutyCycle)
     }
 }
 
+/// Set the PWM duty cycles for several pins at once.
+/**
+On boards that use a PCA9685 PWM chip, all the pins on the chip are updated with one I2C
+transaction and their outputs change together, which is much faster than calling
+analogWrite() for each pin.
+\param[in] pins Array of PWM pins to set, numbered as for analogWrite().
+\param[in] dutyCycles Array of the high pulse time for each pin, range 0 to
+pwm_resolution_count - 1.
+\param[in] count The number of pins to set.
+\sa analogWrite
+*/
+inline void analogWriteMulti(const unsigned int pins[], const unsigned int dutyCycles[], int count)
+{
+    HRESULT hr;
+    std::vector<ULONG> ioPins(count);
+    std::vector<ULONG> scaledDutyCycles(count);
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        ioPins[i] = _AnalogOutPin(pins[i]);
+
+        // Scale the duty cycle passed in using the current analog write resolution.
+        if ((g_pwmResolutionBits < 32) && (dutyCycles[i] >= (1UL << g_pwmResolutionBits)))
+        {
+            ThrowError(E_INVALIDARG, "Specified duty cycle: %d is greater than PWM resolution: %d bits.", dutyCycles[i], g_pwmResolutionBits);
+        }
+        scaledDutyCycles[i] = (ULONG)dutyCycles[i] << (32 - g_pwmResolutionBits);
+    }
+
+    // Set the PWM duty cycles.
+    if (count > 0)
+    {
+        hr = g_pins.setPwmDutyCycles(ioPins.data(), scaledDutyCycles.data(), count);
+
+        if (FAILED(hr))
+        {
+            ThrowError(hr, "Error occurred setting PWM duty cycles on %d pins, Error: %08x", count, hr);
+        }
+    }
+}
+
 /// Set the number of bits used to specify PWM duty cycles to analogWrite().
 /**
 \param[in] bits The number of bits to use for analogWrite() duty cycle values.
@@ -538,34 +683,70 @@ inline void shiftOut(uint8_t data_pin_, uint8_t clock_pin_, uint8_t bit_order_,
 
 ///
 /// \brief Performs a tone operation.
-/// \details This will start a PWM wave on the designated pin of the
-/// inputted frequency with 50% duty cycle
+/// \details This will start a square wave on the designated pin of the
+/// inputted frequency with 50% duty cycle, until noTone() is called.  It
+/// replaces any tone playing or queued on the pin, and returns without
+/// waiting.  To queue sequences of notes, use ToneGenerator.enqueue().
 /// \param [in] pin - The Arduino GPIO pin on which to generate the pulse train.
-///        This can be pin 3, 5, 6, 7, 8, 9, 10, or 11.
+///        Pins with PWM use the PWM hardware, any other digital pin is
+///        toggled by SoftPwm.
 /// \param [in] frequency - in Hertz
 ///
-void tone(int pin, unsigned int frequency);
+inline void tone(int pin, unsigned int frequency)
+{
+    HRESULT hr;
+
+    hr = ToneGenerator.play(pin, frequency, 0);
+
+    if (FAILED(hr))
+    {
+        ThrowError(hr, "Error occurred starting a tone on pin: %d, Error: %08x", pin, hr);
+    }
+}
 
 ///
 /// \brief Performs a tone operation.
-/// \details This will start a PWM wave on the designated pin of the
-/// inputted frequency with 50% duty cycle and set up a timer to trigger
-/// a callback after the inputted duration
+/// \details This will start a square wave on the designated pin of the
+/// inputted frequency with 50% duty cycle, and stop it after the inputted
+/// duration.  It replaces any tone playing or queued on the pin, and
+/// returns without waiting.
 /// \param [in] pin - The Arduino GPIO pin on which to generate the pulse train.
-///        This can be pin 3, 5, 6, 7, 8, 9, 10, or 11.
+///        Pins with PWM use the PWM hardware, any other digital pin is
+///        toggled by SoftPwm.
 /// \param [in] frequency - in Hertz
 /// \param [in] duration - in milliseconds
 ///
-void tone(int pin, unsigned int frequency, unsigned long duration);
+inline void tone(int pin, unsigned int frequency, unsigned long duration)
+{
+    HRESULT hr;
+
+    hr = ToneGenerator.play(pin, frequency, duration);
+
+    if (FAILED(hr))
+    {
+        ThrowError(hr, "Error occurred starting a tone on pin: %d, Error: %08x", pin, hr);
+    }
+}
 
 ///
 /// \brief Performs a noTone operation.
-/// \details This will stop a PWM wave on the designated pin if there is
-/// a tone running on it
+/// \details This will stop the wave on the designated pin if there is
+/// a tone running on it, discard any notes queued for it, and release
+/// the pin.
 /// \param [in] pin - The Arduino GPIO pin on which to generate the pulse train.
-///        This can be pin 3, 5, 6, 7, 8, 9, 10, or 11.
 ///
-void noTone(int pin);
+inline void noTone(int pin)
+{
+    HRESULT hr;
+
+    hr = ToneGenerator.stop(pin);
+
+    // A pin that has never played a tone is already silent.
+    if (FAILED(hr) && (hr != HRESULT_FROM_WIN32(ERROR_NOT_FOUND)))
+    {
+        ThrowError(hr, "Error occurred stopping the tone on pin: %d, Error: %08x", pin, hr);
+    }
+}
 
 //
 // Arduino Sketch Plumbing
@@ -574,9 +755,14 @@ void noTone(int pin);
 #include "Stream.h"
 #include "HardwareSerial.h"
 #include "WInterrupt.h"
+#include "AnalogPin.h"
+#include "TaskScheduler.h"
+#include "LoopProfiler.h"
 
 void setup();
+#ifndef SKETCH_NO_LOOP
 void loop();
+#endif
 
 #ifdef SERIAL_EVENT
 void serialEvent();
@@ -591,13 +777,23 @@ inline int RunArduinoSketch()
         setup();
         while (1)
         {
+            LoopProfiler.markIteration();
+
             // This call is used to handle async procedure calls (APCs); usually by timers
             // This call will relinquish the remainder of its time slice to another 
             // ready to run thread of equal priority. However, in practice it is 
             // a no-op unless there's a pending APC. 
             SleepEx(0, TRUE);
 
-            loop();
+            TaskScheduler.runDueTasks();
+
+            #ifndef SKETCH_NO_LOOP
+            // Sleep until the next scheduled task is due if loop() had nothing to do.
+            TaskScheduler.runLoop(loop);
+            #else
+            // With no loop() to call, sleep until the next scheduled task is due.
+            TaskScheduler.waitForNextTask(TASK_SCHEDULER_IDLE_WAIT_MICROSECONDS);
+            #endif
             #ifdef SERIAL_EVENT
             if (Serial && Serial.available() > 0)
             {
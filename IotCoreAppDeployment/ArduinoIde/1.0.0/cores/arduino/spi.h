@@ -13,6 +13,7 @@
 #include "QuarkSpiController.h"
 #include "BtSpiController.h"
 #include "BcmSpiController.h"
+#include "SpiBusManager.h"
 #include "BoardPins.h"
 
 // SPI clock values in KHz.
@@ -40,7 +41,7 @@ public:
     /// Constructor.
     SPIClass()
     {
-        m_controller = nullptr;
+        m_deviceId = SPI_BUS_NO_DEVICE;
         m_bitOrder = MSBFIRST;             // Default bit order is MSB First
         m_clockKHz = 4000;                 // Default clock rate is 4 MHz
         m_mode = SPI_MODE0;                // Default to Mode 0
@@ -60,57 +61,29 @@ public:
     void begin()
     {
         HRESULT hr;
-        BoardPinsClass::BOARD_TYPE board;
 
-        hr = g_pins.getBoardType(board);
-
-        if (FAILED(hr))
+        // Open the shared SPI bus if we don't already have it open.
+        if (m_deviceId == SPI_BUS_NO_DEVICE)
         {
-            ThrowError(hr, "An error occurred determining board type: %08x", hr);
-        }
+            hr = g_spiBus.begin();
 
-        // Create and initialize the SPI Controller object if we don't already have one.
-        if (m_controller == nullptr)
-        {
-            if (board == BoardPinsClass::BOARD_TYPE::MBM_BARE)
-            {
-                m_controller = new BtSpiControllerClass;
-                hr = m_controller->configurePins(MBM_PIN_MISO, MBM_PIN_MOSI, MBM_PIN_SCK);
-            }
-            else if (board == BoardPinsClass::BOARD_TYPE::PI2_BARE)
-            {
-                m_controller = new BcmSpiControllerClass;
-                hr = m_controller->configurePins(PI2_PIN_SPI0_MISO, PI2_PIN_SPI0_MOSI, PI2_PIN_SPI0_SCK);
-            }
-            else
+            if (FAILED(hr))
             {
-                m_controller = new QuarkSpiControllerClass;
-                hr = m_controller->configurePins(ARDUINO_PIN_MISO, ARDUINO_PIN_MOSI, ARDUINO_PIN_SCK);
+                ThrowError(hr, "An error occurred initializing the SPI controller: %08x", hr);
             }
 
+            // The sketch drives its own chip select lines, so don't give the bus one to manage.
+            hr = g_spiBus.addDevice(SPI_BUS_NO_CS_PIN, m_mode, m_clockKHz, m_dataWidth, (m_bitOrder == LSBFIRST), m_deviceId);
+
             if (FAILED(hr))
             {
-                ThrowError(hr, "An error occurred configuring pins for SPI use: %08x", hr);
+                g_spiBus.end();
+                ThrowError(hr, "An error occurred adding the sketch to the SPI bus: %08x", hr);
             }
         }
 
-        // Set the desired SPI bit shifting order.
-        if (m_bitOrder == MSBFIRST)
-        {
-            m_controller->setMsbFirstBitOrder();
-        }
-        else
-        {
-            m_controller->setLsbFirstBitOrder();
-        }
-
-        // Map the SPI1 controller registers into memory.
-        hr = m_controller->begin(EXTERNAL_SPI_BUS, m_mode, m_clockKHz, m_dataWidth);
-
-        if (FAILED(hr))
-        {
-            ThrowError(hr, "An error occurred initializing the SPI controller: %08x", hr);
-        }
+        // Program the controller with the settings for this object.
+        _configureDevice();
     }
 
     /// Free up the external SPI bus so its pins can be used for other functions.
@@ -119,22 +92,13 @@ public:
     */
     void end()
     {
-        HRESULT hr;
-
-        if (m_controller != nullptr)
+        if (m_deviceId != SPI_BUS_NO_DEVICE)
         {
-            // Set all SPI pins as digital I/O.
-            hr = m_controller->revertPinsToGpio();
-
-            if (FAILED(hr))
-            {
-                ThrowError(hr, "An error occurred reverting SPI pins to GPIO: %08x", hr);
-            }
-
-            // Get rid of the underlying SPI Controller object.  This closes the handle
-            // we have open to the SPI controller.
-            delete m_controller;
-            m_controller = nullptr;
+            // Release our hold on the shared SPI bus.  When the last user of the bus
+            // releases it, the SPI pins are reverted to digital I/O.
+            g_spiBus.removeDevice(m_deviceId);
+            m_deviceId = SPI_BUS_NO_DEVICE;
+            g_spiBus.end();
         }
     }
 
@@ -152,17 +116,7 @@ public:
         }
         m_bitOrder = bitOrder;
 
-        if (m_controller != nullptr)
-        {
-            if (bitOrder == MSBFIRST)
-            {
-                m_controller->setMsbFirstBitOrder();
-            }
-            else
-            {
-                m_controller->setLsbFirstBitOrder();
-            }
-        }
+        _configureDevice();
     }
 
  
@@ -190,19 +144,9 @@ public:
     */
     void setClockDivider(ULONG clockKHz)
     {
-        HRESULT hr;
-
         m_clockKHz = clockKHz;
 
-        if (m_controller != nullptr)
-        {
-            hr = m_controller->setClock(clockKHz);
-
-            if (FAILED(hr))
-            {
-                ThrowError(hr, "An error occurred setting the SPI clock rate: %d", hr);
-            }
-        }
+        _configureDevice();
     }
 
     /// Set the SPI mode (clock polarity and phase).
@@ -213,23 +157,13 @@ public:
     */
     void setDataMode(UINT mode)
     {
-        HRESULT hr;
-
         if ((mode != SPI_MODE0) && (mode != SPI_MODE1) && (mode != SPI_MODE2) && (mode != SPI_MODE3))
         {
             ThrowError(E_INVALIDARG, "Spi Mode must be SPI_MODE0, SPI_MODE1, SPI_MODE2 or SPI_MODE3.");
         }
         m_mode = mode;
 
-        if (m_controller != nullptr)
-        {
-            hr = m_controller->setMode(mode);
-
-            if (FAILED(hr))
-            {
-                ThrowError(hr, "An error occurred setting the SPI mode: %d", hr);
-            }
-        }
+        _configureDevice();
     }
 
     /// Set the SPI data width.
@@ -253,14 +187,20 @@ public:
     {
         HRESULT hr;
         ULONG dataReturn = 0;
+        SpiControllerClass* controller;
 
-        if (m_controller == nullptr)
+        if (m_deviceId == SPI_BUS_NO_DEVICE)
         {
             ThrowError(HRESULT_FROM_WIN32(ERROR_INVALID_STATE), "Can't transfer on SPI bus until an SPI.begin() has been done.");
         }
 
         // Transfer the data.
-        hr = m_controller->transfer8(val, dataReturn);
+        hr = g_spiBus.beginTransaction(m_deviceId, controller);
+        if (SUCCEEDED(hr))
+        {
+            hr = controller->transfer8(val, dataReturn);
+            g_spiBus.endTransaction(m_deviceId);
+        }
 
         if (FAILED(hr))
         {
@@ -279,14 +219,20 @@ public:
     {
         HRESULT hr;
         ULONG dataReturn = 0;
+        SpiControllerClass* controller;
 
-        if (m_controller == nullptr)
+        if (m_deviceId == SPI_BUS_NO_DEVICE)
         {
             ThrowError(HRESULT_FROM_WIN32(ERROR_INVALID_STATE), "Can't transfer on SPI bus until an SPI.begin() has been done.");
         }
 
         // Transfer the data.
-        hr = m_controller->transfer16(val, dataReturn);
+        hr = g_spiBus.beginTransaction(m_deviceId, controller);
+        if (SUCCEEDED(hr))
+        {
+            hr = controller->transfer16(val, dataReturn);
+            g_spiBus.endTransaction(m_deviceId);
+        }
 
         if (FAILED(hr))
         {
@@ -305,14 +251,20 @@ public:
     {
         HRESULT hr;
         ULONG dataReturn = 0;
+        SpiControllerClass* controller;
 
-        if (m_controller == nullptr)
+        if (m_deviceId == SPI_BUS_NO_DEVICE)
         {
             ThrowError(HRESULT_FROM_WIN32(ERROR_INVALID_STATE), "Can't transfer on SPI bus until an SPI.begin() has been done.");
         }
 
         // Transfer the data.
-        hr = m_controller->transfer24(val, dataReturn);
+        hr = g_spiBus.beginTransaction(m_deviceId, controller);
+        if (SUCCEEDED(hr))
+        {
+            hr = controller->transfer24(val, dataReturn);
+            g_spiBus.endTransaction(m_deviceId);
+        }
 
         if (FAILED(hr))
         {
@@ -331,14 +283,20 @@ public:
     {
         HRESULT hr;
         ULONG dataReturn = 0;
+        SpiControllerClass* controller;
 
-        if (m_controller == nullptr)
+        if (m_deviceId == SPI_BUS_NO_DEVICE)
         {
             ThrowError(HRESULT_FROM_WIN32(ERROR_INVALID_STATE), "Can't transfer on SPI bus until an SPI.begin() has been done.");
         }
 
         // Transfer the data.
-        hr = m_controller->transfer32(val, dataReturn);
+        hr = g_spiBus.beginTransaction(m_deviceId, controller);
+        if (SUCCEEDED(hr))
+        {
+            hr = controller->transfer32(val, dataReturn);
+            g_spiBus.endTransaction(m_deviceId);
+        }
 
         if (FAILED(hr))
         {
@@ -348,10 +306,71 @@ public:
         return dataReturn;
     }
 
+    /// Transfer a buffer of 16-bit words in each direction on the SPI bus.
+    /**
+    \param[in,out] buffer The words to send, which are replaced by the words received.
+    \param[in] count The number of words in the buffer.
+    \param[in] swapBytes TRUE if the words are stored big-endian, FALSE for native words.
+    \note The words go out as one continuous stream where the controller supports buffer transfers.
+    */
+    inline void transfer16(USHORT* buffer, size_t count, BOOL swapBytes = FALSE)
+    {
+        HRESULT hr;
+        SpiControllerClass* controller;
+
+        if (m_deviceId == SPI_BUS_NO_DEVICE)
+        {
+            ThrowError(HRESULT_FROM_WIN32(ERROR_INVALID_STATE), "Can't transfer on SPI bus until an SPI.begin() has been done.");
+        }
+
+        // Transfer the data.
+        hr = g_spiBus.beginTransaction(m_deviceId, controller);
+        if (SUCCEEDED(hr))
+        {
+            hr = controller->transferBuffer16(buffer, buffer, count, swapBytes);
+            g_spiBus.endTransaction(m_deviceId);
+        }
+
+        if (FAILED(hr))
+        {
+            ThrowError(hr, "An error occurred atempting to transfer SPI data: %d", hr);
+        }
+    }
+
+    /// Transfer a buffer of 32-bit words in each direction on the SPI bus.
+    /**
+    \param[in,out] buffer The words to send, which are replaced by the words received.
+    \param[in] count The number of words in the buffer.
+    \param[in] swapBytes TRUE if the words are stored big-endian, FALSE for native words.
+    */
+    inline void transfer32(ULONG* buffer, size_t count, BOOL swapBytes = FALSE)
+    {
+        HRESULT hr;
+        SpiControllerClass* controller;
+
+        if (m_deviceId == SPI_BUS_NO_DEVICE)
+        {
+            ThrowError(HRESULT_FROM_WIN32(ERROR_INVALID_STATE), "Can't transfer on SPI bus until an SPI.begin() has been done.");
+        }
+
+        // Transfer the data.
+        hr = g_spiBus.beginTransaction(m_deviceId, controller);
+        if (SUCCEEDED(hr))
+        {
+            hr = controller->transferBuffer32(buffer, buffer, count, swapBytes);
+            g_spiBus.endTransaction(m_deviceId);
+        }
+
+        if (FAILED(hr))
+        {
+            ThrowError(hr, "An error occurred atempting to transfer SPI data: %d", hr);
+        }
+    }
+
 private:
 
-    /// Underlying SPI Controller object that really does the work.
-    SpiControllerClass *m_controller;
+    /// The ID of this object's device on the shared SPI bus.
+    ULONG m_deviceId;
 
     /// Bit order (LSBFIRST or MSBFIRST)
     ULONG m_bitOrder;
@@ -364,6 +383,22 @@ private:
 
     /// SPI mode to use.
     ULONG m_mode;
+
+    /// Pass the current settings to the shared SPI bus, if we have it open.
+    void _configureDevice()
+    {
+        HRESULT hr;
+
+        if (m_deviceId != SPI_BUS_NO_DEVICE)
+        {
+            hr = g_spiBus.configureDevice(m_deviceId, m_mode, m_clockKHz, m_dataWidth, (m_bitOrder == LSBFIRST));
+
+            if (FAILED(hr))
+            {
+                ThrowError(hr, "An error occurred configuring the SPI controller: %08x", hr);
+            }
+        }
+    }
 };
 
 /// The global SPI bus object.